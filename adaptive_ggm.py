@@ -7,6 +7,12 @@ import subprocess
 from astropy.io import fits
 import numpy as np
 
+# use native code if available (see ggm_native)
+try:
+    import ggmnative
+except ImportError:
+    ggmnative = None
+
 def _escapeArgs(args):
     """Escape arguments for printing."""
     out = []
@@ -31,6 +37,12 @@ def call(*args, **argsv):
 def calcGradient(inimg, log):
     """Calculate gradient magnitude of input image."""
 
+    # the native code works in float32, so is only used for float32
+    # input, where the output is float32 anyway
+    if ggmnative is not None and inimg.dtype.type == np.float32:
+        inimg = np.ascontiguousarray(inimg, dtype=np.float32)
+        return np.asarray(ggmnative.gradient_magnitude(inimg, log=log))
+
     if log:
         inimg = np.log10(inimg)
 
@@ -60,6 +72,8 @@ def main():
     parser.add_argument('--smoothed', help='Intermediate smoothed image filename', default='smoothed.fits')
     parser.add_argument('--threads', type=int, default=4, help='Number of threads to use when smoothing')
     parser.add_argument('--contbin-dir', help='Override location of contour binning code')
+    parser.add_argument('--native-dir', help='Use adaptive_smooth from ggm_native in this directory for smoothing')
+    parser.add_argument('--buckets', type=int, default=16, help='Number of sigma buckets for native smoothing')
 
     parser.add_argument('output', help='output image filename')
     args = parser.parse_args()
@@ -86,18 +100,29 @@ def main():
     print('* Smoothing input image')
     inimage = args.image or args.counts
 
-    cargs = [
-        inimage,
-        '--apply',
-        '--scale=%s' % args.scale,
-        '--applied=%s' % args.smoothed,
-        '--threads=%i' % args.threads,
-        '--gaussian',
-    ]
-    if args.mask:
-        cargs.append('--mask=%s' % args.mask)
-
-    call(program, *cargs)
+    if args.native_dir:
+        cargs = [
+            '--buckets=%i' % args.buckets,
+            '--threads=%i' % args.threads,
+        ]
+        if args.mask:
+            cargs.append('--mask=%s' % args.mask)
+        cargs += [inimage, args.scale, args.smoothed]
+
+        call(os.path.join(args.native_dir, 'adaptive_smooth'), *cargs)
+    else:
+        cargs = [
+            inimage,
+            '--apply',
+            '--scale=%s' % args.scale,
+            '--applied=%s' % args.smoothed,
+            '--threads=%i' % args.threads,
+            '--gaussian',
+        ]
+        if args.mask:
+            cargs.append('--mask=%s' % args.mask)
+
+        call(program, *cargs)
 
     # get gradient
     print('* Calculating gradient')
@@ -8,6 +8,12 @@ from astropy.io import fits
 import scipy.ndimage
 import numpy as N
 
+# use native code if available (see ggm_native)
+try:
+    import ggmnative
+except ImportError:
+    ggmnative = None
+
 def run(infile, outfile, scale):
     f = fits.open(infile)
     img = f[0].data
@@ -16,7 +22,13 @@ def run(infile, outfile, scale):
     if issubclass(img.dtype.type, N.integer):
         img = img.astype(N.float32)
 
-    proc = scipy.ndimage.gaussian_gradient_magnitude(img, scale)
+    # the native code works in float32, so is only used if the output
+    # would be float32 anyway (float64 input gives float64 output)
+    if ggmnative is not None and img.dtype.type == N.float32:
+        img = N.ascontiguousarray(img, dtype=N.float32)
+        proc = N.asarray(ggmnative.gaussian_gradient_magnitude(img, scale))
+    else:
+        proc = scipy.ndimage.gaussian_gradient_magnitude(img, scale)
 
     f[0].data = proc
 
@@ -5,6 +5,8 @@ from __future__ import division, print_function
 import sys
 import os
 import glob
+import io
+import subprocess
 from random import choice
 from string import ascii_uppercase
 from math import floor
@@ -40,6 +42,61 @@ def ds9xpa(img, hdr, filename=None):
     if filename is None:
         os.unlink(tempfn)
 
+def ds9send(img, hdr):
+    """Send data to ds9 via xpa, without using a temporary file."""
+    hdu = fits.PrimaryHDU(header=hdr)
+    hdu.data = img
+
+    buf = io.BytesIO()
+    fits.HDUList([hdu]).writeto(buf)
+
+    p = subprocess.Popen(['xpaset', 'ds9', 'fits'], stdin=subprocess.PIPE)
+    p.communicate(buf.getvalue())
+
+def binHeader(hdr, binning):
+    """Adjust header WCS for image binned by factor given."""
+    hdr = hdr.copy()
+    if binning > 1:
+        for i in (1, 2):
+            if 'CRPIX%i' % i in hdr:
+                hdr['CRPIX%i' % i] = (hdr['CRPIX%i' % i]-0.5)/binning + 0.5
+            if 'CDELT%i' % i in hdr:
+                hdr['CDELT%i' % i] *= binning
+    return hdr
+
+def roiHeader(hdr, x0, y0):
+    """Adjust header WCS for the part of the image starting at pixel
+    x0, y0 (from 0)."""
+    hdr = hdr.copy()
+    for i, off in ((1, x0), (2, y0)):
+        if 'CRPIX%i' % i in hdr:
+            hdr['CRPIX%i' % i] -= off
+    return hdr
+
+def readCurve(d):
+    """Get radii, normalised weights and scale from data parameters."""
+    radii = N.array(d['weightrad'], dtype=N.float64)
+    weightvals = N.array(d['weightvals'], dtype=N.float64)
+    maxval = round(N.max(weightvals), 2)
+    return radii, weightvals/maxval, maxval
+
+def headerWCS(hdr):
+    """Build a wcs object from the header the hacky way."""
+    w = WCS(naxis=2)
+    w.wcs.crval = [hdr['CRVAL1'], hdr['CRVAL2']]
+    w.wcs.cdelt = [hdr['CDELT1'], hdr['CDELT2']]
+    w.wcs.crpix = [hdr['CRPIX1'], hdr['CRPIX2']]
+    w.wcs.ctype = [hdr['CTYPE1'], hdr['CTYPE2']]
+    return w
+
+def chopCutout(image, chop, w):
+    """Cut out the chop region from the image."""
+    dy = chop[3]-chop[1]
+    dx = chop[2]-chop[0]
+    x0 = floor((chop[0] + chop[2])/2)
+    y0 = floor((chop[1] + chop[3])/2)
+    return Cutout2D(image, (x0, y0), (dy, dx), wcs=w)
+
 class ImageContainer:
     def __init__(self, pars):
 
@@ -59,32 +116,21 @@ class ImageContainer:
             print('Loading', d['filename'])
             with fits.open(d['filename']) as f:
                 image = f[0].data
-                # build a wcs object the hacky way
                 if i == 0:
                     hdr = f[0].header
-                    w = WCS(naxis=2)
-                    w.wcs.crval = [hdr['CRVAL1'], hdr['CRVAL2']]
-                    w.wcs.cdelt = [hdr['CDELT1'], hdr['CDELT2']]
-                    w.wcs.crpix = [hdr['CRPIX1'], hdr['CRPIX2']]
-                    w.wcs.ctype = [hdr['CTYPE1'], hdr['CTYPE2']]
+                    w = headerWCS(hdr)
             if chop:
-                dy = chop[3]-chop[1]
-                dx = chop[2]-chop[0]
-                x0 = floor((chop[0] + chop[2])/2)
-                y0 = floor((chop[1] + chop[3])/2)
-                image_cutout = Cutout2D(image, (x0, y0), (dy, dx), wcs=w)
+                image_cutout = chopCutout(image, chop, w)
                 image = image_cutout.data
                 if i == 0:
                     new_w = image_cutout.wcs
                     hdr = new_w.to_header()
             self.images.append(image)
 
-            radii = N.array(d['weightrad'], dtype=N.float64)
+            radii, weights, maxval = readCurve(d)
             self.radii.append(radii)
-            weightvals = N.array(d['weightvals'], dtype=N.float64)
-            maxval = round(N.max(weightvals), 2)
             self.scales.append(maxval)
-            self.weights.append(weightvals/maxval)
+            self.weights.append(weights)
         # set the header, which will be used later when writing the file
         some_random_str = ''.join(choice(ascii_uppercase) for i in range(10))
         with open('tmp' + some_random_str, 'w') as f:
@@ -130,6 +176,113 @@ class ImageContainer:
         out = out / maxval
         return out
 
+class ServerContainer(ImageContainer):
+    """Keeps the images in a combine_server process (from ggm_native),
+    which does the combination. Only the weights of changed scales are
+    sent for each redraw."""
+
+    def __init__(self, pars):
+
+        self.pars = dict(pars)
+        self.radii = []
+        self.weights = []
+        self.scales = []
+        self.sent = []
+
+        filenames = []
+        for d in pars['data']:
+            filenames.append(d['filename'])
+            radii, weights, maxval = readCurve(d)
+            self.radii.append(radii)
+            self.scales.append(maxval)
+            self.weights.append(weights)
+            self.sent.append(None)
+
+        with fits.open(filenames[0]) as f:
+            self.hdr = f[0].header
+            shape = f[0].shape
+
+        args = [pars['image']['server']]
+        if 'chop' in pars['image'] and pars['image']['chop']['enable']:
+            # use a dummy image to get the same region as Cutout2D
+            dummy = N.broadcast_to(N.float32(0), shape)
+            cutout = chopCutout(
+                dummy, pars['image']['chop']['range'], headerWCS(self.hdr))
+            (ymin, ymax), (xmin, xmax) = cutout.bbox_original
+            args.append('--chop=%i,%i,%i,%i' % (xmin, ymin, xmax, ymax))
+            self.hdr = cutout.wcs.to_header()
+
+        xc, yc = pars['image']['centre']
+        args += [str(xc), str(yc)] + filenames
+
+        self.proc = subprocess.Popen(
+            args, stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+        ready = self.proc.stdout.readline().split()
+        if not ready or ready[0] != b'ready':
+            raise RuntimeError('combine_server failed to start')
+
+    def _serverExited(self):
+        """Raise an error giving the exit status of the server."""
+        status = self.proc.wait()
+        raise RuntimeError(
+            'combine_server exited with status %i (see its messages above)'
+            % status)
+
+    def _command(self, cmd):
+        try:
+            self.proc.stdin.write(cmd.encode('ascii') + b'\n')
+            self.proc.stdin.flush()
+        except BrokenPipeError:
+            self._serverExited()
+        reply = self.proc.stdout.readline().split()
+        if not reply:
+            self._serverExited()
+        if reply[0] == b'error':
+            raise RuntimeError(b' '.join(reply[1:]).decode('ascii'))
+        return reply
+
+    def _sendCurves(self):
+        """Send curves which have changed."""
+        for i, (r, w, s) in enumerate(zip(
+                self.radii, self.weights, self.scales)):
+            curve = (list(r), list(w), s)
+            if curve != self.sent[i]:
+                vals = ' '.join(repr(float(v)) for v in list(r)+list(w))
+                self._command('curve %i %r %i %s' % (
+                    i, float(s), len(r), vals))
+                self.sent[i] = curve
+
+    def _readImage(self, reply):
+        xw, yw = int(reply[1]), int(reply[2])
+        data = self.proc.stdout.read(xw*yw*4)
+        if len(data) != xw*yw*4:
+            self._serverExited()
+        return N.frombuffer(data, dtype=N.float32).reshape((yw, xw))
+
+    def filterAdd(self, binning=1):
+        """Get combined image, binned by factor given."""
+        self._sendCurves()
+        return self._readImage(self._command('get %i' % binning))
+
+    def preview(self, size):
+        """Get combined image from the server's smallest copy of the
+        images which is at least size (width, height). Returns the
+        image and its binning."""
+        self._sendCurves()
+        reply = self._command('fit %i %i' % tuple(size))
+        return self._readImage(reply), int(reply[3])
+
+    def roi(self, box):
+        """Get the combined image of the pixels x0, y0, x1, y1 in box
+        (inclusive, from 0), combined at full resolution."""
+        self._sendCurves()
+        return self._readImage(self._command('roi %i %i %i %i 1' % tuple(box)))
+
+    def close(self):
+        self.proc.stdin.write(b'quit\n')
+        self.proc.stdin.close()
+        self.proc.wait()
+
 class Window(qt.QWidget):
     def __init__(self, infile):
         qt.QWidget.__init__(self)
@@ -139,7 +292,12 @@ class Window(qt.QWidget):
         with open(infile) as f:
             self.pars = pars = yaml.load(f)
 
-        self.images = ImageContainer(pars)
+        # use a combine_server process, if given
+        self.server = 'server' in pars['image']
+        if self.server:
+            self.images = ServerContainer(pars)
+        else:
+            self.images = ImageContainer(pars)
 
         def getOnChanged(idx):
             def func(vals):
@@ -166,7 +324,7 @@ class Window(qt.QWidget):
                 self.redraw()
             return func
 
-        for i in range(len(self.images.images)):
+        for i in range(len(self.images.radii)):
 
             radii = self.images.radii[i]
             weights = self.images.weights[i]
@@ -186,10 +344,32 @@ class Window(qt.QWidget):
             c.clicked.connect( getCheck(i, l) )
             layout.addWidget(c, i, 2)
 
+        if self.server:
+            # output is only written when requested
+            save = qt.QPushButton('Save')
+            save.clicked.connect(self.save)
+            layout.addWidget(save, len(self.images.radii), 0)
+
         self.setLayout(layout)
         self.redraw()
 
     def redraw(self):
+        if self.server:
+            if 'roi' in self.pars['image']:
+                # zoomed view, at full resolution
+                box = self.pars['image']['roi']
+                img = self.images.roi(box)
+                ds9send(img, roiHeader(self.images.hdr, box[0], box[1]))
+                return
+            if 'previewsize' in self.pars['image']:
+                img, binning = self.images.preview(
+                    self.pars['image']['previewsize'])
+            else:
+                binning = self.pars['image'].get('previewbin', 1)
+                img = self.images.filterAdd(binning)
+            ds9send(img, binHeader(self.images.hdr, binning))
+            return
+
         img = self.images.filterAdd()
         tmp_file = max(glob.iglob('tmp*'), key=os.path.getctime)
         print('Temporary header file: %s.' % tmp_file)
@@ -197,6 +377,16 @@ class Window(qt.QWidget):
         ds9xpa(img, hdr, filename=self.pars['image']['outfilename'])
         self.images.writeOutputPars('out-pars.yml')
 
+    def save(self):
+        """Write full resolution output and parameters."""
+        img = self.images.filterAdd()
+        outfilename = self.pars['image']['outfilename']
+        print('Writing', outfilename)
+        hdu = fits.PrimaryHDU(header=self.images.hdr)
+        hdu.data = img
+        fits.HDUList([hdu]).writeto(outfilename, overwrite=True)
+        self.images.writeOutputPars('out-pars.yml')
+
 def main():
     filename = sys.argv[1]
 
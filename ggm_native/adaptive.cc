@@ -0,0 +1,109 @@
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <vector>
+
+#include "adaptive.hh"
+#include "gaussian.hh"
+#include "mask.hh"
+#include "parallel.hh"
+
+void ggm::adaptive_smooth(const dm::memimage<float>& in,
+			  const dm::memimage<float>& sigma,
+			  const dm::memimage<float>* mask,
+			  dm::memimage<float>* out,
+			  unsigned nbuckets,
+			  const exposure_correction* expcorr)
+{
+  const unsigned xw = in.xw(), yw = in.yw();
+  if( sigma.xw() != xw || sigma.yw() != yw ||
+      out->xw() != xw || out->yw() != yw ||
+      (mask != 0 && (mask->xw() != xw || mask->yw() != yw)) ||
+      (expcorr != 0 && (expcorr->exposure.xw() != xw ||
+			expcorr->exposure.yw() != yw)) )
+    throw dm::memimage<float>::size_mismatch_exception();
+
+  const float nan = std::numeric_limits<float>::quiet_NaN();
+  const size_t npix = size_t(xw)*yw;
+
+  // input weights, weighted data and whether output pixel is wanted.
+  // With exposure correction, the weight is the exposure, and the
+  // weighted data (counts-bkg)/exposure*exposure is counts-bkg.
+  std::vector<float> wt(npix), dw(npix);
+  std::vector<unsigned char> wanted(npix);
+  float smin = std::numeric_limits<float>::max(), smax = 0;
+  for(size_t i=0; i<npix; ++i) {
+    const float m = mask != 0 ? mask->flatdata(i) : 1.f;
+    const float v = in.flatdata(i);
+    const float e = expcorr != 0 ? expcorr->weight(i) : 1.f;
+    const float w = std::isfinite(v) ? mask_in_weight(m)*e : 0.f;
+    wt[i] = w;
+    if( w > 0 )
+      dw[i] = expcorr != 0 ? expcorr->subtract(v, i) : v*w;
+    else
+      dw[i] = 0.f;
+
+    const float s = sigma.flatdata(i);
+    wanted[i] = mask_has_output(m) && e > 0 && std::isfinite(s) && s >= 0;
+    if( wanted[i] ) {
+      const float sc = std::max(s, adaptive_min_sigma);
+      smin = std::min(smin, sc);
+      smax = std::max(smax, sc);
+    }
+  }
+
+  out->set_all(nan);
+  if( smax == 0 )
+    return;
+
+  // log-spaced buckets between smin and smax
+  if( nbuckets < 2 || smax <= smin*1.0001f )
+    nbuckets = smax > smin ? 2 : 1;
+  const double lmin = std::log(double(smin));
+  const double dl = nbuckets > 1 ?
+    (std::log(double(smax))-lmin) / (nbuckets-1) : 1;
+
+  // smoothed weighted data and weights for this and previous bucket
+  std::vector<float> cur_dw(npix), cur_wt(npix), prev_dw(npix), prev_wt(npix);
+
+  const float* inchans[2] = { &dw[0], &wt[0] };
+
+  for(unsigned b=0; b<nbuckets; ++b) {
+    const double bsigma = std::exp(lmin + b*dl);
+    float* outchans[2] = { &cur_dw[0], &cur_wt[0] };
+    convolve_separable(2, inchans, outchans, xw, yw,
+		       gaussian_kernel(bsigma));
+
+    // assemble output pixels which lie between buckets b-1 and b (or
+    // at bucket 0 if only one bucket)
+    parallel_rows(yw, [&](unsigned y0, unsigned y1)
+      {
+	for(size_t i=size_t(y0)*xw; i<size_t(y1)*xw; ++i) {
+	  if( ! wanted[i] )
+	    continue;
+	  const double s = std::max(sigma.flatdata(i), adaptive_min_sigma);
+	  double t = (std::log(s)-lmin) / dl;
+	  t = std::min(std::max(t, 0.), double(nbuckets-1));
+
+	  unsigned lo = unsigned(t);
+	  if( lo == nbuckets-1 && lo > 0 )
+	    lo = nbuckets-2;
+
+	  float num, den;
+	  if( nbuckets == 1 ) {
+	    num = cur_dw[i]; den = cur_wt[i];
+	  } else if( lo+1 == b ) {
+	    const float f = float(t - lo);
+	    num = (1-f)*prev_dw[i] + f*cur_dw[i];
+	    den = (1-f)*prev_wt[i] + f*cur_wt[i];
+	  } else
+	    continue;
+
+	  out->flatdata(i) = den > 0 ? num/den : nan;
+	}
+      });
+
+    cur_dw.swap(prev_dw);
+    cur_wt.swap(prev_wt);
+  }
+}
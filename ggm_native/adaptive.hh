@@ -0,0 +1,39 @@
+#ifndef GGM_ADAPTIVE_HH
+#define GGM_ADAPTIVE_HH
+
+#include <dm/memimage.hh>
+
+#include "exposure.hh"
+
+namespace ggm
+{
+  // Smooth image with a gaussian whose sigma varies per pixel, taken
+  // from the sigma image (in pixels).
+  //
+  // Rather than applying a 2D kernel per pixel, the range of sigma is
+  // split into nbuckets log-spaced values. The image is smoothed with
+  // a separable gaussian for each bucket and each output pixel is
+  // interpolated (in log sigma) between the two buckets either side
+  // of its sigma. More buckets give a more accurate result, at a
+  // cost of one separable smoothing per bucket.
+  //
+  // The optional mask uses the adaptive_ggm conventions (see
+  // mask.hh). Excluded and ignored pixels do not contribute to the
+  // smoothing (normalised convolution). Output pixels which are
+  // excluded, have no valid sigma or no input within range are NaN.
+  //
+  // With expcorr, in is a counts image, and the output is the
+  // smoothed exposure-corrected image (see exposure.hh). The counts
+  // and exposure are smoothed in the same pass for each bucket.
+  void adaptive_smooth(const dm::memimage<float>& in,
+		       const dm::memimage<float>& sigma,
+		       const dm::memimage<float>* mask,
+		       dm::memimage<float>* out,
+		       unsigned nbuckets = 16,
+		       const exposure_correction* expcorr = 0);
+
+  // smallest sigma used for a bucket (smaller values are clipped)
+  const float adaptive_min_sigma = 0.25f;
+}
+
+#endif
@@ -0,0 +1,151 @@
+// Adaptive Gaussian gradient magnitude, doing all the steps of
+// adaptive_ggm.py (scale map, adaptive smoothing and gradient) in
+// memory in one program. Intermediate images are only written if
+// requested. Given an exposure map, the smoothed image is exposure
+// corrected.
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <cmath>
+#include <cstdlib>
+
+#include <dm/dm.hh>
+
+#include "adaptive.hh"
+#include "gradient.hh"
+#include "io.hh"
+#include "parallel.hh"
+#include "scalemap.hh"
+
+struct Options
+{
+  Options()
+    : sn(32), expthresh(0.1), log(true), buckets(16)
+  {}
+
+  std::string counts, output, image, mask, scale, smoothed;
+  std::string expmap, bkg;
+  double sn, expthresh;
+  bool log;
+  unsigned buckets;
+};
+
+void run(const Options& opts)
+{
+  std::unique_ptr< dm::memimage<float> > counts( ggm::load_image(opts.counts) );
+
+  std::unique_ptr< dm::memimage<float> > mask;
+  if( ! opts.mask.empty() )
+    mask.reset( ggm::load_image_sized(opts.mask, *counts, opts.counts) );
+
+  std::cout << "* Calculating scale map\n";
+  dm::memimage<float> sigma(counts->xw(), counts->yw());
+  ggm::scale_map(*counts, mask.get(), &sigma, opts.sn*opts.sn);
+  if( ! opts.scale.empty() )
+    ggm::write_image(opts.scale, sigma, opts.counts);
+
+  // scale map is radius squared, which is used as gaussian sigma
+  for(size_t i=0; i<sigma.nelem(); ++i)
+    sigma.flatdata(i) = std::sqrt(sigma.flatdata(i));
+
+  // smooth the counts, or a separate input image
+  const std::string& inname = opts.image.empty() ? opts.counts : opts.image;
+  if( ! opts.image.empty() )
+    counts.reset( ggm::load_image_sized(opts.image, *counts, opts.counts) );
+
+  // exposure correction, smoothing the counts and exposure together
+  std::unique_ptr< dm::memimage<float> > expmap, bkg;
+  std::unique_ptr<ggm::exposure_correction> expcorr;
+  if( ! opts.expmap.empty() ) {
+    expmap.reset( ggm::load_image_sized(opts.expmap, *counts, inname) );
+    if( ! opts.bkg.empty() )
+      bkg.reset( ggm::load_image_sized(opts.bkg, *counts, inname) );
+    expcorr.reset( new ggm::exposure_correction(*expmap, bkg.get(),
+						opts.expthresh) );
+  }
+
+  std::cout << "* Smoothing input image\n";
+  dm::memimage<float> smoothed(counts->xw(), counts->yw());
+  ggm::adaptive_smooth(*counts, sigma, mask.get(), &smoothed, opts.buckets,
+		       expcorr.get());
+  counts.reset();
+  expcorr.reset();
+  expmap.reset();
+  bkg.reset();
+  if( ! opts.smoothed.empty() )
+    ggm::write_image(opts.smoothed, smoothed, inname);
+
+  std::cout << "* Calculating gradient\n";
+  // reuse the sigma image for output
+  ggm::gradient_magnitude(smoothed, &sigma, opts.log);
+
+  std::cout << "* Writing gradient image " << opts.output << '\n';
+  ggm::write_image(opts.output, sigma, inname);
+}
+
+bool parse_bool(const std::string& s)
+{
+  return !( s == "0" || s == "False" || s == "false" || s == "no" );
+}
+
+int main(int argc, char* argv[])
+{
+  Options opts;
+  std::vector<std::string> args;
+
+  for(int i=1; i<argc; ++i) {
+    const std::string a(argv[i]);
+    if( a.compare(0, 8, "--image=") == 0 )
+      opts.image = a.substr(8);
+    else if( a.compare(0, 5, "--sn=") == 0 )
+      opts.sn = std::atof(a.substr(5).c_str());
+    else if( a.compare(0, 6, "--log=") == 0 )
+      opts.log = parse_bool(a.substr(6));
+    else if( a.compare(0, 7, "--mask=") == 0 )
+      opts.mask = a.substr(7);
+    else if( a.compare(0, 8, "--scale=") == 0 )
+      opts.scale = a.substr(8);
+    else if( a.compare(0, 11, "--smoothed=") == 0 )
+      opts.smoothed = a.substr(11);
+    else if( a.compare(0, 10, "--buckets=") == 0 )
+      opts.buckets = std::atoi(a.substr(10).c_str());
+    else if( a.compare(0, 9, "--expmap=") == 0 )
+      opts.expmap = a.substr(9);
+    else if( a.compare(0, 6, "--bkg=") == 0 )
+      opts.bkg = a.substr(6);
+    else if( a.compare(0, 12, "--expthresh=") == 0 )
+      opts.expthresh = std::atof(a.substr(12).c_str());
+    else if( a.compare(0, 10, "--threads=") == 0 )
+      ggm::set_threads( std::atoi(a.substr(10).c_str()) );
+    else
+      args.push_back(a);
+  }
+
+  if( args.size() != 2 || opts.sn <= 0 )
+    {
+      std::cerr << "Usage: "
+		<< argv[0]
+		<< " [--image=in.fits] [--sn=32] [--log=1] [--mask=mask.fits]\n"
+		<< "    [--scale=scale.fits] [--smoothed=smoothed.fits]"
+		<< " [--buckets=16] [--threads=N]\n"
+		<< "    [--expmap=exp.fits [--bkg=bkg.fits] [--expthresh=0.1]]\n"
+		<< "    counts.fits output.fits\n";
+      return 1;
+    }
+  opts.counts = args[0];
+  opts.output = args[1];
+
+  try
+    {
+      run(opts);
+    }
+  catch(dm::exception& e)
+    {
+      std::cerr << e() << '\n';
+      return 1;
+    }
+
+  return 0;
+}
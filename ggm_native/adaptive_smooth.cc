@@ -0,0 +1,106 @@
+// Adaptively smooth an image using a scale map, as produced by
+// contbin's accumulate_counts. This is a replacement for the
+// "accumulate_counts --apply --gaussian" step in adaptive_ggm.py.
+// Given an exposure map, the input is counts and the output is the
+// smoothed exposure-corrected image.
+
+#include <iostream>
+#include <string>
+#include <memory>
+#include <cmath>
+#include <cstdlib>
+#include <vector>
+
+#include <dm/dm.hh>
+
+#include "adaptive.hh"
+#include "io.hh"
+#include "parallel.hh"
+
+void run(const std::string& infile,
+	 const std::string& scalefile,
+	 const std::string& maskfile,
+	 const std::string& outfile,
+	 const std::string& expfile,
+	 const std::string& bkgfile,
+	 double expthresh,
+	 unsigned nbuckets)
+{
+  std::unique_ptr< dm::memimage<float> > inimage( ggm::load_image(infile) );
+
+  // scale map contains radius squared, which is used as the gaussian
+  // sigma
+  std::unique_ptr< dm::memimage<float> > sigma
+    ( ggm::load_image_sized(scalefile, *inimage, infile) );
+  for(size_t i=0; i<sigma->nelem(); ++i)
+    sigma->flatdata(i) = std::sqrt(sigma->flatdata(i));
+
+  std::unique_ptr< dm::memimage<float> > mask;
+  if( ! maskfile.empty() )
+    mask.reset( ggm::load_image_sized(maskfile, *inimage, infile) );
+
+  std::unique_ptr< dm::memimage<float> > expmap, bkg;
+  std::unique_ptr<ggm::exposure_correction> expcorr;
+  if( ! expfile.empty() ) {
+    expmap.reset( ggm::load_image_sized(expfile, *inimage, infile) );
+    if( ! bkgfile.empty() )
+      bkg.reset( ggm::load_image_sized(bkgfile, *inimage, infile) );
+    expcorr.reset( new ggm::exposure_correction(*expmap, bkg.get(),
+						expthresh) );
+  }
+
+  dm::memimage<float> outimage(inimage->xw(), inimage->yw());
+  ggm::adaptive_smooth(*inimage, *sigma, mask.get(), &outimage, nbuckets,
+		       expcorr.get());
+
+  ggm::write_image(outfile, outimage, infile);
+}
+
+int main(int argc, char* argv[])
+{
+  std::string maskfile, expfile, bkgfile;
+  double expthresh = 0.1;
+  unsigned nbuckets = 16;
+  std::vector<std::string> args;
+
+  for(int i=1; i<argc; ++i) {
+    const std::string a(argv[i]);
+    if( a.compare(0, 7, "--mask=") == 0 )
+      maskfile = a.substr(7);
+    else if( a.compare(0, 10, "--buckets=") == 0 )
+      nbuckets = std::atoi(a.substr(10).c_str());
+    else if( a.compare(0, 9, "--expmap=") == 0 )
+      expfile = a.substr(9);
+    else if( a.compare(0, 6, "--bkg=") == 0 )
+      bkgfile = a.substr(6);
+    else if( a.compare(0, 12, "--expthresh=") == 0 )
+      expthresh = std::atof(a.substr(12).c_str());
+    else if( a.compare(0, 10, "--threads=") == 0 )
+      ggm::set_threads( std::atoi(a.substr(10).c_str()) );
+    else
+      args.push_back(a);
+  }
+
+  if( args.size() != 3 )
+    {
+      std::cerr << "Usage: "
+		<< argv[0]
+		<< " [--mask=mask.fits] [--buckets=16] [--threads=N]\n"
+		<< "    [--expmap=exp.fits [--bkg=bkg.fits] [--expthresh=0.1]]"
+		<< " in.fits scale.fits out.fits\n";
+      return 1;
+    }
+
+  try
+    {
+      run(args[0], args[1], maskfile, args[2], expfile, bkgfile, expthresh,
+	  nbuckets);
+    }
+  catch(dm::exception& e)
+    {
+      std::cerr << e() << '\n';
+      return 1;
+    }
+
+  return 0;
+}
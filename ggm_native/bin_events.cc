@@ -0,0 +1,272 @@
+// Bin an event list into images in several energy bands, reading the
+// events only once
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+
+#include <dm/dm.hh>
+
+#include "binning.hh"
+#include "io.hh"
+#include "parallel.hh"
+
+struct Options
+{
+  Options()
+    : bin(1), have_xrange(false), have_yrange(false),
+      energycol("energy"), eventsblock("EVENTS"), cube(false)
+  {}
+
+  std::string events, outroot;
+  std::vector<ggm::energy_band> bands;
+  double bin;
+  bool have_xrange, have_yrange;
+  double xrange[2], yrange[2];
+  std::string energycol, eventsblock, gtiblock;
+  bool cube;
+};
+
+// rows read from the event file at a time
+const long batch_rows = 1 << 20;
+
+// columns of events read in a batch
+struct Batch
+{
+  void resize(long n, bool time)
+  {
+    x.resize(n); y.resize(n); energy.resize(n);
+    t.resize(time ? n : 0);
+  }
+  std::vector<double> x, y, energy, t;
+};
+
+void read_batch(dm::table* tab, const Options& opts, long row, long n,
+		Batch* b)
+{
+  const bool time = ! opts.gtiblock.empty();
+  b->resize(n, time);
+  tab->read_column("x", row, n, &b->x[0]);
+  tab->read_column("y", row, n, &b->y[0]);
+  tab->read_column(opts.energycol, row, n, &b->energy[0]);
+  if( time )
+    tab->read_column("time", row, n, &b->t[0]);
+}
+
+// physical coordinates of the events
+void write_physical(dm::image* im, const Options& opts, double x0, double y0)
+{
+  im->write_key("LTM1_1", 1/opts.bin);
+  im->write_key("LTM2_2", 1/opts.bin);
+  im->write_key("LTV1", 0.5 - x0/opts.bin);
+  im->write_key("LTV2", 0.5 - y0/opts.bin);
+}
+
+void write_band(const std::string& filename, const dm::memimage<float>& img,
+		const Options& opts, double x0, double y0)
+{
+  if( filename.size() > 3 &&
+      filename.compare(filename.size()-3, 3, ".fz") == 0 ) {
+    ggm::write_image(filename, img);
+    return;
+  }
+
+  dm::dataset ds(filename, dm::create_over);
+  std::unique_ptr<dm::image> im( ds.create_image("IMAGE", dmFLOAT,
+						 img.xw(), img.yw()) );
+  im->write_from_memimage(img);
+  write_physical(im.get(), opts, x0, y0);
+}
+
+// write all the bands as planes of a cube
+void write_cube(const std::string& filename, const ggm::event_binner& binner,
+		const Options& opts, unsigned xw, unsigned yw,
+		double x0, double y0)
+{
+  dm::memcube<float> cube(xw, yw, binner.no_bands());
+  for(unsigned b=0; b<binner.no_bands(); ++b) {
+    dm::memimage<float> plane = cube.plane(b);
+    binner.get_image(b, &plane);
+  }
+
+  dm::dataset ds(filename, dm::create_over);
+  std::unique_ptr<dm::image> im( ds.create_image("IMAGE", dmFLOAT,
+						 xw, yw, cube.zw()) );
+  im->write_from_memcube(cube);
+  write_physical(im.get(), opts, x0, y0);
+}
+
+std::string band_name(const ggm::energy_band& band)
+{
+  char buf[64];
+  std::snprintf(buf, sizeof(buf), "%g-%g", band.lo, band.hi);
+  return buf;
+}
+
+void throw_range(const std::string& col)
+{
+  dm::except_invalid_param e;
+  e.set_descr("No range for column " + col + ", so give the image range");
+  throw e;
+}
+
+void run(const Options& opts)
+{
+  dm::dataset ds(opts.events);
+  std::unique_ptr<dm::table> events( ds.get_table(opts.eventsblock) );
+
+  // image range, by default the range of the columns
+  double xr[2] = {opts.xrange[0], opts.xrange[1]};
+  double yr[2] = {opts.yrange[0], opts.yrange[1]};
+  if( ! opts.have_xrange && ! events->get_column_range("x", &xr[0], &xr[1]) )
+    throw_range("x");
+  if( ! opts.have_yrange && ! events->get_column_range("y", &yr[0], &yr[1]) )
+    throw_range("y");
+
+  const unsigned xw = unsigned(std::ceil((xr[1]-xr[0])/opts.bin));
+  const unsigned yw = unsigned(std::ceil((yr[1]-yr[0])/opts.bin));
+  std::cout << "* Binning to " << xw << "x" << yw << " pixels in "
+	    << opts.bands.size() << " bands\n";
+
+  ggm::event_binner binner(xr[0], yr[0], xw, yw, opts.bin, opts.bands);
+
+  if( ! opts.gtiblock.empty() ) {
+    std::unique_ptr<dm::table> gti( ds.get_table(opts.gtiblock) );
+    const long n = gti->get_no_rows();
+    std::vector<double> start(n), stop(n);
+    if( n > 0 ) {
+      gti->read_column("start", 0, n, &start[0]);
+      gti->read_column("stop", 0, n, &stop[0]);
+    }
+    binner.set_gti(start, stop);
+  }
+
+  // read the next batch while binning the current one
+  const long nrows = events->get_no_rows();
+  Batch batches[2];
+  if( nrows > 0 )
+    read_batch(events.get(), opts, 0, std::min(batch_rows, nrows),
+	       &batches[0]);
+  for(long row=0, idx=0; row<nrows; row+=batch_rows, idx^=1) {
+    const Batch& cur = batches[idx];
+    const long n = std::min(batch_rows, nrows-row);
+    std::thread binthread
+      ( [&binner, &cur, n]() {
+	binner.add(n, &cur.x[0], &cur.y[0], &cur.energy[0],
+		   cur.t.empty() ? 0 : &cur.t[0]);
+      } );
+
+    try {
+      const long next = row + batch_rows;
+      if( next < nrows )
+	read_batch(events.get(), opts, next,
+		   std::min(batch_rows, nrows-next), &batches[idx^1]);
+    } catch( ... ) {
+      binthread.join();
+      throw;
+    }
+    binthread.join();
+  }
+
+  std::cout << "* Binned " << binner.no_binned() << " of " << nrows
+	    << " events\n";
+
+  if( opts.cube ) {
+    const std::string filename = opts.outroot + ".fits";
+    std::cout << "* Writing " << filename << '\n';
+    write_cube(filename, binner, opts, xw, yw, xr[0], yr[0]);
+    return;
+  }
+
+  dm::memimage<float> img(xw, yw);
+  for(unsigned b=0; b<binner.no_bands(); ++b) {
+    binner.get_image(b, &img);
+    const std::string filename = opts.outroot + "_" +
+      band_name(opts.bands[b]) + ".fits";
+    std::cout << "* Writing " << filename << '\n';
+    write_band(filename, img, opts, xr[0], yr[0]);
+  }
+}
+
+// parse lo:hi into two values
+bool parse_range(const std::string& s, double* lo, double* hi)
+{
+  const size_t colon = s.find(':');
+  if( colon == std::string::npos )
+    return false;
+  *lo = std::atof(s.substr(0, colon).c_str());
+  *hi = std::atof(s.substr(colon+1).c_str());
+  return *hi > *lo;
+}
+
+int main(int argc, char* argv[])
+{
+  Options opts;
+  std::vector<std::string> args;
+  bool ok = true;
+
+  for(int i=1; i<argc; ++i) {
+    const std::string a(argv[i]);
+    if( a.compare(0, 8, "--bands=") == 0 ) {
+      // comma separated list of lo:hi
+      std::string list = a.substr(8);
+      while( ! list.empty() ) {
+	const size_t comma = list.find(',');
+	ggm::energy_band band;
+	ok = ok && parse_range(list.substr(0, comma), &band.lo, &band.hi);
+	opts.bands.push_back(band);
+	list = comma == std::string::npos ? "" : list.substr(comma+1);
+      }
+    } else if( a.compare(0, 6, "--bin=") == 0 )
+      opts.bin = std::atof(a.substr(6).c_str());
+    else if( a.compare(0, 9, "--xrange=") == 0 )
+      ok = ok && (opts.have_xrange =
+		  parse_range(a.substr(9), &opts.xrange[0], &opts.xrange[1]));
+    else if( a.compare(0, 9, "--yrange=") == 0 )
+      ok = ok && (opts.have_yrange =
+		  parse_range(a.substr(9), &opts.yrange[0], &opts.yrange[1]));
+    else if( a.compare(0, 9, "--energy=") == 0 )
+      opts.energycol = a.substr(9);
+    else if( a.compare(0, 9, "--events=") == 0 )
+      opts.eventsblock = a.substr(9);
+    else if( a.compare(0, 6, "--gti=") == 0 )
+      opts.gtiblock = a.substr(6);
+    else if( a == "--cube" )
+      opts.cube = true;
+    else if( a.compare(0, 10, "--threads=") == 0 )
+      ggm::set_threads( std::atoi(a.substr(10).c_str()) );
+    else
+      args.push_back(a);
+  }
+
+  if( args.size() != 2 || opts.bands.empty() || opts.bin <= 0 || ! ok )
+    {
+      std::cerr << "Usage: "
+		<< argv[0]
+		<< " --bands=lo:hi[,lo:hi...] [--bin=1] [--xrange=x0:x1]\n"
+		<< "   [--yrange=y0:y1] [--energy=energy] [--events=EVENTS]"
+		<< " [--gti=GTI]\n"
+		<< "   [--cube] [--threads=N] events.fits outroot\n";
+      return 1;
+    }
+
+  opts.events = args[0];
+  opts.outroot = args[1];
+
+  try
+    {
+      run(opts);
+    }
+  catch(dm::exception& e)
+    {
+      std::cerr << e() << '\n';
+      return 1;
+    }
+
+  return 0;
+}
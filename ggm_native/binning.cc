@@ -0,0 +1,132 @@
+#include <algorithm>
+#include <cmath>
+#include <utility>
+
+#include <dm/parallel.hh>
+
+#include "parallel.hh"
+#include "binning.hh"
+
+namespace
+{
+  // limit on memory used by all the per-thread histograms
+  const double max_hist_bytes = 2e9;
+}
+
+ggm::event_binner::event_binner(double x0, double y0,
+				unsigned xw, unsigned yw, double bin,
+				const std::vector<energy_band>& bands)
+  : m_x0(x0), m_y0(y0), m_bin(bin), m_xw(xw), m_yw(yw), m_bands(bands)
+{
+  // one set of histograms per thread, unless that uses too much memory
+  const double setbytes = double(xw)*yw*bands.size()*sizeof(unsigned);
+  const unsigned maxsets = unsigned(std::max(1., max_hist_bytes/setbytes));
+  const unsigned nsets = std::max(1u, std::min(get_threads(), maxsets));
+
+  m_hists.resize(nsets);
+  for(unsigned i=0; i<nsets; ++i)
+    m_hists[i].assign(size_t(xw)*yw*bands.size(), 0);
+  m_nbinned.assign(nsets, 0);
+}
+
+void ggm::event_binner::set_gti(const std::vector<double>& start,
+				const std::vector<double>& stop)
+{
+  std::vector< std::pair<double,double> > gti;
+  for(size_t i=0; i<start.size() && i<stop.size(); ++i)
+    if( stop[i] > start[i] )
+      gti.push_back(std::make_pair(start[i], stop[i]));
+  std::sort(gti.begin(), gti.end());
+
+  // merge overlapping intervals, so a time is in at most one
+  m_gti_start.clear();
+  m_gti_stop.clear();
+  for(size_t i=0; i<gti.size(); ++i) {
+    if( ! m_gti_stop.empty() && gti[i].first <= m_gti_stop.back() )
+      m_gti_stop.back() = std::max(m_gti_stop.back(), gti[i].second);
+    else {
+      m_gti_start.push_back(gti[i].first);
+      m_gti_stop.push_back(gti[i].second);
+    }
+  }
+
+  // an empty GTI excludes everything
+  if( m_gti_start.empty() ) {
+    m_gti_start.push_back(0);
+    m_gti_stop.push_back(0);
+  }
+}
+
+void ggm::event_binner::add(size_t n, const double* x, const double* y,
+			    const double* energy, const double* time)
+{
+  const bool usegti = ! m_gti_start.empty() && time != 0;
+  const unsigned nbands = no_bands();
+  const size_t npix = size_t(m_xw)*m_yw;
+  const size_t nsets = m_hists.size();
+  const double invbin = 1/m_bin;
+
+  // each set of histograms takes a contiguous part of the batch
+  dm::parallel_items
+    (nsets, nsets,
+     [&](size_t set, unsigned) {
+      const size_t i0 = n*set/nsets, i1 = n*(set+1)/nsets;
+      unsigned* hist = &m_hists[set][0];
+      unsigned long long nbinned = 0;
+
+      for(size_t i=i0; i<i1; ++i) {
+	const double px = std::floor((x[i]-m_x0)*invbin);
+	const double py = std::floor((y[i]-m_y0)*invbin);
+	if( !(px >= 0 && px < m_xw && py >= 0 && py < m_yw) )
+	  continue;
+
+	if( usegti ) {
+	  const size_t idx = std::upper_bound(m_gti_start.begin(),
+					      m_gti_start.end(), time[i]) -
+	    m_gti_start.begin();
+	  if( idx == 0 || time[i] >= m_gti_stop[idx-1] )
+	    continue;
+	}
+
+	const size_t pix = size_t(py)*m_xw + size_t(px);
+	bool binned = false;
+	for(unsigned b=0; b<nbands; ++b)
+	  if( energy[i] >= m_bands[b].lo && energy[i] < m_bands[b].hi ) {
+	    ++hist[b*npix + pix];
+	    binned = true;
+	  }
+	if( binned )
+	  ++nbinned;
+      }
+      m_nbinned[set] += nbinned;
+    });
+}
+
+void ggm::event_binner::get_image(unsigned band,
+				  dm::memimage<float>* out) const
+{
+  if( out->xw() != m_xw || out->yw() != m_yw )
+    *out = dm::memimage<float>(m_xw, m_yw);
+
+  const size_t npix = size_t(m_xw)*m_yw;
+  const size_t offset = size_t(band)*npix;
+
+  parallel_rows
+    (m_yw,
+     [&](unsigned y0, unsigned y1) {
+      for(size_t i=size_t(y0)*m_xw; i<size_t(y1)*m_xw; ++i) {
+	unsigned long long sum = 0;
+	for(size_t s=0; s<m_hists.size(); ++s)
+	  sum += m_hists[s][offset+i];
+	out->data()[i] = float(sum);
+      }
+    });
+}
+
+unsigned long long ggm::event_binner::no_binned() const
+{
+  unsigned long long total = 0;
+  for(size_t s=0; s<m_nbinned.size(); ++s)
+    total += m_nbinned[s];
+  return total;
+}
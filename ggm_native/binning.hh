@@ -0,0 +1,59 @@
+#ifndef GGM_BINNING_HH
+#define GGM_BINNING_HH
+
+#include <vector>
+#include <dm/memimage.hh>
+
+namespace ggm
+{
+  // range of energies, including lo but excluding hi
+  struct energy_band
+  {
+    energy_band(double l=0, double h=0) : lo(l), hi(h) {}
+    double lo, hi;
+  };
+
+  // bins events into images in several energy bands at once, so that
+  // the events only need to be read once. Batches of events are split
+  // between threads, each filling its own histograms, which are
+  // summed when the images are retrieved.
+  class event_binner
+  {
+  public:
+    // output pixel (i,j) covers x0+i*bin <= x < x0+(i+1)*bin and
+    // y0+j*bin <= y < y0+(j+1)*bin
+    event_binner(double x0, double y0, unsigned xw, unsigned yw,
+		 double bin, const std::vector<energy_band>& bands);
+
+    // only include events with times in these intervals (start <=
+    // time < stop)
+    void set_gti(const std::vector<double>& start,
+		 const std::vector<double>& stop);
+
+    // bin n events. time is only used if a GTI has been set
+    void add(size_t n, const double* x, const double* y,
+	     const double* energy, const double* time = 0);
+
+    // get the image for band (resized if needed)
+    void get_image(unsigned band, dm::memimage<float>* out) const;
+
+    // number of events added to at least one image
+    unsigned long long no_binned() const;
+
+    unsigned no_bands() const { return unsigned(m_bands.size()); }
+
+  private:
+    double m_x0, m_y0, m_bin;
+    unsigned m_xw, m_yw;
+    std::vector<energy_band> m_bands;
+
+    // merged good time intervals
+    std::vector<double> m_gti_start, m_gti_stop;
+
+    // histograms for each thread (band by band), and event counts
+    std::vector< std::vector<unsigned> > m_hists;
+    std::vector<unsigned long long> m_nbinned;
+  };
+}
+
+#endif
@@ -0,0 +1,37 @@
+#!/usr/bin/env python3
+
+# Check that ggmnative.gaussian_gradient_magnitude matches
+# scipy.ndimage.gaussian_gradient_magnitude without a mask, including
+# non-integer sigmas (where the kernel radius is rounded).
+# Run from this directory after "make python".
+
+import sys
+
+import numpy as N
+import scipy.ndimage
+
+import ggmnative
+
+def check(img, sigma):
+    ref = scipy.ndimage.gaussian_gradient_magnitude(
+        img.astype(N.float64), sigma)
+    out = N.asarray(ggmnative.gaussian_gradient_magnitude(img, sigma))
+    err = N.abs(out - ref).max() / N.abs(ref).max()
+    ok = err < 1e-5
+    print('sigma %5.2f  max relative error %.2e  %s' % (
+        sigma, err, 'ok' if ok else 'FAILED'))
+    return ok
+
+def main():
+    rng = N.random.default_rng(1)
+    img = rng.poisson(5., size=(211, 333)).astype(N.float32)
+
+    ok = True
+    for sigma in (0.3, 0.7, 1., 1.1, 1.6, 2.3, 4., 6.37):
+        ok = check(img, sigma) and ok
+
+    if not ok:
+        sys.exit(1)
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,174 @@
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
+#include "combine.hh"
+#include "parallel.hh"
+
+namespace
+{
+  // rebuild the sum after this many incremental updates, to stop
+  // rounding errors accumulating
+  const unsigned max_updates = 64;
+
+  // numpy.interp equivalent
+  double interp(double x, const std::vector<double>& xp,
+		const std::vector<double>& fp)
+  {
+    if( xp.empty() )
+      return 0;
+    if( x <= xp.front() )
+      return fp.front();
+    if( x >= xp.back() )
+      return fp.back();
+
+    const size_t i = std::upper_bound(xp.begin(), xp.end(), x) - xp.begin();
+    const double f = (x-xp[i-1]) / (xp[i]-xp[i-1]);
+    return fp[i-1] + f*(fp[i]-fp[i-1]);
+  }
+}
+
+ggm::combiner::combiner(unsigned xw, unsigned yw, double xc, double yc)
+  : m_sum(xw, yw), m_bins(size_t(xw)*yw), m_updates(0)
+{
+  // use the finest bins which fit the bin numbers into 16 bits
+  double rmax = 0;
+  const double cx[2] = {0, double(xw)}, cy[2] = {0, double(yw)};
+  for(unsigned i=0; i<2; ++i)
+    for(unsigned j=0; j<2; ++j)
+      rmax = std::max(rmax, std::sqrt((cx[i]-xc)*(cx[i]-xc) +
+				      (cy[j]-yc)*(cy[j]-yc)));
+  m_binwidth = rmax > 0 ? rmax/65535. : 1.;
+  m_nbins = unsigned(rmax/m_binwidth) + 1;
+
+  parallel_rows(yw, [&](unsigned y0, unsigned y1)
+    {
+      for(unsigned y=y0; y<y1; ++y) {
+	unsigned short* b = &m_bins[size_t(y)*xw];
+	const double dy2 = (y-yc)*(y-yc);
+	for(unsigned x=0; x<xw; ++x) {
+	  const double r = std::sqrt((x-xc)*(x-xc) + dy2);
+	  b[x] = (unsigned short)( std::min(unsigned(r/m_binwidth), m_nbins-1) );
+	}
+      }
+    });
+}
+
+unsigned ggm::combiner::add_image(const dm::memimage<float>* img)
+{
+  if( img->xw() != xw() || img->yw() != yw() )
+    throw dm::memimage<float>::size_mismatch_exception();
+
+  m_images.push_back(img);
+  m_packed.push_back(0);
+  m_luts.push_back( std::vector<float>(m_nbins, 0.f) );
+  m_enabled.push_back(false);
+  return m_images.size()-1;
+}
+
+unsigned ggm::combiner::add_image(const dm::packed_image* img)
+{
+  if( img->xw() != xw() || img->yw() != yw() )
+    throw dm::memimage<float>::size_mismatch_exception();
+
+  m_images.push_back(0);
+  m_packed.push_back(img);
+  m_luts.push_back( std::vector<float>(m_nbins, 0.f) );
+  m_enabled.push_back(false);
+  return m_images.size()-1;
+}
+
+void ggm::combiner::set_curve(unsigned idx,
+			      const std::vector<double>& radii,
+			      const std::vector<double>& weights,
+			      double scale)
+{
+  std::vector<float> lut(m_nbins, 0.f);
+  const bool enabled = scale > 0;
+  if( enabled )
+    for(unsigned i=0; i<m_nbins; ++i)
+      lut[i] = float( interp((i+0.5)*m_binwidth, radii, weights)*scale );
+
+  if( enabled != m_enabled[idx] || ++m_updates >= max_updates ) {
+    // switching an image on or off changes where NaNs are, so
+    // needs a full recalculation
+    m_luts[idx].swap(lut);
+    m_enabled[idx] = enabled;
+    recompute();
+  } else if( enabled ) {
+    std::vector<float> delta(m_nbins);
+    for(unsigned i=0; i<m_nbins; ++i)
+      delta[i] = lut[i] - m_luts[idx][i];
+    m_luts[idx].swap(lut);
+    add_contribution(idx, delta);
+  }
+}
+
+void ggm::combiner::add_contribution(unsigned idx,
+				     const std::vector<float>& delta)
+{
+  const unsigned w = xw();
+  const float* const d = &delta[0];
+  const dm::memimage<float>* img = m_images[idx];
+  const dm::packed_image* packed = m_packed[idx];
+
+  parallel_rows(yw(), [&](unsigned y0, unsigned y1)
+    {
+      std::vector<float> row(packed != 0 ? w : 0);
+      for(unsigned y=y0; y<y1; ++y) {
+	const unsigned short* b = &m_bins[size_t(y)*w];
+	const float* in;
+	if( packed != 0 ) {
+	  packed->get_row(y, row.data());
+	  in = row.data();
+	} else
+	  in = img->row(y);
+	float* s = m_sum.row(y);
+	for(unsigned x=0; x<w; ++x)
+	  s[x] += d[b[x]]*in[x];
+      }
+    });
+}
+
+void ggm::combiner::recompute()
+{
+  m_sum.set_all(0);
+  for(unsigned i=0; i<m_images.size(); ++i)
+    if( m_enabled[i] )
+      add_contribution(i, m_luts[i]);
+  m_updates = 0;
+}
+
+void ggm::combiner::combined(dm::memimage<float>* out) const
+{
+  if( out->xw() != xw() || out->yw() != yw() )
+    throw dm::memimage<float>::size_mismatch_exception();
+
+  // maximum finite value in each band of rows
+  const unsigned w = xw();
+  std::vector<float> maxvals(yw(), -std::numeric_limits<float>::max());
+  parallel_rows(yw(), [&](unsigned y0, unsigned y1)
+    {
+      for(unsigned y=y0; y<y1; ++y) {
+	const float* s = m_sum.row(y);
+	float m = -std::numeric_limits<float>::max();
+	for(unsigned x=0; x<w; ++x)
+	  if( std::isfinite(s[x]) )
+	    m = std::max(m, s[x]);
+	maxvals[y] = m;
+      }
+    });
+  const float maxval = maxvals.empty() ? 1.f :
+    *std::max_element(maxvals.begin(), maxvals.end());
+  const float scale = 1.f/maxval;
+
+  parallel_rows(yw(), [&](unsigned y0, unsigned y1)
+    {
+      for(unsigned y=y0; y<y1; ++y) {
+	const float* s = m_sum.row(y);
+	float* o = out->row(y);
+	for(unsigned x=0; x<w; ++x)
+	  o[x] = s[x]*scale;
+      }
+    });
+}
@@ -0,0 +1,71 @@
+#ifndef GGM_COMBINE_HH
+#define GGM_COMBINE_HH
+
+#include <vector>
+#include <dm/memimage.hh>
+#include <dm/packimage.hh>
+
+namespace ggm
+{
+  // Combine GGM images of different scales, weighting each by a
+  // piecewise-linear function of radius from a centre (as
+  // ImageContainer.filterAdd() in ggm_combine/interactive.py).
+  //
+  // The radius of each pixel is quantised into a bin once, and each
+  // weight curve becomes a lookup table over the bins. A running sum
+  // of the weighted images is kept, so when one curve is changed only
+  // the change in that image's contribution is added.
+  class combiner
+  {
+  public:
+    // images of size xw*yw, with radii measured from pixel xc, yc
+    // (from 0)
+    combiner(unsigned xw, unsigned yw, double xc, double yc);
+
+    // add input image (not copied, so must outlive the combiner),
+    // returning its index. Initially it has zero weight.
+    unsigned add_image(const dm::memimage<float>* img);
+    // add input image held in 16 bits per pixel (not copied), which
+    // is converted a row at a time as it is added to the sum
+    unsigned add_image(const dm::packed_image* img);
+
+    // set the weight curve for an image: weights at radii (pixels,
+    // increasing) multiplied by scale, interpolated linearly as
+    // numpy.interp. Images with scale <= 0 are not included.
+    void set_curve(unsigned idx,
+		   const std::vector<double>& radii,
+		   const std::vector<double>& weights,
+		   double scale);
+
+    // get combined image, divided by its maximum finite value
+    void combined(dm::memimage<float>* out) const;
+
+    // unnormalised sum of weighted images
+    const dm::memimage<float>& sum() const { return m_sum; }
+
+    unsigned xw() const { return m_sum.xw(); }
+    unsigned yw() const { return m_sum.yw(); }
+    unsigned no_images() const { return m_images.size(); }
+
+  private:
+    // add delta[bin]*image to sum
+    void add_contribution(unsigned idx, const std::vector<float>& delta);
+    // rebuild sum from scratch
+    void recompute();
+
+  private:
+    dm::memimage<float> m_sum;
+    std::vector<unsigned short> m_bins;  // radius bin of each pixel
+    double m_binwidth;
+    unsigned m_nbins;
+
+    // each image is either a memimage or a packed_image (other null)
+    std::vector<const dm::memimage<float>*> m_images;
+    std::vector<const dm::packed_image*> m_packed;
+    std::vector< std::vector<float> > m_luts; // weight per bin
+    std::vector<bool> m_enabled;
+    unsigned m_updates; // incremental updates since recompute
+  };
+}
+
+#endif
@@ -0,0 +1,381 @@
+// Server process for ggm_combine/interactive.py. This loads the GGM
+// images into memory once, then reads commands from stdin and writes
+// replies to stdout, so that redraws don't need any files.
+//
+// Usage: combine_server [--chop=x0,y0,x1,y1] [--levels=N] [--threads=N]
+//                       xc yc file1.fits...
+//
+// Block averaged copies of the images at 2x, 4x... 2^N smaller sizes
+// (default N=3) are made when they are loaded. Previews are combined
+// from the coarsest copy which is large enough, and curves are only
+// applied to the copies which are used, so redraws do not depend on
+// the size of the input images.
+//
+// Commands (one per line):
+//   curve IDX SCALE N R1..RN W1..WN  set weight curve for image IDX
+//       (N at most 65536)
+//       reply: "ok\n"
+//   get BIN   get combined image, block averaged by BIN (1 for none)
+//       reply: "image XW YW\n" followed by XW*YW native float32 values
+//   fit XW YW get combined image, binned by the largest power of two
+//             leaving it at least XW by YW
+//       reply: "image XW YW BIN\n" followed by the values
+//   roi X0 Y0 X1 Y1 BIN  get combined image of pixels X0..X1, Y0..Y1
+//             (inclusive, from 0), combined at full resolution and
+//             block averaged by BIN
+//       reply: as get
+//   quit
+// Errors are replied to with "error MESSAGE\n". Each combined image
+// is divided by its own maximum.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <dm/dm.hh>
+#include <dm/pyramid.hh>
+
+#include "combine.hh"
+#include "io.hh"
+#include "parallel.hh"
+
+namespace
+{
+  // largest number of points in a weight curve
+  const unsigned max_curve_points = 1u << 16;
+
+  // chop region (inclusive pixel ranges, from 0)
+  struct Chop
+  {
+    Chop() : enable(false), x0(0), y0(0), x1(0), y1(0) {}
+    bool enable;
+    unsigned x0, y0, x1, y1;
+  };
+
+  dm::memimage<float>* chop_image(const dm::memimage<float>& in,
+				  const Chop& chop)
+  {
+    if( chop.x1 >= in.xw() || chop.y1 >= in.yw() ||
+	chop.x0 > chop.x1 || chop.y0 > chop.y1 )
+      throw std::string("Chop range outside image");
+
+    dm::memimage<float>* out =
+      new dm::memimage<float>(chop.x1-chop.x0+1, chop.y1-chop.y0+1);
+    for(unsigned y=0; y<out->yw(); ++y)
+      for(unsigned x=0; x<out->xw(); ++x)
+	(*out)(x, y) = in(x+chop.x0, y+chop.y0);
+    return out;
+  }
+
+  // reply with an image, and its binning if given
+  void write_image_reply(const dm::memimage<float>& img, unsigned bin = 0)
+  {
+    std::cout << "image " << img.xw() << ' ' << img.yw();
+    if( bin > 0 )
+      std::cout << ' ' << bin;
+    std::cout << '\n';
+    std::cout.write(reinterpret_cast<const char*>(img.row(0)),
+		    std::streamsize(img.nelem())*sizeof(float));
+  }
+
+  // weight curve of an image. version counts the changes, so views
+  // can tell which curves they have not applied yet (0 is unset).
+  struct Curve
+  {
+    Curve() : scale(0), version(0) {}
+    std::vector<double> radii, weights;
+    double scale;
+    unsigned version;
+  };
+
+  // combiner for the images at one resolution, where each pixel is a
+  // block of factor*factor pixels of the full images, starting at
+  // x0, y0. Changed curves are applied when the view is used.
+  class View
+  {
+  public:
+    View(const std::vector<const dm::memimage<float>*>& images,
+	 double xc, double yc, unsigned factor,
+	 unsigned x0 = 0, unsigned y0 = 0)
+      : m_factor(factor),
+	m_comb(images[0]->xw(), images[0]->yw(),
+	       (xc - x0 - 0.5*(factor-1)) / factor,
+	       (yc - y0 - 0.5*(factor-1)) / factor),
+	m_versions(images.size(), 0)
+    {
+      for(size_t i=0; i<images.size(); ++i)
+	m_comb.add_image(images[i]);
+    }
+
+    dm::memimage<float> combined(const std::vector<Curve>& curves)
+    {
+      for(unsigned i=0; i<curves.size(); ++i)
+	if( curves[i].version != m_versions[i] ) {
+	  // radii are in pixels of the full images
+	  std::vector<double> radii(curves[i].radii);
+	  for(size_t j=0; j<radii.size(); ++j)
+	    radii[j] /= m_factor;
+	  m_comb.set_curve(i, radii, curves[i].weights, curves[i].scale);
+	  m_versions[i] = curves[i].version;
+	}
+
+      dm::memimage<float> out(m_comb.xw(), m_comb.yw());
+      m_comb.combined(&out);
+      return out;
+    }
+
+  private:
+    unsigned m_factor;
+    ggm::combiner m_comb;
+    std::vector<unsigned> m_versions;
+  };
+
+  class Server
+  {
+  public:
+    Server(const std::vector<std::string>& filenames, const Chop& chop,
+	   double xc, double yc, unsigned nlevels);
+
+    unsigned xw() const { return m_images[0]->xw(); }
+    unsigned yw() const { return m_images[0]->yw(); }
+
+    void do_curve(std::istringstream& in);
+    void do_get(std::istringstream& in);
+    void do_fit(std::istringstream& in);
+    void do_roi(std::istringstream& in);
+
+  private:
+    // combined image at pyramid level l (0 for full resolution)
+    dm::memimage<float> level_image(unsigned l);
+
+  private:
+    double m_xc, m_yc;
+    std::vector< std::unique_ptr< dm::memimage<float> > > m_images;
+    std::vector< std::unique_ptr<dm::image_pyramid> > m_pyramids;
+    std::vector<Curve> m_curves;
+    // views of each level, made when first used
+    std::vector< std::unique_ptr<View> > m_views;
+
+    // current region of interest, with its own copies of the images
+    Chop m_roi;
+    std::vector< std::unique_ptr< dm::memimage<float> > > m_roiimages;
+    std::unique_ptr<View> m_roiview;
+  };
+
+  Server::Server(const std::vector<std::string>& filenames,
+		 const Chop& chop, double xc, double yc, unsigned nlevels)
+    : m_xc(xc), m_yc(yc), m_curves(filenames.size()),
+      m_views(nlevels+1)
+  {
+    for(size_t i=0; i<filenames.size(); ++i) {
+      std::cerr << "Loading " << filenames[i] << '\n';
+      m_images.push_back( std::unique_ptr< dm::memimage<float> >
+			  ( ggm::load_image(filenames[i]) ) );
+      if( chop.enable )
+	m_images.back().reset( chop_image(*m_images.back(), chop) );
+      if( m_images.back()->xw() != xw() || m_images.back()->yw() != yw() )
+	throw std::string("Images have different sizes");
+
+      m_pyramids.push_back( std::unique_ptr<dm::image_pyramid>
+			    ( new dm::image_pyramid(*m_images.back(),
+						    nlevels) ) );
+    }
+
+    if( chop.enable ) {
+      m_xc -= chop.x0;
+      m_yc -= chop.y0;
+    }
+  }
+
+  dm::memimage<float> Server::level_image(unsigned l)
+  {
+    if( ! m_views[l] ) {
+      std::vector<const dm::memimage<float>*> imgs;
+      for(size_t i=0; i<m_images.size(); ++i)
+	imgs.push_back( l == 0 ? m_images[i].get() :
+			&m_pyramids[i]->level(l) );
+      m_views[l].reset( new View(imgs, m_xc, m_yc,
+				 dm::image_pyramid::factor(l)) );
+    }
+    return m_views[l]->combined(m_curves);
+  }
+
+  void Server::do_curve(std::istringstream& in)
+  {
+    unsigned idx, n;
+    double scale;
+    if( !(in >> idx >> scale >> n) || idx >= m_curves.size() )
+      throw std::string("invalid curve command");
+    if( n > max_curve_points )
+      throw std::string("too many curve points");
+
+    std::vector<double> radii(n), weights(n);
+    for(unsigned i=0; i<n; ++i)
+      in >> radii[i];
+    for(unsigned i=0; i<n; ++i)
+      in >> weights[i];
+    if( ! in )
+      throw std::string("invalid curve values");
+
+    Curve& c = m_curves[idx];
+    c.radii = radii;
+    c.weights = weights;
+    c.scale = scale;
+    c.version++;
+    std::cout << "ok\n";
+  }
+
+  void Server::do_get(std::istringstream& in)
+  {
+    unsigned bin = 1;
+    in >> bin;
+    if( bin == 0 )
+      throw std::string("invalid binning");
+
+    // use the coarsest level whose factor divides the binning, then
+    // bin the rest of the way
+    unsigned l = 0;
+    while( l < m_pyramids[0]->no_levels() &&
+	   bin % dm::image_pyramid::factor(l+1) == 0 )
+      ++l;
+    const unsigned rest = bin / dm::image_pyramid::factor(l);
+
+    dm::memimage<float> out = level_image(l);
+    if( rest > 1 )
+      write_image_reply( dm::block_average(out, rest) );
+    else
+      write_image_reply(out);
+  }
+
+  void Server::do_fit(std::istringstream& in)
+  {
+    unsigned dxw, dyw;
+    if( !(in >> dxw >> dyw) )
+      throw std::string("invalid fit command");
+
+    const unsigned l = m_pyramids[0]->level_for_size(dxw, dyw);
+    write_image_reply( level_image(l), dm::image_pyramid::factor(l) );
+  }
+
+  void Server::do_roi(std::istringstream& in)
+  {
+    Chop roi;
+    unsigned bin = 1;
+    if( !(in >> roi.x0 >> roi.y0 >> roi.x1 >> roi.y1 >> bin) || bin == 0 )
+      throw std::string("invalid roi command");
+    roi.enable = true;
+
+    // copy the region out of the images if it has changed
+    if( ! m_roiview || roi.x0 != m_roi.x0 || roi.y0 != m_roi.y0 ||
+	roi.x1 != m_roi.x1 || roi.y1 != m_roi.y1 ) {
+      m_roiview.reset();
+      m_roiimages.clear();
+      std::vector<const dm::memimage<float>*> imgs;
+      for(size_t i=0; i<m_images.size(); ++i) {
+	m_roiimages.push_back( std::unique_ptr< dm::memimage<float> >
+			       ( chop_image(*m_images[i], roi) ) );
+	imgs.push_back(m_roiimages.back().get());
+      }
+      m_roiview.reset( new View(imgs, m_xc, m_yc, 1, roi.x0, roi.y0) );
+      m_roi = roi;
+    }
+
+    dm::memimage<float> out = m_roiview->combined(m_curves);
+    if( bin > 1 )
+      write_image_reply( dm::block_average(out, bin) );
+    else
+      write_image_reply(out);
+  }
+
+  void run(double xc, double yc, const Chop& chop, unsigned nlevels,
+	   const std::vector<std::string>& filenames)
+  {
+    Server server(filenames, chop, xc, yc, nlevels);
+
+    std::cout << "ready " << server.xw() << ' ' << server.yw() << std::endl;
+
+    std::string line;
+    while( std::getline(std::cin, line) ) {
+      std::istringstream in(line);
+      std::string cmd;
+      in >> cmd;
+
+      try {
+	if( cmd == "curve" )
+	  server.do_curve(in);
+	else if( cmd == "get" )
+	  server.do_get(in);
+	else if( cmd == "fit" )
+	  server.do_fit(in);
+	else if( cmd == "roi" )
+	  server.do_roi(in);
+	else if( cmd == "quit" )
+	  break;
+	else
+	  throw std::string("unknown command ") + cmd;
+      }
+      catch(std::string& s) {
+	std::cout << "error " << s << '\n';
+      }
+      catch(std::bad_alloc&) {
+	std::cout << "error out of memory\n";
+      }
+      std::cout.flush();
+    }
+  }
+}
+
+int main(int argc, char* argv[])
+{
+  Chop chop;
+  unsigned nlevels = 3;
+  std::vector<std::string> args;
+
+  for(int i=1; i<argc; ++i) {
+    const std::string a(argv[i]);
+    if( a.compare(0, 7, "--chop=") == 0 ) {
+      chop.enable = std::sscanf(a.c_str()+7, "%u,%u,%u,%u",
+				&chop.x0, &chop.y0, &chop.x1, &chop.y1) == 4;
+    } else if( a.compare(0, 9, "--levels=") == 0 )
+      nlevels = std::min( unsigned(std::atoi(a.substr(9).c_str())),
+			  dm::image_pyramid::max_levels );
+    else if( a.compare(0, 10, "--threads=") == 0 )
+      ggm::set_threads( std::atoi(a.substr(10).c_str()) );
+    else
+      args.push_back(a);
+  }
+
+  if( args.size() < 3 )
+    {
+      std::cerr << "Usage: "
+		<< argv[0]
+		<< " [--chop=x0,y0,x1,y1] [--levels=N] [--threads=N]"
+		<< " xc yc file1.fits...\n";
+      return 1;
+    }
+
+  try
+    {
+      run(std::atof(args[0].c_str()), std::atof(args[1].c_str()), chop,
+	  nlevels, std::vector<std::string>(args.begin()+2, args.end()));
+    }
+  catch(dm::exception& e)
+    {
+      std::cerr << e() << '\n';
+      return 1;
+    }
+  catch(std::string& s)
+    {
+      std::cerr << s << '\n';
+      return 1;
+    }
+
+  return 0;
+}
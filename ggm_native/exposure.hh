@@ -0,0 +1,73 @@
+#ifndef GGM_EXPOSURE_HH
+#define GGM_EXPOSURE_HH
+
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <dm/memimage.hh>
+
+#include "parallel.hh"
+
+namespace ggm
+{
+  // Exposure correction for the smoothing and GGM filters.
+  //
+  // Filtering an exposure-corrected image (counts-bkg)/exposure
+  // amplifies the noise where the exposure is low, such as at chip
+  // edges. Instead, the filters take the counts image as input, and
+  // smooth counts-bkg and the exposure together as a normalised
+  // convolution weighted by exposure, in the same pass, dividing as
+  // the output is made. Pixels with exposure below threshold times
+  // the maximum exposure (or without finite exposure or background)
+  // are left out of the input, and their output is NaN.
+  struct exposure_correction
+  {
+    // bkg (optional) is in counts, as the input. The images are not
+    // copied, so must outlive this.
+    exposure_correction(const dm::memimage<float>& exposure_,
+			const dm::memimage<float>* bkg_ = 0,
+			double threshold = 0.1)
+      : exposure(exposure_), bkg(bkg_), limit(0)
+    {
+      if( bkg != 0 && (bkg->xw() != exposure.xw() ||
+		       bkg->yw() != exposure.yw()) )
+	throw dm::memimage<float>::size_mismatch_exception();
+
+      std::vector<float> rowmax(exposure.yw(), 0.f);
+      parallel_rows(exposure.yw(), [&](unsigned y0, unsigned y1)
+	{
+	  for(unsigned y=y0; y<y1; ++y) {
+	    const float* e = exposure.row(y);
+	    for(unsigned x=0; x<exposure.xw(); ++x)
+	      if( std::isfinite(e[x]) )
+		rowmax[y] = std::max(rowmax[y], e[x]);
+	  }
+	});
+      const float maxexp = rowmax.empty() ? 0.f :
+	*std::max_element(rowmax.begin(), rowmax.end());
+      limit = float(threshold*maxexp);
+    }
+
+    // weight of pixel i in the input (its exposure, or 0 if left out)
+    float weight(size_t i) const
+    {
+      const float e = exposure.flatdata(i);
+      if( !(e >= limit && e > 0) ||
+	  (bkg != 0 && ! std::isfinite(bkg->flatdata(i))) )
+	return 0.f;
+      return e;
+    }
+
+    // value v of input pixel i with the background subtracted
+    float subtract(float v, size_t i) const
+    {
+      return bkg != 0 ? v - bkg->flatdata(i) : v;
+    }
+
+    const dm::memimage<float>& exposure;
+    const dm::memimage<float>* bkg;
+    float limit;  // smallest exposure used
+  };
+}
+
+#endif
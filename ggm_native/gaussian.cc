@@ -0,0 +1,93 @@
+#include <cmath>
+#include <algorithm>
+#include "gaussian.hh"
+#include "parallel.hh"
+
+std::vector<float> ggm::gaussian_kernel(double sigma, double truncate)
+{
+  // the radius used by scipy.ndimage
+  const int r = int(truncate*sigma + 0.5);
+  std::vector<double> k(2*r+1);
+
+  double tot = 0;
+  for(int i=-r; i<=r; ++i) {
+    const double v = sigma > 0 ?
+      std::exp(-0.5*(double(i)*i)/(sigma*sigma)) : (i == 0 ? 1 : 0);
+    k[i+r] = v;
+    tot += v;
+  }
+
+  std::vector<float> out(2*r+1);
+  for(int i=0; i<=2*r; ++i)
+    out[i] = float(k[i]/tot);
+  return out;
+}
+
+std::vector<float> ggm::gaussian_deriv_kernel(double sigma, double truncate)
+{
+  std::vector<float> k( gaussian_kernel(sigma, truncate) );
+  const int r = int(k.size()/2);
+  for(int i=-r; i<=r; ++i)
+    k[i+r] *= sigma > 0 ? float(i/(sigma*sigma)) : 0.f;
+  return k;
+}
+
+namespace
+{
+  // convolve rows [y0,y1) of one channel
+  void convolve_rows(const float* in, float* out,
+		     unsigned xw, unsigned yw,
+		     const std::vector<float>& kern,
+		     unsigned y0, unsigned y1,
+		     std::vector<float>& pad)
+  {
+    const int r = int(kern.size()/2);
+    const float* const kc = &kern[r];   // centre of kernel
+    float* const pc = &pad[r];          // first real pixel in padded row
+
+    for(unsigned y=y0; y<y1; ++y) {
+      // vertical pass into padded row (padding stays zero)
+      std::fill(pad.begin(), pad.end(), 0.f);
+      const int kmin = std::max(-r, -int(y));
+      const int kmax = std::min(r, int(yw)-1-int(y));
+      for(int k=kmin; k<=kmax; ++k) {
+	const float kv = kc[k];
+	const float* inrow = in + size_t(int(y)+k)*xw;
+	for(unsigned x=0; x<xw; ++x)
+	  pc[x] += kv*inrow[x];
+      }
+
+      // horizontal pass, using symmetry of kernel
+      float* outrow = out + size_t(y)*xw;
+      const float k0 = kc[0];
+      for(unsigned x=0; x<xw; ++x)
+	outrow[x] = k0*pc[x];
+      for(int k=1; k<=r; ++k) {
+	const float kv = kc[k];
+	const float* lo = pc - k;
+	const float* hi = pc + k;
+	for(unsigned x=0; x<xw; ++x)
+	  outrow[x] += kv*(lo[x]+hi[x]);
+      }
+    }
+  }
+}
+
+void ggm::convolve_separable(unsigned nchan,
+			     const float* const* in, float* const* out,
+			     unsigned xw, unsigned yw,
+			     const std::vector<float>& kern)
+{
+  parallel_rows(yw, [&](unsigned y0, unsigned y1)
+    {
+      std::vector<float> pad(xw + kern.size() - 1);
+      // work through bands of rows, doing all the channels for a band
+      // while the input rows are still in cache
+      const unsigned band = 16;
+      for(unsigned yb=y0; yb<y1; yb+=band) {
+	const unsigned ye = std::min(y1, yb+band);
+	for(unsigned c=0; c<nchan; ++c)
+	  convolve_rows(in[c], out[c], xw, yw, kern, yb, ye, pad);
+      }
+    });
+}
@@ -0,0 +1,32 @@
+#ifndef GGM_GAUSSIAN_HH
+#define GGM_GAUSSIAN_HH
+
+#include <vector>
+
+namespace ggm
+{
+  // make a normalised 1D gaussian kernel of 2*r+1 taps, where r is
+  // int(truncate*sigma + 0.5), as in scipy.ndimage (whose default
+  // truncate is also 4)
+  std::vector<float> gaussian_kernel(double sigma, double truncate = 4);
+
+  // first derivative of the gaussian kernel above (antisymmetric, so
+  // that correlating with it gives the gradient)
+  std::vector<float> gaussian_deriv_kernel(double sigma, double truncate = 4);
+
+  // convolve nchan images (each xw*yw) with the separable symmetric
+  // kernel in both directions, writing to out. Pixels outside the
+  // image are treated as zero, so smoothing data*weight and weight
+  // together and dividing gives a normalised convolution.
+  //
+  // All the channels are convolved in one pass over the rows: each
+  // output row is built from a vertical pass into a padded scratch
+  // row, followed by a horizontal pass, so no full-size temporaries
+  // are needed. in and out must not alias.
+  void convolve_separable(unsigned nchan,
+			  const float* const* in, float* const* out,
+			  unsigned xw, unsigned yw,
+			  const std::vector<float>& kern);
+}
+
+#endif
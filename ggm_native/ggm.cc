@@ -0,0 +1,340 @@
+#include <cmath>
+#include <limits>
+#include <vector>
+
+#include "ggm.hh"
+#include "gaussian.hh"
+#include "mask.hh"
+#include "parallel.hh"
+
+namespace
+{
+  // reflect index into range [0,n) (scipy "reflect" mode)
+  inline int reflect(int i, int n)
+  {
+    const int period = 2*n;
+    i %= period;
+    if( i < 0 )
+      i += period;
+    return i < n ? i : period-1-i;
+  }
+
+  // vertical pass for one row, smoothing and differentiating into
+  // padded rows ps and pd (centre pointers), where value(i) is the
+  // value of input pixel i
+  template<class V> void vertical(const V& value,
+				  unsigned xw, unsigned yw, unsigned y,
+				  const float* g, const float* d, int r,
+				  bool zeroedge, float* ps, float* pd)
+  {
+    for(unsigned x=0; x<xw; ++x)
+      ps[x] = pd[x] = 0;
+
+    for(int k=-r; k<=r; ++k) {
+      int yy = int(y)+k;
+      if( yy < 0 || yy >= int(yw) ) {
+	if( zeroedge )
+	  continue;
+	yy = reflect(yy, yw);
+      }
+      const float gk = g[k], dk = d[k];
+      const size_t off = size_t(yy)*xw;
+      for(unsigned x=0; x<xw; ++x) {
+	const float v = value(off+x);
+	ps[x] += gk*v;
+	pd[x] += dk*v;
+      }
+    }
+
+    // fill in the padding
+    for(int k=1; k<=r; ++k) {
+      if( zeroedge ) {
+	ps[-k] = pd[-k] = ps[int(xw)-1+k] = pd[int(xw)-1+k] = 0;
+      } else {
+	const int lo = reflect(-k, xw), hi = reflect(int(xw)-1+k, xw);
+	ps[-k] = ps[lo]; pd[-k] = pd[lo];
+	ps[int(xw)-1+k] = ps[hi]; pd[int(xw)-1+k] = pd[hi];
+      }
+    }
+  }
+
+  // horizontal smoothing of padded row
+  void hsmooth(const float* p, float* out, unsigned xw,
+	       const float* g, int r)
+  {
+    for(unsigned x=0; x<xw; ++x)
+      out[x] = g[0]*p[x];
+    for(int k=1; k<=r; ++k) {
+      const float gk = g[k];
+      const float* lo = p - k;
+      const float* hi = p + k;
+      for(unsigned x=0; x<xw; ++x)
+	out[x] += gk*(hi[x]+lo[x]);
+    }
+  }
+
+  // horizontal derivative of padded row
+  void hderiv(const float* p, float* out, unsigned xw,
+	      const float* d, int r)
+  {
+    for(unsigned x=0; x<xw; ++x)
+      out[x] = 0;
+    for(int k=1; k<=r; ++k) {
+      const float dk = d[k];
+      const float* lo = p - k;
+      const float* hi = p + k;
+      for(unsigned x=0; x<xw; ++x)
+	out[x] += dk*(hi[x]-lo[x]);
+    }
+  }
+
+  // weight of input pixel i in a normalised convolution: the mask,
+  // times the exposure if correcting, and 0 if in (if given) is not
+  // finite
+  inline float input_weight(const dm::memimage<float>* in,
+			    const dm::memimage<float>* mask,
+			    const ggm::exposure_correction* expcorr,
+			    size_t i)
+  {
+    if( in != 0 && ! std::isfinite(in->flatdata(i)) )
+      return 0.f;
+    const float m = mask != 0 ? ggm::mask_in_weight(mask->flatdata(i)) : 1.f;
+    return expcorr != 0 ? m*expcorr->weight(i) : m;
+  }
+
+  // does pixel i have output in a normalised convolution?
+  inline bool has_output(const dm::memimage<float>* mask,
+			 const ggm::exposure_correction* expcorr, size_t i)
+  {
+    return (mask == 0 || ggm::mask_has_output(mask->flatdata(i))) &&
+      (expcorr == 0 || expcorr->weight(i) > 0);
+  }
+
+  // gradient magnitude of the normalised convolution of the weighted
+  // data given by value(i). If wsmooth is given, the weights have
+  // been smoothed into it (0 where there is no output) and
+  // differentiated into wdx and wdy. Otherwise the input weights wt
+  // are smoothed in the same pass as the data, and output(i) says
+  // whether pixel i has output.
+  template<class V, class O> void normalised_ggm(const V& value,
+						 const float* wt,
+						 const O& output,
+						 unsigned xw, unsigned yw,
+						 const float* g, const float* d,
+						 int r,
+						 const float* wsmooth,
+						 const float* wdx,
+						 const float* wdy,
+						 dm::memimage<float>* out)
+  {
+    const float nan = std::numeric_limits<float>::quiet_NaN();
+    auto weights = [wt](size_t i) { return wt[i]; };
+    ggm::parallel_rows(yw, [&](unsigned y0, unsigned y1)
+      {
+	const size_t plen = xw+2*r;
+	std::vector<float> ps_d(plen), pd_d(plen);
+	std::vector<float> s_d(xw), x_d(xw), y_d(xw);
+	std::vector<float> ps_w, pd_w, sw_row, xw_row, yw_row;
+	if( wsmooth == 0 ) {
+	  ps_w.resize(plen); pd_w.resize(plen);
+	  sw_row.resize(xw); xw_row.resize(xw); yw_row.resize(xw);
+	}
+
+	for(unsigned y=y0; y<y1; ++y) {
+	  const size_t off = size_t(y)*xw;
+	  vertical(value, xw, yw, y, g, d, r, true, &ps_d[r], &pd_d[r]);
+	  hsmooth(&ps_d[r], &s_d[0], xw, g, r);
+	  hderiv(&ps_d[r], &x_d[0], xw, d, r);
+	  hsmooth(&pd_d[r], &y_d[0], xw, g, r);
+
+	  const float *s_w, *x_w, *y_w;
+	  if( wsmooth != 0 ) {
+	    s_w = wsmooth + off;
+	    x_w = wdx + off;
+	    y_w = wdy + off;
+	  } else {
+	    vertical(weights, xw, yw, y, g, d, r, true, &ps_w[r], &pd_w[r]);
+	    hsmooth(&ps_w[r], &sw_row[0], xw, g, r);
+	    hderiv(&ps_w[r], &xw_row[0], xw, d, r);
+	    hsmooth(&pd_w[r], &yw_row[0], xw, g, r);
+	    for(unsigned x=0; x<xw; ++x)
+	      if( ! output(off+x) )
+		sw_row[x] = 0;
+	    s_w = &sw_row[0];
+	    x_w = &xw_row[0];
+	    y_w = &yw_row[0];
+	  }
+
+	  // gradient of ratio s_d/s_w
+	  float* o = out->row(y);
+	  for(unsigned x=0; x<xw; ++x) {
+	    const float w = s_w[x];
+	    const float s = s_d[x] / w;
+	    const float gx = (x_d[x] - s*x_w[x]) / w;
+	    const float gy = (y_d[x] - s*y_w[x]) / w;
+	    o[x] = w > 0 ? std::sqrt(gx*gx + gy*gy) : nan;
+	  }
+	}
+      });
+  }
+}
+
+ggm::ggm_filter::ggm_filter(unsigned xw, unsigned yw, double sigma,
+			    const dm::memimage<float>* mask,
+			    const dm::memimage<float>* in,
+			    const exposure_correction* expcorr)
+  : m_xw(xw), m_yw(yw),
+    m_gkern( gaussian_kernel(sigma) ), m_dkern( gaussian_deriv_kernel(sigma) ),
+    m_masked(mask != 0 || expcorr != 0),
+    m_expcorr(expcorr != 0), m_bkg(expcorr != 0 ? expcorr->bkg : 0)
+{
+  if( (mask != 0 && (mask->xw() != xw || mask->yw() != yw)) ||
+      (in != 0 && (in->xw() != xw || in->yw() != yw)) ||
+      (expcorr != 0 && (expcorr->exposure.xw() != xw ||
+			expcorr->exposure.yw() != yw)) )
+    throw dm::memimage<float>::size_mismatch_exception();
+  if( ! m_masked || xw == 0 || yw == 0 )
+    return;
+
+  // the weights are the mask, times the exposure if correcting.
+  // Smooth and differentiate them, as they are the same for every
+  // image filtered.
+  const size_t npix = size_t(xw)*yw;
+  m_weight.resize(npix);
+  m_wsmooth.resize(npix);
+  m_wdx.resize(npix);
+  m_wdy.resize(npix);
+  parallel_rows(yw, [&](unsigned y0, unsigned y1)
+    {
+      for(size_t i=size_t(y0)*xw; i<size_t(y1)*xw; ++i)
+	m_weight[i] = input_weight(in, mask, expcorr, i);
+    });
+
+  const int r = int(m_gkern.size()/2);
+  const float* const g = &m_gkern[r];
+  const float* const d = &m_dkern[r];
+  const float* const wt = &m_weight[0];
+  auto weights = [wt](size_t i) { return wt[i]; };
+  parallel_rows(yw, [&](unsigned y0, unsigned y1)
+    {
+      const size_t plen = xw+2*r;
+      std::vector<float> ps(plen), pd(plen);
+      for(unsigned y=y0; y<y1; ++y) {
+	const size_t off = size_t(y)*xw;
+	vertical(weights, xw, yw, y, g, d, r, true, &ps[r], &pd[r]);
+	hsmooth(&ps[r], &m_wsmooth[off], xw, g, r);
+	hderiv(&ps[r], &m_wdx[off], xw, d, r);
+	hsmooth(&pd[r], &m_wdy[off], xw, g, r);
+
+	// pixels without output get no weight
+	for(unsigned x=0; x<xw; ++x)
+	  if( ! has_output(mask, expcorr, off+x) )
+	    m_wsmooth[off+x] = 0;
+      }
+    });
+}
+
+void ggm::ggm_filter::apply(const dm::memimage<float>& in,
+			    dm::memimage<float>* out) const
+{
+  const unsigned xw = m_xw, yw = m_yw;
+  if( in.xw() != xw || in.yw() != yw || out->xw() != xw || out->yw() != yw )
+    throw dm::memimage<float>::size_mismatch_exception();
+  if( xw == 0 || yw == 0 )
+    return;
+
+  const int r = int(m_gkern.size()/2);
+  const float* const g = &m_gkern[r];
+  const float* const d = &m_dkern[r];
+  const float* const data = in.row(0);
+
+  if( ! m_masked ) {
+    // plain gaussian derivative filters
+    auto value = [data](size_t i) { return data[i]; };
+    parallel_rows(yw, [&](unsigned y0, unsigned y1)
+      {
+	std::vector<float> ps(xw+2*r), pd(xw+2*r), gx(xw), gy(xw);
+	for(unsigned y=y0; y<y1; ++y) {
+	  vertical(value, xw, yw, y, g, d, r, false, &ps[r], &pd[r]);
+	  hderiv(&ps[r], &gx[0], xw, d, r);
+	  hsmooth(&pd[r], &gy[0], xw, g, r);
+	  float* o = out->row(y);
+	  for(unsigned x=0; x<xw; ++x)
+	    o[x] = std::sqrt(gx[x]*gx[x] + gy[x]*gy[x]);
+	}
+      });
+    return;
+  }
+
+  // normalised convolution of the weighted data. With exposure
+  // correction the data are (counts-bkg)/exposure, so the weighted
+  // data are counts-bkg.
+  const float* const wt = &m_weight[0];
+  const float* const ws = &m_wsmooth[0];
+  const float* const wdx = &m_wdx[0];
+  const float* const wdy = &m_wdy[0];
+  auto output = [](size_t) { return true; };
+  if( m_bkg != 0 ) {
+    const float* const bkg = m_bkg->row(0);
+    auto value = [data, wt, bkg](size_t i)
+      { return wt[i] > 0 ? data[i]-bkg[i] : 0.f; };
+    normalised_ggm(value, wt, output, xw, yw, g, d, r, ws, wdx, wdy, out);
+  } else if( m_expcorr ) {
+    auto value = [data, wt](size_t i)
+      { return wt[i] > 0 ? data[i] : 0.f; };
+    normalised_ggm(value, wt, output, xw, yw, g, d, r, ws, wdx, wdy, out);
+  } else {
+    auto value = [data, wt](size_t i)
+      { return wt[i] > 0 ? data[i]*wt[i] : 0.f; };
+    normalised_ggm(value, wt, output, xw, yw, g, d, r, ws, wdx, wdy, out);
+  }
+}
+
+void ggm::gaussian_gradient_magnitude(const dm::memimage<float>& in,
+				      const dm::memimage<float>* mask,
+				      dm::memimage<float>* out,
+				      double sigma,
+				      const exposure_correction* expcorr)
+{
+  const unsigned xw = in.xw(), yw = in.yw();
+  if( out->xw() != xw || out->yw() != yw )
+    throw dm::memimage<float>::size_mismatch_exception();
+  if( mask == 0 && expcorr == 0 ) {
+    const ggm_filter filter(xw, yw, sigma);
+    filter.apply(in, out);
+    return;
+  }
+
+  if( (mask != 0 && (mask->xw() != xw || mask->yw() != yw)) ||
+      (expcorr != 0 && (expcorr->exposure.xw() != xw ||
+			expcorr->exposure.yw() != yw)) )
+    throw dm::memimage<float>::size_mismatch_exception();
+  if( xw == 0 || yw == 0 )
+    return;
+
+  // for a single image, the weighted data and weights are smoothed
+  // together, rather than keeping the smoothed weights as ggm_filter
+  // does. With exposure correction the data are
+  // (counts-bkg)/exposure, so the weighted data are counts-bkg.
+  const size_t npix = size_t(xw)*yw;
+  std::vector<float> dw(npix), wt(npix);
+  parallel_rows(yw, [&](unsigned y0, unsigned y1)
+    {
+      for(size_t i=size_t(y0)*xw; i<size_t(y1)*xw; ++i) {
+	const float w = input_weight(&in, mask, expcorr, i);
+	const float v = in.flatdata(i);
+	wt[i] = w;
+	dw[i] = w > 0 ? (expcorr != 0 ? expcorr->subtract(v, i) : v*w) : 0.f;
+      }
+    });
+
+  const std::vector<float> gkern( gaussian_kernel(sigma) );
+  const std::vector<float> dkern( gaussian_deriv_kernel(sigma) );
+  const int r = int(gkern.size()/2);
+  const float* const data = &dw[0];
+  auto value = [data](size_t i) { return data[i]; };
+  auto output = [mask, expcorr](size_t i)
+    { return has_output(mask, expcorr, i); };
+  normalised_ggm(value, &wt[0], output, xw, yw, &gkern[r], &dkern[r], r,
+		 0, 0, 0, out);
+}
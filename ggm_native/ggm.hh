@@ -0,0 +1,69 @@
+#ifndef GGM_GGM_HH
+#define GGM_GGM_HH
+
+#include <vector>
+#include <dm/memimage.hh>
+
+#include "exposure.hh"
+
+namespace ggm
+{
+  // Gaussian gradient magnitude filter of image, with gaussian sigma
+  // in pixels.
+  //
+  // Without a mask, this matches scipy.ndimage's
+  // gaussian_gradient_magnitude (reflecting boundaries, kernel
+  // truncated at 4 sigma, rounded to the nearest pixel), to float
+  // precision. check_scipy.py compares them.
+  //
+  // With a mask (using the adaptive_ggm conventions in mask.hh), a
+  // normalised convolution is done: the weighted data and weights
+  // are smoothed and differentiated together, a row at a time, and
+  // the gradient of their ratio is taken. Excluded pixels (and
+  // pixels outside the image) do not leak edges into the output.
+  // Output pixels which are excluded, or have no valid input in
+  // range, are NaN.
+  //
+  // With expcorr, in is a counts image and the output is the GGM of
+  // the exposure-corrected image, done as a normalised convolution
+  // weighted by exposure (see exposure.hh).
+  void gaussian_gradient_magnitude(const dm::memimage<float>& in,
+				   const dm::memimage<float>* mask,
+				   dm::memimage<float>* out,
+				   double sigma,
+				   const exposure_correction* expcorr = 0);
+
+  // The same filter, set up once for filtering many images of the
+  // same size with the same mask (e.g. noise realisations). With a
+  // mask, the smoothed weights are calculated and kept here rather
+  // than for every image, which costs four floats per pixel. Pixels where in (if given) is not finite are left
+  // out, as they are by gaussian_gradient_magnitude for that image.
+  // With expcorr, the images filtered are counts, and its background
+  // image (if any) must outlive the filter.
+  class ggm_filter
+  {
+  public:
+    ggm_filter(unsigned xw, unsigned yw, double sigma,
+	       const dm::memimage<float>* mask = 0,
+	       const dm::memimage<float>* in = 0,
+	       const exposure_correction* expcorr = 0);
+
+    // filter in into out. With a mask, values of in which have no
+    // weight are ignored, and the others must be finite.
+    void apply(const dm::memimage<float>& in,
+	       dm::memimage<float>* out) const;
+
+    unsigned xw() const { return m_xw; }
+    unsigned yw() const { return m_yw; }
+
+  private:
+    unsigned m_xw, m_yw;
+    std::vector<float> m_gkern, m_dkern;
+    bool m_masked, m_expcorr;
+    const dm::memimage<float>* m_bkg;
+    // input weights, and their smoothing and derivatives
+    std::vector<float> m_weight, m_wsmooth, m_wdx, m_wdy;
+  };
+}
+
+#endif
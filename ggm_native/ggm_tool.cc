@@ -0,0 +1,244 @@
+// Gaussian gradient magnitude filter of an image at a fixed scale,
+// optionally using a mask (native version of
+// gaussian_gradient_magnitude.py). If several scales are given, the
+// output is a cube with a plane for each scale. The output can be
+// written as scaled 16 bit integers to halve its size.
+//
+// With --mc=N the input is a model of the counts, and the output is
+// the mean, standard deviation and any quantiles of the GGM of N
+// Poisson realisations of it, for each scale.
+//
+// With --expmap, the input is counts and the GGM is of the exposure
+// corrected image, with the counts and exposure smoothed together.
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdlib>
+#include <algorithm>
+
+#include <dm/dm.hh>
+#include <dm/packimage.hh>
+
+#include "ggm.hh"
+#include "montecarlo.hh"
+#include "io.hh"
+#include "parallel.hh"
+
+// write planes as 16 bit integers, with one scaling covering the
+// values in all the planes
+void write_scaled(const std::string& outfile,
+		  const std::vector<const dm::memimage<float>*>& planes)
+{
+  float minval = 0, maxval = 0;
+  bool any = false;
+  for(size_t i=0; i<planes.size(); ++i) {
+    float lo, hi;
+    if( dm::packed_image::finite_range(*planes[i], &lo, &hi) ) {
+      minval = any ? std::min(minval, lo) : lo;
+      maxval = any ? std::max(maxval, hi) : hi;
+      any = true;
+    }
+  }
+  float bscale, bzero;
+  dm::packed_image::range_scaling(minval, maxval, &bscale, &bzero);
+
+  std::vector< std::unique_ptr<dm::packed_image> > packed;
+  std::vector<const dm::packed_image*> ptrs;
+  for(size_t i=0; i<planes.size(); ++i) {
+    packed.emplace_back( new dm::packed_image(*planes[i], bscale, bzero) );
+    ptrs.push_back(packed.back().get());
+  }
+  dm::packed_image::write(outfile, ptrs);
+}
+
+// write planes of a cube, as 16 bit integers or floats
+void write_planes(const std::string& outfile, const std::string& infile,
+		  const dm::memcube<float>& outcube, int bitpix)
+{
+  if( bitpix == 16 ) {
+    std::vector< std::unique_ptr< dm::memimage<float> > > planes;
+    std::vector<const dm::memimage<float>*> ptrs;
+    for(unsigned z=0; z<outcube.zw(); ++z) {
+      planes.emplace_back( new dm::memimage<float>
+			   (outcube.xw(), outcube.yw(),
+			    const_cast<float*>(outcube.plane_data(z)),
+			    dm::borrow) );
+      ptrs.push_back(planes.back().get());
+    }
+    write_scaled(outfile, ptrs);
+  } else
+    ggm::write_cube(outfile, outcube, infile);
+}
+
+struct Options
+{
+  Options()
+    : bitpix(-32), nreal(0), seed(0), expthresh(0.1)
+  {}
+
+  std::string input, output, mask, expmap, bkg;
+  std::vector<double> sigmas, quantiles;
+  int bitpix;
+  unsigned nreal;
+  uint64_t seed;
+  double expthresh;
+};
+
+// Monte Carlo statistics of the GGM of realisations of the input,
+// with planes mean, stddev and the quantiles for each scale
+void run_mc(const Options& opts,
+	    const dm::memimage<float>& model,
+	    const dm::memimage<float>* mask,
+	    const ggm::exposure_correction* expcorr)
+{
+  const unsigned nplanes = 2 + unsigned(opts.quantiles.size());
+  dm::memcube<float> outcube(model.xw(), model.yw(),
+			     unsigned(opts.sigmas.size())*nplanes);
+  for(unsigned s=0; s<opts.sigmas.size(); ++s) {
+    std::cout << "* " << opts.nreal << " realisations at scale "
+	      << opts.sigmas[s] << '\n';
+    ggm::monte_carlo mc(model, mask, opts.sigmas[s], opts.quantiles,
+			opts.seed, expcorr);
+    mc.run(opts.nreal);
+
+    dm::memimage<float> meanplane = outcube.plane(s*nplanes);
+    mc.mean(&meanplane);
+    dm::memimage<float> sdplane = outcube.plane(s*nplanes+1);
+    mc.stddev(&sdplane);
+    for(unsigned q=0; q<opts.quantiles.size(); ++q) {
+      dm::memimage<float> qplane = outcube.plane(s*nplanes+2+q);
+      mc.quantile(q, &qplane);
+    }
+  }
+  write_planes(opts.output, opts.input, outcube, opts.bitpix);
+}
+
+void run(const Options& opts)
+{
+  std::unique_ptr< dm::memimage<float> > inimage( ggm::load_image(opts.input) );
+
+  std::unique_ptr< dm::memimage<float> > mask;
+  if( ! opts.mask.empty() )
+    mask.reset( ggm::load_image_sized(opts.mask, *inimage, opts.input) );
+
+  std::unique_ptr< dm::memimage<float> > expmap, bkg;
+  std::unique_ptr<ggm::exposure_correction> expcorr;
+  if( ! opts.expmap.empty() ) {
+    expmap.reset( ggm::load_image_sized(opts.expmap, *inimage, opts.input) );
+    if( ! opts.bkg.empty() )
+      bkg.reset( ggm::load_image_sized(opts.bkg, *inimage, opts.input) );
+    expcorr.reset( new ggm::exposure_correction(*expmap, bkg.get(),
+						opts.expthresh) );
+  }
+
+  if( opts.nreal > 0 ) {
+    run_mc(opts, *inimage, mask.get(), expcorr.get());
+    return;
+  }
+
+  const std::vector<double>& sigmas = opts.sigmas;
+  if( sigmas.size() == 1 ) {
+    dm::memimage<float> outimage(inimage->xw(), inimage->yw());
+    ggm::gaussian_gradient_magnitude(*inimage, mask.get(), &outimage,
+				     sigmas[0], expcorr.get());
+    if( opts.bitpix == 16 )
+      write_scaled(opts.output, std::vector<const dm::memimage<float>*>
+		   (1, &outimage));
+    else
+      ggm::write_image(opts.output, outimage, opts.input);
+    return;
+  }
+
+  // filter into the planes of a cube (each filter is multithreaded)
+  dm::memcube<float> outcube(inimage->xw(), inimage->yw(), sigmas.size());
+  for(unsigned z=0; z<sigmas.size(); ++z) {
+    std::cout << "* Filtering at scale " << sigmas[z] << '\n';
+    dm::memimage<float> plane = outcube.plane(z);
+    ggm::gaussian_gradient_magnitude(*inimage, mask.get(), &plane,
+				     sigmas[z], expcorr.get());
+  }
+  write_planes(opts.output, opts.input, outcube, opts.bitpix);
+}
+
+int main(int argc, char* argv[])
+{
+  Options opts;
+  std::vector<std::string> args;
+
+  for(int i=1; i<argc; ++i) {
+    const std::string a(argv[i]);
+    if( a.compare(0, 7, "--mask=") == 0 )
+      opts.mask = a.substr(7);
+    else if( a.compare(0, 10, "--threads=") == 0 )
+      ggm::set_threads( std::atoi(a.substr(10).c_str()) );
+    else if( a.compare(0, 9, "--bitpix=") == 0 )
+      opts.bitpix = std::atoi(a.substr(9).c_str());
+    else if( a.compare(0, 5, "--mc=") == 0 )
+      opts.nreal = unsigned( std::atoi(a.substr(5).c_str()) );
+    else if( a.compare(0, 7, "--seed=") == 0 )
+      opts.seed = std::strtoull(a.substr(7).c_str(), 0, 10);
+    else if( a.compare(0, 12, "--quantiles=") == 0 ) {
+      // comma separated list
+      std::string list = a.substr(12);
+      size_t start = 0;
+      while( start <= list.size() ) {
+	size_t end = list.find(',', start);
+	if( end == std::string::npos )
+	  end = list.size();
+	opts.quantiles.push_back
+	  ( std::atof(list.substr(start, end-start).c_str()) );
+	start = end+1;
+      }
+    }
+    else if( a.compare(0, 9, "--expmap=") == 0 )
+      opts.expmap = a.substr(9);
+    else if( a.compare(0, 6, "--bkg=") == 0 )
+      opts.bkg = a.substr(6);
+    else if( a.compare(0, 12, "--expthresh=") == 0 )
+      opts.expthresh = std::atof(a.substr(12).c_str());
+    else
+      args.push_back(a);
+  }
+
+  for(size_t i=2; i<args.size(); ++i)
+    opts.sigmas.push_back( std::atof(args[i].c_str()) );
+
+  const std::vector<double>& sigmas = opts.sigmas;
+  const std::vector<double>& quantiles = opts.quantiles;
+  if( sigmas.empty() ||
+      *std::min_element(sigmas.begin(), sigmas.end()) <= 0 ||
+      (opts.bitpix != -32 && opts.bitpix != 16) ||
+      (!quantiles.empty() &&
+       (*std::min_element(quantiles.begin(), quantiles.end()) < 0 ||
+	*std::max_element(quantiles.begin(), quantiles.end()) > 1)) )
+    {
+      std::cerr << "Usage: "
+		<< argv[0]
+		<< " [--mask=mask.fits] [--threads=N] [--bitpix=-32|16]\n"
+		<< "    [--mc=N [--seed=S] [--quantiles=q,q...]]\n"
+		<< "    [--expmap=exp.fits [--bkg=bkg.fits] [--expthresh=0.1]]\n"
+		<< "    in.fits out.fits sigma [sigma...]\n";
+      return 1;
+    }
+  opts.input = args[0];
+  opts.output = args[1];
+
+  try
+    {
+      run(opts);
+    }
+  catch(dm::exception& e)
+    {
+      std::cerr << e() << '\n';
+      return 1;
+    }
+  catch(std::string& s)
+    {
+      std::cerr << s << '\n';
+      return 1;
+    }
+
+  return 0;
+}
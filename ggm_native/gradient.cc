@@ -0,0 +1,74 @@
+#include <cmath>
+#include <vector>
+
+#include "gradient.hh"
+#include "parallel.hh"
+
+namespace
+{
+  // calculate one row of output from the previous, current and next
+  // rows (prev and next are null on the top and bottom edges)
+  void gradient_row(const float* prev, const float* cur, const float* next,
+		    float* out, unsigned xw)
+  {
+    // the differences are not simplified (e.g. to next-prev) so that
+    // infinities and NaNs propagate as in numpy
+    if( prev != 0 && next != 0 ) {
+      for(unsigned x=1; x+1<xw; ++x) {
+	const float gx = 0.5f*((cur[x+1]-cur[x]) + (cur[x]-cur[x-1]));
+	const float gy = 0.5f*((next[x]-cur[x]) + (cur[x]-prev[x]));
+	out[x] = std::sqrt(gx*gx + gy*gy);
+      }
+      // no x gradient on left and right edges
+      const unsigned edges[2] = { 0, xw-1 };
+      for(unsigned i=0; i<2; ++i) {
+	const unsigned x = edges[i];
+	const float gy = 0.5f*((next[x]-cur[x]) + (cur[x]-prev[x]));
+	out[x] = std::sqrt(gy*gy);
+      }
+    } else {
+      for(unsigned x=1; x+1<xw; ++x) {
+	const float gx = 0.5f*((cur[x+1]-cur[x]) + (cur[x]-cur[x-1]));
+	out[x] = std::sqrt(gx*gx);
+      }
+      out[0] = out[xw-1] = 0;
+    }
+  }
+}
+
+void ggm::gradient_magnitude(const dm::memimage<float>& in,
+			     dm::memimage<float>* out,
+			     bool log)
+{
+  const unsigned xw = in.xw(), yw = in.yw();
+  if( out->xw() != xw || out->yw() != yw )
+    throw dm::memimage<float>::size_mismatch_exception();
+  if( xw == 0 || yw == 0 )
+    return;
+
+  parallel_rows(yw, [&](unsigned y0, unsigned y1)
+    {
+      // ring of three log rows, each only calculated once per band
+      std::vector<float> buf(log ? 3*size_t(xw) : 0);
+      auto get_row = [&](unsigned y) -> const float*
+	{
+	  if( ! log )
+	    return in.row(y);
+	  float* dest = &buf[(y%3)*size_t(xw)];
+	  const float* src = in.row(y);
+	  for(unsigned x=0; x<xw; ++x)
+	    dest[x] = std::log10(src[x]);
+	  return dest;
+	};
+
+      const float* prev = y0 > 0 ? get_row(y0-1) : 0;
+      const float* cur = get_row(y0);
+      for(unsigned y=y0; y<y1; ++y) {
+	const float* next = y+1 < yw ? get_row(y+1) : 0;
+	gradient_row(next != 0 ? prev : 0, cur, prev != 0 ? next : 0,
+		     out->row(y), xw);
+	prev = cur;
+	cur = next;
+      }
+    });
+}
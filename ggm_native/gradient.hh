@@ -0,0 +1,18 @@
+#ifndef GGM_GRADIENT_HH
+#define GGM_GRADIENT_HH
+
+#include <dm/memimage.hh>
+
+namespace ggm
+{
+  // Gradient magnitude of image from central differences, optionally
+  // taking log10 of the image first. This gives the same results as
+  // calcGradient() in adaptive_ggm.py (including zero gradient
+  // components on the edges and NaN propagation), but is done in one
+  // pass over the image without any full-size temporaries.
+  void gradient_magnitude(const dm::memimage<float>& in,
+			  dm::memimage<float>* out,
+			  bool log = true);
+}
+
+#endif
@@ -0,0 +1,289 @@
+// Calculate an image from an expression of other images, e.g.
+//   imgcalc '(src-bkg)/exp' out.fits src=src.fits bkg=bkg.fits exp=exp.fits
+// The expression is compiled once (see dm/expression.hh), and the
+// inputs are read, evaluated and written in strips of rows, so the
+// memory used does not depend on the size of the images.
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <new>
+#include <thread>
+#include <cctype>
+#include <cstdlib>
+
+#include <dm/dm.hh>
+#include <dm/compimage.hh>
+#include <dm/gzimage.hh>
+#include <dm/expression.hh>
+
+#include "io.hh"
+#include "parallel.hh"
+
+// pixels in a default strip
+const size_t strip_pixels = size_t(1) << 22;
+// pixels evaluated by each thread at a time
+const size_t eval_chunk = size_t(1) << 16;
+
+struct Input
+{
+  std::string name, filename;
+  unsigned xw, yw;
+  // compressed images cannot be read in strips, so are read whole
+  std::unique_ptr< dm::memimage<float> > whole;
+  std::unique_ptr<dm::dataset> ds;
+  std::unique_ptr<dm::image> im;
+};
+
+bool is_compressed(const std::string& filename)
+{
+  return dm::compressed_image::is_compressed(filename) ||
+    dm::gzip_image::is_gzipped(filename);
+}
+
+void open_input(Input* in)
+{
+  if( is_compressed(in->filename) ) {
+    in->whole.reset( ggm::load_image(in->filename) );
+    in->xw = in->whole->xw();
+    in->yw = in->whole->yw();
+    return;
+  }
+
+  in->ds.reset( new dm::dataset(in->filename) );
+  in->im.reset( in->ds->get_image() );
+  dm::pix_vec dims;
+  in->im->get_dimensions(&dims);
+  if( dims.size() != 2 )
+    throw std::string("Input " + in->filename + " is not a 2D image");
+  in->xw = dims[0];
+  in->yw = dims[1];
+}
+
+// rows [y0, y1) of an input, read into buf if needed
+const float* read_rows(Input& in, unsigned y0, unsigned y1,
+		       std::unique_ptr<float[]>* buf)
+{
+  if( in.whole )
+    return in.whole->row(y0);
+
+  dm::pix_vec lower, upper;
+  lower.push_back(1); lower.push_back(y0+1);
+  upper.push_back(in.xw); upper.push_back(y1);
+  float* data;
+  in.im->get_subarray(lower, upper, &data);
+  buf->reset(data);
+  return data;
+}
+
+// rows of all the inputs
+struct Strip
+{
+  std::vector< std::unique_ptr<float[]> > bufs;
+  std::vector<const float*> rows;
+};
+
+void read_strip(std::vector<Input>& inputs, unsigned y0, unsigned y1,
+		Strip* s)
+{
+  s->bufs.resize(inputs.size());
+  s->rows.resize(inputs.size());
+  for(size_t i=0; i<inputs.size(); ++i)
+    s->rows[i] = read_rows(inputs[i], y0, y1, &s->bufs[i]);
+}
+
+// calculate the whole-image values in the expression, in a pass over
+// the inputs
+void calc_reductions(dm::image_expression& expr, std::vector<Input>& inputs,
+		     unsigned rows)
+{
+  const unsigned xw = inputs[0].xw, yw = inputs[0].yw;
+  const std::vector<dm::image_expression::reduction>& reds =
+    expr.reductions();
+
+  std::vector<dm::image_stats> stats(inputs.size());
+  std::vector<bool> used(inputs.size(), false);
+  for(size_t r=0; r<reds.size(); ++r)
+    used[reds[r].input] = true;
+
+  for(size_t i=0; i<inputs.size(); ++i) {
+    if( ! used[i] )
+      continue;
+    std::unique_ptr<float[]> buf;
+    for(unsigned y0=0; y0<yw; y0+=rows) {
+      const unsigned y1 = std::min(yw, y0+rows);
+      const float* d = read_rows(inputs[i], y0, y1, &buf);
+      const dm::memimage<float> strip(xw, y1-y0, const_cast<float*>(d),
+				      dm::borrow);
+      stats[i].add(strip);
+    }
+  }
+
+  for(size_t r=0; r<reds.size(); ++r)
+    expr.set_reduction(unsigned(r), stats[reds[r].input].value(reds[r].type));
+}
+
+void run(const std::string& exprtext, const std::string& outfile,
+	 std::vector<Input>& inputs, unsigned rows)
+{
+  std::vector<std::string> names;
+  for(size_t i=0; i<inputs.size(); ++i)
+    names.push_back(inputs[i].name);
+  dm::image_expression expr(exprtext, names);
+
+  for(size_t i=0; i<inputs.size(); ++i) {
+    open_input(&inputs[i]);
+    if( inputs[i].xw != inputs[0].xw || inputs[i].yw != inputs[0].yw )
+      throw std::string("Input " + inputs[i].filename +
+			" is not the same size as " + inputs[0].filename);
+  }
+  const unsigned xw = inputs[0].xw, yw = inputs[0].yw;
+  if( rows == 0 )
+    rows = unsigned(std::max(size_t(1), strip_pixels / std::max(xw, 1u)));
+
+  if( ! expr.reductions().empty() )
+    calc_reductions(expr, inputs, rows);
+
+  // compressed output is made whole, then written
+  const bool compressed_out = outfile.size() > 3 &&
+    outfile.compare(outfile.size()-3, 3, ".fz") == 0;
+  std::unique_ptr< dm::memimage<float> > whole;
+  std::unique_ptr<dm::dataset> ds;
+  std::unique_ptr<dm::image> outim;
+  std::vector<float> outbuf;
+  if( compressed_out )
+    whole.reset( new dm::memimage<float>(xw, yw) );
+  else {
+    ds.reset( new dm::dataset(outfile, dm::create_over) );
+    outim.reset( ds->create_image("IMAGE", dmFLOAT, xw, yw) );
+    outbuf.resize(size_t(xw)*rows);
+  }
+
+  // read the next strip while evaluating the current one
+  Strip strips[2];
+  if( yw > 0 )
+    read_strip(inputs, 0, std::min(yw, rows), &strips[0]);
+  for(unsigned y0=0, idx=0; y0<yw; y0+=rows, idx^=1) {
+    const unsigned y1 = std::min(yw, y0+rows);
+    const size_t n = size_t(xw)*(y1-y0);
+    const Strip& cur = strips[idx];
+    float* out = compressed_out ? whole->row(y0) : &outbuf[0];
+
+    std::thread calcthread
+      ( [&expr, &cur, out, n]() {
+	dm::parallel_for(n, eval_chunk, [&](size_t i0, size_t i1) {
+	    std::vector<const float*> in(cur.rows.size());
+	    for(size_t i=0; i<in.size(); ++i)
+	      in[i] = cur.rows[i] + i0;
+	    expr.evaluate(&in[0], out+i0, i1-i0);
+	  });
+      } );
+
+    try {
+      if( y1 < yw )
+	read_strip(inputs, y1, std::min(yw, y1+rows), &strips[idx^1]);
+    } catch( ... ) {
+      calcthread.join();
+      throw;
+    }
+    calcthread.join();
+
+    if( ! compressed_out ) {
+      dm::pix_vec lower, upper;
+      lower.push_back(1); lower.push_back(y0+1);
+      upper.push_back(xw); upper.push_back(y1);
+      outim->set_subarray(lower, upper, &outbuf[0]);
+    }
+  }
+
+  if( compressed_out ) {
+    ggm::write_image(outfile, *whole);
+    return;
+  }
+
+  // coordinates from the first input
+  if( inputs[0].im )
+    outim->copy_wcs_from(inputs[0].im.get());
+}
+
+// parse name=filename
+bool parse_input(const std::string& arg, Input* in)
+{
+  const size_t eq = arg.find('=');
+  if( eq == std::string::npos || eq == 0 )
+    return false;
+  in->name = arg.substr(0, eq);
+  in->filename = arg.substr(eq+1);
+  if( ! (std::isalpha((unsigned char)in->name[0]) || in->name[0] == '_') )
+    return false;
+  for(size_t i=0; i<in->name.size(); ++i)
+    if( ! (std::isalnum((unsigned char)in->name[i]) || in->name[i] == '_') )
+      return false;
+  return ! in->filename.empty();
+}
+
+int main(int argc, char* argv[])
+{
+  unsigned rows = 0;
+  bool rows_ok = true;
+  std::vector<std::string> args;
+
+  for(int i=1; i<argc; ++i) {
+    const std::string a(argv[i]);
+    if( a.compare(0, 7, "--rows=") == 0 ) {
+      const int r = std::atoi(a.substr(7).c_str());
+      rows_ok = r > 0;
+      rows = rows_ok ? unsigned(r) : 0;
+    }
+    else if( a.compare(0, 10, "--threads=") == 0 )
+      ggm::set_threads( std::atoi(a.substr(10).c_str()) );
+    else
+      args.push_back(a);
+  }
+
+  std::vector<Input> inputs(args.size() > 2 ? args.size()-2 : 0);
+  bool ok = rows_ok && ! inputs.empty();
+  for(size_t i=0; ok && i<inputs.size(); ++i) {
+    ok = parse_input(args[i+2], &inputs[i]);
+    for(size_t j=0; ok && j<i; ++j)
+      ok = inputs[j].name != inputs[i].name;
+  }
+
+  if( ! ok )
+    {
+      std::cerr << "Usage: "
+		<< argv[0]
+		<< " [--rows=N] [--threads=N] 'expression' out.fits\n"
+		<< "    name=in.fits [name=in.fits...]\n"
+		<< "Expressions use the names of the inputs, numbers,"
+		<< " + - * / ^ ( ) ?:\n"
+		<< "comparisons, && || !, sqrt exp log log10 abs floor ceil"
+		<< " isfinite,\n"
+		<< "min(x,y) max(x,y) pow(x,y) atan2(y,x), and sum mean min"
+		<< " max of an input.\n";
+      return 1;
+    }
+
+  try
+    {
+      run(args[0], args[1], inputs, rows);
+    }
+  catch(dm::exception& e)
+    {
+      std::cerr << e() << '\n';
+      return 1;
+    }
+  catch(std::string& s)
+    {
+      std::cerr << s << '\n';
+      return 1;
+    }
+  catch(std::bad_alloc&)
+    {
+      std::cerr << "Out of memory\n";
+      return 1;
+    }
+
+  return 0;
+}
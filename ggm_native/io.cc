@@ -0,0 +1,89 @@
+#include <memory>
+#include <dm/dm.hh>
+#include <dm/compimage.hh>
+#include <dm/gzimage.hh>
+#include "parallel.hh"
+#include "io.hh"
+
+dm::memimage<float>* ggm::load_image(const std::string& filename)
+{
+  if( dm::compressed_image::is_compressed(filename) ) {
+    dm::compressed_image comp(filename);
+    comp.set_threads(get_threads());
+
+    dm::memimage<float>* mem;
+    comp.create_memimage(&mem);
+    return mem;
+  }
+
+  if( dm::gzip_image::is_gzipped(filename) ) {
+    dm::gzip_image gz(filename);
+    gz.set_threads(get_threads());
+
+    dm::memimage<float>* mem;
+    gz.create_memimage(&mem);
+    return mem;
+  }
+
+  dm::dataset ds(filename);
+  std::unique_ptr<dm::image> im( ds.get_image() );
+
+  dm::memimage<float>* mem;
+  im->create_memimage(&mem);
+  return mem;
+}
+
+dm::memimage<float>* ggm::load_image_sized(const std::string& filename,
+					     const dm::memimage<float>& ref,
+					     const std::string& reffile)
+{
+  std::unique_ptr< dm::memimage<float> > im( load_image(filename) );
+  if( im->xw() != ref.xw() || im->yw() != ref.yw() ) {
+    dm::except_invalid_param e;
+    e.set_descr("Image " + filename + " is not the same size as " +
+		reffile);
+    throw e;
+  }
+  return im.release();
+}
+
+void ggm::write_image(const std::string& filename,
+		      const dm::memimage<float>& img,
+		      const std::string& wcsfile)
+{
+  if( filename.size() > 3 &&
+      filename.compare(filename.size()-3, 3, ".fz") == 0 ) {
+    dm::tile_options opts;
+    opts.threads = get_threads();
+    dm::compressed_image::write(filename, img, opts);
+    return;
+  }
+
+  dm::dataset ds(filename, dm::create_over);
+  std::unique_ptr<dm::image> im( ds.create_image("IMAGE", dmFLOAT,
+						 img.xw(), img.yw()) );
+  im->write_from_memimage(img);
+
+  if( ! wcsfile.empty() ) {
+    dm::dataset wcsds(wcsfile);
+    std::unique_ptr<dm::image> wcsim( wcsds.get_image() );
+    im->copy_wcs_from(wcsim.get());
+  }
+}
+
+void ggm::write_cube(const std::string& filename,
+		     const dm::memcube<float>& cube,
+		     const std::string& wcsfile)
+{
+  dm::dataset ds(filename, dm::create_over);
+  std::unique_ptr<dm::image> im( ds.create_image("IMAGE", dmFLOAT,
+						 cube.xw(), cube.yw(),
+						 cube.zw()) );
+  im->write_from_memcube(cube);
+
+  if( ! wcsfile.empty() ) {
+    dm::dataset wcsds(wcsfile);
+    std::unique_ptr<dm::image> wcsim( wcsds.get_image() );
+    im->copy_wcs_from(wcsim.get());
+  }
+}
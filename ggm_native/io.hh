@@ -0,0 +1,37 @@
+#ifndef GGM_IO_HH
+#define GGM_IO_HH
+
+#include <string>
+#include <dm/memimage.hh>
+#include <dm/memcube.hh>
+
+namespace ggm
+{
+  // load the primary image from a file as floating point, or the
+  // first tile-compressed image if there is one. gzipped files are
+  // decompressed directly into memory
+  // (caller owns returned image)
+  dm::memimage<float>* load_image(const std::string& filename);
+
+  // load an image (as load_image) which must be the same size as ref,
+  // loaded from reffile. If not, throws except_invalid_param naming
+  // both files.
+  dm::memimage<float>* load_image_sized(const std::string& filename,
+					const dm::memimage<float>& ref,
+					const std::string& reffile);
+
+  // write image to file (overwriting), copying the coordinate system
+  // from the image in wcsfile if it is not empty. Filenames ending
+  // in .fz are written tile-compressed, without the coordinate system
+  void write_image(const std::string& filename,
+		   const dm::memimage<float>& img,
+		   const std::string& wcsfile = "");
+
+  // write cube to file (overwriting) as a 3D image, one plane per
+  // scale or band, copying the coordinate system as write_image
+  void write_cube(const std::string& filename,
+		  const dm::memcube<float>& cube,
+		  const std::string& wcsfile = "");
+}
+
+#endif
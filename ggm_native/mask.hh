@@ -0,0 +1,18 @@
+#ifndef GGM_MASK_HH
+#define GGM_MASK_HH
+
+namespace ggm
+{
+  // Mask pixel values follow adaptive_ggm.py (and contbin):
+  //   1 (>0)   pixel included
+  //   0        pixel excluded (no input, no output)
+  //   -2 (<0)  pixel ignored in the input, but output is calculated
+  //            here from the surrounding pixels
+
+  // weight of pixel in input
+  inline float mask_in_weight(float m) { return m > 0 ? 1.f : 0.f; }
+  // whether to calculate output for pixel (false for 0 and NaN)
+  inline bool mask_has_output(float m) { return m > 0 || m < 0; }
+}
+
+#endif
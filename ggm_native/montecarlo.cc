@@ -0,0 +1,318 @@
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <string>
+
+#include "montecarlo.hh"
+#include "parallel.hh"
+
+namespace
+{
+  inline uint64_t mix64(uint64_t z)
+  {
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+  }
+
+  // splitmix64 random numbers for one row of one realisation, so the
+  // values do not depend on how rows are split between threads
+  class row_random
+  {
+  public:
+    row_random(uint64_t seed, unsigned real, unsigned y)
+      : m_state(mix64(seed ^ mix64((uint64_t(real) << 32) | y)))
+    {}
+
+    // uniform in [0, 1)
+    double uniform()
+    {
+      m_state += 0x9e3779b97f4a7c15ULL;
+      return double(mix64(m_state) >> 11) * (1.0 / 9007199254740992.0);
+    }
+
+  private:
+    uint64_t m_state;
+  };
+
+  // log(k!)
+  double log_factorial(unsigned k)
+  {
+    static const unsigned ntab = 64;
+    static const std::vector<double> table = []() {
+      std::vector<double> t(ntab, 0.);
+      for(unsigned i=2; i<ntab; ++i)
+	t[i] = t[i-1] + std::log(double(i));
+      return t;
+    }();
+    if( k < ntab )
+      return table[k];
+    // Stirling series
+    const double x = k + 1.0, ix = 1.0/x, ix2 = ix*ix;
+    return (x-0.5)*std::log(x) - x + 0.5*std::log(2*M_PI) +
+      ix*(1./12 - ix2*(1./360 - ix2/1260));
+  }
+
+  // Poisson value of mean lam >= 10 by transformed rejection (PTRS,
+  // Hoermann 1993)
+  unsigned poisson_large(double lam, row_random& rng)
+  {
+    const double slam = std::sqrt(lam), loglam = std::log(lam);
+    const double b = 0.931 + 2.53*slam;
+    const double a = -0.059 + 0.02483*b;
+    const double invalpha = 1.1239 + 1.1328/(b-3.4);
+    const double vr = 0.9277 - 3.6224/(b-2);
+
+    for(;;) {
+      const double u = rng.uniform() - 0.5;
+      const double v = rng.uniform();
+      const double us = 0.5 - std::fabs(u);
+      const double k = std::floor((2*a/us + b)*u + lam + 0.43);
+      if( us >= 0.07 && v <= vr )
+	return unsigned(k);
+      if( k < 0 || (us < 0.013 && v > us) )
+	continue;
+      if( std::log(v) + std::log(invalpha) - std::log(a/(us*us) + b) <=
+	  -lam + k*loglam - log_factorial(unsigned(k)) )
+	return unsigned(k);
+    }
+  }
+
+  // Poisson value of mean lam, where explam is exp(-lam)
+  inline unsigned poisson(float lam, double explam, row_random& rng)
+  {
+    if( lam <= 0 )
+      return 0;
+    if( lam >= 10 )
+      return poisson_large(lam, rng);
+
+    // inversion, adding up the probabilities of 0, 1, 2... (stopping
+    // if rounding leaves the sum just short of u)
+    const double u = rng.uniform();
+    double p = explam, sum = p;
+    unsigned k = 0;
+    while( u > sum && p > sum*std::numeric_limits<double>::epsilon() ) {
+      ++k;
+      p *= double(lam) / k;
+      sum += p;
+    }
+    return k;
+  }
+
+  // value of quantile q from the first n (< 5) values, sorted in h
+  float small_quantile(const float* h, unsigned n, double q)
+  {
+    if( n == 0 )
+      return std::numeric_limits<float>::quiet_NaN();
+    const double pos = q*(n-1);
+    const unsigned i = std::min(unsigned(pos), n-1);
+    const unsigned j = std::min(i+1, n-1);
+    return float(h[i] + (pos-i)*(h[j]-h[i]));
+  }
+
+  // add value v to the P^2 markers of a pixel for quantile q, where n
+  // values have already been added. h is the 5 heights and pos the
+  // positions of the middle 3 markers.
+  void p2_add(float* h, unsigned* pos, unsigned n, double q, float v)
+  {
+    if( n < 5 ) {
+      // keep the first values sorted
+      unsigned i = n;
+      while( i > 0 && h[i-1] > v ) {
+	h[i] = h[i-1];
+	--i;
+      }
+      h[i] = v;
+      if( n == 4 )
+	for(unsigned j=0; j<3; ++j)
+	  pos[j] = j+1;
+      return;
+    }
+
+    // cell containing v, extending the ends if necessary
+    unsigned k;
+    if( v < h[0] ) {
+      h[0] = v;
+      k = 0;
+    } else if( v >= h[4] ) {
+      h[4] = v;
+      k = 3;
+    } else
+      k = v < h[1] ? 0 : v < h[2] ? 1 : v < h[3] ? 2 : 3;
+
+    // marker positions, including the fixed ends
+    double np[5] = { 0, double(pos[0]), double(pos[1]), double(pos[2]),
+		     double(n) };
+    for(unsigned i=k+1; i<4; ++i)
+      np[i] += 1;
+
+    // adjust the middle markers towards their desired positions
+    const double frac[5] = { 0, q/2, q, (1+q)/2, 1 };
+    for(unsigned i=1; i<4; ++i) {
+      const double d = n*frac[i] - np[i];
+      if( (d >= 1 && np[i+1]-np[i] > 1) ||
+	  (d <= -1 && np[i-1]-np[i] < -1) ) {
+	const int ds = d > 0 ? 1 : -1;
+	// piecewise parabolic prediction, else linear
+	const double hp = h[i] + ds/(np[i+1]-np[i-1]) *
+	  ((np[i]-np[i-1]+ds)*(h[i+1]-h[i])/(np[i+1]-np[i]) +
+	   (np[i+1]-np[i]-ds)*(h[i]-h[i-1])/(np[i]-np[i-1]));
+	if( h[i-1] < hp && hp < h[i+1] )
+	  h[i] = float(hp);
+	else
+	  h[i] = float(h[i] + ds*(h[i+ds]-h[i])/(np[i+ds]-np[i]));
+	np[i] += ds;
+      }
+    }
+    for(unsigned i=0; i<3; ++i)
+      pos[i] = unsigned(np[i+1]);
+  }
+}
+
+ggm::monte_carlo::monte_carlo(const dm::memimage<float>& model,
+			      const dm::memimage<float>* mask,
+			      double sigma,
+			      const std::vector<double>& quantiles,
+			      uint64_t seed,
+			      const exposure_correction* expcorr)
+  : m_xw(model.xw()), m_yw(model.yw()), m_seed(seed),
+    m_filter(model.xw(), model.yw(), sigma, mask, &model, expcorr),
+    m_quantiles(quantiles),
+    m_lambda(model.nelem()), m_explambda(model.nelem()),
+    m_count(0),
+    m_mean(model.nelem(), 0.), m_m2(model.nelem(), 0.),
+    m_heights(quantiles.size()), m_positions(quantiles.size())
+{
+  for(size_t i=0; i<quantiles.size(); ++i)
+    if( !(quantiles[i] >= 0 && quantiles[i] <= 1) )
+      throw std::string("Quantiles must be between 0 and 1");
+
+  const size_t npix = model.nelem();
+  for(size_t i=0; i<quantiles.size(); ++i) {
+    m_heights[i].assign(npix*5, 0.f);
+    m_positions[i].assign(npix*3, 0);
+  }
+
+  const float* in = model.data();
+  parallel_rows(m_yw, [&](unsigned y0, unsigned y1)
+    {
+      for(size_t i=size_t(y0)*m_xw; i<size_t(y1)*m_xw; ++i) {
+	const float v = in[i];
+	m_lambda[i] = std::isfinite(v) && v > 0 ? v : 0.f;
+	m_explambda[i] = std::exp(-double(m_lambda[i]));
+      }
+    });
+}
+
+void ggm::monte_carlo::realisation(unsigned real,
+				   dm::memimage<float>* out) const
+{
+  if( out->xw() != m_xw || out->yw() != m_yw )
+    throw dm::memimage<float>::size_mismatch_exception();
+
+  parallel_rows(m_yw, [&](unsigned y0, unsigned y1)
+    {
+      for(unsigned y=y0; y<y1; ++y) {
+	row_random rng(m_seed, real, y);
+	const float* lam = &m_lambda[size_t(y)*m_xw];
+	const double* elam = &m_explambda[size_t(y)*m_xw];
+	float* o = out->row(y);
+	for(unsigned x=0; x<m_xw; ++x)
+	  o[x] = float(poisson(lam[x], elam[x], rng));
+      }
+    });
+}
+
+void ggm::monte_carlo::run(unsigned n, unsigned batch)
+{
+  if( batch == 0 )
+    batch = get_threads();
+  batch = std::max(1u, std::min(batch, n));
+
+  std::vector< dm::memimage<float> > reals, ggms;
+  reals.reserve(batch);
+  ggms.reserve(batch);
+  for(unsigned k=0; k<batch; ++k) {
+    reals.emplace_back(m_xw, m_yw);
+    ggms.emplace_back(m_xw, m_yw);
+  }
+
+  for(unsigned done=0; done<n; ) {
+    const unsigned nb = std::min(batch, n-done);
+    for(unsigned k=0; k<nb; ++k) {
+      realisation(m_count+k, &reals[k]);
+      m_filter.apply(reals[k], &ggms[k]);
+    }
+    update(ggms, nb);
+    done += nb;
+  }
+}
+
+void ggm::monte_carlo::update(const std::vector< dm::memimage<float> >& ggms,
+			      unsigned nb)
+{
+  const unsigned nq = unsigned(m_quantiles.size());
+  const unsigned count0 = m_count;
+  parallel_rows(m_yw, [&](unsigned y0, unsigned y1)
+    {
+      for(size_t i=size_t(y0)*m_xw; i<size_t(y1)*m_xw; ++i) {
+	double mean = m_mean[i], m2 = m_m2[i];
+	for(unsigned k=0; k<nb; ++k) {
+	  const float v = ggms[k].flatdata(i);
+	  const unsigned c = count0 + k;
+
+	  // Welford's update (NaN stays NaN)
+	  const double delta = v - mean;
+	  mean += delta / (c+1);
+	  m2 += delta * (v - mean);
+
+	  for(unsigned q=0; q<nq; ++q) {
+	    float* h = &m_heights[q][i*5];
+	    if( ! std::isfinite(v) || std::isnan(h[0]) ) {
+	      h[0] = std::numeric_limits<float>::quiet_NaN();
+	      continue;
+	    }
+	    p2_add(h, &m_positions[q][i*3], c, m_quantiles[q], v);
+	  }
+	}
+	m_mean[i] = mean;
+	m_m2[i] = m2;
+      }
+    });
+  m_count += nb;
+}
+
+void ggm::monte_carlo::mean(dm::memimage<float>* out) const
+{
+  if( out->xw() != m_xw || out->yw() != m_yw )
+    throw dm::memimage<float>::size_mismatch_exception();
+  const float nan = std::numeric_limits<float>::quiet_NaN();
+  for(size_t i=0; i<m_mean.size(); ++i)
+    out->flatdata(i) = m_count > 0 ? float(m_mean[i]) : nan;
+}
+
+void ggm::monte_carlo::stddev(dm::memimage<float>* out) const
+{
+  if( out->xw() != m_xw || out->yw() != m_yw )
+    throw dm::memimage<float>::size_mismatch_exception();
+  const float nan = std::numeric_limits<float>::quiet_NaN();
+  for(size_t i=0; i<m_m2.size(); ++i)
+    out->flatdata(i) = m_count > 1 ?
+      float(std::sqrt(m_m2[i] / (m_count-1))) : nan;
+}
+
+void ggm::monte_carlo::quantile(unsigned idx, dm::memimage<float>* out) const
+{
+  if( out->xw() != m_xw || out->yw() != m_yw )
+    throw dm::memimage<float>::size_mismatch_exception();
+
+  const std::vector<float>& heights = m_heights.at(idx);
+  const double q = m_quantiles[idx];
+  for(size_t i=0; i<m_mean.size(); ++i) {
+    const float* h = &heights[i*5];
+    if( std::isnan(h[0]) )
+      out->flatdata(i) = h[0];
+    else
+      out->flatdata(i) = m_count < 5 ? small_quantile(h, m_count, q) : h[2];
+  }
+}
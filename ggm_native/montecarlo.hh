@@ -0,0 +1,83 @@
+#ifndef GGM_MONTECARLO_HH
+#define GGM_MONTECARLO_HH
+
+#include <vector>
+#include <stdint.h>
+#include <dm/memimage.hh>
+
+#include "ggm.hh"
+
+namespace ggm
+{
+  // Monte Carlo estimate of the noise in the GGM of a counts image,
+  // to judge whether features are real.
+  //
+  // Poisson realisations of a model image (e.g. the counts image
+  // itself, or a smoothed version of it) are filtered with the GGM,
+  // and the mean, standard deviation and chosen quantiles of the GGM
+  // of each pixel are accumulated as the realisations are made,
+  // without keeping them. Quantiles use the P^2 algorithm (Jain &
+  // Chlamtac 1985), which is approximate, and costs 32 bytes per
+  // pixel per quantile.
+  //
+  // Realisations are made in batches, each image being sampled and
+  // filtered in parallel, and the statistics are then updated in one
+  // pass over the batch. The filter and buffers are reused between
+  // batches. Each realisation has its own random numbers, and is
+  // added to the statistics in order, so the results only depend on
+  // the seed and the number of realisations.
+  class monte_carlo
+  {
+  public:
+    // model values which are negative or not finite are taken as
+    // zero. The mask follows mask.hh, as gaussian_gradient_magnitude.
+    // quantiles are fractions between 0 and 1. With expcorr, the
+    // model is of the counts, and the GGM is exposure corrected.
+    monte_carlo(const dm::memimage<float>& model,
+		const dm::memimage<float>* mask,
+		double sigma,
+		const std::vector<double>& quantiles = std::vector<double>(),
+		uint64_t seed = 0,
+		const exposure_correction* expcorr = 0);
+
+    // add n more realisations, batch at a time (0 for the number of
+    // threads)
+    void run(unsigned n, unsigned batch = 0);
+
+    unsigned no_realisations() const { return m_count; }
+    const std::vector<double>& quantiles() const { return m_quantiles; }
+
+    // get the statistics (out must be the size of the model). Pixels
+    // without output are NaN.
+    void mean(dm::memimage<float>* out) const;
+    void stddev(dm::memimage<float>* out) const;
+    void quantile(unsigned idx, dm::memimage<float>* out) const;
+
+    // make realisation number real (from 0) into out
+    void realisation(unsigned real, dm::memimage<float>* out) const;
+
+  private:
+    // add values of realisations in the batch to the statistics
+    void update(const std::vector< dm::memimage<float> >& ggms,
+		unsigned nb);
+
+  private:
+    unsigned m_xw, m_yw;
+    uint64_t m_seed;
+    ggm_filter m_filter;
+    std::vector<double> m_quantiles;
+
+    // model, and exp(-model) for sampling small values
+    std::vector<float> m_lambda;
+    std::vector<double> m_explambda;
+
+    unsigned m_count;
+    std::vector<double> m_mean, m_m2;  // Welford's running moments
+    // P^2 markers for each quantile: 5 heights and the positions of
+    // the middle 3 for each pixel
+    std::vector< std::vector<float> > m_heights;
+    std::vector< std::vector<unsigned> > m_positions;
+  };
+}
+
+#endif
@@ -0,0 +1,17 @@
+#ifndef GGM_PARALLEL_HH
+#define GGM_PARALLEL_HH
+
+#include <dm/parallel.hh>
+
+namespace ggm
+{
+  // the kernels use the shared thread pool of the dm library
+  // (default number of threads is the number of cores, or DM_THREADS)
+  using dm::get_threads;
+  using dm::set_threads;
+
+  // split rows [0, ny) into bands, calling func(y0, y1) for each band
+  using dm::parallel_rows;
+}
+
+#endif
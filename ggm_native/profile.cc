@@ -0,0 +1,199 @@
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
+#include "profile.hh"
+#include "mask.hh"
+
+const unsigned ggm::profiler::no_bin;
+
+namespace
+{
+  // images are summed in bands of at least this many rows, with at
+  // most max_bands bands (each having its own sums)
+  const unsigned accumulate_rows = 16;
+  const unsigned max_bands = 64;
+}
+
+double ggm::profile_sums::mean(unsigned img, unsigned bin) const
+{
+  const size_t i = size_t(img)*nbins + bin;
+  if( count[i] == 0 )
+    return std::numeric_limits<double>::quiet_NaN();
+  return sum[i] / count[i];
+}
+
+double ggm::profile_sums::stddev(unsigned img, unsigned bin) const
+{
+  const size_t i = size_t(img)*nbins + bin;
+  if( count[i] == 0 )
+    return std::numeric_limits<double>::quiet_NaN();
+  const double m = sum[i] / count[i];
+  return std::sqrt(std::max(0., sum2[i]/count[i] - m*m));
+}
+
+ggm::profiler::profiler(unsigned xw, unsigned yw, double xc, double yc,
+			const std::vector<double>& edges,
+			unsigned nsectors, double angle0)
+  : m_xw(xw), m_yw(yw),
+    m_nannuli(edges.size() > 1 ? unsigned(edges.size())-1 : 0),
+    m_nsectors(std::max(nsectors, 1u)),
+    m_bins(size_t(xw)*yw, no_bin)
+{
+  if( m_nannuli == 0 )
+    return;
+
+  const double twopi = 2*M_PI;
+  const double sector_width = twopi / m_nsectors;
+
+  parallel_rows(yw, [&](unsigned y0, unsigned y1)
+    {
+      for(unsigned y=y0; y<y1; ++y) {
+	unsigned* b = &m_bins[size_t(y)*xw];
+	const double dy = y-yc;
+	for(unsigned x=0; x<xw; ++x) {
+	  const double dx = x-xc;
+	  const double r = std::sqrt(dx*dx + dy*dy);
+	  if( r < edges.front() || r >= edges.back() )
+	    continue;
+	  const unsigned annulus = unsigned
+	    (std::upper_bound(edges.begin(), edges.end(), r)-edges.begin()-1);
+
+	  unsigned sector = 0;
+	  if( m_nsectors > 1 ) {
+	    double a = std::atan2(dy, dx) - angle0;
+	    a -= twopi*std::floor(a/twopi);
+	    sector = std::min(unsigned(a/sector_width), m_nsectors-1);
+	  }
+	  b[x] = bin(annulus, sector);
+	}
+      }
+    });
+}
+
+void ggm::profiler::apply_mask(const dm::memimage<float>& mask)
+{
+  if( mask.xw() != m_xw || mask.yw() != m_yw )
+    throw dm::memimage<float>::size_mismatch_exception();
+
+  parallel_rows(m_yw, [&](unsigned y0, unsigned y1)
+    {
+      for(unsigned y=y0; y<y1; ++y) {
+	unsigned* b = &m_bins[size_t(y)*m_xw];
+	const float* m = mask.row(y);
+	for(unsigned x=0; x<m_xw; ++x)
+	  if( mask_in_weight(m[x]) <= 0 )
+	    b[x] = no_bin;
+      }
+    });
+}
+
+void ggm::profiler::apply_mask(const dm::mask_image& mask)
+{
+  if( mask.xw() != m_xw || mask.yw() != m_yw )
+    throw dm::memimage<float>::size_mismatch_exception();
+
+  // clear the gaps between the runs of set pixels
+  parallel_rows(m_yw, [&](unsigned y0, unsigned y1)
+    {
+      for(unsigned y=y0; y<y1; ++y) {
+	unsigned* b = &m_bins[size_t(y)*m_xw];
+	unsigned next = 0;
+	mask.for_each_run(y, [&](unsigned x0, unsigned x1)
+			  {
+			    std::fill(b+next, b+x0, no_bin);
+			    next = x1;
+			  });
+	std::fill(b+next, b+m_xw, no_bin);
+      }
+    });
+}
+
+void ggm::profiler::exclude(const dm::mask_image& mask)
+{
+  if( mask.xw() != m_xw || mask.yw() != m_yw )
+    throw dm::memimage<float>::size_mismatch_exception();
+
+  parallel_rows(m_yw, [&](unsigned y0, unsigned y1)
+    {
+      for(unsigned y=y0; y<y1; ++y) {
+	unsigned* b = &m_bins[size_t(y)*m_xw];
+	mask.for_each_run(y, [b](unsigned x0, unsigned x1)
+			  { std::fill(b+x0, b+x1, no_bin); });
+      }
+    });
+}
+
+void ggm::profiler::accumulate
+(const std::vector<const dm::memimage<float>*>& images,
+ profile_sums* out) const
+{
+  for(size_t i=0; i<images.size(); ++i)
+    if( images[i]->xw() != m_xw || images[i]->yw() != m_yw )
+      throw dm::memimage<float>::size_mismatch_exception();
+
+  const unsigned nimages = unsigned(images.size());
+  const unsigned nbins = no_bins();
+  const size_t nvals = size_t(nimages)*nbins;
+
+  // each band of rows has its own sums, so the threads do not share
+  // anything. The bands depend only on the image size, and are added
+  // in order, so the result does not depend on the number of threads.
+  struct sums
+  {
+    std::vector<uint64_t> area, count;
+    std::vector<double> sum, sum2;
+  };
+  const unsigned band_rows = std::max(accumulate_rows,
+				      (m_yw + max_bands - 1) / max_bands);
+  const unsigned nbands = (m_yw + band_rows - 1) / band_rows;
+  std::vector<sums> bands(nbands);
+
+  dm::parallel_for(m_yw, band_rows, [&](size_t y0, size_t y1)
+    {
+      sums& s = bands[y0 / band_rows];
+      s.area.assign(nbins, 0);
+      s.count.assign(nvals, 0);
+      s.sum.assign(nvals, 0.);
+      s.sum2.assign(nvals, 0.);
+
+      for(size_t y=y0; y<y1; ++y) {
+	const unsigned* b = &m_bins[size_t(y)*m_xw];
+	for(unsigned x=0; x<m_xw; ++x)
+	  if( b[x] != no_bin )
+	    ++s.area[b[x]];
+
+	for(unsigned i=0; i<nimages; ++i) {
+	  const float* in = images[i]->row(y);
+	  const size_t off = size_t(i)*nbins;
+	  uint64_t* c = s.count.data() + off;
+	  double* su = s.sum.data() + off;
+	  double* su2 = s.sum2.data() + off;
+	  for(unsigned x=0; x<m_xw; ++x)
+	    if( b[x] != no_bin && std::isfinite(in[x]) ) {
+	      const double v = in[x];
+	      ++c[b[x]];
+	      su[b[x]] += v;
+	      su2[b[x]] += v*v;
+	    }
+	}
+      }
+    });
+
+  out->nimages = nimages;
+  out->nbins = nbins;
+  out->area.assign(nbins, 0);
+  out->count.assign(nvals, 0);
+  out->sum.assign(nvals, 0.);
+  out->sum2.assign(nvals, 0.);
+  for(unsigned band=0; band<nbands; ++band) {
+    const sums& s = bands[band];
+    for(unsigned j=0; j<nbins; ++j)
+      out->area[j] += s.area[j];
+    for(size_t j=0; j<nvals; ++j) {
+      out->count[j] += s.count[j];
+      out->sum[j] += s.sum[j];
+      out->sum2[j] += s.sum2[j];
+    }
+  }
+}
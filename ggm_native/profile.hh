@@ -0,0 +1,105 @@
+#ifndef GGM_PROFILE_HH
+#define GGM_PROFILE_HH
+
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
+#include <dm/memimage.hh>
+#include <dm/maskimage.hh>
+
+#include "parallel.hh"
+
+namespace ggm
+{
+  // sums of the pixel values in each bin of a profile, for several
+  // images. Values for image i and bin b are at index i*nbins+b.
+  struct profile_sums
+  {
+    unsigned nimages, nbins;
+    std::vector<uint64_t> area;   // pixels in each bin (per bin only)
+    std::vector<uint64_t> count;  // finite values
+    std::vector<double> sum, sum2;
+
+    // mean and standard deviation of the values (NaN if empty)
+    double mean(unsigned img, unsigned bin) const;
+    double stddev(unsigned img, unsigned bin) const;
+  };
+
+  // Radial and sector profiles of images about a centre.
+  //
+  // The bin of each pixel (annulus and sector) is calculated once,
+  // then any number of images of the same size can be profiled, each
+  // in a single pass. Masked and excluded pixels are removed from the
+  // bins, so they are not counted in the area either.
+  class profiler
+  {
+  public:
+    // images of size xw*yw, with radii measured from pixel xc, yc
+    // (from 0). Annuli lie between the radii in edges (pixels,
+    // increasing; radius r is in annulus i if edges[i] <= r <
+    // edges[i+1]), and each is split into nsectors equal sectors, the
+    // first starting at angle0 (radians, anticlockwise from +x).
+    profiler(unsigned xw, unsigned yw, double xc, double yc,
+	     const std::vector<double>& edges,
+	     unsigned nsectors = 1, double angle0 = 0);
+
+    unsigned xw() const { return m_xw; }
+    unsigned yw() const { return m_yw; }
+    unsigned no_annuli() const { return m_nannuli; }
+    unsigned no_sectors() const { return m_nsectors; }
+    unsigned no_bins() const { return m_nannuli*m_nsectors; }
+
+    // bin index of an annulus and sector
+    unsigned bin(unsigned annulus, unsigned sector) const
+    {
+      return sector*m_nannuli + annulus;
+    }
+
+    // remove pixels which are not included in the mask (see mask.hh)
+    void apply_mask(const dm::memimage<float>& mask);
+    // remove pixels which are not set in mask
+    void apply_mask(const dm::mask_image& mask);
+
+    // remove pixels (x, y) in the box x0..x1, y0..y1 (inclusive) where
+    // inside(x, y) is true, e.g. pixels in a region. inside is called
+    // from several threads at once.
+    template<class F> void exclude(unsigned x0, unsigned y0,
+				   unsigned x1, unsigned y1, F inside);
+    // remove pixels which are set in mask (e.g. regions drawn into it)
+    void exclude(const dm::mask_image& mask);
+
+    // sum the values of images (NaN and infinite values are skipped)
+    void accumulate(const std::vector<const dm::memimage<float>*>& images,
+		    profile_sums* out) const;
+
+  private:
+    static const unsigned no_bin = ~0u;
+
+    unsigned m_xw, m_yw;
+    unsigned m_nannuli, m_nsectors;
+    std::vector<unsigned> m_bins;  // bin of each pixel, or no_bin
+  };
+
+  template<class F> void profiler::exclude(unsigned x0, unsigned y0,
+					   unsigned x1, unsigned y1,
+					   F inside)
+  {
+    if( m_xw == 0 || m_yw == 0 || x0 >= m_xw || y0 >= m_yw ||
+	x1 < x0 || y1 < y0 )
+      return;
+    x1 = std::min(x1, m_xw-1);
+    y1 = std::min(y1, m_yw-1);
+
+    parallel_rows(y1-y0+1, [&](unsigned r0, unsigned r1)
+      {
+	for(unsigned y=y0+r0; y<y0+r1; ++y) {
+	  unsigned* b = &m_bins[size_t(y)*m_xw];
+	  for(unsigned x=x0; x<=x1; ++x)
+	    if( b[x] != no_bin && inside(x, y) )
+	      b[x] = no_bin;
+	}
+      });
+  }
+}
+
+#endif
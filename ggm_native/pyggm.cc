@@ -0,0 +1,973 @@
+// Python bindings for the ggm_native kernels (module ggmnative)
+//
+// Input images can be any 2D float32 C-contiguous object supporting
+// the buffer protocol (e.g. numpy arrays), which are used without
+// copying. Output images are returned as ggmnative.Image objects,
+// which also support the buffer protocol, so numpy.asarray(img)
+// gives an array using the same memory. The GIL is released while
+// the kernels run.
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <exception>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <dm/exception.hh>
+#include <dm/memimage.hh>
+#include <dm/packimage.hh>
+#include "fill.hh"
+
+#include "adaptive.hh"
+#include "combine.hh"
+#include "ggm.hh"
+#include "gradient.hh"
+#include "montecarlo.hh"
+#include "parallel.hh"
+#include "profile.hh"
+#include "scalemap.hh"
+
+namespace
+{
+  typedef dm::memimage<float> Img;
+
+  //////////////////////////////////////////////////////////////////
+  // Image type, owning a memimage
+
+  struct ImageObject
+  {
+    PyObject_HEAD
+    Img* img;
+    Py_ssize_t shape[2], strides[2];
+  };
+
+  extern PyTypeObject ImageType;
+
+  // make Image object taking ownership of img
+  PyObject* wrap_image(Img* img)
+  {
+    ImageObject* self = PyObject_New(ImageObject, &ImageType);
+    if( self == 0 ) {
+      delete img;
+      return 0;
+    }
+    self->img = img;
+    self->shape[0] = img->yw();
+    self->shape[1] = img->xw();
+    self->strides[0] = Py_ssize_t(img->xw())*sizeof(float);
+    self->strides[1] = sizeof(float);
+    return reinterpret_cast<PyObject*>(self);
+  }
+
+  PyObject* Image_new(PyTypeObject*, PyObject* args, PyObject* kwds)
+  {
+    static const char* kwlist[] = {"xw", "yw", "val", 0};
+    unsigned xw, yw;
+    float val = 0;
+    if( ! PyArg_ParseTupleAndKeywords(args, kwds, "II|f",
+				      const_cast<char**>(kwlist),
+				      &xw, &yw, &val) )
+      return 0;
+    return wrap_image(new Img(xw, yw, val));
+  }
+
+  void Image_dealloc(ImageObject* self)
+  {
+    delete self->img;
+    PyObject_Del(self);
+  }
+
+  int Image_getbuffer(ImageObject* self, Py_buffer* view, int flags)
+  {
+    view->buf = self->img->data();
+    view->obj = reinterpret_cast<PyObject*>(self);
+    Py_INCREF(view->obj);
+    view->len = Py_ssize_t(self->img->nelem())*sizeof(float);
+    view->readonly = 0;
+    view->itemsize = sizeof(float);
+    view->format = (flags & PyBUF_FORMAT) ? const_cast<char*>("f") : 0;
+    view->ndim = 2;
+    view->shape = self->shape;
+    view->strides = self->strides;
+    view->suboffsets = 0;
+    view->internal = 0;
+    return 0;
+  }
+
+  PyBufferProcs Image_as_buffer = {
+    reinterpret_cast<getbufferproc>(Image_getbuffer), 0
+  };
+
+  PyObject* Image_get_xw(ImageObject* self, void*)
+  {
+    return PyLong_FromUnsignedLong(self->img->xw());
+  }
+
+  PyObject* Image_get_yw(ImageObject* self, void*)
+  {
+    return PyLong_FromUnsignedLong(self->img->yw());
+  }
+
+  PyGetSetDef Image_getset[] = {
+    {const_cast<char*>("xw"), reinterpret_cast<getter>(Image_get_xw), 0,
+     const_cast<char*>("image width"), 0},
+    {const_cast<char*>("yw"), reinterpret_cast<getter>(Image_get_yw), 0,
+     const_cast<char*>("image height"), 0},
+    {0, 0, 0, 0, 0}
+  };
+
+  PyTypeObject ImageType = {
+    PyVarObject_HEAD_INIT(0, 0)
+    "ggmnative.Image",
+  };
+
+  //////////////////////////////////////////////////////////////////
+  // Input images from objects supporting buffer protocol
+
+  class InImage
+  {
+  public:
+    InImage() : m_have_view(false), m_img(0) {}
+    ~InImage()
+    {
+      delete m_img;
+      if( m_have_view )
+	PyBuffer_Release(&m_view);
+    }
+
+    // get image from obj, returning false with exception set on
+    // failure. If obj is None and optional is set, img() is null.
+    bool set(PyObject* obj, const char* name, bool optional = false)
+    {
+      if( optional && (obj == 0 || obj == Py_None) )
+	return true;
+
+      if( PyObject_GetBuffer(obj, &m_view,
+			     PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) != 0 )
+	return false;
+      m_have_view = true;
+
+      const std::string fmt(m_view.format != 0 ? m_view.format : "B");
+      if( m_view.ndim != 2 || m_view.itemsize != sizeof(float) ||
+	  (fmt != "f" && fmt != "<f" && fmt != "=f") ) {
+	PyErr_Format(PyExc_TypeError, "%s must be a 2D float32 array", name);
+	return false;
+      }
+      const Py_ssize_t maxlen = std::numeric_limits<unsigned>::max();
+      if( m_view.shape[0] > maxlen || m_view.shape[1] > maxlen ) {
+	PyErr_Format(PyExc_ValueError, "%s is too large", name);
+	return false;
+      }
+
+      m_img = new Img(unsigned(m_view.shape[1]), unsigned(m_view.shape[0]),
+		      static_cast<float*>(m_view.buf), dm::borrow);
+      return true;
+    }
+
+    Img* img() { return m_img; }
+    const Img& operator*() const { return *m_img; }
+
+  private:
+    InImage(const InImage&);
+    InImage& operator=(const InImage&);
+
+    Py_buffer m_view;
+    bool m_have_view;
+    Img* m_img;
+  };
+
+  // run func, returning the message of any C++ exception (empty if
+  // none). Nothing may be thrown past here into Python.
+  template<class F> std::string call_caught(const F& func)
+  {
+    try {
+      func();
+    }
+    catch(Img::size_mismatch_exception&) {
+      return "image sizes do not match";
+    }
+    catch(dm::exception& e) {
+      return e();
+    }
+    catch(std::string& s) {
+      return s;
+    }
+    catch(std::exception& e) {
+      return e.what();
+    }
+    catch(...) {
+      return "unknown error";
+    }
+    return std::string();
+  }
+
+  // run func without the GIL, converting C++ exceptions to Python
+  template<class F> bool run_nogil(const F& func)
+  {
+    PyThreadState* state = PyEval_SaveThread();
+    const std::string err( call_caught(func) );
+    PyEval_RestoreThread(state);
+
+    if( ! err.empty() ) {
+      PyErr_SetString(PyExc_ValueError, err.c_str());
+      return false;
+    }
+    return true;
+  }
+
+  // run func with the GIL held, converting C++ exceptions to Python
+  template<class F> bool run_gil(const F& func)
+  {
+    const std::string err( call_caught(func) );
+    if( ! err.empty() ) {
+      PyErr_SetString(PyExc_ValueError, err.c_str());
+      return false;
+    }
+    return true;
+  }
+
+  // read sequence of floats
+  bool get_doubles(PyObject* obj, std::vector<double>* out)
+  {
+    PyObject* seq = PySequence_Fast(obj, "expected a sequence of numbers");
+    if( seq == 0 )
+      return false;
+    const Py_ssize_t n = PySequence_Fast_GET_SIZE(seq);
+    out->resize(n);
+    for(Py_ssize_t i=0; i<n; ++i)
+      (*out)[i] = PyFloat_AsDouble(PySequence_Fast_GET_ITEM(seq, i));
+    Py_DECREF(seq);
+    return ! PyErr_Occurred();
+  }
+
+  // exposure correction if an exposure image was given, else null
+  // (made without the GIL, as it scans the exposure)
+  ggm::exposure_correction* make_expcorr(InImage& exposure, InImage& bkg,
+					 double thresh)
+  {
+    if( exposure.img() == 0 )
+      return 0;
+    return new ggm::exposure_correction(*exposure, bkg.img(), thresh);
+  }
+
+  //////////////////////////////////////////////////////////////////
+  // Kernel functions
+
+  PyObject* py_gaussian_gradient_magnitude(PyObject*, PyObject* args,
+					   PyObject* kwds)
+  {
+    static const char* kwlist[] = {"image", "sigma", "mask", "exposure",
+				   "bkg", "expthresh", 0};
+    PyObject *inobj, *maskobj = 0, *expobj = 0, *bkgobj = 0;
+    double sigma, expthresh = 0.1;
+    if( ! PyArg_ParseTupleAndKeywords(args, kwds, "Od|OOOd",
+				      const_cast<char**>(kwlist),
+				      &inobj, &sigma, &maskobj, &expobj,
+				      &bkgobj, &expthresh) )
+      return 0;
+
+    InImage in, mask, exposure, bkg;
+    if( ! in.set(inobj, "image") || ! mask.set(maskobj, "mask", true) ||
+	! exposure.set(expobj, "exposure", true) ||
+	! bkg.set(bkgobj, "bkg", true) )
+      return 0;
+
+    Img* out = new Img(in.img()->xw(), in.img()->yw());
+    if( ! run_nogil([&]()
+      {
+	std::unique_ptr<ggm::exposure_correction>
+	  expcorr( make_expcorr(exposure, bkg, expthresh) );
+	ggm::gaussian_gradient_magnitude(*in, mask.img(), out, sigma,
+					 expcorr.get());
+      }) ) {
+      delete out;
+      return 0;
+    }
+    return wrap_image(out);
+  }
+
+  PyObject* py_ggm_monte_carlo(PyObject*, PyObject* args, PyObject* kwds)
+  {
+    static const char* kwlist[] = {"model", "sigma", "realisations", "mask",
+				   "quantiles", "seed", "batch", "exposure",
+				   "bkg", "expthresh", 0};
+    PyObject *inobj, *maskobj = 0, *qobj = 0, *expobj = 0, *bkgobj = 0;
+    double sigma, expthresh = 0.1;
+    unsigned nreal, batch = 0;
+    unsigned long long seed = 0;
+    if( ! PyArg_ParseTupleAndKeywords(args, kwds, "OdI|OOKIOOd",
+				      const_cast<char**>(kwlist),
+				      &inobj, &sigma, &nreal, &maskobj, &qobj,
+				      &seed, &batch, &expobj, &bkgobj,
+				      &expthresh) )
+      return 0;
+
+    std::vector<double> quantiles;
+    if( qobj != 0 && qobj != Py_None && ! get_doubles(qobj, &quantiles) )
+      return 0;
+
+    InImage in, mask, exposure, bkg;
+    if( ! in.set(inobj, "model") || ! mask.set(maskobj, "mask", true) ||
+	! exposure.set(expobj, "exposure", true) ||
+	! bkg.set(bkgobj, "bkg", true) )
+      return 0;
+
+    const unsigned xw = in.img()->xw(), yw = in.img()->yw();
+    std::vector< std::unique_ptr<Img> > outs;
+    for(size_t i=0; i<2+quantiles.size(); ++i)
+      outs.emplace_back( new Img(xw, yw) );
+    if( ! run_nogil([&]()
+      {
+	std::unique_ptr<ggm::exposure_correction>
+	  expcorr( make_expcorr(exposure, bkg, expthresh) );
+	ggm::monte_carlo mc(*in, mask.img(), sigma, quantiles, seed,
+			    expcorr.get());
+	mc.run(nreal, batch);
+	mc.mean(outs[0].get());
+	mc.stddev(outs[1].get());
+	for(unsigned q=0; q<quantiles.size(); ++q)
+	  mc.quantile(q, outs[2+q].get());
+      }) )
+      return 0;
+
+    PyObject* qlist = PyList_New(Py_ssize_t(quantiles.size()));
+    if( qlist == 0 )
+      return 0;
+    for(size_t q=0; q<quantiles.size(); ++q) {
+      PyObject* item = wrap_image(outs[2+q].release());
+      if( item == 0 ) {
+	Py_DECREF(qlist);
+	return 0;
+      }
+      PyList_SET_ITEM(qlist, Py_ssize_t(q), item);
+    }
+    PyObject* mean = wrap_image(outs[0].release());
+    PyObject* sd = wrap_image(outs[1].release());
+    PyObject* ret = 0;
+    if( mean != 0 && sd != 0 )
+      ret = Py_BuildValue("{sOsOsO}", "mean", mean, "stddev", sd,
+			  "quantiles", qlist);
+    Py_XDECREF(mean);
+    Py_XDECREF(sd);
+    Py_DECREF(qlist);
+    return ret;
+  }
+
+  PyObject* py_adaptive_smooth(PyObject*, PyObject* args, PyObject* kwds)
+  {
+    static const char* kwlist[] = {"image", "sigma", "mask", "buckets",
+				   "exposure", "bkg", "expthresh", 0};
+    PyObject *inobj, *sigobj, *maskobj = 0, *expobj = 0, *bkgobj = 0;
+    unsigned buckets = 16;
+    double expthresh = 0.1;
+    if( ! PyArg_ParseTupleAndKeywords(args, kwds, "OO|OIOOd",
+				      const_cast<char**>(kwlist),
+				      &inobj, &sigobj, &maskobj, &buckets,
+				      &expobj, &bkgobj, &expthresh) )
+      return 0;
+
+    InImage in, sigma, mask, exposure, bkg;
+    if( ! in.set(inobj, "image") || ! sigma.set(sigobj, "sigma") ||
+	! mask.set(maskobj, "mask", true) ||
+	! exposure.set(expobj, "exposure", true) ||
+	! bkg.set(bkgobj, "bkg", true) )
+      return 0;
+
+    Img* out = new Img(in.img()->xw(), in.img()->yw());
+    if( ! run_nogil([&]()
+      {
+	std::unique_ptr<ggm::exposure_correction>
+	  expcorr( make_expcorr(exposure, bkg, expthresh) );
+	ggm::adaptive_smooth(*in, *sigma, mask.img(), out, buckets,
+			     expcorr.get());
+      }) ) {
+      delete out;
+      return 0;
+    }
+    return wrap_image(out);
+  }
+
+  PyObject* py_gradient_magnitude(PyObject*, PyObject* args, PyObject* kwds)
+  {
+    static const char* kwlist[] = {"image", "log", 0};
+    PyObject* inobj;
+    int log = 1;
+    if( ! PyArg_ParseTupleAndKeywords(args, kwds, "O|p",
+				      const_cast<char**>(kwlist),
+				      &inobj, &log) )
+      return 0;
+
+    InImage in;
+    if( ! in.set(inobj, "image") )
+      return 0;
+
+    Img* out = new Img(in.img()->xw(), in.img()->yw());
+    if( ! run_nogil([&]()
+      { ggm::gradient_magnitude(*in, out, log != 0); }) ) {
+      delete out;
+      return 0;
+    }
+    return wrap_image(out);
+  }
+
+  PyObject* py_scale_map(PyObject*, PyObject* args, PyObject* kwds)
+  {
+    static const char* kwlist[] = {"counts", "mincounts", "mask",
+				   "maxradius", 0};
+    PyObject *inobj, *maskobj = 0;
+    double mincounts;
+    unsigned maxradius = 0;
+    if( ! PyArg_ParseTupleAndKeywords(args, kwds, "Od|OI",
+				      const_cast<char**>(kwlist),
+				      &inobj, &mincounts, &maskobj,
+				      &maxradius) )
+      return 0;
+
+    InImage in, mask;
+    if( ! in.set(inobj, "counts") || ! mask.set(maskobj, "mask", true) )
+      return 0;
+
+    Img* out = new Img(in.img()->xw(), in.img()->yw());
+    if( ! run_nogil([&]()
+      { ggm::scale_map(*in, mask.img(), out, mincounts, maxradius); }) ) {
+      delete out;
+      return 0;
+    }
+    return wrap_image(out);
+  }
+
+  PyObject* py_fill_regions(PyObject*, PyObject* args, PyObject* kwds)
+  {
+    static const char* kwlist[] = {"image", "regions", "crpix", "crval",
+				   "cdelt", 0};
+    PyObject *inobj, *regobj;
+    double crpix[2] = {0.5, 0.5}, crval[2] = {0.5, 0.5}, cdelt[2] = {1, 1};
+    if( ! PyArg_ParseTupleAndKeywords(args, kwds, "OO|(dd)(dd)(dd)",
+				      const_cast<char**>(kwlist),
+				      &inobj, &regobj,
+				      &crpix[0], &crpix[1], &crval[0],
+				      &crval[1], &cdelt[0], &cdelt[1]) )
+      return 0;
+
+    InImage in;
+    if( ! in.set(inobj, "image") )
+      return 0;
+
+    std::vector<std::string> regions;
+    PyObject* seq = PySequence_Fast(regobj, "regions must be a sequence");
+    if( seq == 0 )
+      return 0;
+    for(Py_ssize_t i=0; i<PySequence_Fast_GET_SIZE(seq); ++i) {
+      const char* s = PyUnicode_AsUTF8(PySequence_Fast_GET_ITEM(seq, i));
+      if( s == 0 ) {
+	Py_DECREF(seq);
+	return 0;
+      }
+      regions.push_back(s);
+    }
+    Py_DECREF(seq);
+
+    Img* out = new Img(*in);
+    const Transform trans(crpix, crval, cdelt);
+
+    // the CIAO region parser is not reentrant, so the regions (and
+    // their enlarged versions) are parsed before releasing the GIL
+    const size_t nreg = regions.size();
+    const unsigned xw = out->xw(), yw = out->yw();
+    std::vector<PixelBox> boxes(nreg), enlboxes(nreg);
+    std::vector<bool> valid(nreg), enlvalid(nreg);
+    std::vector< std::unique_ptr<Region> > regs(nreg), enlarged(nreg);
+    if( ! run_gil([&]()
+      {
+	for(size_t i=0; i<nreg; ++i) {
+	  valid[i] = regionBox(regions[i], trans, xw, yw, &boxes[i]);
+	  regs[i].reset(new Region(regions[i]));
+	  const std::string enl( enlargeRegion(regions[i]) );
+	  enlvalid[i] = regionBox(enl, trans, xw, yw, &enlboxes[i]);
+	  if( enlvalid[i] )
+	    enlarged[i].reset(new Region(enl));
+	}
+      }) ) {
+      delete out;
+      return 0;
+    }
+
+    if( ! run_nogil([&]()
+      {
+	// as hideregions2, neighbouring regions are not sampled
+	const RegionIndex index(boxes, valid);
+	std::vector<unsigned> near;
+	std::vector<Region*> neighbours;
+	for(size_t i=0; i<nreg; ++i) {
+	  if( ! enlvalid[i] )
+	    continue;
+	  index.find(enlboxes[i], &near);
+	  neighbours.clear();
+	  for(size_t j=0; j<near.size(); ++j)
+	    if( near[j] != i )
+	      neighbours.push_back(regs[near[j]].get());
+	  fillRegion(regs[i].get(), enlarged[i].get(), trans, in.img(), out,
+		     &enlboxes[i], 0, 0, &neighbours);
+	}
+      }) ) {
+      delete out;
+      return 0;
+    }
+    return wrap_image(out);
+  }
+
+  // read sequence of region strings
+  bool get_strings(PyObject* obj, std::vector<std::string>* out)
+  {
+    PyObject* seq = PySequence_Fast(obj, "expected a sequence of strings");
+    if( seq == 0 )
+      return false;
+    for(Py_ssize_t i=0; i<PySequence_Fast_GET_SIZE(seq); ++i) {
+      const char* s = PyUnicode_AsUTF8(PySequence_Fast_GET_ITEM(seq, i));
+      if( s == 0 ) {
+	Py_DECREF(seq);
+	return false;
+      }
+      out->push_back(s);
+    }
+    Py_DECREF(seq);
+    return true;
+  }
+
+  // list of n values from v
+  // Python numbers for the values of lists
+  inline PyObject* py_number(double v) { return PyFloat_FromDouble(v); }
+  inline PyObject* py_number(uint64_t v)
+  {
+    return PyLong_FromUnsignedLongLong((unsigned long long)v);
+  }
+
+  template<class T> PyObject* make_list(const T* v, size_t n)
+  {
+    PyObject* list = PyList_New(Py_ssize_t(n));
+    if( list == 0 )
+      return 0;
+    for(size_t i=0; i<n; ++i) {
+      PyObject* item = py_number(v[i]);
+      if( item == 0 ) {
+	Py_DECREF(list);
+	return 0;
+      }
+      PyList_SET_ITEM(list, Py_ssize_t(i), item);
+    }
+    return list;
+  }
+
+  // list of a list for each image, from values ordered by image
+  template<class T> PyObject* make_image_lists(const std::vector<T>& v,
+					       unsigned nimages,
+					       unsigned nbins)
+  {
+    PyObject* list = PyList_New(nimages);
+    if( list == 0 )
+      return 0;
+    for(unsigned i=0; i<nimages; ++i) {
+      PyObject* item = make_list(v.empty() ? 0 : &v[size_t(i)*nbins], nbins);
+      if( item == 0 ) {
+	Py_DECREF(list);
+	return 0;
+      }
+      PyList_SET_ITEM(list, i, item);
+    }
+    return list;
+  }
+
+  PyObject* py_profiles(PyObject*, PyObject* args, PyObject* kwds)
+  {
+    static const char* kwlist[] = {"images", "xc", "yc", "edges",
+				   "nsectors", "angle0", "mask", "regions",
+				   "crpix", "crval", "cdelt", 0};
+    PyObject *imgsobj, *edgesobj, *maskobj = 0, *regobj = 0;
+    double xc, yc, angle0 = 0;
+    unsigned nsectors = 1;
+    double crpix[2] = {0.5, 0.5}, crval[2] = {0.5, 0.5}, cdelt[2] = {1, 1};
+    if( ! PyArg_ParseTupleAndKeywords(args, kwds, "OddO|IdOO(dd)(dd)(dd)",
+				      const_cast<char**>(kwlist),
+				      &imgsobj, &xc, &yc, &edgesobj,
+				      &nsectors, &angle0, &maskobj, &regobj,
+				      &crpix[0], &crpix[1], &crval[0],
+				      &crval[1], &cdelt[0], &cdelt[1]) )
+      return 0;
+
+    std::vector<double> edges;
+    if( ! get_doubles(edgesobj, &edges) )
+      return 0;
+    for(size_t i=1; i<edges.size(); ++i)
+      if( !(edges[i] > edges[i-1]) ) {
+	PyErr_SetString(PyExc_ValueError, "edges must be increasing");
+	return 0;
+      }
+
+    std::vector<std::string> regions;
+    if( regobj != 0 && regobj != Py_None && ! get_strings(regobj, &regions) )
+      return 0;
+
+    PyObject* seq = PySequence_Fast(imgsobj, "images must be a sequence");
+    if( seq == 0 )
+      return 0;
+    const Py_ssize_t nimages = PySequence_Fast_GET_SIZE(seq);
+    std::vector< std::unique_ptr<InImage> > ins(nimages);
+    std::vector<const Img*> imgs(nimages);
+    for(Py_ssize_t i=0; i<nimages; ++i) {
+      ins[i].reset(new InImage);
+      if( ! ins[i]->set(PySequence_Fast_GET_ITEM(seq, i), "image") ) {
+	Py_DECREF(seq);
+	return 0;
+      }
+      imgs[i] = ins[i]->img();
+    }
+    Py_DECREF(seq);
+
+    InImage mask;
+    if( ! mask.set(maskobj, "mask", true) )
+      return 0;
+    if( imgs.empty() && mask.img() == 0 ) {
+      PyErr_SetString(PyExc_ValueError, "no images given");
+      return 0;
+    }
+    const Img& first = imgs.empty() ? *mask : *imgs.front();
+
+    // the pixels in the regions, as hideregions2 fills them, drawn
+    // with the GIL held as the region parser is not reentrant
+    std::unique_ptr<dm::mask_image> regmask;
+    const Transform trans(crpix, crval, cdelt);
+    if( ! regions.empty() && ! run_gil([&]()
+      {
+	regmask.reset(new dm::mask_image(first.xw(), first.yw()));
+	for(size_t i=0; i<regions.size(); ++i)
+	  regionMask(regions[i], trans, regmask.get());
+      }) )
+      return 0;
+
+    ggm::profile_sums sums;
+    if( ! run_nogil([&]()
+      {
+	ggm::profiler prof(first.xw(), first.yw(), xc, yc, edges,
+			   nsectors, angle0);
+	if( mask.img() != 0 )
+	  prof.apply_mask(*mask);
+	if( regmask )
+	  prof.exclude(*regmask);
+
+	prof.accumulate(imgs, &sums);
+      }) )
+      return 0;
+
+    const unsigned nimg = sums.nimages, nbins = sums.nbins;
+    PyObject* area = make_list(sums.area.empty() ? 0 : &sums.area[0], nbins);
+    PyObject* count = make_image_lists(sums.count, nimg, nbins);
+    PyObject* sum = make_image_lists(sums.sum, nimg, nbins);
+    PyObject* sum2 = make_image_lists(sums.sum2, nimg, nbins);
+    PyObject* ret = 0;
+    if( area != 0 && count != 0 && sum != 0 && sum2 != 0 )
+      ret = Py_BuildValue("{sOsOsOsO}", "area", area, "count", count,
+			  "sum", sum, "sum2", sum2);
+    Py_XDECREF(area);
+    Py_XDECREF(count);
+    Py_XDECREF(sum);
+    Py_XDECREF(sum2);
+    return ret;
+  }
+
+  PyObject* py_set_threads(PyObject*, PyObject* args)
+  {
+    unsigned n;
+    if( ! PyArg_ParseTuple(args, "I", &n) )
+      return 0;
+    ggm::set_threads(n);
+    Py_RETURN_NONE;
+  }
+
+  PyObject* py_get_threads(PyObject*, PyObject*)
+  {
+    return PyLong_FromUnsignedLong(ggm::get_threads());
+  }
+
+  //////////////////////////////////////////////////////////////////
+  // Combiner type
+
+  struct CombinerObject
+  {
+    PyObject_HEAD
+    std::vector<InImage*>* images;
+    std::vector<dm::packed_image*>* packed;
+    ggm::combiner* comb;
+    // held while the combiner is used without the GIL
+    std::mutex* lock;
+  };
+
+  // free the contents of a Combiner
+  void combiner_clear(CombinerObject* self)
+  {
+    delete self->comb;
+    self->comb = 0;
+    if( self->images != 0 )
+      for(size_t i=0; i<self->images->size(); ++i)
+	delete (*self->images)[i];
+    delete self->images;
+    self->images = 0;
+    if( self->packed != 0 )
+      for(size_t i=0; i<self->packed->size(); ++i)
+	delete (*self->packed)[i];
+    delete self->packed;
+    self->packed = 0;
+    delete self->lock;
+    self->lock = 0;
+  }
+
+  void Combiner_dealloc(CombinerObject* self)
+  {
+    combiner_clear(self);
+    Py_TYPE(self)->tp_free(reinterpret_cast<PyObject*>(self));
+  }
+
+  bool combiner_ready(CombinerObject* self)
+  {
+    if( self->comb == 0 )
+      PyErr_SetString(PyExc_RuntimeError, "Combiner not initialised");
+    return self->comb != 0;
+  }
+
+  // set up a Combiner of the images (storage already checked)
+  bool combiner_setup(CombinerObject* self, PyObject* imgsobj,
+		      double xc, double yc, const std::string& st)
+  {
+    PyObject* seq = PySequence_Fast(imgsobj, "images must be a sequence");
+    if( seq == 0 )
+      return false;
+
+    self->lock = new std::mutex;
+    self->images = new std::vector<InImage*>;
+    for(Py_ssize_t i=0; i<PySequence_Fast_GET_SIZE(seq); ++i) {
+      self->images->push_back(new InImage);
+      if( ! self->images->back()->set(PySequence_Fast_GET_ITEM(seq, i),
+				      "image") ) {
+	Py_DECREF(seq);
+	return false;
+      }
+    }
+    Py_DECREF(seq);
+
+    if( self->images->empty() ) {
+      PyErr_SetString(PyExc_ValueError, "no images given");
+      return false;
+    }
+
+    const Img& first = **self->images->front();
+    std::unique_ptr<ggm::combiner> comb
+      ( new ggm::combiner(first.xw(), first.yw(), xc, yc) );
+    for(size_t i=0; i<self->images->size(); ++i) {
+      const Img* img = (*self->images)[i]->img();
+      if( img->xw() != first.xw() || img->yw() != first.yw() ) {
+	PyErr_SetString(PyExc_ValueError, "image sizes do not match");
+	return false;
+      }
+      if( st == "float32" )
+	comb->add_image(img);
+    }
+
+    // pack copies of the images, then release the inputs
+    if( st != "float32" ) {
+      const dm::pack_format fmt =
+	st == "float16" ? dm::pack_half : dm::pack_scaled;
+      self->packed = new std::vector<dm::packed_image*>;
+      for(size_t i=0; i<self->images->size(); ++i) {
+	const Img& img = **(*self->images)[i];
+	dm::packed_image* p = 0;
+	if( ! run_nogil([&]() { p = new dm::packed_image(img, fmt); }) )
+	  return false;
+	self->packed->push_back(p);
+	comb->add_image(p);
+	delete (*self->images)[i];
+	(*self->images)[i] = 0;
+      }
+    }
+
+    // only usable once complete
+    self->comb = comb.release();
+    return true;
+  }
+
+  int Combiner_init(CombinerObject* self, PyObject* args, PyObject* kwds)
+  {
+    static const char* kwlist[] = {"images", "xc", "yc", "storage", 0};
+    PyObject* imgsobj;
+    double xc, yc;
+    const char* storage = "float32";
+    if( ! PyArg_ParseTupleAndKeywords(args, kwds, "Odd|s",
+				      const_cast<char**>(kwlist),
+				      &imgsobj, &xc, &yc, &storage) )
+      return -1;
+
+    // other threads may be using the existing combiner
+    if( self->lock != 0 ) {
+      PyErr_SetString(PyExc_RuntimeError, "Combiner already initialised");
+      return -1;
+    }
+
+    const std::string st(storage);
+    if( st != "float32" && st != "float16" && st != "int16" ) {
+      PyErr_SetString(PyExc_ValueError,
+		      "storage must be float32, float16 or int16");
+      return -1;
+    }
+
+    if( ! combiner_setup(self, imgsobj, xc, yc, st) ) {
+      combiner_clear(self);
+      return -1;
+    }
+    return 0;
+  }
+
+  PyObject* Combiner_set_curve(CombinerObject* self, PyObject* args)
+  {
+    if( ! combiner_ready(self) )
+      return 0;
+    unsigned idx;
+    PyObject *radobj, *wtobj;
+    double scale;
+    if( ! PyArg_ParseTuple(args, "IOOd", &idx, &radobj, &wtobj, &scale) )
+      return 0;
+
+    std::vector<double> radii, weights;
+    if( ! get_doubles(radobj, &radii) || ! get_doubles(wtobj, &weights) )
+      return 0;
+    if( idx >= self->comb->no_images() || radii.size() != weights.size() ) {
+      PyErr_SetString(PyExc_ValueError, "invalid curve");
+      return 0;
+    }
+
+    if( ! run_nogil([&]()
+      {
+	std::lock_guard<std::mutex> lock(*self->lock);
+	self->comb->set_curve(idx, radii, weights, scale);
+      }) )
+      return 0;
+    Py_RETURN_NONE;
+  }
+
+  PyObject* Combiner_combined(CombinerObject* self, PyObject*)
+  {
+    if( ! combiner_ready(self) )
+      return 0;
+    Img* out = new Img(self->comb->xw(), self->comb->yw());
+    if( ! run_nogil([&]()
+      {
+	std::lock_guard<std::mutex> lock(*self->lock);
+	self->comb->combined(out);
+      }) ) {
+      delete out;
+      return 0;
+    }
+    return wrap_image(out);
+  }
+
+  PyMethodDef Combiner_methods[] = {
+    {"set_curve", reinterpret_cast<PyCFunction>(Combiner_set_curve),
+     METH_VARARGS,
+     "set_curve(idx, radii, weights, scale): set weight curve of image"},
+    {"combined", reinterpret_cast<PyCFunction>(Combiner_combined),
+     METH_NOARGS, "combined(): get combined image, normalised by maximum"},
+    {0, 0, 0, 0}
+  };
+
+  PyTypeObject CombinerType = {
+    PyVarObject_HEAD_INIT(0, 0)
+    "ggmnative.Combiner",
+  };
+
+  //////////////////////////////////////////////////////////////////
+  // Module
+
+  PyMethodDef module_methods[] = {
+    {"gaussian_gradient_magnitude",
+     reinterpret_cast<PyCFunction>(py_gaussian_gradient_magnitude),
+     METH_VARARGS | METH_KEYWORDS,
+     "gaussian_gradient_magnitude(image, sigma, mask=None, exposure=None, "
+     "bkg=None, expthresh=0.1): GGM filter"},
+    {"ggm_monte_carlo", reinterpret_cast<PyCFunction>(py_ggm_monte_carlo),
+     METH_VARARGS | METH_KEYWORDS,
+     "ggm_monte_carlo(model, sigma, realisations, mask=None, quantiles=(), "
+     "seed=0, batch=0, exposure=None, bkg=None, expthresh=0.1): mean, "
+     "stddev and quantiles of the GGM of Poisson realisations of model"},
+    {"adaptive_smooth", reinterpret_cast<PyCFunction>(py_adaptive_smooth),
+     METH_VARARGS | METH_KEYWORDS,
+     "adaptive_smooth(image, sigma, mask=None, buckets=16, exposure=None, "
+     "bkg=None, expthresh=0.1): smooth with per-pixel gaussian sigma"},
+    {"gradient_magnitude",
+     reinterpret_cast<PyCFunction>(py_gradient_magnitude),
+     METH_VARARGS | METH_KEYWORDS,
+     "gradient_magnitude(image, log=True): central difference gradient"},
+    {"scale_map", reinterpret_cast<PyCFunction>(py_scale_map),
+     METH_VARARGS | METH_KEYWORDS,
+     "scale_map(counts, mincounts, mask=None, maxradius=0): radius "
+     "squared containing mincounts"},
+    {"fill_regions", reinterpret_cast<PyCFunction>(py_fill_regions),
+     METH_VARARGS | METH_KEYWORDS,
+     "fill_regions(image, regions, crpix, crval, cdelt): hideregions2 "
+     "fill of region strings (physical coordinates)"},
+    {"profiles", reinterpret_cast<PyCFunction>(py_profiles),
+     METH_VARARGS | METH_KEYWORDS,
+     "profiles(images, xc, yc, edges, nsectors=1, angle0=0, mask=None, "
+     "regions=None, crpix, crval, cdelt): radial and sector profile sums"},
+    {"set_threads", py_set_threads, METH_VARARGS,
+     "set_threads(n): set number of threads (0 for number of cores)"},
+    {"get_threads", py_get_threads, METH_NOARGS,
+     "get_threads(): get number of threads"},
+    {0, 0, 0, 0}
+  };
+
+  PyModuleDef module_def = {
+    PyModuleDef_HEAD_INIT,
+    "ggmnative",
+    "Native GGM kernels operating on float32 images",
+    -1,
+    module_methods,
+  };
+}
+
+PyMODINIT_FUNC PyInit_ggmnative()
+{
+  ImageType.tp_basicsize = sizeof(ImageObject);
+  ImageType.tp_flags = Py_TPFLAGS_DEFAULT;
+  ImageType.tp_doc = "Image(xw, yw, val=0): float32 image owned by "
+    "ggmnative, supporting the buffer protocol";
+  ImageType.tp_new = Image_new;
+  ImageType.tp_dealloc = reinterpret_cast<destructor>(Image_dealloc);
+  ImageType.tp_as_buffer = &Image_as_buffer;
+  ImageType.tp_getset = Image_getset;
+
+  CombinerType.tp_basicsize = sizeof(CombinerObject);
+  CombinerType.tp_flags = Py_TPFLAGS_DEFAULT;
+  CombinerType.tp_doc = "Combiner(images, xc, yc, storage='float32'): "
+    "radially weighted combination of images (see ggm_combine). With "
+    "storage 'float16' or 'int16' the images are copied into 16 bits "
+    "per pixel";
+  CombinerType.tp_new = PyType_GenericNew;
+  CombinerType.tp_init = reinterpret_cast<initproc>(Combiner_init);
+  CombinerType.tp_dealloc = reinterpret_cast<destructor>(Combiner_dealloc);
+  CombinerType.tp_methods = Combiner_methods;
+
+  if( PyType_Ready(&ImageType) < 0 || PyType_Ready(&CombinerType) < 0 )
+    return 0;
+
+  PyObject* mod = PyModule_Create(&module_def);
+  if( mod == 0 )
+    return 0;
+
+  Py_INCREF(&ImageType);
+  PyModule_AddObject(mod, "Image", reinterpret_cast<PyObject*>(&ImageType));
+  Py_INCREF(&CombinerType);
+  PyModule_AddObject(mod, "Combiner",
+		     reinterpret_cast<PyObject*>(&CombinerType));
+  return mod;
+}
@@ -0,0 +1,152 @@
+#include <cmath>
+#include <limits>
+#include <vector>
+
+#include "scalemap.hh"
+#include "mask.hh"
+#include "parallel.hh"
+
+namespace
+{
+  typedef long long rad2_t;
+
+  // largest integer whose square is <= v
+  inline int isqrt(rad2_t v)
+  {
+    rad2_t r = rad2_t(std::sqrt(double(v)));
+    while( r*r > v )
+      --r;
+    while( (r+1)*(r+1) <= v )
+      ++r;
+    return int(r);
+  }
+
+  // sums counts in circles using cumulative sums along each row
+  class CircleSum
+  {
+  public:
+    CircleSum(const dm::memimage<float>& counts,
+	      const dm::memimage<float>* mask)
+      : m_xw(counts.xw()), m_yw(counts.yw()),
+	m_cumul(size_t(m_xw+1)*m_yw)
+    {
+      ggm::parallel_rows(m_yw, [&](unsigned y0, unsigned y1)
+	{
+	  for(unsigned y=y0; y<y1; ++y) {
+	    const float* c = counts.row(y);
+	    const float* m = mask != 0 ? mask->row(y) : 0;
+	    double* cum = &m_cumul[size_t(y)*(m_xw+1)];
+	    cum[0] = 0;
+	    for(unsigned x=0; x<m_xw; ++x) {
+	      const bool use = (m == 0 || ggm::mask_in_weight(m[x]) > 0) &&
+		std::isfinite(c[x]);
+	      cum[x+1] = cum[x] + (use ? c[x] : 0.);
+	    }
+	  }
+	});
+    }
+
+    // sum of counts in pixels with dx*dx+dy*dy <= r2
+    double operator()(int x, int y, rad2_t r2) const
+    {
+      const int r = isqrt(r2);
+      const int ymin = std::max(0, y-r), ymax = std::min(int(m_yw)-1, y+r);
+      double tot = 0;
+      for(int yy=ymin; yy<=ymax; ++yy) {
+	const int dy = yy-y;
+	const int hw = isqrt(r2 - rad2_t(dy)*dy);
+	const int x0 = std::max(0, x-hw), x1 = std::min(int(m_xw)-1, x+hw);
+	if( x1 >= x0 ) {
+	  const double* cum = &m_cumul[size_t(yy)*(m_xw+1)];
+	  tot += cum[x1+1] - cum[x0];
+	}
+      }
+      return tot;
+    }
+
+  private:
+    unsigned m_xw, m_yw;
+    std::vector<double> m_cumul;
+  };
+}
+
+void ggm::scale_map(const dm::memimage<float>& counts,
+		    const dm::memimage<float>* mask,
+		    dm::memimage<float>* out,
+		    double mincounts,
+		    unsigned maxradius)
+{
+  const unsigned xw = counts.xw(), yw = counts.yw();
+  if( out->xw() != xw || out->yw() != yw ||
+      (mask != 0 && (mask->xw() != xw || mask->yw() != yw)) )
+    throw dm::memimage<float>::size_mismatch_exception();
+
+  if( maxradius == 0 )
+    maxradius = std::max(xw, yw);
+  const rad2_t maxr2 = rad2_t(maxradius)*maxradius;
+
+  const CircleSum circsum(counts, mask);
+
+  parallel_rows(yw, [&](unsigned y0, unsigned y1)
+    {
+      // the previous pixel's radius is a good starting point for the
+      // search, so exponentially step away from it, then bisect
+      rad2_t hint = 0;
+      for(unsigned y=y0; y<y1; ++y) {
+	const float* m = mask != 0 ? mask->row(y) : 0;
+	float* o = out->row(y);
+	for(unsigned x=0; x<xw; ++x) {
+	  if( m != 0 && ! mask_has_output(m[x]) ) {
+	    o[x] = std::numeric_limits<float>::quiet_NaN();
+	    continue;
+	  }
+
+	  auto enough = [&](rad2_t r2)
+	    { return circsum(x, y, r2) >= mincounts; };
+
+	  // lo is not enough (or -1), hi is enough. The largest circle is
+	  // only summed if the search upwards reaches it.
+	  rad2_t lo, hi;
+	  if( enough(hint) ) {
+	    hi = hint;
+	    lo = -1;
+	    for(rad2_t step=1; hint-step >= 0; step *= 2) {
+	      if( ! enough(hint-step) ) {
+		lo = hint-step;
+		break;
+	      }
+	      hi = hint-step;
+	    }
+	  } else {
+	    lo = hint;
+	    hi = -1;
+	    for(rad2_t step=1; hint+step < maxr2; step *= 2) {
+	      if( enough(hint+step) ) {
+		hi = hint+step;
+		break;
+	      }
+	      lo = hint+step;
+	    }
+	    if( hi < 0 ) {
+	      if( lo == maxr2 || ! enough(maxr2) ) {
+		o[x] = float(maxr2);
+		continue;
+	      }
+	      hi = maxr2;
+	    }
+	  }
+
+	  while( hi-lo > 1 ) {
+	    const rad2_t mid = lo + (hi-lo)/2;
+	    if( enough(mid) )
+	      hi = mid;
+	    else
+	      lo = mid;
+	  }
+
+	  o[x] = float(hi);
+	  hint = hi;
+	}
+      }
+    });
+}
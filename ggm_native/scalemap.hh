@@ -0,0 +1,23 @@
+#ifndef GGM_SCALEMAP_HH
+#define GGM_SCALEMAP_HH
+
+#include <dm/memimage.hh>
+
+namespace ggm
+{
+  // Calculate the adaptive smoothing scale map from a counts image,
+  // as contbin's accumulate_counts. For each pixel the output is the
+  // smallest radius squared (in pixels) of a circle around the pixel
+  // containing at least mincounts counts (sn*sn). Pixels which are
+  // not included in the mask (see mask.hh) do not contribute counts,
+  // and excluded pixels are NaN in the output. If a circle of
+  // maxradius does not contain enough counts, maxradius squared is
+  // returned (maxradius of 0 uses the larger image dimension).
+  void scale_map(const dm::memimage<float>& counts,
+		 const dm::memimage<float>* mask,
+		 dm::memimage<float>* out,
+		 double mincounts,
+		 unsigned maxradius = 0);
+}
+
+#endif
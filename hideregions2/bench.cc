@@ -0,0 +1,369 @@
+// Benchmarks of the dm library and the hideregions2 fill, on images
+// and region catalogues made in memory. Results are written as JSON
+// so that runs of different versions can be compared.
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <cstdlib>
+#include <cstdio>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <random>
+#include <thread>
+
+#include <unistd.h>
+
+#include <dm/dm.hh>
+#include <dm/convert.hh>
+#include <dm/parallel.hh>
+
+#include "fill.hh"
+#include "cache.hh"
+
+namespace
+{
+  // a single timing
+  struct Result
+  {
+    std::string group, name, params, unit;
+    unsigned threads;
+    double seconds;   // best time for one repeat
+    double items;     // items processed per repeat
+    unsigned repeats;
+  };
+
+  std::vector<Result> results;
+  double min_time = 0.3;
+
+  // call func repeatedly (after one warm-up call) for at least
+  // min_time seconds, recording the fastest call
+  template<class F> void timeit(const std::string& group,
+                                const std::string& name,
+                                const std::string& params,
+                                const std::string& unit,
+                                double items, F func)
+  {
+    typedef std::chrono::steady_clock clock;
+    func();
+
+    double best = 1e99, total = 0;
+    unsigned repeats = 0;
+    while(total < min_time || repeats < 3)
+      {
+        const clock::time_point t0 = clock::now();
+        func();
+        const double dt =
+          std::chrono::duration<double>(clock::now() - t0).count();
+        best = std::min(best, dt);
+        total += dt;
+        ++repeats;
+      }
+
+    Result r;
+    r.group = group; r.name = name; r.params = params; r.unit = unit;
+    r.threads = dm::get_threads();
+    r.seconds = best;
+    r.items = items;
+    r.repeats = repeats;
+    results.push_back(r);
+
+    std::cout << group << ' ' << name;
+    if(!params.empty())
+      std::cout << " (" << params << ')';
+    std::cout << " threads=" << r.threads << ": "
+              << items/best << ' ' << unit << "/s\n";
+  }
+
+  // stop the compiler removing unused results
+  volatile double sink;
+
+  dm::memimage<float> random_image(unsigned xw, unsigned yw)
+  {
+    dm::memimage<float> im(xw, yw);
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<float> dist(0.f, 100.f);
+    for(size_t i=0; i<im.nelem(); ++i)
+      im.flatdata(i) = dist(rng);
+    return im;
+  }
+
+  void bench_memimage(unsigned size)
+  {
+    dm::memimage<float> a(random_image(size, size)), b(a);
+    const double npix = double(a.nelem());
+
+    timeit("memimage", "add_image", "", "pixels", npix,
+           [&]() { a += b; });
+    timeit("memimage", "multiply_const", "", "pixels", npix,
+           [&]() { a *= 1.0001f; });
+    timeit("memimage", "sum", "", "pixels", npix,
+           [&]() { sink = a.sum(); });
+    timeit("memimage", "max", "", "pixels", npix,
+           [&]() { sink = a.max(); });
+  }
+
+  template<class T1, class T2>
+  void bench_convert_pair(const std::string& name, size_t n)
+  {
+    std::vector<T2> src(n);
+    for(size_t i=0; i<n; ++i)
+      src[i] = T2(i % 1000);
+    std::vector<T1> dst(n);
+    timeit("convert", name, "", "values", double(n),
+           [&]() { dm::convert_array(&dst[0], &src[0], n); });
+  }
+
+  void bench_big_endian(const std::string& name, int bitpix, size_t n)
+  {
+    std::vector<unsigned char> raw(n*std::abs(bitpix)/8);
+    for(size_t i=0; i<raw.size(); ++i)
+      raw[i] = (unsigned char)(i*7);
+    std::vector<float> dst(n);
+    timeit("convert", name, "", "values", double(n),
+           [&]() { dm::convert_big_endian(&dst[0], &raw[0], bitpix, n); });
+  }
+
+  void bench_convert(unsigned size)
+  {
+    const size_t n = size_t(size)*size;
+    bench_convert_pair<float, short>("short_to_float", n);
+    bench_convert_pair<float, long>("long_to_float", n);
+    bench_convert_pair<double, float>("float_to_double", n);
+    bench_convert_pair<short, float>("float_to_short", n);
+    bench_convert_pair<float, unsigned char>("byte_to_float", n);
+    bench_big_endian("be16_to_float", 16, n);
+    bench_big_endian("be32f_to_float", -32, n);
+  }
+
+  // write and read an image through the DM
+  void bench_io(unsigned size, const std::string& tmpfile)
+  {
+    const dm::memimage<float> im(random_image(size, size));
+    const double npix = double(im.nelem());
+
+    timeit("io", "write_image", "", "pixels", npix, [&]()
+      {
+        dm::dataset ds(tmpfile, dm::create_over);
+        std::unique_ptr<dm::image> out
+          (ds.create_image("IMAGE", dmFLOAT, im.xw(), im.yw()));
+        out->write_from_memimage(im);
+      });
+
+    timeit("io", "read_image", "", "pixels", npix, [&]()
+      {
+        dm::dataset ds(tmpfile);
+        std::unique_ptr<dm::image> in(ds.get_image());
+        dm::memimage<float>* r;
+        in->create_memimage(&r);
+        delete r;
+      });
+
+    // read the central quarter, converting to double
+    const unsigned q = size/4;
+    dm::pix_vec lower, upper;
+    lower.push_back(q+1); lower.push_back(q+1);
+    upper.push_back(3*q); upper.push_back(3*q);
+    std::ostringstream params;
+    params << "box=" << 2*q << 'x' << 2*q;
+    timeit("io", "read_subarray", params.str(), "pixels",
+           double(2*q)*(2*q), [&]()
+      {
+        dm::dataset ds(tmpfile);
+        std::unique_ptr<dm::image> in(ds.get_image());
+        double* vals;
+        in->get_subarray(lower, upper, &vals);
+        delete[] vals;
+      });
+
+    dm::dataset::delete_on_disk(tmpfile);
+  }
+
+  // fill a catalogue of circles of the same radius, in parallel with
+  // neighbours excluded, as hideregions2 does
+  void bench_fill(unsigned size, unsigned nsources, double radius)
+  {
+    const dm::memimage<float> in(random_image(size, size));
+    const double crpix[2] = {1, 1}, crval[2] = {1, 1}, cdlt[2] = {1, 1};
+    const Transform trans(crpix, crval, cdlt);
+
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<double> pos(1, size);
+    std::vector<std::string> lines(nsources);
+    for(unsigned i=0; i<nsources; ++i)
+      {
+        std::ostringstream s;
+        s << "circle(" << pos(rng) << ',' << pos(rng) << ','
+          << radius << ')';
+        lines[i] = s.str();
+      }
+
+    std::vector<PixelBox> boxes(nsources), enlboxes(nsources);
+    std::vector<bool> valid(nsources), enlvalid(nsources);
+    std::vector< std::unique_ptr<Region> > regs(nsources), enl(nsources);
+    for(unsigned i=0; i<nsources; ++i)
+      {
+        valid[i] = regionBox(lines[i], trans, size, size, &boxes[i]);
+        const std::string e(enlargeRegion(lines[i]));
+        enlvalid[i] = regionBox(e, trans, size, size, &enlboxes[i]);
+        regs[i].reset(new Region(lines[i]));
+        enl[i].reset(new Region(e));
+      }
+
+    std::ostringstream params;
+    params << "sources=" << nsources << " radius=" << radius
+           << " size=" << size;
+
+    timeit("fill", "fill_regions", params.str(), "regions",
+           double(nsources), [&]()
+      {
+        const RegionIndex index(boxes, valid);
+        std::vector< std::vector<FilledPixel> > filled(nsources);
+        dm::parallel_items(0, nsources, [&](size_t i, unsigned)
+          {
+            if(!enlvalid[i])
+              return;
+            std::vector<unsigned> near;
+            index.find(enlboxes[i], &near);
+            std::vector<Region*> neighbours;
+            for(size_t j=0; j<near.size(); ++j)
+              if(near[j] != i)
+                neighbours.push_back(regs[near[j]].get());
+            std::mt19937_64 r(FillCache::regionSeed(lines[i], 0));
+            fillRegion(regs[i].get(), enl[i].get(), trans, &in, 0,
+                       &enlboxes[i], &r, &filled[i], &neighbours);
+          });
+      });
+  }
+
+  // quoted JSON string
+  std::string quote(const std::string& s)
+  {
+    std::string out("\"");
+    for(size_t i=0; i<s.size(); ++i)
+      {
+        if(s[i] == '"' || s[i] == '\\')
+          out += '\\';
+        out += s[i];
+      }
+    return out + '"';
+  }
+
+  void write_json(const std::string& filename)
+  {
+    std::ofstream out(filename.c_str());
+    if(!out)
+      throw std::string("Cannot write ") + filename;
+
+    char host[256] = "";
+    gethostname(host, sizeof(host)-1);
+
+    out.precision(6);
+    out << "{\n"
+        << "  \"program\": \"hideregions2_bench\",\n"
+        << "  \"host\": " << quote(host) << ",\n"
+        << "  \"cores\": " << std::thread::hardware_concurrency() << ",\n"
+        << "  \"time\": "
+        << std::chrono::duration_cast<std::chrono::seconds>
+           (std::chrono::system_clock::now().time_since_epoch()).count()
+        << ",\n"
+        << "  \"results\": [\n";
+    for(size_t i=0; i<results.size(); ++i)
+      {
+        const Result& r = results[i];
+        out << "    {\"group\": " << quote(r.group)
+            << ", \"name\": " << quote(r.name)
+            << ", \"params\": " << quote(r.params)
+            << ", \"threads\": " << r.threads
+            << ", \"seconds\": " << r.seconds
+            << ", \"items\": " << r.items
+            << ", \"unit\": " << quote(r.unit)
+            << ", \"rate\": " << r.items/r.seconds
+            << ", \"repeats\": " << r.repeats << '}'
+            << (i+1 < results.size() ? ",\n" : "\n");
+      }
+    out << "  ]\n}\n";
+  }
+
+  std::vector<unsigned> parse_list(const std::string& s)
+  {
+    std::vector<unsigned> out;
+    std::istringstream in(s);
+    std::string item;
+    while(std::getline(in, item, ','))
+      out.push_back(unsigned(std::atoi(item.c_str())));
+    return out;
+  }
+}
+
+int main(int argc, char* argv[])
+{
+  std::string outfile("bench.json");
+  std::string tmpfile("bench_tmp.fits");
+  unsigned size = 4096;
+  std::vector<unsigned> threads;
+  threads.push_back(1);
+  threads.push_back(std::max(1u, std::thread::hardware_concurrency()));
+  bool bad = false;
+
+  for(int i=1; i<argc; ++i)
+    {
+      const std::string a(argv[i]);
+      if(a.compare(0, 6, "--out=") == 0)
+        outfile = a.substr(6);
+      else if(a.compare(0, 6, "--tmp=") == 0)
+        tmpfile = a.substr(6);
+      else if(a.compare(0, 7, "--size=") == 0)
+        size = unsigned(std::atoi(a.substr(7).c_str()));
+      else if(a.compare(0, 10, "--threads=") == 0)
+        threads = parse_list(a.substr(10));
+      else if(a.compare(0, 11, "--min-time=") == 0)
+        min_time = std::atof(a.substr(11).c_str());
+      else
+        bad = true;
+    }
+
+  if(bad || size < 64 || threads.empty())
+    {
+      std::cerr << "Usage: "
+                << argv[0]
+                << " [--out=bench.json] [--size=4096] [--threads=1,2,4,8]"
+                << " [--min-time=0.3] [--tmp=bench_tmp.fits]\n";
+      return 1;
+    }
+
+  try
+    {
+      bench_io(size, tmpfile);
+
+      for(size_t t=0; t<threads.size(); ++t)
+        {
+          dm::set_threads(threads[t]);
+          bench_memimage(size);
+          bench_convert(size);
+
+          const unsigned nsources[] = { 100, 1000, 10000 };
+          const double radii[] = { 2, 8, 32 };
+          for(unsigned n=0; n<3; ++n)
+            for(unsigned r=0; r<3; ++r)
+              bench_fill(size/2, nsources[n], radii[r]);
+        }
+
+      write_json(outfile);
+    }
+  catch(dm::exception& e)
+    {
+      std::cerr << e() << '\n';
+      return 1;
+    }
+  catch(std::string s)
+    {
+      std::cerr << s << '\n';
+      return 1;
+    }
+
+  return 0;
+}
@@ -0,0 +1,195 @@
+#include <fstream>
+#include <cstring>
+
+#include "cache.hh"
+
+namespace
+{
+  const char magic[8] = { 'H', 'R', 'F', 'I', 'L', 'L', '0', '1' };
+
+  // 64 bit FNV-1a hash
+  class Hash
+  {
+  public:
+    Hash() : m_h(14695981039346656037ULL) {}
+
+    void add(const void* data, size_t n)
+    {
+      const unsigned char* p = static_cast<const unsigned char*>(data);
+      for(size_t i=0; i<n; ++i)
+        m_h = (m_h ^ p[i]) * 1099511628211ULL;
+    }
+    template<class T> void add(const T& v) { add(&v, sizeof(T)); }
+
+    uint64_t operator()() const { return m_h; }
+
+  private:
+    uint64_t m_h;
+  };
+
+  template<class T> void readval(std::istream& in, T* v)
+  {
+    in.read(reinterpret_cast<char*>(v), sizeof(T));
+  }
+  template<class T> void writeval(std::ostream& out, const T& v)
+  {
+    out.write(reinterpret_cast<const char*>(&v), sizeof(T));
+  }
+}
+
+uint64_t FillCache::regionSeed(const std::string& region, uint64_t seed)
+{
+  Hash h;
+  h.add(seed);
+  h.add(region.data(), region.size());
+  return h();
+}
+
+uint64_t FillCache::key(const std::string& region,
+                        const std::string& enlarged,
+                        const std::vector<std::string>& neighbours,
+                        uint64_t seed, const Transform& trans,
+                        const dm::memimage<float>& inimage,
+                        const PixelBox* box)
+{
+  Hash h;
+  h.add(region.data(), region.size());
+  h.add(char(0));
+  h.add(enlarged.data(), enlarged.size());
+  h.add(char(0));
+  h.add(uint64_t(neighbours.size()));
+  for(size_t i=0; i<neighbours.size(); ++i)
+    {
+      h.add(neighbours[i].data(), neighbours[i].size());
+      h.add(char(0));
+    }
+  h.add(seed);
+  h.add(trans.pcrpix);
+  h.add(trans.pcrval);
+  h.add(trans.pcdlt);
+  h.add(inimage.xw());
+  h.add(inimage.yw());
+  if(box != 0)
+    {
+      h.add(*box);
+      for(unsigned y = box->y0; y <= box->y1; ++y)
+        h.add(inimage.row(y) + box->x0,
+              (box->x1-box->x0+1)*sizeof(float));
+    }
+  return h();
+}
+
+void FillCache::load(const std::string& filename)
+{
+  m_entries.clear();
+
+  std::ifstream in(filename.c_str(), std::ios::binary);
+  if(!in)
+    return;
+
+  char m[sizeof(magic)];
+  in.read(m, sizeof(m));
+  if(!in || std::memcmp(m, magic, sizeof(magic)) != 0)
+    throw std::string("Invalid cache file ") + filename;
+
+  uint64_t nentries = 0;
+  readval(in, &nentries);
+  for(uint64_t i=0; i<nentries && in; ++i)
+    {
+      uint64_t k;
+      uint32_t nruns, nvals;
+      readval(in, &k);
+      readval(in, &nruns);
+      readval(in, &nvals);
+
+      Entry& e = m_entries[k];
+      e.runs.resize(nruns);
+      e.vals.resize(nvals);
+      if(nruns > 0)
+        in.read(reinterpret_cast<char*>(&e.runs[0]), nruns*sizeof(Run));
+      if(nvals > 0)
+        in.read(reinterpret_cast<char*>(&e.vals[0]), nvals*sizeof(float));
+    }
+
+  if(!in)
+    throw std::string("Truncated cache file ") + filename;
+}
+
+void FillCache::save(const std::string& filename) const
+{
+  std::ofstream out(filename.c_str(), std::ios::binary);
+  if(!out)
+    throw std::string("Cannot write cache file ") + filename;
+
+  uint64_t nentries = 0;
+  for(std::map<uint64_t, Entry>::const_iterator i = m_entries.begin();
+      i != m_entries.end(); ++i)
+    if(i->second.used)
+      ++nentries;
+
+  out.write(magic, sizeof(magic));
+  writeval(out, nentries);
+  for(std::map<uint64_t, Entry>::const_iterator i = m_entries.begin();
+      i != m_entries.end(); ++i)
+    {
+      const Entry& e = i->second;
+      if(!e.used)
+        continue;
+      writeval(out, i->first);
+      writeval(out, uint32_t(e.runs.size()));
+      writeval(out, uint32_t(e.vals.size()));
+      if(!e.runs.empty())
+        out.write(reinterpret_cast<const char*>(&e.runs[0]),
+                  e.runs.size()*sizeof(Run));
+      if(!e.vals.empty())
+        out.write(reinterpret_cast<const char*>(&e.vals[0]),
+                  e.vals.size()*sizeof(float));
+    }
+
+  if(!out)
+    throw std::string("Error writing cache file ") + filename;
+}
+
+bool FillCache::apply(uint64_t key, dm::memimage<float>* image)
+{
+  std::map<uint64_t, Entry>::iterator i = m_entries.find(key);
+  if(i == m_entries.end())
+    return false;
+
+  Entry& e = i->second;
+  size_t vi = 0;
+  for(size_t r=0; r<e.runs.size(); ++r)
+    {
+      const Run& run = e.runs[r];
+      if(run.y >= image->yw() || run.x + run.n > image->xw() ||
+         vi + run.n > e.vals.size())
+        throw std::string("Cache entry does not match image");
+      std::memcpy(image->row(run.y) + run.x, &e.vals[vi],
+                  run.n*sizeof(float));
+      vi += run.n;
+    }
+
+  e.used = true;
+  return true;
+}
+
+void FillCache::add(uint64_t key, const std::vector<FilledPixel>& pixels)
+{
+  Entry& e = m_entries[key];
+  e.runs.clear();
+  e.vals.clear();
+  e.used = true;
+
+  for(size_t i=0; i<pixels.size(); ++i)
+    {
+      const FilledPixel& p = pixels[i];
+      if(e.runs.empty() || e.runs.back().y != p.y ||
+         e.runs.back().x + e.runs.back().n != p.x)
+        {
+          const Run run = { p.x, p.y, 0 };
+          e.runs.push_back(run);
+        }
+      ++e.runs.back().n;
+      e.vals.push_back(p.val);
+    }
+}
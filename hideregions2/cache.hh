@@ -0,0 +1,62 @@
+#ifndef HIDEREGIONS2_CACHE_HH
+#define HIDEREGIONS2_CACHE_HH
+
+// Cache of region fills, so that re-running with a slightly changed
+// region file only recomputes the regions which have changed
+
+#include <string>
+#include <vector>
+#include <map>
+#include <stdint.h>
+
+#include "fill.hh"
+
+class FillCache
+{
+public:
+  // seed for the random numbers of a region, so that its fill does not
+  // depend on the other regions
+  static uint64_t regionSeed(const std::string& region, uint64_t seed);
+
+  // key identifying a fill: a hash of the region, its enlarged
+  // region, the neighbouring regions excluded from the fill, the
+  // seed, the transform and the input pixels in box
+  static uint64_t key(const std::string& region,
+                      const std::string& enlarged,
+                      const std::vector<std::string>& neighbours,
+                      uint64_t seed, const Transform& trans,
+                      const dm::memimage<float>& inimage,
+                      const PixelBox* box);
+
+  // read cache file (a missing file is an empty cache)
+  void load(const std::string& filename);
+  // write cache file, keeping only the entries used since loading
+  void save(const std::string& filename) const;
+
+  // is the key in the cache?
+  bool has(uint64_t key) const { return m_entries.count(key) != 0; }
+
+  // set the pixels of a cached fill in image, returning false if the
+  // key is not in the cache
+  bool apply(uint64_t key, dm::memimage<float>* image);
+  // store a fill
+  void add(uint64_t key, const std::vector<FilledPixel>& pixels);
+
+private:
+  // a fill is stored as runs of pixels along rows
+  struct Run
+  {
+    uint32_t x, y, n;
+  };
+  struct Entry
+  {
+    Entry() : used(false) {}
+    std::vector<Run> runs;
+    std::vector<float> vals;
+    bool used;
+  };
+
+  std::map<uint64_t, Entry> m_entries;
+};
+
+#endif
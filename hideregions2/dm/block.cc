@@ -1,4 +1,5 @@
 #include <cassert>
+#include "general.hh"
 #include "block.hh"
 
 dm::block::~block()
@@ -16,3 +17,22 @@ bool dm::block::read_key(const std::string& name, double* ret)
 
   return( desc != 0 );
 }
+
+bool dm::block::write_key(const std::string& name, double val,
+			  const std::string& comment)
+{
+  assert( m_block != 0 );
+
+  strlike bname(name), bunit(""), bcomment(comment);
+  dmDescriptor* desc = dmKeyWrite_d(m_block, bname(), val, bunit(),
+				    bcomment());
+
+  return( desc != 0 );
+}
+
+void dm::block::copy_wcs_from(const block* other)
+{
+  assert( m_block != 0 && other->m_block != 0 );
+
+  dmBlockCopyWCS(other->m_block, m_block);
+}
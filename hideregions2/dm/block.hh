@@ -13,6 +13,12 @@ namespace dm {
 
     // read a double key with name, return false if not found
     bool read_key(const std::string& name, double* ret);
+    // write a double key, returning false on failure
+    bool write_key(const std::string& name, double val,
+		   const std::string& comment = "");
+
+    // copy the world coordinate system from another block
+    void copy_wcs_from(const block* other);
 
   protected:
     block(dmBlock *init) { m_block = init; }
@@ -0,0 +1,812 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <map>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "exception.hh"
+#include "fitsheader.hh"
+#include "parallel.hh"
+#include "tilecodec.hh"
+#include "compimage.hh"
+
+namespace
+{
+  void throw_invalid(const std::string& descr)
+  {
+    dm::except_invalid_param e;
+    e.set_descr(descr);
+    throw e;
+  }
+
+  // read header at offset, returning offset of following data
+  bool read_header(int fd, off_t offset, dm::fits_header* keys,
+		   off_t* dataoffset)
+  {
+    keys->clear();
+    char block[dm::fits_block];
+    for(bool first=true; ; first=false) {
+      if( pread(fd, block, dm::fits_block, offset) !=
+	  ssize_t(dm::fits_block) )
+	return false;
+      if( first && ! dm::fits_header::is_header_start(block) )
+	return false;
+      offset += dm::fits_block;
+      if( keys->add_block(block) ) {
+	*dataoffset = offset;
+	return true;
+      }
+    }
+  }
+
+  // find header of first compressed image in file
+  bool find_compressed(int fd, dm::fits_header* keys, off_t* dataoffset)
+  {
+    off_t offset = 0;
+    while( read_header(fd, offset, keys, dataoffset) ) {
+      if( keys->get_str("XTENSION") == "BINTABLE" &&
+	  keys->get_str("ZIMAGE") == "T" )
+	return true;
+      offset = *dataoffset + keys->data_size();
+    }
+    return false;
+  }
+
+  // a column in a binary table
+  struct column
+  {
+    column() : type(0), offset(-1) {}
+    char type;        // type of item, or P or Q for descriptors
+    long long offset; // offset in row
+  };
+
+  // parse column definitions, returning those we're interested in
+  void parse_columns(const dm::fits_header& keys,
+		     std::map<std::string, column>* cols)
+  {
+    const long long nfields = keys.get_int("TFIELDS", 0);
+    long long offset = 0;
+    for(long long i=1; i<=nfields; ++i) {
+      const std::string num = dm::to_str(int(i));
+      const std::string form = keys.get_str("TFORM" + num);
+
+      size_t p = 0;
+      long long repeat = 0;
+      while( p < form.size() && form[p] >= '0' && form[p] <= '9' )
+	repeat = repeat*10 + (form[p++] - '0');
+      if( p == 0 )
+	repeat = 1;
+      if( p >= form.size() )
+	throw_invalid("Invalid TFORM in compressed image");
+
+      const char type = form[p];
+      long long size;
+      switch( type ) {
+      case 'L': case 'B': case 'A': size = repeat; break;
+      case 'X': size = (repeat+7)/8; break;
+      case 'I': size = repeat*2; break;
+      case 'J': case 'E': size = repeat*4; break;
+      case 'K': case 'D': case 'C': case 'P': size = repeat*8; break;
+      case 'M': case 'Q': size = repeat*16; break;
+      default:
+	throw_invalid("Invalid TFORM in compressed image");
+      }
+
+      column c;
+      c.type = type;
+      c.offset = offset;
+      (*cols)[keys.get_str("TTYPE" + num)] = c;
+      offset += size;
+    }
+  }
+
+  // big endian conversion
+  inline unsigned long long get_be(const unsigned char* p, unsigned n)
+  {
+    unsigned long long v = 0;
+    for(unsigned i=0; i<n; ++i)
+      v = (v << 8) | p[i];
+    return v;
+  }
+
+  inline void put_be(unsigned char* p, unsigned long long v, unsigned n)
+  {
+    for(unsigned i=0; i<n; ++i)
+      p[i] = (unsigned char)(v >> (8*(n-1-i)));
+  }
+
+  inline double get_be_real(const unsigned char* p, char type)
+  {
+    if( type == 'E' ) {
+      const unsigned u = unsigned(get_be(p, 4));
+      float f;
+      std::memcpy(&f, &u, 4);
+      return f;
+    } else {
+      const unsigned long long u = get_be(p, 8);
+      double d;
+      std::memcpy(&d, &u, 8);
+      return d;
+    }
+  }
+
+  inline void put_be_real(unsigned char* p, double v, int bitpix)
+  {
+    if( bitpix == -32 ) {
+      const float f = float(v);
+      unsigned u;
+      std::memcpy(&u, &f, 4);
+      put_be(p, u, 4);
+    } else {
+      unsigned long long u;
+      std::memcpy(&u, &v, 8);
+      put_be(p, u, 8);
+    }
+  }
+
+  // read descriptor of variable length array in row
+  void get_descriptor(const unsigned char* row, const column& col,
+		      long long* nelem, long long* offset)
+  {
+    if( col.type == 'P' ) {
+      *nelem = get_be(row+col.offset, 4);
+      *offset = get_be(row+col.offset+4, 4);
+    } else {
+      *nelem = get_be(row+col.offset, 8);
+      *offset = get_be(row+col.offset+8, 8);
+    }
+  }
+
+  // integer types are stored with an offset if unsigned
+  template<class T> struct storage {};
+  template<> struct storage<unsigned char>
+  { static const int bitpix = 8; static double bzero() { return 0; } };
+  template<> struct storage<short>
+  { static const int bitpix = 16; static double bzero() { return 0; } };
+  template<> struct storage<unsigned short>
+  { static const int bitpix = 16; static double bzero() { return 32768.; } };
+  template<> struct storage<long>
+  { static const int bitpix = 32; static double bzero() { return 0; } };
+  template<> struct storage<unsigned long>
+  { static const int bitpix = 32;
+    static double bzero() { return 2147483648.; } };
+  template<> struct storage<float>
+  { static const int bitpix = -32; static double bzero() { return 0; } };
+  template<> struct storage<double>
+  { static const int bitpix = -64; static double bzero() { return 0; } };
+
+  inline int nint(double v)
+  {
+    return v >= 0 ? int(v+0.5) : int(v-0.5);
+  }
+
+  // quantise a tile of values with subtractive dithering, returning
+  // false if this isn't possible. With dither 2, zeros are kept exactly
+  // and the integers start just above the reserved values (as fpack)
+  bool quantise_tile(const std::vector<double>& vals, unsigned tileidx,
+		     long dither0, int dither, float q,
+		     std::vector<int>* ivals, double* zscale, double* zzero)
+  {
+    double minval = std::numeric_limits<double>::infinity();
+    double maxval = -minval;
+    std::vector<double> diffs;
+    diffs.reserve(vals.size());
+    double last = std::numeric_limits<double>::quiet_NaN();
+    for(size_t i=0; i<vals.size(); ++i) {
+      const double v = vals[i];
+      if( ! std::isfinite(v) )
+	continue;
+      minval = std::min(minval, v);
+      maxval = std::max(maxval, v);
+      if( std::isfinite(last) )
+	diffs.push_back(std::fabs(v-last));
+      last = v;
+    }
+
+    if( ! std::isfinite(minval) ) {
+      // no good values
+      *zscale = 1;
+      *zzero = 0;
+      ivals->assign(vals.size(), dm::codec::null_value);
+      return true;
+    }
+
+    // noise from median absolute difference of neighbours
+    if( diffs.empty() )
+      return false;
+    std::nth_element(diffs.begin(), diffs.begin()+diffs.size()/2,
+		     diffs.end());
+    const double sigma = diffs[diffs.size()/2] * 1.0484;
+    const double delta = sigma / q;
+    if( ! (delta > 0) || (maxval-minval)/delta > 2147483000. )
+      return false;
+
+    *zscale = delta;
+    *zzero = dither == 2 ?
+      minval - delta*(double(dm::codec::null_value) + 10) : minval;
+
+    const float* randoms = dm::codec::dither_randoms();
+    const unsigned nrand = dm::codec::dither_nrandom;
+    unsigned iseed = unsigned((tileidx + dither0 - 1) % nrand);
+    unsigned nextrand = unsigned(randoms[iseed] * 500);
+
+    ivals->resize(vals.size());
+    for(size_t i=0; i<vals.size(); ++i) {
+      const double v = vals[i];
+      if( ! std::isfinite(v) )
+	(*ivals)[i] = dm::codec::null_value;
+      else if( dither == 2 && v == 0 )
+	(*ivals)[i] = dm::codec::zero_value;
+      else
+	(*ivals)[i] = nint((v - *zzero)/delta + randoms[nextrand] - 0.5);
+
+      if( ++nextrand == nrand ) {
+	if( ++iseed == nrand )
+	  iseed = 0;
+	nextrand = unsigned(randoms[iseed] * 500);
+      }
+    }
+    return true;
+  }
+
+  // compress integer values
+  void encode_ints(const std::vector<int>& ivals, unsigned bytepix,
+		   dm::tile_codec codec, dm::codec::bytes* out)
+  {
+    if( codec == dm::codec_rice )
+      dm::codec::rice_encode(&ivals[0], ivals.size(), bytepix, 32, out);
+    else {
+      std::vector<unsigned char> raw(ivals.size()*bytepix);
+      for(size_t i=0; i<ivals.size(); ++i)
+	put_be(&raw[i*bytepix], unsigned(ivals[i]), bytepix);
+      dm::codec::gzip_encode(&raw[0], raw.size(), out);
+    }
+  }
+
+  // compress floating point values without loss
+  void encode_reals(const std::vector<double>& vals, int bitpix,
+		    bool shuffle, dm::codec::bytes* out)
+  {
+    const unsigned bytepix = std::abs(bitpix)/8;
+    std::vector<unsigned char> raw(vals.size()*bytepix);
+    for(size_t i=0; i<vals.size(); ++i)
+      put_be_real(&raw[i*bytepix], vals[i], bitpix);
+    if( shuffle )
+      dm::codec::shuffle(&raw[0], vals.size(), bytepix);
+    dm::codec::gzip_encode(&raw[0], raw.size(), out);
+  }
+}
+
+dm::compressed_image::compressed_image(const std::string& filename)
+  : m_filename(filename), m_fd(-1), m_threads(0)
+{
+  m_fd = ::open(filename.c_str(), O_RDONLY);
+  if( m_fd < 0 ) {
+    except_unable_to_open e;
+    e.set_descr("Cannot open file " + filename);
+    throw e;
+  }
+
+  try {
+    dm::fits_header keys;
+    off_t dataoffset;
+    if( ! find_compressed(m_fd, &keys, &dataoffset) )
+      throw_invalid("No compressed image in " + filename);
+
+    // image properties
+    const long long znaxis = keys.get_int("ZNAXIS", 0);
+    m_xw = unsigned(keys.get_int("ZNAXIS1", 0));
+    m_yw = unsigned(keys.get_int("ZNAXIS2", 1));
+    if( znaxis < 1 || znaxis > 3 ||
+	(znaxis == 3 && keys.get_int("ZNAXIS3", 1) != 1) )
+      throw_invalid("Compressed image is not 2D in " + filename);
+    if( znaxis == 1 )
+      m_yw = 1;
+
+    m_bitpix = int(keys.get_int("ZBITPIX", 0));
+    m_tile_xw = unsigned(std::min(keys.get_int("ZTILE1", m_xw),
+				  (long long)(m_xw)));
+    m_tile_yw = unsigned(std::min(keys.get_int("ZTILE2", 1),
+				  (long long)(m_yw)));
+    if( m_tile_xw == 0 || m_tile_yw == 0 )
+      throw_invalid("Invalid tile size in " + filename);
+    m_ntile_x = (m_xw + m_tile_xw - 1) / m_tile_xw;
+    const unsigned ntile_y = (m_yw + m_tile_yw - 1) / m_tile_yw;
+
+    m_cmptype = keys.get_str("ZCMPTYPE");
+    if( m_cmptype == "RICE_ONE" )
+      m_cmptype = "RICE_1";
+    if( m_cmptype != "RICE_1" && m_cmptype != "GZIP_1" &&
+	m_cmptype != "GZIP_2" )
+      throw_invalid("Unsupported compression " + m_cmptype + " in " +
+		    filename);
+
+    // compression parameters
+    m_blocksize = 32;
+    m_bytepix = m_bitpix > 0 ? m_bitpix/8 : 4;
+    for(int i=1; keys.has("ZNAME" + to_str(i)); ++i) {
+      const std::string name = keys.get_str("ZNAME" + to_str(i));
+      const long long val = keys.get_int("ZVAL" + to_str(i), 0);
+      if( name == "BLOCKSIZE" )
+	m_blocksize = unsigned(val);
+      else if( name == "BYTEPIX" )
+	m_bytepix = unsigned(val);
+    }
+
+    const std::string quantiz = keys.get_str("ZQUANTIZ", "NO_DITHER");
+    m_dither = quantiz == "SUBTRACTIVE_DITHER_1" ? 1 :
+      quantiz == "SUBTRACTIVE_DITHER_2" ? 2 : 0;
+    m_dither0 = long(keys.get_int("ZDITHER0", 1));
+
+    m_have_blank = keys.has("ZBLANK");
+    m_blank = int(keys.get_int("ZBLANK", 0));
+    m_bscale = keys.get_double("BSCALE", 1);
+    m_bzero = keys.get_double("BZERO", 0);
+
+    // columns with tile data
+    std::map<std::string, column> cols;
+    parse_columns(keys, &cols);
+    const column cdata = cols["COMPRESSED_DATA"];
+    const column cgzip = cols["GZIP_COMPRESSED_DATA"];
+    const column cscale = cols["ZSCALE"];
+    const column czero = cols["ZZERO"];
+    const column cblank = cols["ZBLANK"];
+    if( cdata.offset < 0 )
+      throw_invalid("No compressed data column in " + filename);
+    if( cblank.offset >= 0 )
+      m_have_blank = true;
+    const double zscale = keys.get_double("ZSCALE", 1);
+    const double zzero = keys.get_double("ZZERO", 0);
+    m_quantised = m_bitpix < 0 &&
+      (cscale.offset >= 0 || keys.has("ZSCALE"));
+
+    // read table, with tile locations
+    const long long rowbytes = keys.get_int("NAXIS1", 0);
+    const long long nrows = keys.get_int("NAXIS2", 0);
+    if( nrows != (long long)(m_ntile_x) * ntile_y )
+      throw_invalid("Number of tiles not matched in " + filename);
+
+    std::vector<unsigned char> table(rowbytes*nrows);
+    if( ! table.empty() &&
+	pread(m_fd, &table[0], table.size(), dataoffset) !=
+	ssize_t(table.size()) )
+      throw_invalid("Cannot read table in " + filename);
+    m_heap_start = dataoffset + keys.get_int("THEAP", rowbytes*nrows);
+
+    m_tiles.resize(nrows);
+    for(long long i=0; i<nrows; ++i) {
+      const unsigned char* row = &table[i*rowbytes];
+      tile& t = m_tiles[i];
+      get_descriptor(row, cdata, &t.nbytes, &t.offset);
+      t.gz_nbytes = 0;
+      t.gz_offset = 0;
+      if( cgzip.offset >= 0 )
+	get_descriptor(row, cgzip, &t.gz_nbytes, &t.gz_offset);
+      t.zscale = cscale.offset >= 0 ?
+	get_be_real(row+cscale.offset, cscale.type) : zscale;
+      t.zzero = czero.offset >= 0 ?
+	get_be_real(row+czero.offset, czero.type) : zzero;
+      t.zblank = cblank.offset >= 0 ?
+	int(get_be(row+cblank.offset, 4)) : m_blank;
+    }
+  } catch( ... ) {
+    ::close(m_fd);
+    throw;
+  }
+}
+
+dm::compressed_image::~compressed_image()
+{
+  ::close(m_fd);
+}
+
+void dm::compressed_image::get_dimensions(pix_vec* retn) const
+{
+  retn->clear();
+  retn->push_back(m_xw);
+  retn->push_back(m_yw);
+}
+
+// decompress tile idx into out
+void dm::compressed_image::decode_tile(unsigned idx,
+				       std::vector<unsigned char>* buf,
+				       std::vector<int>* ivals,
+				       double* out) const
+{
+  const tile& t = m_tiles[idx];
+  const unsigned tx = idx % m_ntile_x, ty = idx / m_ntile_x;
+  const unsigned npix =
+    std::min(m_tile_xw, m_xw - tx*m_tile_xw) *
+    std::min(m_tile_yw, m_yw - ty*m_tile_yw);
+
+  // tile which couldn't be quantised, stored with gzip
+  const bool gzipped = t.nbytes == 0 && t.gz_nbytes > 0;
+
+  const long long nbytes = gzipped ? t.gz_nbytes : t.nbytes;
+  buf->resize(nbytes + 1);
+  if( pread(m_fd, &(*buf)[0], nbytes,
+	    m_heap_start + (gzipped ? t.gz_offset : t.offset)) !=
+      ssize_t(nbytes) )
+    throw_invalid("Cannot read tile data from " + m_filename);
+
+  if( gzipped || (m_bitpix < 0 && ! m_quantised) ) {
+    // floating point values without loss
+    const unsigned bytepix = std::abs(m_bitpix)/8;
+    std::vector<unsigned char> raw(npix*bytepix);
+    if( ! codec::gzip_decode(&(*buf)[0], nbytes, &raw[0], raw.size()) )
+      throw_invalid("Corrupt tile in " + m_filename);
+    if( ! gzipped && m_cmptype == "GZIP_2" )
+      codec::unshuffle(&raw[0], npix, bytepix);
+    const char type = m_bitpix == -32 ? 'E' : 'D';
+    for(unsigned i=0; i<npix; ++i)
+      out[i] = get_be_real(&raw[i*bytepix], type);
+    return;
+  }
+
+  // integer values
+  ivals->resize(npix);
+  int* iv = &(*ivals)[0];
+  const unsigned bytepix = m_quantised ? 4 : m_bitpix/8;
+  if( m_cmptype == "RICE_1" ) {
+    if( ! codec::rice_decode(&(*buf)[0], nbytes, m_bytepix, m_blocksize,
+			     iv, npix) )
+      throw_invalid("Corrupt tile in " + m_filename);
+  } else {
+    std::vector<unsigned char> raw(npix*bytepix);
+    if( ! codec::gzip_decode(&(*buf)[0], nbytes, &raw[0], raw.size()) )
+      throw_invalid("Corrupt tile in " + m_filename);
+    if( m_cmptype == "GZIP_2" )
+      codec::unshuffle(&raw[0], npix, bytepix);
+    for(unsigned i=0; i<npix; ++i) {
+      const unsigned v = unsigned(get_be(&raw[i*bytepix], bytepix));
+      iv[i] = bytepix == 2 ? int(short(v)) : int(v);
+    }
+  }
+
+  if( ! m_quantised ) {
+    for(unsigned i=0; i<npix; ++i) {
+      // 8 bit values are unsigned
+      const int v = m_bitpix == 8 ? (iv[i] & 0xff) : iv[i];
+      if( m_have_blank && v == t.zblank )
+	out[i] = std::numeric_limits<double>::quiet_NaN();
+      else
+	out[i] = v*m_bscale + m_bzero;
+    }
+    return;
+  }
+
+  // undo quantisation
+  const double nan = std::numeric_limits<double>::quiet_NaN();
+  if( m_dither == 0 ) {
+    for(unsigned i=0; i<npix; ++i)
+      out[i] = m_have_blank && iv[i] == t.zblank ?
+	nan : iv[i]*t.zscale + t.zzero;
+    return;
+  }
+
+  const float* randoms = codec::dither_randoms();
+  const unsigned nrand = codec::dither_nrandom;
+  unsigned iseed = unsigned((idx + m_dither0 - 1) % nrand);
+  unsigned nextrand = unsigned(randoms[iseed] * 500);
+  for(unsigned i=0; i<npix; ++i) {
+    if( m_have_blank && iv[i] == t.zblank )
+      out[i] = nan;
+    else if( m_dither == 2 && iv[i] == codec::zero_value )
+      out[i] = 0;
+    else
+      // in double, as with SUBTRACTIVE_DITHER_2 the integers are
+      // near -2^31
+      out[i] = (double(iv[i]) - double(randoms[nextrand]) + 0.5)*
+	double(t.zscale) + double(t.zzero);
+
+    if( ++nextrand == nrand ) {
+      if( ++iseed == nrand )
+	iseed = 0;
+      nextrand = unsigned(randoms[iseed] * 500);
+    }
+  }
+}
+
+// read region of image (0-based) into out, decompressing only
+// overlapping tiles
+void dm::compressed_image::read_tiles(unsigned x0, unsigned y0,
+				      unsigned xw, unsigned yw,
+				      double* out) const
+{
+  const unsigned tx0 = x0 / m_tile_xw, tx1 = (x0+xw-1) / m_tile_xw;
+  const unsigned ty0 = y0 / m_tile_yw, ty1 = (y0+yw-1) / m_tile_yw;
+  const unsigned ntx = tx1-tx0+1;
+  const size_t ntiles = size_t(ntx) * (ty1-ty0+1);
+
+  const unsigned nworkers = dm::no_workers(m_threads, ntiles);
+  std::vector< std::vector<unsigned char> > bufs(nworkers);
+  std::vector< std::vector<int> > ivals(nworkers);
+  std::vector< std::vector<double> > tilevals(nworkers);
+
+  dm::parallel_items
+    (m_threads, ntiles,
+     [&](size_t i, unsigned w) {
+      const unsigned tx = tx0 + unsigned(i % ntx);
+      const unsigned ty = ty0 + unsigned(i / ntx);
+      const unsigned idx = ty*m_ntile_x + tx;
+
+      std::vector<double>& vals = tilevals[w];
+      vals.resize(size_t(m_tile_xw)*m_tile_yw);
+      decode_tile(idx, &bufs[w], &ivals[w], &vals[0]);
+
+      // copy overlapping part of tile
+      const unsigned ox = tx*m_tile_xw, oy = ty*m_tile_yw;
+      const unsigned txw = std::min(m_tile_xw, m_xw-ox);
+      const unsigned tyw = std::min(m_tile_yw, m_yw-oy);
+      const unsigned sx0 = std::max(ox, x0), sx1 = std::min(ox+txw, x0+xw);
+      const unsigned sy0 = std::max(oy, y0), sy1 = std::min(oy+tyw, y0+yw);
+      for(unsigned y=sy0; y<sy1; ++y) {
+	const double* src = &vals[size_t(y-oy)*txw + (sx0-ox)];
+	std::copy(src, src + (sx1-sx0),
+		  out + size_t(y-y0)*xw + (sx0-x0));
+      }
+    });
+}
+
+template<class T> void dm::compressed_image::create_memimage(memimage<T> **im)
+{
+  pix_vec lower, upper;
+  lower.push_back(1); lower.push_back(1);
+  get_dimensions(&upper);
+  get_subarray(lower, upper, im);
+}
+
+template<class T>
+void dm::compressed_image::get_subarray(const pix_vec& lowerbounds,
+					const pix_vec& upperbounds,
+					memimage<T> **im)
+{
+  if( lowerbounds.size() != 2 || upperbounds.size() != 2 ||
+      lowerbounds[0] < 1 || lowerbounds[1] < 1 ||
+      upperbounds[0] > m_xw || upperbounds[1] > m_yw ||
+      lowerbounds[0] > upperbounds[0] || lowerbounds[1] > upperbounds[1] ) {
+    throw_invalid("Invalid bounds in dm::compressed_image::get_subarray");
+  }
+
+  const unsigned xw = upperbounds[0]-lowerbounds[0]+1;
+  const unsigned yw = upperbounds[1]-lowerbounds[1]+1;
+  std::vector<double> vals(size_t(xw)*yw);
+  read_tiles(lowerbounds[0]-1, lowerbounds[1]-1, xw, yw, &vals[0]);
+
+  memimage<T>* out = new memimage<T>(xw, yw);
+  T* data = out->data();
+  for(size_t i=0; i<vals.size(); ++i) {
+    const double v = vals[i];
+    if( std::numeric_limits<T>::is_integer )
+      data[i] = std::isfinite(v) ? T(v) : T(0);
+    else
+      data[i] = T(v);
+  }
+  *im = out;
+}
+
+template<class T>
+void dm::compressed_image::write(const std::string& filename,
+				 const memimage<T>& im,
+				 const tile_options& opts,
+				 open_mode mode)
+{
+  if( mode != create && mode != create_over )
+    throw_invalid("Invalid mode in dm::compressed_image::write");
+
+  const int bitpix = storage<T>::bitpix;
+  const double bzero = storage<T>::bzero();
+  const bool quantise = bitpix < 0 && opts.quantize > 0;
+  const unsigned xw = im.xw(), yw = im.yw();
+  if( xw == 0 || yw == 0 )
+    throw_invalid("Empty image in dm::compressed_image::write");
+
+  const unsigned tile_xw = opts.tile_xw == 0 ? xw : std::min(opts.tile_xw, xw);
+  const unsigned tile_yw = std::max(1u, std::min(opts.tile_yw, yw));
+  const unsigned ntile_x = (xw + tile_xw - 1) / tile_xw;
+  const unsigned ntile_y = (yw + tile_yw - 1) / tile_yw;
+  const size_t ntiles = size_t(ntile_x) * ntile_y;
+  const long dither0 = 1;
+
+  // compress the tiles
+  std::vector<codec::bytes> comp(ntiles), gzcomp(ntiles);
+  std::vector<double> zscale(ntiles, 1), zzero(ntiles, 0);
+
+  dm::parallel_items
+    (opts.threads, ntiles,
+     [&](size_t i, unsigned) {
+      const unsigned ox = unsigned(i % ntile_x)*tile_xw;
+      const unsigned oy = unsigned(i / ntile_x)*tile_yw;
+      const unsigned txw = std::min(tile_xw, xw-ox);
+      const unsigned tyw = std::min(tile_yw, yw-oy);
+
+      std::vector<double> vals;
+      vals.reserve(size_t(txw)*tyw);
+      for(unsigned y=oy; y<oy+tyw; ++y) {
+	const T* row = im.row(y);
+	for(unsigned x=ox; x<ox+txw; ++x)
+	  vals.push_back(double(row[x]));
+      }
+
+      std::vector<int> ivals;
+      if( quantise ) {
+	if( quantise_tile(vals, unsigned(i), dither0, opts.dither,
+			  opts.quantize, &ivals, &zscale[i], &zzero[i]) )
+	  encode_ints(ivals, 4, opts.codec, &comp[i]);
+	else
+	  encode_reals(vals, bitpix, false, &gzcomp[i]);
+      } else if( bitpix < 0 ) {
+	encode_reals(vals, bitpix, true, &comp[i]);
+      } else {
+	ivals.resize(vals.size());
+	for(size_t j=0; j<vals.size(); ++j)
+	  ivals[j] = int((long long)(vals[j] - bzero));
+	encode_ints(ivals, bitpix/8, opts.codec, &comp[i]);
+      }
+    });
+
+  // layout of heap
+  std::vector<long long> offsets(ntiles), gzoffsets(ntiles);
+  long long heapsize = 0, maxlen = 0;
+  for(size_t i=0; i<ntiles; ++i) {
+    offsets[i] = heapsize;
+    heapsize += comp[i].size();
+    gzoffsets[i] = heapsize;
+    heapsize += gzcomp[i].size();
+    maxlen = std::max(maxlen,
+		      (long long)(std::max(comp[i].size(), gzcomp[i].size())));
+  }
+  // use 64 bit descriptors if needed
+  const bool bigheap = heapsize > 2147483647LL;
+  const unsigned descsize = bigheap ? 16 : 8;
+  const std::string dform = std::string(bigheap ? "1QB(" : "1PB(") +
+    to_str(int(maxlen)) + ")";
+  const unsigned rowbytes = quantise ? 2*descsize + 16 : descsize;
+
+  std::string cmptype;
+  if( bitpix < 0 && ! quantise )
+    cmptype = "GZIP_2";
+  else
+    cmptype = opts.codec == codec_rice ? "RICE_1" : "GZIP_1";
+
+  // headers
+  std::vector<std::string> cards;
+  cards.push_back(fits_card_bool("SIMPLE", true, "file conforms to FITS"));
+  cards.push_back(fits_card_int("BITPIX", 8));
+  cards.push_back(fits_card_int("NAXIS", 0));
+  cards.push_back(fits_card_bool("EXTEND", true));
+  std::string out = fits_header_block(cards);
+
+  cards.clear();
+  cards.push_back(fits_card_str("XTENSION", "BINTABLE",
+				"binary table extension"));
+  cards.push_back(fits_card_int("BITPIX", 8));
+  cards.push_back(fits_card_int("NAXIS", 2));
+  cards.push_back(fits_card_int("NAXIS1", rowbytes, "width of table in bytes"));
+  cards.push_back(fits_card_int("NAXIS2", ntiles, "number of tiles"));
+  cards.push_back(fits_card_int("PCOUNT", heapsize, "size of heap"));
+  cards.push_back(fits_card_int("GCOUNT", 1));
+  cards.push_back(fits_card_int("TFIELDS", quantise ? 4 : 1));
+  cards.push_back(fits_card_str("TTYPE1", "COMPRESSED_DATA"));
+  cards.push_back(fits_card_str("TFORM1", dform));
+  if( quantise ) {
+    cards.push_back(fits_card_str("TTYPE2", "GZIP_COMPRESSED_DATA"));
+    cards.push_back(fits_card_str("TFORM2", dform));
+    cards.push_back(fits_card_str("TTYPE3", "ZSCALE"));
+    cards.push_back(fits_card_str("TFORM3", "1D"));
+    cards.push_back(fits_card_str("TTYPE4", "ZZERO"));
+    cards.push_back(fits_card_str("TFORM4", "1D"));
+  }
+  cards.push_back(fits_card_bool("ZIMAGE", true, "compressed image"));
+  cards.push_back(fits_card_bool("ZSIMPLE", true));
+  cards.push_back(fits_card_int("ZBITPIX", bitpix));
+  cards.push_back(fits_card_int("ZNAXIS", 2));
+  cards.push_back(fits_card_int("ZNAXIS1", xw));
+  cards.push_back(fits_card_int("ZNAXIS2", yw));
+  cards.push_back(fits_card_int("ZTILE1", tile_xw));
+  cards.push_back(fits_card_int("ZTILE2", tile_yw));
+  cards.push_back(fits_card_str("ZCMPTYPE", cmptype));
+  if( cmptype == "RICE_1" ) {
+    cards.push_back(fits_card_str("ZNAME1", "BLOCKSIZE"));
+    cards.push_back(fits_card_int("ZVAL1", 32));
+    cards.push_back(fits_card_str("ZNAME2", "BYTEPIX"));
+    cards.push_back(fits_card_int("ZVAL2", quantise ? 4 : bitpix/8));
+  }
+  if( quantise ) {
+    cards.push_back(fits_card_str("ZQUANTIZ", opts.dither == 2 ?
+				  "SUBTRACTIVE_DITHER_2" :
+				  "SUBTRACTIVE_DITHER_1"));
+    cards.push_back(fits_card_int("ZDITHER0", dither0));
+    cards.push_back(fits_card_int("ZBLANK", codec::null_value));
+  }
+  if( bzero != 0 ) {
+    cards.push_back(fits_card_real("BSCALE", 1));
+    cards.push_back(fits_card_real("BZERO", bzero));
+  }
+  cards.push_back(fits_card_str("EXTNAME", "COMPRESSED_IMAGE"));
+  out += fits_header_block(cards);
+
+  // table
+  std::string table(size_t(rowbytes)*ntiles, '\0');
+  for(size_t i=0; i<ntiles; ++i) {
+    unsigned char* row = reinterpret_cast<unsigned char*>(&table[i*rowbytes]);
+    const unsigned w = descsize/2;
+    put_be(row, comp[i].size(), w);
+    put_be(row+w, offsets[i], w);
+    if( quantise ) {
+      put_be(row+descsize, gzcomp[i].size(), w);
+      put_be(row+descsize+w, gzoffsets[i], w);
+      put_be_real(row+2*descsize, zscale[i], -64);
+      put_be_real(row+2*descsize+8, zzero[i], -64);
+    }
+  }
+
+  const int flags = O_WRONLY | O_CREAT | (mode == create ? O_EXCL : O_TRUNC);
+  const int fd = ::open(filename.c_str(), flags, 0666);
+  if( fd < 0 ) {
+    except_unable_to_create e;
+    e.set_descr("Cannot create file " + filename);
+    throw e;
+  }
+
+  bool ok = ::write(fd, out.data(), out.size()) == ssize_t(out.size()) &&
+    ::write(fd, table.data(), table.size()) == ssize_t(table.size());
+  for(size_t i=0; i<ntiles && ok; ++i) {
+    if( ! comp[i].empty() )
+      ok = ::write(fd, &comp[i][0], comp[i].size()) == ssize_t(comp[i].size());
+    if( ok && ! gzcomp[i].empty() )
+      ok = ::write(fd, &gzcomp[i][0], gzcomp[i].size()) ==
+	ssize_t(gzcomp[i].size());
+  }
+  // pad to block
+  const long long datasize = (long long)(table.size()) + heapsize;
+  const std::string pad((fits_block - datasize % fits_block) % fits_block,
+			'\0');
+  if( ok && ! pad.empty() )
+    ok = ::write(fd, pad.data(), pad.size()) == ssize_t(pad.size());
+  ok = (::close(fd) == 0) && ok;
+
+  if( ! ok ) {
+    except_unable_to_create e;
+    e.set_descr("Error writing file " + filename);
+    throw e;
+  }
+}
+
+bool dm::compressed_image::is_compressed(const std::string& filename)
+{
+  const int fd = ::open(filename.c_str(), O_RDONLY);
+  if( fd < 0 )
+    return false;
+  dm::fits_header keys;
+  off_t dataoffset;
+  const bool found = find_compressed(fd, &keys, &dataoffset);
+  ::close(fd);
+  return found;
+}
+
+#define DM_DEFINE_TEMPL(TYPE) \
+ template void \
+  dm::compressed_image::create_memimage(memimage<TYPE> **im); \
+ template void \
+  dm::compressed_image::get_subarray(const pix_vec& lowerbounds, \
+				     const pix_vec& upperbounds, \
+				     memimage<TYPE> **im); \
+ template void \
+  dm::compressed_image::write(const std::string& filename, \
+			      const memimage<TYPE>& im, \
+			      const tile_options& opts, \
+			      open_mode mode);
+
+DM_DEFINE_TEMPL(short)
+DM_DEFINE_TEMPL(long)
+DM_DEFINE_TEMPL(float)
+DM_DEFINE_TEMPL(double)
+DM_DEFINE_TEMPL(unsigned char)
+DM_DEFINE_TEMPL(unsigned short)
+DM_DEFINE_TEMPL(unsigned long)
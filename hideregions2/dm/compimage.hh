@@ -0,0 +1,113 @@
+#ifndef DM_COMPIMAGE_HH
+#define DM_COMPIMAGE_HH
+
+#include <string>
+#include <vector>
+
+#include "general.hh"
+#include "memimage.hh"
+
+namespace dm
+{
+  // compression algorithm for tiles
+  enum tile_codec { codec_rice, codec_gzip };
+
+  // options for writing tile-compressed images
+  struct tile_options
+  {
+    tile_options()
+      : codec(codec_rice), tile_xw(0), tile_yw(1), quantize(16),
+	dither(1), threads(0)
+    {}
+
+    tile_codec codec;
+    // size of tiles (tile_xw=0 means the image width)
+    unsigned tile_xw, tile_yw;
+    // floating point values are dithered and quantised to noise/quantize
+    // in each tile. quantize=0 stores them losslessly with gzip
+    float quantize;
+    // SUBTRACTIVE_DITHER_1 or 2 (2 keeps zero values exactly)
+    int dither;
+    // threads compressing tiles (0 is the number of cores)
+    unsigned threads;
+  };
+
+  // image stored using the FITS tiled image compression convention
+  // (as written by fpack). This is read and written directly, as the
+  // DM doesn't handle it. Only the tiles needed are read and they are
+  // decompressed in parallel.
+  //
+  // supported are RICE_1, GZIP_1 and GZIP_2 with 2D images, and
+  // quantised floating point images with and without dithering
+  class compressed_image
+  {
+  public:
+    // open the first compressed image in the file
+    compressed_image(const std::string& filename);
+    ~compressed_image();
+
+    void get_dimensions(pix_vec* retn) const;
+
+    // threads decompressing tiles (0 is the number of cores)
+    void set_threads(unsigned n) { m_threads = n; }
+
+    // read the whole image
+    template<class T> void create_memimage(memimage<T> **im);
+    // read part of image (bounds inclusive and starting at 1)
+    template<class T> void get_subarray(const pix_vec& lowerbounds,
+					const pix_vec& upperbounds,
+					memimage<T> **im);
+
+  public:
+    // static functions
+
+    // write image to file as a compressed image
+    template<class T> static void write(const std::string& filename,
+					const memimage<T>& im,
+					const tile_options& opts
+					= tile_options(),
+					open_mode mode = create_over);
+
+    // does the file contain a compressed image?
+    static bool is_compressed(const std::string& filename);
+
+  private:
+    compressed_image(const compressed_image& other); // disallow copy
+    compressed_image& operator=(const compressed_image& other);
+
+    // location of compressed data for a tile
+    struct tile
+    {
+      long long nbytes, offset;        // in heap
+      long long gz_nbytes, gz_offset;  // gzipped unquantised data
+      double zscale, zzero;
+      int zblank;
+    };
+
+    void read_tiles(unsigned x0, unsigned y0, unsigned xw, unsigned yw,
+		    double* out) const;
+    void decode_tile(unsigned idx, std::vector<unsigned char>* buf,
+		     std::vector<int>* ivals, double* out) const;
+
+  private:
+    std::string m_filename;
+    int m_fd;
+    unsigned m_threads;
+
+    unsigned m_xw, m_yw, m_tile_xw, m_tile_yw, m_ntile_x;
+    int m_bitpix;
+    bool m_quantised;
+    std::string m_cmptype;
+    unsigned m_blocksize, m_bytepix;
+    int m_dither;
+    long m_dither0;
+    bool m_have_blank;
+    int m_blank;
+    double m_bscale, m_bzero;
+    long long m_heap_start;
+
+    std::vector<tile> m_tiles;
+  };
+}
+
+#endif
@@ -0,0 +1,556 @@
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <stdint.h>
+
+#include "convert.hh"
+#include "exception.hh"
+#include "parallel.hh"
+
+// kernels are compiled for several instruction sets on x86-64 with
+// gcc, and chosen when called
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__)
+#define DM_CONVERT_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+namespace
+{
+  // arrays are split between threads in chunks of this many values,
+  // if there are at least two chunks (a multiple of 64, so chunks of
+  // bits start on a word)
+  const size_t chunk_size = size_t(1) << 19;
+
+  // values are byte swapped into a buffer of this size on the stack
+  const size_t swap_block = 1024;
+
+  enum cpu_level { cpu_default, cpu_avx2, cpu_avx512 };
+
+  cpu_level get_cpu_level()
+  {
+#ifdef DM_CONVERT_X86
+    static const cpu_level level = []() {
+      __builtin_cpu_init();
+      if( __builtin_cpu_supports("avx512f") &&
+	  __builtin_cpu_supports("avx512bw") &&
+	  __builtin_cpu_supports("avx512dq") &&
+	  __builtin_cpu_supports("avx512vl") )
+	return cpu_avx512;
+      if( __builtin_cpu_supports("avx2") )
+	return cpu_avx2;
+      return cpu_default;
+    }();
+    return level;
+#else
+    return cpu_default;
+#endif
+  }
+
+  // does the CPU have the half precision conversion instructions?
+  bool have_f16c()
+  {
+#ifdef DM_CONVERT_X86
+    static const bool f16c = []() {
+      unsigned a, b, c, d;
+      return __get_cpuid(1, &a, &b, &c, &d) && (c & bit_F16C) != 0 &&
+	get_cpu_level() != cpu_default;
+    }();
+    return f16c;
+#else
+    return false;
+#endif
+  }
+
+  // unsigned integer of the same size as T, for byte swapping
+  template<int N> struct uint_of_size {};
+  template<> struct uint_of_size<1> { typedef uint8_t type; };
+  template<> struct uint_of_size<2> { typedef uint16_t type; };
+  template<> struct uint_of_size<4> { typedef uint32_t type; };
+  template<> struct uint_of_size<8> { typedef uint64_t type; };
+
+  inline uint8_t bswap(uint8_t v) { return v; }
+  inline uint16_t bswap(uint16_t v) { return __builtin_bswap16(v); }
+  inline uint32_t bswap(uint32_t v) { return __builtin_bswap32(v); }
+  inline uint64_t bswap(uint64_t v) { return __builtin_bswap64(v); }
+
+  // the loops, written so that the compiler vectorises them
+  template<class T1, class T2> inline __attribute__((always_inline))
+  void convert_loop(T1* __restrict dst, const T2* __restrict src, size_t n)
+  {
+    for(size_t i=0; i<n; ++i)
+      dst[i] = static_cast<T1>(src[i]);
+  }
+
+  // convert big endian values of type R to T, through a buffer so
+  // that dst and src may be the same
+  template<class T, class R> inline __attribute__((always_inline))
+  void big_endian_loop(T* dst, const unsigned char* src, size_t n)
+  {
+    typedef typename uint_of_size<sizeof(R)>::type U;
+    R buf[swap_block];
+    for(size_t i0=0; i0<n; i0+=swap_block) {
+      const size_t nb = std::min(swap_block, n-i0);
+      const unsigned char* __restrict in = src + i0*sizeof(R);
+      R* __restrict out = buf;
+      for(size_t i=0; i<nb; ++i) {
+	U u;
+	std::memcpy(&u, in + i*sizeof(R), sizeof(R));
+	u = bswap(u);
+	std::memcpy(out + i, &u, sizeof(R));
+      }
+      convert_loop(dst+i0, buf, nb);
+    }
+  }
+
+  inline float bits_to_float(uint32_t u)
+  {
+    float f;
+    std::memcpy(&f, &u, sizeof(f));
+    return f;
+  }
+
+  inline uint32_t float_to_bits(float f)
+  {
+    uint32_t u;
+    std::memcpy(&u, &f, sizeof(u));
+    return u;
+  }
+
+  // half precision conversions without branches, so they vectorise
+  // (after F. Giesen's public domain half_to_float_fast and
+  // float_to_half_fast3_rtne)
+  inline __attribute__((always_inline)) float half_value(uint16_t h)
+  {
+    const uint32_t shifted_exp = 0x7c00u << 13;
+    uint32_t o = uint32_t(h & 0x7fff) << 13;
+    const uint32_t exp = o & shifted_exp;
+    o += uint32_t(127 - 15) << 23;
+    // infinity and NaN
+    o += exp == shifted_exp ? uint32_t(128 - 16) << 23 : 0;
+    // zero and subnormals are renormalised
+    const float sub = bits_to_float(o + (1u << 23)) - bits_to_float(113u << 23);
+    o = exp == 0 ? float_to_bits(sub) : o;
+    return bits_to_float(o | (uint32_t(h & 0x8000) << 16));
+  }
+
+  inline __attribute__((always_inline)) uint16_t half_bits(float f)
+  {
+    const uint32_t infty = 255u << 23, f16max = uint32_t(127 + 16) << 23;
+    const uint32_t denorm_magic = uint32_t((127 - 15) + (23 - 10) + 1) << 23;
+
+    uint32_t u = float_to_bits(f);
+    const uint32_t sign = u & 0x80000000u;
+    u ^= sign;
+
+    // results which are subnormal or zero
+    const uint32_t sub = float_to_bits(bits_to_float(u) +
+				       bits_to_float(denorm_magic)) -
+      denorm_magic;
+    // normal results, rounding to nearest even
+    const uint32_t norm = (u + (uint32_t(15 - 127) << 23) + 0xfff +
+			   ((u >> 13) & 1)) >> 13;
+    // too large, infinity or NaN
+    const uint32_t big = u > infty ? 0x7e00 : 0x7c00;
+
+    const uint32_t o = u >= f16max ? big : u < (113u << 23) ? sub : norm;
+    return uint16_t(o | (sign >> 16));
+  }
+
+  inline __attribute__((always_inline))
+  void half_to_float_loop(float* __restrict dst,
+			  const uint16_t* __restrict src, size_t n)
+  {
+    for(size_t i=0; i<n; ++i)
+      dst[i] = half_value(src[i]);
+  }
+
+  inline __attribute__((always_inline))
+  void float_to_half_loop(uint16_t* __restrict dst,
+			  const float* __restrict src, size_t n)
+  {
+    for(size_t i=0; i<n; ++i)
+      dst[i] = half_bits(src[i]);
+  }
+
+  inline __attribute__((always_inline))
+  void scaled_to_float_loop(float* __restrict dst,
+			    const short* __restrict src, size_t n,
+			    float bscale, float bzero)
+  {
+    const float nan = std::numeric_limits<float>::quiet_NaN();
+    for(size_t i=0; i<n; ++i)
+      dst[i] = src[i] == dm::scaled_blank ? nan : src[i]*bscale + bzero;
+  }
+
+  inline __attribute__((always_inline))
+  void float_to_scaled_loop(short* __restrict dst,
+			    const float* __restrict src, size_t n,
+			    float bscale, float bzero)
+  {
+    const float inv = 1.f / bscale;
+    for(size_t i=0; i<n; ++i) {
+      const float v = src[i];
+      // false for NaN and infinite values
+      const bool finite = v - v == 0.f;
+      float q = ((finite ? v : bzero) - bzero) * inv;
+      q = std::min(std::max(q, -32767.f), 32767.f);
+      const short r = short(q + (q >= 0 ? 0.5f : -0.5f));
+      dst[i] = finite ? r : dm::scaled_blank;
+    }
+  }
+
+  // a copy of the kernels for each instruction set
+#define DM_CONVERT_KERNELS(SUFFIX, ATTR) \
+  template<class T1, class T2> ATTR \
+  void convert_##SUFFIX(T1* __restrict dst, const T2* __restrict src, \
+			size_t n) \
+  { convert_loop(dst, src, n); } \
+  template<class T, class R> ATTR \
+  void big_endian_##SUFFIX(T* dst, const unsigned char* src, size_t n) \
+  { big_endian_loop<T, R>(dst, src, n); } \
+  ATTR void scaled_to_float_##SUFFIX(float* dst, const short* src, \
+				     size_t n, float bscale, float bzero) \
+  { scaled_to_float_loop(dst, src, n, bscale, bzero); } \
+  ATTR void float_to_scaled_##SUFFIX(short* dst, const float* src, \
+				     size_t n, float bscale, float bzero) \
+  { float_to_scaled_loop(dst, src, n, bscale, bzero); }
+
+  DM_CONVERT_KERNELS(default, )
+#ifdef DM_CONVERT_X86
+  DM_CONVERT_KERNELS(avx2, __attribute__((target("avx2"))))
+  DM_CONVERT_KERNELS(avx512, __attribute__((target("avx512f,avx512bw,"
+						     "avx512dq,avx512vl"))))
+#endif
+
+#undef DM_CONVERT_KERNELS
+
+  void half_to_float_default(float* dst, const uint16_t* src, size_t n)
+  {
+    half_to_float_loop(dst, src, n);
+  }
+
+  void float_to_half_default(uint16_t* dst, const float* src, size_t n)
+  {
+    float_to_half_loop(dst, src, n);
+  }
+
+  inline __attribute__((always_inline))
+  bool bit_passes(float v, dm::bit_test test)
+  {
+    return test == dm::bits_positive ? v > 0 : (v > 0 || v < 0);
+  }
+
+  void float_to_bits_default(uint64_t* dst, const float* src, size_t n,
+			     dm::bit_test test)
+  {
+    for(size_t w=0; w*64<n; ++w) {
+      const float* s = src + w*64;
+      const size_t nb = std::min(size_t(64), n-w*64);
+      uint64_t b = 0;
+      for(size_t j=0; j<nb; ++j)
+	b |= uint64_t(bit_passes(s[j], test)) << j;
+      dst[w] = b;
+    }
+  }
+
+  void bits_to_float_default(float* dst, const uint64_t* src, size_t n,
+			     float val0, float val1)
+  {
+    for(size_t i=0; i<n; ++i)
+      dst[i] = (src[i >> 6] >> (i & 63)) & 1 ? val1 : val0;
+  }
+
+#ifdef DM_CONVERT_X86
+  // bits with compare and movemask, eight values at a time
+  __attribute__((target("avx2")))
+  void float_to_bits_avx2(uint64_t* dst, const float* src, size_t n,
+			  dm::bit_test test)
+  {
+    const __m256 zero = _mm256_setzero_ps();
+    const size_t nwords = n / 64;
+    for(size_t w=0; w<nwords; ++w) {
+      const float* s = src + w*64;
+      uint64_t b = 0;
+      for(unsigned k=0; k<8; ++k) {
+	const __m256 v = _mm256_loadu_ps(s + 8*k);
+	const __m256 c = test == dm::bits_positive ?
+	  _mm256_cmp_ps(v, zero, _CMP_GT_OQ) :
+	  _mm256_cmp_ps(v, zero, _CMP_NEQ_OQ);
+	b |= uint64_t(unsigned(_mm256_movemask_ps(c))) << (8*k);
+      }
+      dst[w] = b;
+    }
+    float_to_bits_default(dst+nwords, src+nwords*64, n-nwords*64, test);
+  }
+
+  __attribute__((target("avx2")))
+  void bits_to_float_avx2(float* dst, const uint64_t* src, size_t n,
+			  float val0, float val1)
+  {
+    const __m256i bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+    const __m256 v0 = _mm256_set1_ps(val0), v1 = _mm256_set1_ps(val1);
+    size_t i = 0;
+    for(; i+8<=n; i+=8) {
+      const int byte = int((src[i >> 6] >> (i & 63)) & 0xff);
+      const __m256i m = _mm256_and_si256(_mm256_set1_epi32(byte), bits);
+      const __m256 sel = _mm256_castsi256_ps(_mm256_cmpeq_epi32(m, bits));
+      _mm256_storeu_ps(dst+i, _mm256_blendv_ps(v0, v1, sel));
+    }
+    for(; i<n; ++i)
+      dst[i] = (src[i >> 6] >> (i & 63)) & 1 ? val1 : val0;
+  }
+
+  // half precision with the F16C instructions
+  __attribute__((target("avx2,f16c")))
+  void half_to_float_f16c(float* dst, const uint16_t* src, size_t n)
+  {
+    size_t i = 0;
+    for(; i+8<=n; i+=8)
+      _mm256_storeu_ps(dst+i, _mm256_cvtph_ps
+		       (_mm_loadu_si128(reinterpret_cast<const __m128i*>
+					(src+i))));
+    half_to_float_loop(dst+i, src+i, n-i);
+  }
+
+  __attribute__((target("avx2,f16c")))
+  void float_to_half_f16c(uint16_t* dst, const float* src, size_t n)
+  {
+    size_t i = 0;
+    for(; i+8<=n; i+=8)
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(dst+i),
+		       _mm256_cvtps_ph(_mm256_loadu_ps(src+i),
+				       _MM_FROUND_TO_NEAREST_INT));
+    float_to_half_loop(dst+i, src+i, n-i);
+  }
+#endif
+
+  template<class T1, class T2>
+  void convert_block(T1* dst, const T2* src, size_t n)
+  {
+    switch( get_cpu_level() ) {
+#ifdef DM_CONVERT_X86
+    case cpu_avx512: convert_avx512(dst, src, n); break;
+    case cpu_avx2: convert_avx2(dst, src, n); break;
+#endif
+    default: convert_default(dst, src, n); break;
+    }
+  }
+
+  template<class T, class R>
+  void big_endian_block(T* dst, const unsigned char* src, size_t n)
+  {
+    switch( get_cpu_level() ) {
+#ifdef DM_CONVERT_X86
+    case cpu_avx512: big_endian_avx512<T, R>(dst, src, n); break;
+    case cpu_avx2: big_endian_avx2<T, R>(dst, src, n); break;
+#endif
+    default: big_endian_default<T, R>(dst, src, n); break;
+    }
+  }
+
+  void half_to_float_block(float* dst, const uint16_t* src, size_t n)
+  {
+#ifdef DM_CONVERT_X86
+    if( have_f16c() ) {
+      half_to_float_f16c(dst, src, n);
+      return;
+    }
+#endif
+    half_to_float_default(dst, src, n);
+  }
+
+  void float_to_half_block(uint16_t* dst, const float* src, size_t n)
+  {
+#ifdef DM_CONVERT_X86
+    if( have_f16c() ) {
+      float_to_half_f16c(dst, src, n);
+      return;
+    }
+#endif
+    float_to_half_default(dst, src, n);
+  }
+
+  void float_to_bits_block(uint64_t* dst, const float* src, size_t n,
+			   dm::bit_test test)
+  {
+#ifdef DM_CONVERT_X86
+    if( get_cpu_level() != cpu_default ) {
+      float_to_bits_avx2(dst, src, n, test);
+      return;
+    }
+#endif
+    float_to_bits_default(dst, src, n, test);
+  }
+
+  void bits_to_float_block(float* dst, const uint64_t* src, size_t n,
+			   float val0, float val1)
+  {
+#ifdef DM_CONVERT_X86
+    if( get_cpu_level() != cpu_default ) {
+      bits_to_float_avx2(dst, src, n, val0, val1);
+      return;
+    }
+#endif
+    bits_to_float_default(dst, src, n, val0, val1);
+  }
+
+  void scaled_to_float_block(float* dst, const short* src, size_t n,
+			     float bscale, float bzero)
+  {
+    switch( get_cpu_level() ) {
+#ifdef DM_CONVERT_X86
+    case cpu_avx512: scaled_to_float_avx512(dst, src, n, bscale, bzero); break;
+    case cpu_avx2: scaled_to_float_avx2(dst, src, n, bscale, bzero); break;
+#endif
+    default: scaled_to_float_default(dst, src, n, bscale, bzero); break;
+    }
+  }
+
+  void float_to_scaled_block(short* dst, const float* src, size_t n,
+			     float bscale, float bzero)
+  {
+    switch( get_cpu_level() ) {
+#ifdef DM_CONVERT_X86
+    case cpu_avx512: float_to_scaled_avx512(dst, src, n, bscale, bzero); break;
+    case cpu_avx2: float_to_scaled_avx2(dst, src, n, bscale, bzero); break;
+#endif
+    default: float_to_scaled_default(dst, src, n, bscale, bzero); break;
+    }
+  }
+
+  // call func(i0, n) over n values, in chunks split between threads
+  template<class Func> void chunked(size_t n, unsigned threads, Func func)
+  {
+    const size_t nchunks = (n + chunk_size - 1) / chunk_size;
+    if( n == 0 )
+      return;
+    if( threads == 1 || nchunks < 2 )
+      func(size_t(0), n);
+    else
+      dm::parallel_items(threads, nchunks, [&](size_t c, unsigned) {
+	  const size_t i0 = c*chunk_size;
+	  func(i0, std::min(chunk_size, n-i0));
+	});
+  }
+
+  template<class T1, class T2>
+  void convert_any(T1* dst, const T2* src, size_t n, unsigned threads)
+  {
+    chunked(n, threads, [&](size_t i0, size_t nc) {
+	convert_block(dst+i0, src+i0, nc);
+      });
+  }
+
+  // the same types are just copied
+  template<class T>
+  void convert_any(T* dst, const T* src, size_t n, unsigned threads)
+  {
+    if( dst == src )
+      return;
+    chunked(n, threads, [&](size_t i0, size_t nc) {
+	std::memcpy(dst+i0, src+i0, nc*sizeof(T));
+      });
+  }
+
+  template<class T, class R>
+  void big_endian_any(T* dst, const void* src, size_t n, unsigned threads)
+  {
+    const unsigned char* in = static_cast<const unsigned char*>(src);
+    chunked(n, threads, [&](size_t i0, size_t nc) {
+	big_endian_block<T, R>(dst+i0, in+i0*sizeof(R), nc);
+      });
+  }
+}
+
+template<class T> void dm::convert_big_endian(T* dst, const void* src,
+					      int bitpix, size_t n,
+					      unsigned threads)
+{
+  switch( bitpix ) {
+  case 8: big_endian_any<T, unsigned char>(dst, src, n, threads); break;
+  case 16: big_endian_any<T, int16_t>(dst, src, n, threads); break;
+  case 32: big_endian_any<T, int32_t>(dst, src, n, threads); break;
+  case 64: big_endian_any<T, int64_t>(dst, src, n, threads); break;
+  case -32: big_endian_any<T, float>(dst, src, n, threads); break;
+  case -64: big_endian_any<T, double>(dst, src, n, threads); break;
+  default: {
+    except_invalid_param e;
+    e.set_descr("Invalid BITPIX in dm::convert_big_endian");
+    throw e;
+  }
+  }
+}
+
+void dm::half_to_float(float* dst, const uint16_t* src, size_t n,
+		       unsigned threads)
+{
+  chunked(n, threads, [&](size_t i0, size_t nc) {
+      half_to_float_block(dst+i0, src+i0, nc);
+    });
+}
+
+void dm::float_to_half(uint16_t* dst, const float* src, size_t n,
+		       unsigned threads)
+{
+  chunked(n, threads, [&](size_t i0, size_t nc) {
+      float_to_half_block(dst+i0, src+i0, nc);
+    });
+}
+
+void dm::scaled_to_float(float* dst, const short* src, size_t n,
+			 float bscale, float bzero, unsigned threads)
+{
+  chunked(n, threads, [&](size_t i0, size_t nc) {
+      scaled_to_float_block(dst+i0, src+i0, nc, bscale, bzero);
+    });
+}
+
+void dm::float_to_scaled(short* dst, const float* src, size_t n,
+			 float bscale, float bzero, unsigned threads)
+{
+  chunked(n, threads, [&](size_t i0, size_t nc) {
+      float_to_scaled_block(dst+i0, src+i0, nc, bscale, bzero);
+    });
+}
+
+void dm::float_to_bits(uint64_t* dst, const float* src, size_t n,
+		       bit_test test, unsigned threads)
+{
+  chunked(n, threads, [&](size_t i0, size_t nc) {
+      float_to_bits_block(dst+i0/64, src+i0, nc, test);
+    });
+}
+
+void dm::bits_to_float(float* dst, const uint64_t* src, size_t n,
+		       float val0, float val1, unsigned threads)
+{
+  chunked(n, threads, [&](size_t i0, size_t nc) {
+      bits_to_float_block(dst+i0, src+i0/64, nc, val0, val1);
+    });
+}
+
+#define DM_DEFINE_CONVERT(T1, T2) \
+  template<> void dm::convert_array(T1* dst, const T2* src, size_t n, \
+				    unsigned threads) \
+  { convert_any(dst, src, n, threads); }
+
+#define DM_DEFINE_TEMPL(TYPE) \
+  DM_DEFINE_CONVERT(TYPE, short) \
+  DM_DEFINE_CONVERT(TYPE, long) \
+  DM_DEFINE_CONVERT(TYPE, float) \
+  DM_DEFINE_CONVERT(TYPE, double) \
+  DM_DEFINE_CONVERT(TYPE, unsigned char) \
+  DM_DEFINE_CONVERT(TYPE, unsigned short) \
+  DM_DEFINE_CONVERT(TYPE, unsigned long) \
+  template void dm::convert_big_endian(TYPE* dst, const void* src, \
+				       int bitpix, size_t n, \
+				       unsigned threads);
+
+DM_DEFINE_TEMPL(short)
+DM_DEFINE_TEMPL(long)
+DM_DEFINE_TEMPL(float)
+DM_DEFINE_TEMPL(double)
+DM_DEFINE_TEMPL(unsigned char)
+DM_DEFINE_TEMPL(unsigned short)
+DM_DEFINE_TEMPL(unsigned long)
@@ -0,0 +1,91 @@
+#ifndef DM_CONVERT_HH
+#define DM_CONVERT_HH
+
+#include <cstddef>
+#include <stdint.h>
+
+namespace dm
+{
+  // convert n values from src to dst, as static_cast would.
+  //
+  // For the DM types (short, long, float, double, unsigned char,
+  // unsigned short, unsigned long) this uses vectorised kernels,
+  // chosen at run time for the CPU, and large arrays are split between
+  // threads (threads=0 is the number of cores, 1 is no threading).
+  // Other types use this plain loop.
+  template<class T1, class T2> void convert_array(T1* dst, const T2* src,
+						  size_t n,
+						  unsigned threads = 0)
+  {
+    for(size_t i=0; i<n; ++i)
+      dst[i] = static_cast<T1>(src[i]);
+  }
+
+  // convert n big endian values of FITS type bitpix (8, 16, 32, 64,
+  // -32 or -64) to T, without any scaling. dst may be the same as src
+  // if T is the same size as the FITS type. T must be a DM type.
+  template<class T> void convert_big_endian(T* dst, const void* src,
+					    int bitpix, size_t n,
+					    unsigned threads = 0);
+
+  // IEEE half precision values, held as 16 bit integers. Conversion
+  // to half rounds to the nearest value, and values too large become
+  // infinite. F16C instructions are used if the CPU has them.
+  void half_to_float(float* dst, const uint16_t* src, size_t n,
+		     unsigned threads = 0);
+  void float_to_half(uint16_t* dst, const float* src, size_t n,
+		     unsigned threads = 0);
+
+  // 16 bit integers scaled as FITS BSCALE and BZERO (value =
+  // v*bscale + bzero), with scaled_blank for NaN
+  const short scaled_blank = -32768;
+  void scaled_to_float(float* dst, const short* src, size_t n,
+		       float bscale, float bzero, unsigned threads = 0);
+  // the inverse, rounding to the nearest integer and clipping to
+  // +-32767. NaN and infinite values become scaled_blank.
+  void float_to_scaled(short* dst, const float* src, size_t n,
+		       float bscale, float bzero, unsigned threads = 0);
+
+  // tests for packing values into bits
+  enum bit_test
+    {
+      bits_positive,  // value > 0
+      bits_nonzero    // value > 0 or < 0
+    };
+
+  // pack n values into bits, 64 per word: bit i%64 of dst[i/64] is
+  // set if src[i] passes test (never for NaN). Unused bits of the
+  // last word are cleared.
+  void float_to_bits(uint64_t* dst, const float* src, size_t n,
+		     bit_test test, unsigned threads = 0);
+  // the inverse, setting n values to val1 where the bit is set, else
+  // val0
+  void bits_to_float(float* dst, const uint64_t* src, size_t n,
+		     float val0, float val1, unsigned threads = 0);
+
+  // declare the kernels for each pair of types
+#define DM_CONVERT_DECL(T1, T2) \
+  template<> void convert_array(T1* dst, const T2* src, size_t n, \
+				unsigned threads);
+#define DM_CONVERT_DECL_TO(T1) \
+  DM_CONVERT_DECL(T1, short) \
+  DM_CONVERT_DECL(T1, long) \
+  DM_CONVERT_DECL(T1, float) \
+  DM_CONVERT_DECL(T1, double) \
+  DM_CONVERT_DECL(T1, unsigned char) \
+  DM_CONVERT_DECL(T1, unsigned short) \
+  DM_CONVERT_DECL(T1, unsigned long)
+
+  DM_CONVERT_DECL_TO(short)
+  DM_CONVERT_DECL_TO(long)
+  DM_CONVERT_DECL_TO(float)
+  DM_CONVERT_DECL_TO(double)
+  DM_CONVERT_DECL_TO(unsigned char)
+  DM_CONVERT_DECL_TO(unsigned short)
+  DM_CONVERT_DECL_TO(unsigned long)
+
+#undef DM_CONVERT_DECL_TO
+#undef DM_CONVERT_DECL
+}
+
+#endif
@@ -111,37 +111,28 @@ dm::block* dm::dataset::copy_block(const std::string& name,
 
 dm::image* dm::dataset::create_image(const std::string& name,
 				     dmDataType datatype,
-				     const std::vector<int>& axes_lengths)
+				     const std::vector<long>& axes_lengths)
 {
-  strlike buffer(name);
-
-  const unsigned noaxes = axes_lengths.size();
-  long* lengths = new long[noaxes];
-  for(unsigned i=0; i<noaxes; ++i)
-    lengths[i] = axes_lengths[i];
-
-  dmBlock* b = dmDatasetCreateImage(m_dataset, buffer(),
-				    datatype, lengths,
-				    noaxes);
-  delete[] lengths;
-
-  if( b == 0 ) {
-    except_block_create_fail e;
-    e.set_descr("Unable to create image block");
-    throw e;
-  }
-  return new image(b);
+  return create_image(name, datatype, unsigned(axes_lengths.size()),
+		      axes_lengths.empty() ? 0 : &axes_lengths[0]);
 }
 
 dm::image* dm::dataset::create_image(const std::string& name,
 				     dmDataType datatype,
-				     unsigned nlen, const int* lengths)
+				     unsigned nlen, const long* lengths)
 {
   strlike buffer(name);
 
   long* tlengths = new long[nlen];
-  for(unsigned i=0; i<nlen; ++i)
+  for(unsigned i=0; i<nlen; ++i) {
+    if( lengths[i] <= 0 ) {
+      delete[] tlengths;
+      except_invalid_param e;
+      e.set_descr("Invalid axis length in dm::dataset::create_image");
+      throw e;
+    }
     tlengths[i] = lengths[i];
+  }
 
   dmBlock* b = dmDatasetCreateImage(m_dataset, buffer(),
 				    datatype, tlengths, nlen);
@@ -158,12 +149,20 @@ dm::image* dm::dataset::create_image(const std::string& name,
 
 dm::image* dm::dataset::create_image(const std::string& name,
 				     dmDataType datatype,
-				     int xw, int yw)
+				     long xw, long yw)
 {
-  int l[2] = {xw, yw};
+  long l[2] = {xw, yw};
   return create_image(name, datatype, 2, l);
 }
 
+dm::image* dm::dataset::create_image(const std::string& name,
+				     dmDataType datatype,
+				     long xw, long yw, long zw)
+{
+  long l[3] = {xw, yw, zw};
+  return create_image(name, datatype, 3, l);
+}
+
 dm::image* dm::dataset::get_image(int blockno)
 {
   if( get_block_type(blockno) != dmIMAGE ) {
@@ -177,6 +176,36 @@ dm::image* dm::dataset::get_image(int blockno)
   return new image(b);
 }
 
+//////////////////////////////////////////////////////////////
+// Table functions
+
+dm::table* dm::dataset::get_table(int blockno)
+{
+  if( get_block_type(blockno) != dmTABLE ) {
+    except_invalid_param e;
+    e.set_descr("get_table: block is not a table block");
+    throw e;
+  }
+
+  dmBlock* b = _get_block(blockno);
+
+  return new table(b);
+}
+
+dm::table* dm::dataset::get_table(const std::string& name)
+{
+  strlike buffer(name);
+
+  dmBlock* b = dmTableOpen(m_dataset, buffer());
+  if( b == 0 ) {
+    except_invalid_param e;
+    e.set_descr("Unable to open table " + name);
+    throw e;
+  }
+
+  return new table(b);
+}
+
 ///////////////////////////////////////////////////////////
 // private functions
 
@@ -8,6 +8,7 @@
 #include "general.hh"
 #include "block.hh"
 #include "image.hh"
+#include "table.hh"
 
 namespace dm
 {
@@ -38,16 +39,24 @@ namespace dm
 
     // IMAGE FUNCTIONS
     //////////////////
+    // axis lengths must be positive
     image* create_image(const std::string& name,
 			dmDataType datatype,
-			const std::vector<int>& axes_lengths);
+			const std::vector<long>& axes_lengths);
     image* create_image(const std::string& name,
 			dmDataType datatype,
-			unsigned nlen, const int* lengths);
+			unsigned nlen, const long* lengths);
     image* create_image(const std::string& name,
-			dmDataType datatype, int xw, int yw);
+			dmDataType datatype, long xw, long yw);
+    image* create_image(const std::string& name,
+			dmDataType datatype, long xw, long yw, long zw);
     image* get_image(int block_no = 1);
 
+    // TABLE FUNCTIONS
+    //////////////////
+    table* get_table(int block_no);
+    table* get_table(const std::string& name);
+
     // delete the dataset when we close (default false)
     void delete_when_finished(bool b=true) 
      { m_delete_on_finish = b; }
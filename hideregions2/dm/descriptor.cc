@@ -1,8 +1,10 @@
 #include <cstdlib>
 #include <typeinfo>
+#include <type_traits>
 #include "descriptor.hh"
 #include "general.hh"
 #include "exception.hh"
+#include "convert.hh"
 
 dm::descriptor::descriptor(dmDescriptor* d)
 {
@@ -75,27 +77,36 @@ dm::descriptor::get_pixel(const pix_vec& pos, T* val)
 
 namespace dm{
   // copies T2[] to T1 (size items)
-  template<class T1, class T2> void _translate_array(T1* a, T2* b, unsigned size)
+  template<class T1, class T2> void _translate_array(T1* a, T2* b, size_t size)
   {
-    for(unsigned i=0; i<size; ++i) {
-      *a = T1(*b);
-      a++; b++;
-    }
+    convert_array(a, b, size);
   }
 
-  unsigned get_total_size(const pix_vec& lowerbounds,
-			  const pix_vec& upperbounds)
+  size_t get_total_size(const pix_vec& lowerbounds,
+			const pix_vec& upperbounds)
   {
-    const unsigned no = lowerbounds.size();
+    const size_t no = lowerbounds.size();
     if( no != upperbounds.size() ) {
       except_invalid_param e;
       e.set_descr("Mismatching subarray bound sizes in dm::descriptor::get_total_size()");
       throw e;
     }
 
-    unsigned mult = 1;
-    for(unsigned i=0; i<no; ++i)
-      mult *= (upperbounds[i] - lowerbounds[i] + 1);
+    size_t mult = 1;
+    for(size_t i=0; i<no; ++i) {
+      if( upperbounds[i] < lowerbounds[i] ) {
+	except_invalid_param e;
+	e.set_descr("Invalid subarray bounds in dm::descriptor::get_total_size()");
+	throw e;
+      }
+      const size_t len = size_t(upperbounds[i]) - lowerbounds[i] + 1;
+      if( mult > size_t(-1) / len ) {
+	except_invalid_param e;
+	e.set_descr("Subarray too large in dm::descriptor::get_total_size()");
+	throw e;
+      }
+      mult *= len;
+    }
 
     return mult;
   }
@@ -103,8 +114,14 @@ namespace dm{
 }
 
 // macro simplifies template below a lot
+// (reading straight into the output if the types match)
 #define DM_DESCRIPTOR_GETSUBARRAY(TYPE, EXTEN) \
 {\
+    if( std::is_same<T, TYPE>::value ) {\
+      r = dmImageDataGetSubArray ## EXTEN (m_descriptor, l(), u(),\
+					   reinterpret_cast<TYPE*>(*val));\
+      break;\
+    }\
     TYPE *x = new TYPE[size];\
     r = dmImageDataGetSubArray ## EXTEN (m_descriptor, l(), u(), x);\
     _translate_array(*val, x, size);\
@@ -116,7 +133,7 @@ dm::descriptor::get_subarray(const pix_vec& lowerbounds,
 			     const pix_vec& upperbounds,
 			     T** val)
 {
-  const int size = get_total_size(lowerbounds, upperbounds);
+  const size_t size = get_total_size(lowerbounds, upperbounds);
   arraycopy l( lowerbounds), u ( upperbounds );
   *val = new T[size];
 
@@ -157,7 +174,7 @@ dm::descriptor::set_subarray(const pix_vec& lowerbounds,
 			     const pix_vec& upperbounds,
 			     const T* val)
 {
-  const int size = get_total_size(lowerbounds, upperbounds);
+  const size_t size = get_total_size(lowerbounds, upperbounds);
   arraycopy l( lowerbounds), u ( upperbounds );
 
   int r;
@@ -200,7 +217,8 @@ void dm::descriptor::get_dimensions(pix_vec* retn)
   const int no = dmGetArrayDimensions(m_descriptor, &axeslengths);
 
   for(int i=0; i<no; ++i)
-    retn->push_back( unsigned(axeslengths[i]) );
+    retn->push_back( checked_cast<unsigned>(axeslengths[i],
+					    "dm::descriptor::get_dimensions") );
 
   std::free( axeslengths );
 }
@@ -3,10 +3,12 @@
 
 #include <dm/dataset.hh>
 #include <dm/image.hh>
+#include <dm/table.hh>
 #include <dm/block.hh>
 #include <dm/coord.hh>
 #include <dm/exception.hh>
 #include <dm/general.hh>
 #include <dm/memimage.hh>
+#include <dm/memcube.hh>
 
 #endif
@@ -0,0 +1,611 @@
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+#include <limits>
+#include <sstream>
+
+#include "exception.hh"
+#include "expression.hh"
+#include "parallel.hh"
+
+namespace
+{
+  typedef dm::image_expression expr;
+
+  // images are split between threads in chunks of this many pixels
+  const size_t chunk_size = size_t(1) << 16;
+
+  unsigned no_args(expr::opcode op)
+  {
+    switch(op) {
+    case expr::op_neg: case expr::op_not: case expr::op_sqrt:
+    case expr::op_exp: case expr::op_log: case expr::op_log10:
+    case expr::op_abs: case expr::op_floor: case expr::op_ceil:
+    case expr::op_isfinite:
+      return 1;
+    case expr::op_select:
+      return 3;
+    default:
+      return 2;
+    }
+  }
+
+  template<class F> inline void unary(float* d, const float* a, size_t n,
+				      F f)
+  {
+    for(size_t i=0; i<n; ++i)
+      d[i] = f(a[i]);
+  }
+
+  template<class F> inline void binary(float* d, const float* a,
+				       const float* b, size_t n, F f)
+  {
+    for(size_t i=0; i<n; ++i)
+      d[i] = f(a[i], b[i]);
+  }
+
+  // do operation op for n values. These loops are the whole cost of
+  // evaluating an expression.
+  void run_op(expr::opcode op, float* d, const float* a, const float* b,
+	      const float* c, size_t n)
+  {
+    switch(op) {
+    case expr::op_add:
+      binary(d, a, b, n, [](float x, float y) { return x + y; }); break;
+    case expr::op_sub:
+      binary(d, a, b, n, [](float x, float y) { return x - y; }); break;
+    case expr::op_mul:
+      binary(d, a, b, n, [](float x, float y) { return x * y; }); break;
+    case expr::op_div:
+      binary(d, a, b, n, [](float x, float y) { return x / y; }); break;
+    case expr::op_pow:
+      binary(d, a, b, n, [](float x, float y) { return std::pow(x, y); });
+      break;
+    case expr::op_neg:
+      unary(d, a, n, [](float x) { return -x; }); break;
+    case expr::op_not:
+      unary(d, a, n, [](float x) { return x == 0.f ? 1.f : 0.f; }); break;
+    case expr::op_lt:
+      binary(d, a, b, n, [](float x, float y) { return x < y ? 1.f : 0.f; });
+      break;
+    case expr::op_le:
+      binary(d, a, b, n, [](float x, float y) { return x <= y ? 1.f : 0.f; });
+      break;
+    case expr::op_gt:
+      binary(d, a, b, n, [](float x, float y) { return x > y ? 1.f : 0.f; });
+      break;
+    case expr::op_ge:
+      binary(d, a, b, n, [](float x, float y) { return x >= y ? 1.f : 0.f; });
+      break;
+    case expr::op_eq:
+      binary(d, a, b, n, [](float x, float y) { return x == y ? 1.f : 0.f; });
+      break;
+    case expr::op_ne:
+      binary(d, a, b, n, [](float x, float y) { return x != y ? 1.f : 0.f; });
+      break;
+    case expr::op_and:
+      binary(d, a, b, n, [](float x, float y)
+	     { return (x != 0.f && y != 0.f) ? 1.f : 0.f; });
+      break;
+    case expr::op_or:
+      binary(d, a, b, n, [](float x, float y)
+	     { return (x != 0.f || y != 0.f) ? 1.f : 0.f; });
+      break;
+    case expr::op_select:
+      for(size_t i=0; i<n; ++i)
+	d[i] = a[i] != 0.f ? b[i] : c[i];
+      break;
+    case expr::op_sqrt:
+      unary(d, a, n, [](float x) { return std::sqrt(x); }); break;
+    case expr::op_exp:
+      unary(d, a, n, [](float x) { return std::exp(x); }); break;
+    case expr::op_log:
+      unary(d, a, n, [](float x) { return std::log(x); }); break;
+    case expr::op_log10:
+      unary(d, a, n, [](float x) { return std::log10(x); }); break;
+    case expr::op_abs:
+      unary(d, a, n, [](float x) { return std::fabs(x); }); break;
+    case expr::op_floor:
+      unary(d, a, n, [](float x) { return std::floor(x); }); break;
+    case expr::op_ceil:
+      unary(d, a, n, [](float x) { return std::ceil(x); }); break;
+    case expr::op_isfinite:
+      unary(d, a, n, [](float x) { return std::isfinite(x) ? 1.f : 0.f; });
+      break;
+    case expr::op_min:
+      // NaN if either is NaN, unlike std::min
+      binary(d, a, b, n, [](float x, float y)
+	     { return (x < y || x != x) ? x : y; });
+      break;
+    case expr::op_max:
+      binary(d, a, b, n, [](float x, float y)
+	     { return (x > y || x != x) ? x : y; });
+      break;
+    case expr::op_atan2:
+      binary(d, a, b, n, [](float x, float y) { return std::atan2(x, y); });
+      break;
+    }
+  }
+
+  struct function_def
+  {
+    const char* name;
+    expr::opcode op;
+  };
+
+  const function_def functions[] = {
+    {"sqrt", expr::op_sqrt}, {"exp", expr::op_exp}, {"log", expr::op_log},
+    {"log10", expr::op_log10}, {"abs", expr::op_abs},
+    {"floor", expr::op_floor}, {"ceil", expr::op_ceil},
+    {"isfinite", expr::op_isfinite}, {"min", expr::op_min},
+    {"max", expr::op_max}, {"pow", expr::op_pow}, {"atan2", expr::op_atan2}
+  };
+}
+
+// recursive descent parser, emitting operations as it goes
+class dm::image_expression::parser
+{
+public:
+  parser(image_expression& ex, const std::string& text,
+	 const std::vector<std::string>& names)
+    : m_ex(ex), m_text(text), m_names(names), m_pos(0)
+  {}
+
+  unsigned parse()
+  {
+    const unsigned r = ternary();
+    skip_space();
+    if( m_pos != m_text.size() )
+      error("unexpected text");
+    return r;
+  }
+
+private:
+  void error(const std::string& msg) const
+  {
+    std::ostringstream o;
+    o << "Invalid expression \"" << m_text << "\" at character "
+      << m_pos+1 << ": " << msg;
+    except_invalid_param e;
+    e.set_descr(o.str());
+    throw e;
+  }
+
+  void skip_space()
+  {
+    while( m_pos < m_text.size() && std::isspace((unsigned char)m_text[m_pos]) )
+      ++m_pos;
+  }
+
+  // skip tok if it is next
+  bool accept(const char* tok)
+  {
+    skip_space();
+    const size_t len = std::char_traits<char>::length(tok);
+    if( m_text.compare(m_pos, len, tok) != 0 )
+      return false;
+    m_pos += len;
+    return true;
+  }
+
+  void expect(const char* tok)
+  {
+    if( ! accept(tok) )
+      error(std::string("expected \"") + tok + "\"");
+  }
+
+  // name at current position, or empty
+  std::string identifier()
+  {
+    skip_space();
+    size_t end = m_pos;
+    if( end < m_text.size() && (std::isalpha((unsigned char)m_text[end]) ||
+				m_text[end] == '_') )
+      while( end < m_text.size() &&
+	     (std::isalnum((unsigned char)m_text[end]) || m_text[end] == '_') )
+	++end;
+    const std::string id(m_text, m_pos, end-m_pos);
+    m_pos = end;
+    return id;
+  }
+
+  // index of input called name, or -1
+  int input(const std::string& name) const
+  {
+    for(size_t i=0; i<m_names.size(); ++i)
+      if( m_names[i] == name )
+	return int(i);
+    return -1;
+  }
+
+  unsigned ternary()
+  {
+    const unsigned c = logical_or();
+    if( ! accept("?") )
+      return c;
+    const unsigned a = ternary();
+    expect(":");
+    const unsigned b = ternary();
+    return m_ex.emit(op_select, c, a, b);
+  }
+
+  unsigned logical_or()
+  {
+    unsigned r = logical_and();
+    while( accept("||") )
+      r = m_ex.emit(op_or, r, logical_and());
+    return r;
+  }
+
+  unsigned logical_and()
+  {
+    unsigned r = comparison();
+    while( accept("&&") )
+      r = m_ex.emit(op_and, r, comparison());
+    return r;
+  }
+
+  unsigned comparison()
+  {
+    unsigned r = additive();
+    for(;;) {
+      opcode op;
+      if( accept("==") ) op = op_eq;
+      else if( accept("!=") ) op = op_ne;
+      else if( accept("<=") ) op = op_le;
+      else if( accept(">=") ) op = op_ge;
+      else if( accept("<") ) op = op_lt;
+      else if( accept(">") ) op = op_gt;
+      else return r;
+      r = m_ex.emit(op, r, additive());
+    }
+  }
+
+  unsigned additive()
+  {
+    unsigned r = multiplicative();
+    for(;;) {
+      if( accept("+") ) r = m_ex.emit(op_add, r, multiplicative());
+      else if( accept("-") ) r = m_ex.emit(op_sub, r, multiplicative());
+      else return r;
+    }
+  }
+
+  unsigned multiplicative()
+  {
+    unsigned r = unary_op();
+    for(;;) {
+      if( accept("*") ) r = m_ex.emit(op_mul, r, unary_op());
+      else if( accept("/") ) r = m_ex.emit(op_div, r, unary_op());
+      else return r;
+    }
+  }
+
+  unsigned unary_op()
+  {
+    if( accept("-") )
+      return m_ex.emit(op_neg, unary_op());
+    if( accept("+") )
+      return unary_op();
+    // not the start of "!="
+    skip_space();
+    if( m_text.compare(m_pos, 1, "!") == 0 &&
+	m_text.compare(m_pos, 2, "!=") != 0 ) {
+      ++m_pos;
+      return m_ex.emit(op_not, unary_op());
+    }
+    return power();
+  }
+
+  unsigned power()
+  {
+    const unsigned r = primary();
+    if( accept("^") )
+      return m_ex.emit(op_pow, r, unary_op());
+    return r;
+  }
+
+  unsigned primary()
+  {
+    skip_space();
+    if( m_pos == m_text.size() )
+      error("unexpected end");
+
+    if( accept("(") ) {
+      const unsigned r = ternary();
+      expect(")");
+      return r;
+    }
+
+    const char ch = m_text[m_pos];
+    if( std::isdigit((unsigned char)ch) || ch == '.' ) {
+      const char* start = m_text.c_str() + m_pos;
+      char* end;
+      const double v = std::strtod(start, &end);
+      if( end == start )
+	error("invalid number");
+      m_pos += end - start;
+      return m_ex.add_reg(reg_const, 0, float(v));
+    }
+
+    const size_t start = m_pos;
+    const std::string id = identifier();
+    if( id.empty() )
+      error("expected a value");
+
+    skip_space();
+    if( m_text.compare(m_pos, 1, "(") == 0 )
+      return call(id, start);
+
+    const int in = input(id);
+    if( in >= 0 )
+      return m_ex.add_reg(reg_input, unsigned(in));
+    if( id == "nan" )
+      return m_ex.add_reg(reg_const, 0,
+			  std::numeric_limits<float>::quiet_NaN());
+    if( id == "inf" )
+      return m_ex.add_reg(reg_const, 0,
+			  std::numeric_limits<float>::infinity());
+
+    m_pos = start;
+    error("unknown input \"" + id + "\"");
+    return 0;
+  }
+
+  // function call, with m_pos at the "("
+  unsigned call(const std::string& name, size_t start)
+  {
+    expect("(");
+
+    // reductions of an input name
+    const bool is_reduction = name == "sum" || name == "mean" ||
+      name == "min" || name == "max";
+    if( is_reduction ) {
+      const size_t argpos = m_pos;
+      const std::string arg = identifier();
+      const int in = input(arg);
+      if( in >= 0 && accept(")") ) {
+	reduction_type type = red_sum;
+	if( name == "mean" ) type = red_mean;
+	else if( name == "min" ) type = red_min;
+	else if( name == "max" ) type = red_max;
+	return m_ex.emit_reduction(unsigned(in), type);
+      }
+      m_pos = argpos;
+      if( name == "sum" || name == "mean" )
+	error("expected the name of an input");
+    }
+
+    const function_def* def = 0;
+    for(size_t i=0; i<sizeof(functions)/sizeof(functions[0]); ++i)
+      if( name == functions[i].name )
+	def = &functions[i];
+    if( def == 0 ) {
+      m_pos = start;
+      error("unknown function \"" + name + "\"");
+    }
+
+    unsigned args[2] = {0, 0};
+    const unsigned nargs = no_args(def->op);
+    for(unsigned i=0; i<nargs; ++i) {
+      if( i > 0 )
+	expect(",");
+      args[i] = ternary();
+    }
+    expect(")");
+    return m_ex.emit(def->op, args[0], args[1]);
+  }
+
+private:
+  image_expression& m_ex;
+  const std::string& m_text;
+  const std::vector<std::string>& m_names;
+  size_t m_pos;
+};
+
+const unsigned dm::image_expression::block_size;
+
+dm::image_expression::image_expression(const std::string& text,
+				       const std::vector<std::string>& names)
+  : m_ninputs(unsigned(names.size())), m_result(0)
+{
+  parser p(*this, text, names);
+  m_result = p.parse();
+}
+
+unsigned dm::image_expression::add_reg(reg_kind kind, unsigned index,
+				       float value)
+{
+  const reg r = {kind, index, value};
+  m_regs.push_back(r);
+  return unsigned(m_regs.size()-1);
+}
+
+unsigned dm::image_expression::emit(opcode op, unsigned a, unsigned b,
+				    unsigned c)
+{
+  const unsigned nargs = no_args(op);
+  const unsigned args[3] = {a, b, c};
+
+  bool constant = true;
+  for(unsigned i=0; i<nargs; ++i)
+    constant = constant && m_regs[args[i]].kind == reg_const;
+  if( constant ) {
+    float v[3] = {0, 0, 0};
+    for(unsigned i=0; i<nargs; ++i)
+      v[i] = m_regs[args[i]].value;
+    float res;
+    run_op(op, &res, &v[0], &v[1], &v[2], 1);
+    return add_reg(reg_const, 0, res);
+  }
+
+  // x^2 is common, and much quicker as x*x
+  if( op == op_pow && m_regs[b].kind == reg_const && m_regs[b].value == 2.f ) {
+    op = op_mul;
+    b = a;
+  }
+
+  unsigned ntemps = 0;
+  for(size_t i=0; i<m_regs.size(); ++i)
+    if( m_regs[i].kind == reg_temp )
+      ++ntemps;
+  const unsigned dst = add_reg(reg_temp, ntemps);
+  const instr in = {op, dst, a, b, c};
+  m_code.push_back(in);
+  return dst;
+}
+
+unsigned dm::image_expression::emit_reduction(unsigned input,
+					      reduction_type type)
+{
+  unsigned idx = 0;
+  while( idx < m_reductions.size() && ! (m_reductions[idx].input == input &&
+					  m_reductions[idx].type == type) )
+    ++idx;
+  if( idx == m_reductions.size() ) {
+    const reduction red = {input, type};
+    m_reductions.push_back(red);
+    m_redvalues.push_back(std::numeric_limits<float>::quiet_NaN());
+  }
+
+  for(size_t i=0; i<m_regs.size(); ++i)
+    if( m_regs[i].kind == reg_reduction && m_regs[i].index == idx )
+      return unsigned(i);
+  return add_reg(reg_reduction, idx);
+}
+
+void dm::image_expression::evaluate(const float* const* in, float* out,
+				    size_t n) const
+{
+  const size_t nregs = m_regs.size();
+
+  // a block of values for each register which is not an input.
+  // Constants and reductions are the same for every block.
+  std::vector<float> store;
+  std::vector<float*> block(nregs, static_cast<float*>(0));
+  {
+    size_t nblocks = 0;
+    for(size_t r=0; r<nregs; ++r)
+      if( m_regs[r].kind != reg_input )
+	++nblocks;
+    store.resize(nblocks*block_size);
+    size_t slot = 0;
+    for(size_t r=0; r<nregs; ++r) {
+      const reg& rg = m_regs[r];
+      if( rg.kind == reg_input )
+	continue;
+      block[r] = &store[slot*block_size];
+      ++slot;
+      if( rg.kind == reg_const )
+	std::fill(block[r], block[r]+block_size, rg.value);
+      else if( rg.kind == reg_reduction )
+	std::fill(block[r], block[r]+block_size, m_redvalues[rg.index]);
+    }
+  }
+
+  // the last operation makes the result, so is written to the output
+  const bool direct = ! m_code.empty() && m_code.back().dst == m_result;
+
+  std::vector<const float*> src(nregs);
+  for(size_t off=0; off<n; off+=block_size) {
+    const size_t len = std::min(size_t(block_size), n-off);
+
+    for(size_t r=0; r<nregs; ++r)
+      src[r] = m_regs[r].kind == reg_input ? in[m_regs[r].index] + off :
+	block[r];
+
+    for(size_t i=0; i<m_code.size(); ++i) {
+      const instr& ins = m_code[i];
+      float* dst = (direct && i+1 == m_code.size()) ? out+off :
+	block[ins.dst];
+      run_op(ins.op, dst, src[ins.a], src[ins.b], src[ins.c], len);
+    }
+
+    if( ! direct )
+      std::copy(src[m_result], src[m_result]+len, out+off);
+  }
+}
+
+void dm::image_expression::evaluate(const std::vector<const memimage<float>*>& in,
+				    memimage<float>* out)
+{
+  if( in.size() != m_ninputs ) {
+    except_invalid_param e;
+    e.set_descr("Wrong number of inputs in dm::image_expression::evaluate");
+    throw e;
+  }
+  for(size_t i=0; i<in.size(); ++i)
+    if( in[i]->xw() != out->xw() || in[i]->yw() != out->yw() )
+      throw memimage<float>::size_mismatch_exception();
+
+  for(size_t i=0; i<m_reductions.size(); ++i) {
+    image_stats stats;
+    stats.add(*in[m_reductions[i].input]);
+    set_reduction(unsigned(i), stats.value(m_reductions[i].type));
+  }
+
+  std::vector<const float*> ptrs(in.size());
+  for(size_t i=0; i<in.size(); ++i)
+    ptrs[i] = in[i]->row(0);
+  float* o = out->row(0);
+
+  parallel_for(out->nelem(), chunk_size, [&](size_t i0, size_t i1)
+    {
+      std::vector<const float*> p(ptrs.size());
+      for(size_t i=0; i<p.size(); ++i)
+	p[i] = ptrs[i] + i0;
+      evaluate(p.data(), o+i0, i1-i0);
+    });
+}
+
+void dm::image_stats::add(const memimage<float>& im)
+{
+  // each chunk is summed in double (a float sum of 2^16 pixels loses
+  // precision), and the chunks combined in order
+  struct part
+  {
+    double sum;
+    size_t count;
+    float min, max;
+  };
+  const size_t n = im.nelem();
+  std::vector<part> parts((n + chunk_size - 1) / chunk_size);
+  const float* d = im.data();
+
+  parallel_for(n, chunk_size, [&](size_t i0, size_t i1)
+    {
+      part p = { 0., 0, m_min, m_max };
+      for(size_t i=i0; i<i1; ++i)
+	if( std::isfinite(d[i]) ) {
+	  p.sum += d[i];
+	  ++p.count;
+	  p.min = std::min(p.min, d[i]);
+	  p.max = std::max(p.max, d[i]);
+	}
+      parts[i0 / chunk_size] = p;
+    });
+
+  for(size_t c=0; c<parts.size(); ++c) {
+    m_sum += parts[c].sum;
+    m_count += parts[c].count;
+    m_min = std::min(m_min, parts[c].min);
+    m_max = std::max(m_max, parts[c].max);
+  }
+}
+
+float dm::image_stats::value(image_expression::reduction_type type) const
+{
+  const float nan = std::numeric_limits<float>::quiet_NaN();
+  switch(type) {
+  case image_expression::red_sum:
+    return float(m_sum);
+  case image_expression::red_mean:
+    return m_count > 0 ? float(m_sum / m_count) : nan;
+  case image_expression::red_min:
+    return m_count > 0 ? m_min : nan;
+  case image_expression::red_max:
+    return m_count > 0 ? m_max : nan;
+  }
+  return nan;
+}
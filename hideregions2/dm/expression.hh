@@ -0,0 +1,142 @@
+#ifndef DM_EXPRESSION_HH
+#define DM_EXPRESSION_HH
+
+#include <string>
+#include <vector>
+#include <limits>
+
+#include "memimage.hh"
+
+namespace dm
+{
+  // Arithmetic expression of several images, such as "(a-b)/c*(m>0)",
+  // compiled once into a list of operations on registers.
+  //
+  // Pixels are evaluated in blocks of block_size. Each operation is
+  // done for the whole block before the next, so its loop is simple
+  // enough for the compiler to vectorise, and the intermediate values
+  // are only a block long and stay in cache. The expression is
+  // therefore done in one pass over the inputs, without temporary
+  // images. Operations with constant arguments are done when the
+  // expression is compiled.
+  //
+  // Syntax, in order of increasing precedence:
+  //   c ? x : y
+  //   x || y, x && y        (nonzero is true, giving 1 or 0)
+  //   x == y, x != y, x < y, x <= y, x > y, x >= y   (1 or 0)
+  //   x + y, x - y
+  //   x * y, x / y
+  //   -x, +x, !x
+  //   x ^ y                 (power, right associative)
+  //   numbers, nan, inf, input names, (x), functions
+  // Functions of each pixel are sqrt, exp, log, log10, abs, floor,
+  // ceil, isfinite (1 or 0), min(x, y), max(x, y), pow(x, y) and
+  // atan2(y, x). With one argument, which must be an input name,
+  // sum, mean, min and max are the values of the whole input image
+  // (reductions, ignoring values which are not finite).
+  class image_expression
+  {
+  public:
+    // compile expr, where names are the names of the inputs in order.
+    // Throws except_invalid_param if it is invalid.
+    image_expression(const std::string& expr,
+		     const std::vector<std::string>& names);
+
+    static const unsigned block_size = 256;
+
+    unsigned no_inputs() const { return m_ninputs; }
+    // number of operations done for each pixel
+    unsigned no_operations() const { return unsigned(m_code.size()); }
+
+    // whole-image values used by the expression, which must be set
+    // with set_reduction before evaluate(in, out, n)
+    enum reduction_type { red_sum, red_mean, red_min, red_max };
+    struct reduction
+    {
+      unsigned input;
+      reduction_type type;
+    };
+    const std::vector<reduction>& reductions() const { return m_reductions; }
+    void set_reduction(unsigned idx, float value)
+    { m_redvalues.at(idx) = value; }
+
+    // evaluate n pixels, out[i] = expr(in[0][i], in[1][i]...), in
+    // this thread. Different threads can evaluate different pixels at
+    // once.
+    void evaluate(const float* const* in, float* out, size_t n) const;
+
+    // evaluate over whole images of the same size (in parallel),
+    // calculating any reductions from the inputs
+    void evaluate(const std::vector<const memimage<float>*>& in,
+		  memimage<float>* out);
+
+  public:
+    enum opcode
+      {
+	op_add, op_sub, op_mul, op_div, op_pow, op_neg, op_not,
+	op_lt, op_le, op_gt, op_ge, op_eq, op_ne, op_and, op_or,
+	op_select, op_sqrt, op_exp, op_log, op_log10, op_abs, op_floor,
+	op_ceil, op_isfinite, op_min, op_max, op_atan2
+      };
+
+  private:
+    // registers are inputs, constants, reduction values (set before
+    // evaluating, constant for each pixel) or temporary values
+    enum reg_kind { reg_input, reg_const, reg_reduction, reg_temp };
+    struct reg
+    {
+      reg_kind kind;
+      unsigned index;  // input or reduction number
+      float value;     // if constant
+    };
+    struct instr
+    {
+      opcode op;
+      unsigned dst, a, b, c;
+    };
+
+    class parser;
+    friend class parser;
+
+    unsigned add_reg(reg_kind kind, unsigned index, float value = 0);
+    // add operation with arguments a, b, c (unused ones ignored),
+    // returning its result register. Constants are folded.
+    unsigned emit(opcode op, unsigned a, unsigned b = 0, unsigned c = 0);
+    // reduction of an input
+    unsigned emit_reduction(unsigned input, reduction_type type);
+
+  private:
+    unsigned m_ninputs;
+    std::vector<reg> m_regs;
+    std::vector<instr> m_code;
+    unsigned m_result;
+    std::vector<reduction> m_reductions;
+    std::vector<float> m_redvalues;
+  };
+
+  // Statistics of the finite values of an image, which can be added
+  // to a strip at a time, for the reductions of image_expression
+  class image_stats
+  {
+  public:
+    image_stats()
+      : m_sum(0), m_count(0),
+	m_min(std::numeric_limits<float>::infinity()),
+	m_max(-std::numeric_limits<float>::infinity())
+    {}
+
+    // add the pixels of an image (or strip of one)
+    void add(const memimage<float>& im);
+
+    // value of reduction (NaN for mean, min and max if there were no
+    // finite values)
+    float value(image_expression::reduction_type type) const;
+
+  private:
+    double m_sum;
+    size_t m_count;
+    float m_min, m_max;
+  };
+}
+
+#endif
@@ -0,0 +1,159 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "general.hh"
+#include "fitsheader.hh"
+
+namespace
+{
+  std::string trim(const std::string& s)
+  {
+    const size_t first = s.find_first_not_of(' ');
+    if( first == std::string::npos )
+      return std::string();
+    const size_t last = s.find_last_not_of(' ');
+    return s.substr(first, last-first+1);
+  }
+
+  // get value from card (after "= "), removing comments and quotes
+  std::string parse_value(const std::string& text)
+  {
+    const size_t start = text.find_first_not_of(' ');
+    if( start == std::string::npos )
+      return std::string();
+
+    if( text[start] != '\'' ) {
+      const size_t slash = text.find('/', start);
+      return trim(text.substr(start, slash == std::string::npos ?
+			      std::string::npos : slash-start));
+    }
+
+    // quoted string, where '' is a quote
+    std::string val;
+    for(size_t i=start+1; i<text.size(); ++i) {
+      if( text[i] == '\'' ) {
+	if( i+1 < text.size() && text[i+1] == '\'' )
+	  ++i;
+	else
+	  break;
+      }
+      val += text[i];
+    }
+    return trim(val);
+  }
+}
+
+bool dm::fits_header::add_block(const char* block)
+{
+  for(unsigned c=0; c<fits_block/80; ++c) {
+    const std::string card(block+c*80, 80);
+    const std::string key = trim(card.substr(0, 8));
+    if( key == "END" )
+      return true;
+    if( card.compare(8, 2, "= ") == 0 )
+      m_keys[key] = parse_value(card.substr(10));
+  }
+  return false;
+}
+
+bool dm::fits_header::is_header_start(const char* block)
+{
+  return std::strncmp(block, "SIMPLE  ", 8) == 0 ||
+    std::strncmp(block, "XTENSION", 8) == 0;
+}
+
+std::string dm::fits_header::get_str(const std::string& key,
+				     const std::string& def) const
+{
+  std::map<std::string, std::string>::const_iterator i = m_keys.find(key);
+  return i == m_keys.end() ? def : i->second;
+}
+
+long long dm::fits_header::get_int(const std::string& key,
+				   long long def) const
+{
+  std::map<std::string, std::string>::const_iterator i = m_keys.find(key);
+  return i == m_keys.end() ? def : std::atoll(i->second.c_str());
+}
+
+double dm::fits_header::get_double(const std::string& key, double def) const
+{
+  std::map<std::string, std::string>::const_iterator i = m_keys.find(key);
+  if( i == m_keys.end() )
+    return def;
+  // fortran style exponents
+  std::string v = i->second;
+  std::replace(v.begin(), v.end(), 'D', 'E');
+  return std::atof(v.c_str());
+}
+
+long long dm::fits_header::data_size() const
+{
+  const long long naxis = get_int("NAXIS", 0);
+  if( naxis == 0 )
+    return 0;
+  long long n = 1;
+  for(long long i=1; i<=naxis; ++i)
+    n *= get_int("NAXIS" + to_str(int(i)), 0);
+  const long long bytes = std::llabs(get_int("BITPIX", 8)) / 8 *
+    get_int("GCOUNT", 1) * (get_int("PCOUNT", 0) + n);
+  return (bytes + fits_block - 1) / fits_block * fits_block;
+}
+
+std::string dm::fits_card(const std::string& key, const std::string& value,
+			  const std::string& comment)
+{
+  std::string c = key;
+  c.resize(8, ' ');
+  c += "= " + value;
+  if( ! comment.empty() )
+    c += " / " + comment;
+  c.resize(80, ' ');
+  return c;
+}
+
+std::string dm::fits_card_int(const std::string& key, long long value,
+			      const std::string& comment)
+{
+  char buf[32];
+  std::snprintf(buf, sizeof(buf), "%20lld", value);
+  return fits_card(key, buf, comment);
+}
+
+std::string dm::fits_card_real(const std::string& key, double value,
+			       const std::string& comment)
+{
+  char buf[32];
+  std::snprintf(buf, sizeof(buf), "%20.17G", value);
+  return fits_card(key, buf, comment);
+}
+
+std::string dm::fits_card_bool(const std::string& key, bool value,
+			       const std::string& comment)
+{
+  return fits_card(key, value ? "                   T" : "                   F",
+		   comment);
+}
+
+std::string dm::fits_card_str(const std::string& key,
+			      const std::string& value,
+			      const std::string& comment)
+{
+  std::string v = value;
+  if( v.size() < 8 )
+    v.resize(8, ' ');
+  return fits_card(key, "'" + v + "'", comment);
+}
+
+std::string dm::fits_header_block(const std::vector<std::string>& cards)
+{
+  std::string h;
+  for(size_t i=0; i<cards.size(); ++i)
+    h += cards[i];
+  h += "END" + std::string(77, ' ');
+  const size_t nblocks = (h.size() + dm::fits_block - 1) / dm::fits_block;
+  h.resize(nblocks * dm::fits_block, ' ');
+  return h;
+}
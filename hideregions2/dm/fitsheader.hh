@@ -0,0 +1,58 @@
+#ifndef DM_FITSHEADER_HH
+#define DM_FITSHEADER_HH
+
+#include <map>
+#include <string>
+#include <vector>
+
+namespace dm
+{
+  // size of FITS blocks
+  const unsigned fits_block = 2880;
+
+  // keywords of a FITS header, for the parts of the library which
+  // read FITS files without the DM
+  class fits_header
+  {
+  public:
+    // add cards from a block of fits_block bytes, returning true if
+    // the END card was found
+    bool add_block(const char* block);
+    void clear() { m_keys.clear(); }
+
+    // is this the first block of a header?
+    static bool is_header_start(const char* block);
+
+    bool has(const std::string& key) const
+    { return m_keys.find(key) != m_keys.end(); }
+
+    // values of keywords, or def if missing
+    std::string get_str(const std::string& key,
+			const std::string& def = std::string()) const;
+    long long get_int(const std::string& key, long long def) const;
+    double get_double(const std::string& key, double def) const;
+
+    // size of data following header, padded to blocks
+    long long data_size() const;
+
+  private:
+    std::map<std::string, std::string> m_keys;
+  };
+
+  // FITS header cards (80 characters) for writing files
+  std::string fits_card(const std::string& key, const std::string& value,
+			const std::string& comment = std::string());
+  std::string fits_card_int(const std::string& key, long long value,
+			    const std::string& comment = std::string());
+  std::string fits_card_real(const std::string& key, double value,
+			     const std::string& comment = std::string());
+  std::string fits_card_bool(const std::string& key, bool value,
+			     const std::string& comment = std::string());
+  std::string fits_card_str(const std::string& key, const std::string& value,
+			    const std::string& comment = std::string());
+
+  // header of cards, with END and padding to whole blocks
+  std::string fits_header_block(const std::vector<std::string>& cards);
+}
+
+#endif
@@ -10,17 +10,17 @@ dm::strlike::strlike(const std::string& str)
 
 dm::arraycopy::arraycopy(const pix_vec& array)
 {
-  const unsigned no = array.size();
+  const size_t no = array.size();
   m_copy = new long[no];
-  for(unsigned i=0; i<no; ++i)
-    m_copy[i] = array[i];
+  for(size_t i=0; i<no; ++i)
+    m_copy[i] = checked_cast<long>(array[i], "dm::arraycopy");
 }
 
 dm::arraycopy::arraycopy(unsigned no, const unsigned* list)
 {
   m_copy = new long[no];
   for(unsigned i=0; i<no; ++i)
-    m_copy[i] = list[i];
+    m_copy[i] = checked_cast<long>(list[i], "dm::arraycopy");
 }
 
 std::string dm::to_str(int i)
@@ -4,6 +4,8 @@
 #include <string>
 #include <vector>
 
+#include "exception.hh"
+
 namespace dm
 {
   // method to use when opening file
@@ -40,6 +42,20 @@ namespace dm
   };
 
   std::string to_str(int i);
+
+  // convert a size or coordinate to the type used by the DM (or back),
+  // throwing except_invalid_param if the value does not fit
+  template<class To, class From> To checked_cast(const From v,
+						 const char* where)
+  {
+    const To t = static_cast<To>(v);
+    if( static_cast<From>(t) != v || (t < To(0)) != (v < From(0)) ) {
+      except_invalid_param e;
+      e.set_descr(std::string("Value out of range in ") + where);
+      throw e;
+    }
+    return t;
+  }
 }
 
 #endif
@@ -0,0 +1,421 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "convert.hh"
+#include "exception.hh"
+#include "fitsheader.hh"
+#include "parallel.hh"
+#include "gzimage.hh"
+
+namespace
+{
+  void throw_invalid(const std::string& descr)
+  {
+    dm::except_invalid_param e;
+    e.set_descr(descr);
+    throw e;
+  }
+
+  inline unsigned get_le(const unsigned char* p, unsigned n)
+  {
+    unsigned v = 0;
+    for(unsigned i=0; i<n; ++i)
+      v |= unsigned(p[i]) << (8*i);
+    return v;
+  }
+
+  inline unsigned long long get_be(const unsigned char* p, unsigned n)
+  {
+    unsigned long long v = 0;
+    for(unsigned i=0; i<n; ++i)
+      v = (v << 8) | p[i];
+    return v;
+  }
+
+  // sequential reader of decompressed data from gzip members
+  class gz_stream
+  {
+  public:
+    gz_stream(const unsigned char* data, size_t len)
+      : m_next(data), m_left(len), m_end(false)
+    {
+      std::memset(&m_strm, 0, sizeof(m_strm));
+      inflateInit2(&m_strm, 16+15);
+    }
+    ~gz_stream() { inflateEnd(&m_strm); }
+
+    // read up to n bytes, returning the number read
+    size_t read(unsigned char* out, size_t n)
+    {
+      size_t got = 0;
+      while( got < n && ! m_end ) {
+	// zlib only takes 32 bit lengths, so feed in chunks
+	if( m_strm.avail_in == 0 ) {
+	  if( m_left == 0 ) {
+	    m_end = true;
+	    break;
+	  }
+	  const size_t chunk = std::min(m_left, size_t(1) << 30);
+	  m_strm.next_in = const_cast<unsigned char*>(m_next);
+	  m_strm.avail_in = chunk;
+	  m_next += chunk;
+	  m_left -= chunk;
+	}
+
+	m_strm.next_out = out + got;
+	m_strm.avail_out = std::min(n - got, size_t(1) << 30);
+	const size_t before = m_strm.avail_out;
+	const int ret = inflate(&m_strm, Z_NO_FLUSH);
+	got += before - m_strm.avail_out;
+
+	if( ret == Z_STREAM_END ) {
+	  // continue with next member, if any
+	  if( more_members() )
+	    inflateReset(&m_strm);
+	  else
+	    m_end = true;
+	} else if( ret != Z_OK && ret != Z_BUF_ERROR ) {
+	  throw_invalid("Corrupt gzip data");
+	}
+      }
+      return got;
+    }
+
+    // skip n bytes, returning false if there were fewer
+    bool skip(long long n)
+    {
+      unsigned char buf[65536];
+      while( n > 0 ) {
+	const size_t want = size_t(std::min(n, (long long)(sizeof(buf))));
+	if( read(buf, want) != want )
+	  return false;
+	n -= want;
+      }
+      return true;
+    }
+
+  private:
+    // does another gzip member follow?
+    bool more_members()
+    {
+      if( m_strm.avail_in >= 2 )
+	return m_strm.next_in[0] == 0x1f && m_strm.next_in[1] == 0x8b;
+      if( m_strm.avail_in == 1 )
+	return m_strm.next_in[0] == 0x1f && m_left > 0 && m_next[0] == 0x8b;
+      return m_left >= 2 && m_next[0] == 0x1f && m_next[1] == 0x8b;
+    }
+
+    z_stream m_strm;
+    const unsigned char* m_next;
+    size_t m_left;
+    bool m_end;
+  };
+
+  // decompress a single member into out, which has size outlen
+  bool inflate_member(const unsigned char* in, size_t len,
+		      unsigned char* out, size_t outlen)
+  {
+    z_stream strm;
+    std::memset(&strm, 0, sizeof(strm));
+    if( inflateInit2(&strm, 16+15) != Z_OK )
+      return false;
+    strm.next_in = const_cast<unsigned char*>(in);
+    strm.avail_in = len;
+    strm.next_out = out;
+    strm.avail_out = outlen;
+    const int ret = inflate(&strm, Z_FINISH);
+    const bool ok = ret == Z_STREAM_END && strm.total_out == outlen;
+    inflateEnd(&strm);
+    return ok;
+  }
+
+  // FITS type matching T, if any
+  template<class T> int matching_bitpix() { return 0; }
+  template<> int matching_bitpix<unsigned char>() { return 8; }
+  template<> int matching_bitpix<short>() { return 16; }
+  template<> int matching_bitpix<float>() { return -32; }
+  template<> int matching_bitpix<double>() { return -64; }
+}
+
+dm::gzip_image::gzip_image(const std::string& filename)
+  : m_filename(filename), m_map(0), m_size(0), m_threads(0),
+    m_blocked(false)
+{
+  const int fd = ::open(filename.c_str(), O_RDONLY);
+  struct stat st;
+  if( fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0 ) {
+    if( fd >= 0 )
+      ::close(fd);
+    except_unable_to_open e;
+    e.set_descr("Cannot open file " + filename);
+    throw e;
+  }
+
+  // the compressed data are mapped, rather than read
+  m_size = st.st_size;
+  void* map = mmap(0, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if( map == MAP_FAILED ) {
+    except_unable_to_open e;
+    e.set_descr("Cannot map file " + filename);
+    throw e;
+  }
+  m_map = static_cast<const unsigned char*>(map);
+
+  try {
+    if( m_size < 2 || m_map[0] != 0x1f || m_map[1] != 0x8b )
+      throw_invalid("Not a gzip file: " + filename);
+    find_members();
+    find_image();
+  } catch( ... ) {
+    munmap(const_cast<unsigned char*>(m_map), m_size);
+    throw;
+  }
+}
+
+dm::gzip_image::~gzip_image()
+{
+  munmap(const_cast<unsigned char*>(m_map), m_size);
+}
+
+// locate members from their BGZF block sizes. If any member doesn't
+// have one, the file has to be decompressed as a stream.
+void dm::gzip_image::find_members()
+{
+  size_t pos = 0;
+  long long uoffset = 0;
+  while( pos < m_size ) {
+    const unsigned char* p = m_map + pos;
+    if( m_size - pos < 18 || p[0] != 0x1f || p[1] != 0x8b || p[2] != 8 )
+      break;
+
+    // look for BC subfield in extra field
+    size_t size = 0;
+    if( p[3] & 4 ) {
+      const unsigned xlen = get_le(p+10, 2);
+      for(unsigned i=12; i+4 <= 12+xlen && pos+i+4 <= m_size; ) {
+	const unsigned slen = get_le(p+i+2, 2);
+	if( p[i] == 'B' && p[i+1] == 'C' && slen == 2 )
+	  size = get_le(p+i+4, 2) + 1;
+	i += 4 + slen;
+      }
+    }
+    if( size == 0 || size > m_size - pos )
+      break;
+
+    member m;
+    m.offset = pos;
+    m.size = size;
+    m.uoffset = uoffset;
+    m.usize = get_le(p+size-4, 4);
+    m_members.push_back(m);
+
+    uoffset += m.usize;
+    pos += size;
+  }
+
+  m_blocked = pos == m_size && m_members.size() > 1;
+  if( ! m_blocked )
+    m_members.clear();
+}
+
+// find the header of the image in the decompressed data
+void dm::gzip_image::find_image()
+{
+  gz_stream stream(m_map, m_size);
+  fits_header keys;
+  std::vector<char> block(fits_block);
+  long long offset = 0;
+
+  for(;;) {
+    // read header
+    keys.clear();
+    for(bool first=true; ; first=false) {
+      if( stream.read(reinterpret_cast<unsigned char*>(&block[0]),
+		      fits_block) != fits_block ||
+	  (first && ! fits_header::is_header_start(&block[0])) )
+	throw_invalid("No 2D image in " + m_filename);
+      offset += fits_block;
+      if( keys.add_block(&block[0]) )
+	break;
+    }
+
+    // is this a 2D image (allowing extra axes of length 1)?
+    const long long naxis = keys.get_int("NAXIS", 0);
+    bool is2d = naxis >= 2 &&
+      (! keys.has("XTENSION") || keys.get_str("XTENSION") == "IMAGE");
+    for(long long i=3; i<=naxis && is2d; ++i)
+      is2d = keys.get_int("NAXIS" + to_str(int(i)), 0) == 1;
+
+    if( is2d )
+      break;
+
+    const long long size = keys.data_size();
+    if( ! stream.skip(size) )
+      throw_invalid("No 2D image in " + m_filename);
+    offset += size;
+  }
+
+  m_xw = unsigned(keys.get_int("NAXIS1", 0));
+  m_yw = unsigned(keys.get_int("NAXIS2", 0));
+  m_bitpix = int(keys.get_int("BITPIX", 0));
+  if( m_bitpix != 8 && m_bitpix != 16 && m_bitpix != 32 &&
+      m_bitpix != 64 && m_bitpix != -32 && m_bitpix != -64 )
+    throw_invalid("Invalid BITPIX in " + m_filename);
+  m_bscale = keys.get_double("BSCALE", 1);
+  m_bzero = keys.get_double("BZERO", 0);
+  m_have_blank = m_bitpix > 0 && keys.has("BLANK");
+  m_blank = keys.get_int("BLANK", 0);
+  m_data_offset = offset;
+}
+
+void dm::gzip_image::get_dimensions(pix_vec* retn) const
+{
+  retn->clear();
+  retn->push_back(m_xw);
+  retn->push_back(m_yw);
+}
+
+// decompress nbytes of the image data into out
+void dm::gzip_image::read_data(unsigned char* out, long long nbytes) const
+{
+  if( ! m_blocked ) {
+    gz_stream stream(m_map, m_size);
+    if( ! stream.skip(m_data_offset) ||
+	stream.read(out, nbytes) != size_t(nbytes) )
+      throw_invalid("Truncated data in " + m_filename);
+    return;
+  }
+
+  // members overlapping data
+  const long long start = m_data_offset, end = m_data_offset + nbytes;
+  std::vector<const member*> todo;
+  for(size_t i=0; i<m_members.size(); ++i) {
+    const member& m = m_members[i];
+    if( m.uoffset < end && m.uoffset+m.usize > start && m.usize > 0 )
+      todo.push_back(&m);
+  }
+  if( todo.empty() || todo.back()->uoffset + todo.back()->usize < end )
+    throw_invalid("Truncated data in " + m_filename);
+
+  const unsigned nworkers = no_workers(m_threads, todo.size());
+  std::vector< std::vector<unsigned char> > bufs(nworkers);
+
+  parallel_items
+    (m_threads, todo.size(),
+     [&](size_t i, unsigned w) {
+      const member& m = *todo[i];
+      const unsigned char* in = m_map + m.offset;
+
+      if( m.uoffset >= start && m.uoffset+m.usize <= end ) {
+	// member is entirely in data, so write directly
+	if( ! inflate_member(in, m.size, out + (m.uoffset-start), m.usize) )
+	  throw_invalid("Corrupt gzip data in " + m_filename);
+      } else {
+	// only copy overlapping part
+	std::vector<unsigned char>& buf = bufs[w];
+	buf.resize(m.usize);
+	if( ! inflate_member(in, m.size, &buf[0], m.usize) )
+	  throw_invalid("Corrupt gzip data in " + m_filename);
+	const long long lo = std::max(start, m.uoffset);
+	const long long hi = std::min(end, m.uoffset+m.usize);
+	std::memcpy(out + (lo-start), &buf[lo-m.uoffset], hi-lo);
+      }
+    });
+}
+
+template<class T> void dm::gzip_image::create_memimage(memimage<T> **im)
+{
+  const unsigned bytepix = std::abs(m_bitpix)/8;
+  const size_t npix = size_t(m_xw)*m_yw;
+  const long long nbytes = (long long)(npix)*bytepix;
+
+  memimage<T>* out = new memimage<T>(m_xw, m_yw);
+  T* data = out->data();
+
+  try {
+    // decompress straight into the image if the types match, else
+    // into a buffer for conversion
+    const bool direct = matching_bitpix<T>() == m_bitpix &&
+      m_bscale == 1 && m_bzero == 0 && ! m_have_blank;
+    std::vector<unsigned char> buf;
+    unsigned char* raw;
+    if( direct )
+      raw = reinterpret_cast<unsigned char*>(data);
+    else {
+      buf.resize(nbytes);
+      raw = &buf[0];
+    }
+
+    read_data(raw, nbytes);
+
+    if( m_bscale == 1 && m_bzero == 0 && ! m_have_blank &&
+	( m_bitpix > 0 || ! std::numeric_limits<T>::is_integer ) ) {
+      // no scaling, so just convert from big endian
+      convert_big_endian(data, raw, m_bitpix, npix, m_threads);
+    } else {
+      // convert rows from big endian and scale, in bands of rows
+      const unsigned band = 64;
+      const double nan = std::numeric_limits<double>::quiet_NaN();
+      std::vector< std::vector<double> > vals(no_workers(m_threads, m_yw));
+      parallel_items
+	(m_threads, (m_yw + band - 1) / band,
+	 [&](size_t b, unsigned w) {
+	  const size_t i0 = b*band*size_t(m_xw);
+	  const size_t i1 = std::min(npix, (b+1)*band*size_t(m_xw));
+	  std::vector<double>& v = vals[w];
+	  v.resize(i1-i0);
+	  convert_big_endian(&v[0], raw + i0*bytepix, m_bitpix, i1-i0, 1);
+	  for(size_t i=i0; i<i1; ++i) {
+	    double x = v[i-i0];
+	    if( m_have_blank && (long long)(x) == m_blank )
+	      x = nan;
+	    else
+	      x = x*m_bscale + m_bzero;
+
+	    if( std::numeric_limits<T>::is_integer && ! std::isfinite(x) )
+	      data[i] = T(0);
+	    else
+	      data[i] = T(x);
+	  }
+	});
+    }
+  } catch( ... ) {
+    delete out;
+    throw;
+  }
+
+  *im = out;
+}
+
+bool dm::gzip_image::is_gzipped(const std::string& filename)
+{
+  const int fd = ::open(filename.c_str(), O_RDONLY);
+  if( fd < 0 )
+    return false;
+  unsigned char magic[2];
+  const bool gz = ::read(fd, magic, 2) == 2 &&
+    magic[0] == 0x1f && magic[1] == 0x8b;
+  ::close(fd);
+  return gz;
+}
+
+#define DM_DEFINE_TEMPL(TYPE) \
+ template void \
+  dm::gzip_image::create_memimage(memimage<TYPE> **im);
+
+DM_DEFINE_TEMPL(short)
+DM_DEFINE_TEMPL(long)
+DM_DEFINE_TEMPL(float)
+DM_DEFINE_TEMPL(double)
+DM_DEFINE_TEMPL(unsigned char)
+DM_DEFINE_TEMPL(unsigned short)
+DM_DEFINE_TEMPL(unsigned long)
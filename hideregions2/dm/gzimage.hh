@@ -0,0 +1,78 @@
+#ifndef DM_GZIMAGE_HH
+#define DM_GZIMAGE_HH
+
+#include <string>
+#include <vector>
+
+#include "general.hh"
+#include "memimage.hh"
+
+namespace dm
+{
+  // image in a gzip-compressed FITS file (e.g. .fits.gz), read directly
+  // without the DM, and decompressed straight into the image rather
+  // than to a temporary file.
+  //
+  // Files made of many gzip members with recorded sizes (BGZF, as
+  // written by bgzip) are decompressed in parallel, member by
+  // member. Other gzip files can only be decompressed as a single
+  // stream, though the conversion of the values is still parallel.
+  //
+  // The image is the primary image, or the first 2D image extension.
+  class gzip_image
+  {
+  public:
+    gzip_image(const std::string& filename);
+    ~gzip_image();
+
+    void get_dimensions(pix_vec* retn) const;
+
+    // threads decompressing the data (0 is the number of cores)
+    void set_threads(unsigned n) { m_threads = n; }
+
+    // can the file be decompressed in parallel?
+    bool is_blocked() const { return m_blocked; }
+
+    // read the image
+    template<class T> void create_memimage(memimage<T> **im);
+
+  public:
+    // static functions
+
+    // is the file gzip compressed?
+    static bool is_gzipped(const std::string& filename);
+
+  private:
+    gzip_image(const gzip_image& other); // disallow copy
+    gzip_image& operator=(const gzip_image& other);
+
+    void find_members();
+    void find_image();
+    void read_data(unsigned char* out, long long nbytes) const;
+
+    // a gzip member, with compressed and uncompressed ranges
+    struct member
+    {
+      size_t offset, size;
+      long long uoffset, usize;
+    };
+
+  private:
+    std::string m_filename;
+    const unsigned char* m_map;
+    size_t m_size;
+    unsigned m_threads;
+
+    bool m_blocked;
+    std::vector<member> m_members;
+
+    unsigned m_xw, m_yw;
+    int m_bitpix;
+    double m_bscale, m_bzero;
+    bool m_have_blank;
+    long long m_blank;
+    long long m_data_offset;
+  };
+}
+
+#endif
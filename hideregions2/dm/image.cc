@@ -9,8 +9,11 @@ dm::image::image(dmBlock *init)
 
 dm::image::~image()
 {
-  if( m_block != 0 )
+  // block destructor closes block, so only do it once
+  if( m_block != 0 ) {
     dmBlockClose(m_block);
+    m_block = 0;
+  }
 
   // don't do anything with descriptors (I think)
 }
@@ -61,23 +64,63 @@ template<class T> void dm::image::write_from_memimage(const memimage<T>& im)
   pix_vec lower;
   lower.push_back(1); lower.push_back(1);
 
-  // copy data
-  const std::valarray<T>& data = im.data();
-  const int size = data.size();
-  T* copy = new T[size];
-  for(int i=0; i<size; i++)
-    copy[i] = data[i];
+  set_subarray(lower, dims, im.data());
+}
+
+template<class T> void dm::image::create_memcube(memcube<T> **cube)
+{
+  pix_vec dims;
+  get_dimensions( &dims );
+
+  if( dims.size() == 2 )
+    dims.push_back(1);
+  if( dims.size() != 3 ) {
+    except_invalid_param e;
+    e.set_descr("Invalid number of dimensions in dm::image::create_memcube");
+    throw e;
+  }
+
+  pix_vec lower(3, 1);
+  T* data;
+  get_subarray(lower, dims, &data);
+
+  *cube = new memcube<T>(dims[0], dims[1], dims[2], data);
+
+  delete[] data;
+}
 
-  set_subarray(lower, dims, copy);
+template<class T> void dm::image::write_from_memcube(const memcube<T>& cube)
+{
+  pix_vec dims;
+  get_dimensions( &dims );
 
-  delete[] copy;
+  if( dims.size() == 2 )
+    dims.push_back(1);
+  if( dims.size() != 3 ) {
+    except_invalid_param e;
+    e.set_descr("Invalid number of dimensions in dm::image::write_from_memcube");
+    throw e;
+  }
+
+  if( dims[0] != cube.xw() || dims[1] != cube.yw() || dims[2] != cube.zw() ) {
+    except_invalid_param e;
+    e.set_descr("Dimensions of cube and data block not matched");
+    throw e;
+  }
+
+  pix_vec lower(3, 1);
+  set_subarray(lower, dims, cube.data());
 }
 
 #define DM_DEFINE_TEMPL(TYPE) \
  template void \
   dm::image::create_memimage(memimage<TYPE> **im); \
  template void \
-  dm::image::write_from_memimage(const memimage<TYPE>& im);
+  dm::image::write_from_memimage(const memimage<TYPE>& im); \
+ template void \
+  dm::image::create_memcube(memcube<TYPE> **cube); \
+ template void \
+  dm::image::write_from_memcube(const memcube<TYPE>& cube);
 
 DM_DEFINE_TEMPL(short)
 DM_DEFINE_TEMPL(long)
@@ -4,6 +4,7 @@
 #include "block.hh"
 #include "descriptor.hh"
 #include "memimage.hh"
+#include "memcube.hh"
 
 namespace dm
 {
@@ -17,6 +18,11 @@ namespace dm
     // write memory image to disk (note - must be same size!)
     template<class T> void write_from_memimage(const memimage<T>& im);
 
+    // create an in-memory cube from a 3D (or 2D) image
+    template<class T> void create_memcube(memcube<T> **cube);
+    // write cube to disk (must be same size)
+    template<class T> void write_from_memcube(const memcube<T>& cube);
+
   protected:
     image(dmBlock *init);  // protected constructor
     
@@ -0,0 +1,119 @@
+#include <numeric>
+
+#include "maskimage.hh"
+
+dm::mask_image::mask_image(unsigned xw, unsigned yw, bool val)
+  : m_xw(xw), m_yw(yw), m_rowwords((xw+63)/64),
+    m_words(size_t(m_rowwords)*yw)
+{
+  set_all(val);
+}
+
+dm::mask_image::mask_image(const memimage<float>& im, bit_test test)
+  : m_xw(im.xw()), m_yw(im.yw()), m_rowwords((im.xw()+63)/64),
+    m_words(size_t(m_rowwords)*im.yw())
+{
+  parallel_rows(m_yw, [&](unsigned y0, unsigned y1)
+    {
+      for(unsigned y=y0; y<y1; ++y)
+	float_to_bits(row(y), im.row(y), m_xw, test, 1);
+    });
+}
+
+void dm::mask_image::set_all(bool val)
+{
+  std::fill(m_words.begin(), m_words.end(), val ? ~uint64_t(0) : 0);
+  if( val )
+    clear_padding();
+}
+
+void dm::mask_image::clear_padding()
+{
+  if( (m_xw & 63) == 0 )
+    return;
+  const uint64_t keep = (uint64_t(1) << (m_xw & 63)) - 1;
+  for(unsigned y=0; y<m_yw; ++y)
+    row(y)[m_rowwords-1] &= keep;
+}
+
+void dm::mask_image::to_image(memimage<float>* out, float val0,
+			      float val1) const
+{
+  if( out->xw() != m_xw || out->yw() != m_yw )
+    throw memimage<float>::size_mismatch_exception();
+
+  parallel_rows(m_yw, [&](unsigned y0, unsigned y1)
+    {
+      for(unsigned y=y0; y<y1; ++y)
+	bits_to_float(out->row(y), row(y), m_xw, val0, val1, 1);
+    });
+}
+
+size_t dm::mask_image::count() const
+{
+  std::vector<size_t> counts(m_yw);
+  parallel_rows(m_yw, [&](unsigned y0, unsigned y1)
+    {
+      for(unsigned y=y0; y<y1; ++y) {
+	const uint64_t* r = row(y);
+	size_t c = 0;
+	for(unsigned i=0; i<m_rowwords; ++i)
+	  c += unsigned(__builtin_popcountll(r[i]));
+	counts[y] = c;
+      }
+    });
+  return std::accumulate(counts.begin(), counts.end(), size_t(0));
+}
+
+dm::mask_image& dm::mask_image::operator &= (const mask_image& other)
+{
+  if( other.m_xw != m_xw || other.m_yw != m_yw )
+    throw size_mismatch_exception();
+  uint64_t* d = m_words.data();
+  const uint64_t* o = other.m_words.data();
+  parallel_for(m_words.size(), size_t(1) << 16, [&](size_t i0, size_t i1)
+    {
+      for(size_t i=i0; i<i1; ++i)
+	d[i] &= o[i];
+    });
+  return *this;
+}
+
+dm::mask_image& dm::mask_image::operator |= (const mask_image& other)
+{
+  if( other.m_xw != m_xw || other.m_yw != m_yw )
+    throw size_mismatch_exception();
+  uint64_t* d = m_words.data();
+  const uint64_t* o = other.m_words.data();
+  parallel_for(m_words.size(), size_t(1) << 16, [&](size_t i0, size_t i1)
+    {
+      for(size_t i=i0; i<i1; ++i)
+	d[i] |= o[i];
+    });
+  return *this;
+}
+
+dm::mask_image& dm::mask_image::and_not(const mask_image& other)
+{
+  if( other.m_xw != m_xw || other.m_yw != m_yw )
+    throw size_mismatch_exception();
+  uint64_t* d = m_words.data();
+  const uint64_t* o = other.m_words.data();
+  parallel_for(m_words.size(), size_t(1) << 16, [&](size_t i0, size_t i1)
+    {
+      for(size_t i=i0; i<i1; ++i)
+	d[i] &= ~o[i];
+    });
+  return *this;
+}
+
+void dm::mask_image::invert()
+{
+  uint64_t* d = m_words.data();
+  parallel_for(m_words.size(), size_t(1) << 16, [&](size_t i0, size_t i1)
+    {
+      for(size_t i=i0; i<i1; ++i)
+	d[i] = ~d[i];
+    });
+  clear_padding();
+}
@@ -0,0 +1,138 @@
+#ifndef DM_MASKIMAGE_HH
+#define DM_MASKIMAGE_HH
+
+#include <vector>
+#include <algorithm>
+#include <stdint.h>
+
+#include "convert.hh"
+#include "memimage.hh"
+#include "parallel.hh"
+
+namespace dm
+{
+  // Image of single bit pixels, e.g. a mask of the pixels to use or
+  // the pixels in regions. Each row is held in 64 bit words (pixel x
+  // is bit x%64 of word x/64), so set operations work on 64 pixels at
+  // once, and the mask is 1/32 of the size of a float image. Bits
+  // past the end of a row are always clear.
+  class mask_image
+  {
+  public:
+    // mask of xw*yw pixels, all set to val
+    mask_image(unsigned xw, unsigned yw, bool val = false);
+    // pixels of im passing test (see convert.hh)
+    explicit mask_image(const memimage<float>& im,
+			bit_test test = bits_positive);
+
+    unsigned xw() const { return m_xw; }
+    unsigned yw() const { return m_yw; }
+    unsigned row_words() const { return m_rowwords; }
+
+    bool get(unsigned x, unsigned y) const
+    {
+      return (row(y)[x >> 6] >> (x & 63)) & 1;
+    }
+    void set(unsigned x, unsigned y, bool val = true)
+    {
+      const uint64_t bit = uint64_t(1) << (x & 63);
+      uint64_t& w = row(y)[x >> 6];
+      w = val ? (w | bit) : (w & ~bit);
+    }
+
+    // words of row y
+    uint64_t* row(unsigned y) { return &m_words[size_t(y)*m_rowwords]; }
+    const uint64_t* row(unsigned y) const
+    { return &m_words[size_t(y)*m_rowwords]; }
+
+    void set_all(bool val);
+
+    // set pixels (x, y) in the box x0..x1, y0..y1 (inclusive) where
+    // inside(x, y) is true, e.g. to rasterise a region. inside is
+    // called from several threads at once.
+    template<class F> void set_where(unsigned x0, unsigned y0,
+				     unsigned x1, unsigned y1, F inside);
+
+    // write the mask into out (the same size) as val1 where set,
+    // else val0
+    void to_image(memimage<float>* out, float val0 = 0,
+		  float val1 = 1) const;
+
+    // number of set pixels
+    size_t count() const;
+
+    // call func(x0, x1) for each run of set pixels x0 <= x < x1 in
+    // row y, in order
+    template<class F> void for_each_run(unsigned y, F func) const;
+
+    class size_mismatch_exception {};
+
+    // set operations with another mask of the same size
+    mask_image& operator &= (const mask_image& other);
+    mask_image& operator |= (const mask_image& other);
+    // clear the pixels set in other
+    mask_image& and_not(const mask_image& other);
+    // invert all the pixels
+    void invert();
+
+  private:
+    // clear the bits past the end of each row
+    void clear_padding();
+
+  private:
+    unsigned m_xw, m_yw, m_rowwords;
+    std::vector<uint64_t> m_words;
+  };
+
+  template<class F> void mask_image::set_where(unsigned x0, unsigned y0,
+					       unsigned x1, unsigned y1,
+					       F inside)
+  {
+    if( m_xw == 0 || m_yw == 0 || x0 >= m_xw || y0 >= m_yw ||
+	x1 < x0 || y1 < y0 )
+      return;
+    x1 = std::min(x1, m_xw-1);
+    y1 = std::min(y1, m_yw-1);
+
+    // threads have separate rows, so do not share words
+    parallel_rows(y1-y0+1, [&](unsigned r0, unsigned r1)
+      {
+	for(unsigned y=y0+r0; y<y0+r1; ++y)
+	  for(unsigned x=x0; x<=x1; ++x)
+	    if( inside(x, y) )
+	      set(x, y);
+      });
+  }
+
+  template<class F> void mask_image::for_each_run(unsigned y, F func) const
+  {
+    const uint64_t* r = row(y);
+    unsigned w = 0;
+    uint64_t b = m_rowwords > 0 ? r[0] : 0;
+    for(;;) {
+      // next set pixel (b holds the bits of word w not yet looked at)
+      while( b == 0 ) {
+	if( ++w >= m_rowwords )
+	  return;
+	b = r[w];
+      }
+      const unsigned start = w*64 + unsigned(__builtin_ctzll(b));
+
+      // next clear pixel after it
+      b = ~b & ~((uint64_t(1) << (start & 63)) - 1);
+      while( b == 0 ) {
+	if( ++w >= m_rowwords ) {
+	  func(start, m_xw);
+	  return;
+	}
+	b = ~r[w];
+      }
+      const unsigned end = w*64 + unsigned(__builtin_ctzll(b));
+      func(start, end);
+
+      b = ~b & ~((uint64_t(1) << (end & 63)) - 1);
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,84 @@
+#ifndef DM_MEMCUBE_HH
+#define DM_MEMCUBE_HH
+
+#include <vector>
+#include <algorithm>
+
+#include "memimage.hh"
+#include "parallel.hh"
+
+namespace dm {
+
+  // a stack of zw images of xw*yw pixels in one allocation, stored
+  // plane by plane (as a FITS cube)
+  template<class T> class memcube
+  {
+  public:
+    // blank cube
+    memcube(const unsigned xw, const unsigned yw, const unsigned zw,
+	    const T val = 0)
+      : m_xw(xw), m_yw(yw), m_zw(zw), m_data( size_t(xw)*yw*zw, val )
+    {}
+
+    // initialise from C-style array
+    memcube(const unsigned xw, const unsigned yw, const unsigned zw,
+	    const T* data)
+      : m_xw(xw), m_yw(yw), m_zw(zw),
+	m_data( data, data + size_t(xw)*yw*zw )
+    {}
+
+    // set all the pixels
+    void set_all(const T val = 0)
+    { std::fill(m_data.begin(), m_data.end(), val); }
+
+    // get access to pixels
+    T& operator() (const unsigned x, const unsigned y, const unsigned z)
+    { return m_data[(size_t(z)*m_yw + y)*m_xw + x]; }
+    T operator() (const unsigned x, const unsigned y, const unsigned z) const
+    { return m_data[(size_t(z)*m_yw + y)*m_xw + x]; }
+
+    // get pointer to start of plane
+    T* plane_data(const unsigned z)
+    { return &m_data[size_t(z)*m_xw*m_yw]; }
+    const T* plane_data(const unsigned z) const
+    { return &m_data[size_t(z)*m_xw*m_yw]; }
+
+    // get an image using the memory of a plane, without copying.
+    // Assigning the view to another memimage copies the data.
+    memimage<T> plane(const unsigned z)
+    { return memimage<T>(m_xw, m_yw, plane_data(z), borrow); }
+    const memimage<T> plane(const unsigned z) const
+    {
+      return memimage<T>(m_xw, m_yw, const_cast<T*>(plane_data(z)),
+			 borrow);
+    }
+
+    // call func(z, plane) for each plane, with the planes shared
+    // between threads (threads=0 is the number of cores)
+    template<class F> void for_each_plane(const F& func,
+					  unsigned threads = 0)
+    {
+      parallel_items
+	(threads, m_zw,
+	 [this, &func](size_t z, unsigned) {
+	  memimage<T> p = plane(unsigned(z));
+	  func(unsigned(z), p);
+	});
+    }
+
+    // return information about the cube
+    unsigned xw() const { return m_xw; }
+    unsigned yw() const { return m_yw; }
+    unsigned zw() const { return m_zw; }
+    size_t nelem() const { return m_data.size(); }
+    const T* data() const { return m_data.data(); }
+    T* data() { return m_data.data(); }
+
+  private:
+    unsigned m_xw, m_yw, m_zw;
+    std::vector<T> m_data;
+  };
+
+} // namespace
+
+#endif
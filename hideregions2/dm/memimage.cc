@@ -8,7 +8,8 @@ template<class T> dm::memimage<T>::memimage(const std::string& filename)
 
   file >> m_xw >> m_yw;
 
-  m_data.resize(m_xw*m_yw);
+  m_store.resize(size_t(m_xw)*m_yw);
+  m_data = m_store.data();
   if( file )
     {
       for(unsigned y=0; y<m_yw; ++y)
@@ -1,31 +1,65 @@
 #ifndef DM_MEMIMAGE_HH
 #define DM_MEMIMAGE_HH
 
-#include <valarray>
+#include <vector>
 #include <string>
 #include <limits>
 #include <algorithm>
 
+#include "convert.hh"
+#include "parallel.hh"
+
 namespace dm {
 
+  // tag to construct a memimage using existing memory
+  struct borrow_t {};
+  const borrow_t borrow = borrow_t();
+
   template<class T> class memimage
   {
   public:
     // blank image
     memimage(const unsigned xw, const unsigned yw, const T val = 0)
-      : m_xw(xw), m_yw(yw), m_data( val, xw*yw )
+      : m_xw(xw), m_yw(yw), m_store( size_t(xw)*yw, val ),
+	m_data( m_store.data() )
     {}
 
-    // copy image from another
+    // copy image from another (always copies data)
     memimage(const memimage<T>& other)
-      : m_xw( other.m_xw ), m_yw( other.m_yw ), m_data( other.m_data )
+      : m_xw( other.m_xw ), m_yw( other.m_yw ),
+	m_store( other.m_data, other.m_data + other.nelem() ),
+	m_data( m_store.data() )
     {}
 
     // initialise from C-style array
     memimage(const unsigned xw, const unsigned yw, const T* data)
-      : m_xw( xw ), m_yw( yw ), m_data( data, xw*yw )
+      : m_xw( xw ), m_yw( yw ), m_store( data, data + size_t(xw)*yw ),
+	m_data( m_store.data() )
+    {}
+
+    // use existing memory of xw*yw pixels without copying (e.g. from
+    // a numpy array). The memory must outlive the image.
+    memimage(const unsigned xw, const unsigned yw, T* data, borrow_t)
+      : m_xw( xw ), m_yw( yw ), m_data( data )
     {}
 
+    // copy data from another image (resizing if necessary)
+    memimage<T>& operator = (const memimage<T>& other)
+    {
+      if( this == &other )
+	return *this;
+      if( nelem() != other.nelem() ) {
+	m_store.assign( other.m_data, other.m_data + other.nelem() );
+	m_data = m_store.data();
+      } else
+	std::copy( other.m_data, other.m_data + other.nelem(), m_data );
+      m_xw = other.m_xw; m_yw = other.m_yw;
+      return *this;
+    }
+
+    // whether the image uses memory it doesn't own
+    bool is_borrowed() const { return m_data != m_store.data(); }
+
     // initialise from other datatypes
     template<class T2> explicit memimage(const memimage<T2>& other);
     template<class T2> memimage(const unsigned xw,
@@ -37,20 +71,26 @@ namespace dm {
     void dump_to_file(const std::string &filename) const;
 
     // set all the pixels
-    void set_all(const T val = 0)  { m_data = val; }
+    void set_all(const T val = 0)  { std::fill(m_data, m_data+nelem(), val); }
 
     // get access to pixels
     T& operator() (const unsigned x, const unsigned y)
-     { return m_data[x+y*m_xw]; }
+     { return m_data[x+size_t(y)*m_xw]; }
     T operator() (const unsigned x, const unsigned y) const
-     { return m_data[x+y*m_xw]; }
+     { return m_data[x+size_t(y)*m_xw]; }
 
     // get flat access to pixels
-    T& flatdata(const unsigned i)
+    T& flatdata(const size_t i)
     { return m_data[i]; }
-    T flatdata(const unsigned i) const
+    T flatdata(const size_t i) const
     { return m_data[i]; }
 
+    // get pointer to start of row (rows are contiguous in memory)
+    T* row(const unsigned y)
+    { return &m_data[size_t(y)*m_xw]; }
+    const T* row(const unsigned y) const
+    { return &m_data[size_t(y)*m_xw]; }
+
     // checked access to pixels
     class out_of_range_exception {};
     T& pixel(const unsigned x, const unsigned y);
@@ -62,50 +102,35 @@ namespace dm {
     T max() const
     {
       // get minimum value (not smallest value)
-      T maxval = std::numeric_limits<T>::is_integer
+      const T lowest = std::numeric_limits<T>::is_integer
 	? std::numeric_limits<T>::min()
 	: -std::numeric_limits<T>::max();
 
-      const size_t len = m_xw*m_yw;
-      for( size_t i = 0; i != len; ++i )
-	maxval = std::max( maxval, m_data[i] );
-      return maxval;
+      return reduce(lowest, [](T a, T b) { return std::max(a, b); });
     }
 
     // get minimum value of image
     T min() const
     {
-      T minval = std::numeric_limits<T>::max();
-
-      const size_t len = m_xw*m_yw;
-      for( size_t i = 0; i != len; ++i )
-	minval = std::min( minval, m_data[i] );
-      return minval;
+      return reduce(std::numeric_limits<T>::max(),
+		    [](T a, T b) { return std::min(a, b); });
     }
 
     T sum() const
     {
-      T tot = 0;
-      const size_t len = m_xw*m_yw;
-      for( size_t i = 0; i != len; ++i )
-	tot += m_data[i];
-      return tot;
+      return reduce(T(0), [](T a, T b) { return a + b; });
     }
 
     // make all values <= upperval
     void trim_down(const T upperval)
     {
-      const size_t len = m_xw*m_yw;
-      for( size_t i = 0; i != len; ++i )
-	m_data[i] = std::min( m_data[i], upperval );
+      apply([upperval](T& v) { v = std::min(v, upperval); });
     }
 
     // make all values >= lowerval
     void trim_up(const T lowerval)
     {
-      const size_t len = m_xw*m_yw;
-      for( size_t i = 0; i != len; ++i )
-	m_data[i] = std::max( m_data[i], lowerval );
+      apply([lowerval](T& v) { v = std::max(v, lowerval); });
     }
 
   private:
@@ -115,49 +140,111 @@ namespace dm {
 	throw size_mismatch_exception();
     }
 
+    // pixels per chunk for parallel operations
+    static constexpr size_t parallel_chunk = size_t(1) << 18;
+
+    // call func(pixel) for each pixel
+    template<class F> void apply(F func)
+    {
+      T* d = m_data;
+      parallel_for(nelem(), parallel_chunk,
+		   [d, &func](size_t i0, size_t i1) {
+	  for( size_t i = i0; i != i1; ++i ) func(d[i]);
+	});
+    }
+
+    // call func(pixel, otherpixel) for each pixel
+    template<class F> void apply(const memimage<T>& other, F func)
+    {
+      assert_size_other(other);
+      T* d = m_data; const T* o = other.data();
+      parallel_for(nelem(), parallel_chunk,
+		   [d, o, &func](size_t i0, size_t i1) {
+	  for( size_t i = i0; i != i1; ++i ) func(d[i], o[i]);
+	});
+    }
+
   public:
-    // various operations with images
+    // combine the pixels with func, starting from init. Chunks are
+    // combined in order, so the result does not depend on the threads.
+    // func(v, x) is also used to combine the results of the chunks,
+    // so must accept them as x.
+    template<class F> T reduce(const T init, F func) const
+    {
+      const size_t len = nelem();
+      std::vector<T> parts((len + parallel_chunk - 1) / parallel_chunk, init);
+      const T* d = m_data;
+      parallel_for(len, parallel_chunk,
+		   [d, init, &parts, &func](size_t i0, size_t i1) {
+	  T v = init;
+	  for( size_t i = i0; i != i1; ++i ) v = func(v, d[i]);
+	  parts[i0 / parallel_chunk] = v;
+	});
+      T v = init;
+      for( size_t c = 0; c != parts.size(); ++c ) v = func(v, parts[c]);
+      return v;
+    }
+
+    // number of pixels where pred(pixel) is true
+    template<class P> size_t count(P pred) const
+    {
+      const size_t len = nelem();
+      std::vector<size_t> parts((len + parallel_chunk - 1) / parallel_chunk, 0);
+      const T* d = m_data;
+      parallel_for(len, parallel_chunk,
+		   [d, &parts, &pred](size_t i0, size_t i1) {
+	  size_t n = 0;
+	  for( size_t i = i0; i != i1; ++i ) n += pred(d[i]) ? 1 : 0;
+	  parts[i0 / parallel_chunk] = n;
+	});
+      size_t n = 0;
+      for( size_t c = 0; c != parts.size(); ++c ) n += parts[c];
+      return n;
+    }
+
+    // various operations with images (in parallel for large images)
     //  multiply image by another
     const memimage<T>& operator *= (const memimage<T>& other)
     {
-      assert_size_other(other); m_data *= other.data(); return *this;
+      apply(other, [](T& a, T b) { a *= b; }); return *this;
     }
     const memimage<T>& operator /= (const memimage<T>& other)
     {
-      assert_size_other(other); m_data /= other.data(); return *this;
+      apply(other, [](T& a, T b) { a /= b; }); return *this;
     }
     const memimage<T>& operator -= (const memimage<T>& other)
     {
-      assert_size_other(other); m_data -= other.data(); return *this;
+      apply(other, [](T& a, T b) { a -= b; }); return *this;
     }
     const memimage<T>& operator += (const memimage<T>& other)
     {
-      assert_size_other(other); m_data += other.data(); return *this;
+      apply(other, [](T& a, T b) { a += b; }); return *this;
     }
     
     // with constants
     const memimage<T>& operator *= (const T other)
     {
-      m_data *= other; return *this;
+      apply([other](T& a) { a *= other; }); return *this;
     }
     const memimage<T>& operator /= (const T other)
     {
-      m_data /= other; return *this;
+      apply([other](T& a) { a /= other; }); return *this;
     }
     const memimage<T>& operator -= (const T other)
     {
-      m_data -= other; return *this;
+      apply([other](T& a) { a -= other; }); return *this;
     }
     const memimage<T>& operator += (const T other)
     {
-      m_data += other; return *this;
+      apply([other](T& a) { a += other; }); return *this;
     }
 
     // return information about the image
     unsigned xw() const { return m_xw; }  // return width
     unsigned yw() const { return m_yw; }  // return height
-    unsigned nelem() const { return m_xw*m_yw; } // no elements
-    const std::valarray<T>& data() const { return m_data; } // return data
+    size_t nelem() const { return size_t(m_xw)*m_yw; } // no elements
+    const T* data() const { return m_data; } // return data
+    T* data() { return m_data; }
 
     // these make temporaries
     memimage<T> operator * (const memimage<T>& other) const
@@ -197,7 +284,8 @@ namespace dm {
     
   private:
     unsigned m_xw, m_yw;
-    std::valarray<T> m_data;
+    std::vector<T> m_store;  // storage, unless borrowed
+    T* m_data;               // pixels
   };
 
 
@@ -210,24 +298,18 @@ template<class T> template<class T2>
 dm::memimage<T>::memimage(const unsigned xw, const unsigned yw,
 			  const T2* const data)
   : m_xw(xw), m_yw(yw),
-    m_data( data, nelem() )
+    m_store( nelem() ), m_data( m_store.data() )
 {
-  const unsigned size = nelem();
-  for(unsigned i=0; i != size; ++i)
-    m_data[i] = static_cast<T>( data[i] );
+  convert_array(m_data, data, nelem());
 }
 
 // copy image of different type
 template<class T> template<class T2>
 dm::memimage<T>::memimage(const memimage<T2>& other)
   : m_xw( other.xw() ), m_yw( other.yw() ),
-    m_data( static_cast<T>(0), nelem() )
+    m_store( nelem() ), m_data( m_store.data() )
 {
-  const unsigned size = nelem();
-  const std::valarray<T2>& otherdata = other.data();
-
-  for(unsigned i=0; i != size; ++i)
-    m_data[i] = static_cast<T>(otherdata[i]);
+  convert_array(m_data, other.data(), nelem());
 }
 
 #endif
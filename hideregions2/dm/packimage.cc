@@ -0,0 +1,237 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "exception.hh"
+#include "fitsheader.hh"
+#include "parallel.hh"
+#include "convert.hh"
+#include "packimage.hh"
+
+namespace
+{
+  void throw_invalid(const std::string& descr)
+  {
+    dm::except_invalid_param e;
+    e.set_descr(descr);
+    throw e;
+  }
+
+  // write all of n bytes (large writes may be split)
+  bool write_all(int fd, const void* data, size_t n)
+  {
+    const char* p = static_cast<const char*>(data);
+    while( n > 0 ) {
+      const ssize_t w = ::write(fd, p, std::min(n, size_t(1) << 30));
+      if( w <= 0 )
+	return false;
+      p += w;
+      n -= size_t(w);
+    }
+    return true;
+  }
+
+  // pixels per chunk for parallel loops
+  const size_t chunk_size = size_t(1) << 18;
+
+  inline void put_be16(unsigned char* p, uint16_t v)
+  {
+    p[0] = (unsigned char)(v >> 8);
+    p[1] = (unsigned char)(v);
+  }
+
+  inline void put_be32(unsigned char* p, float f)
+  {
+    uint32_t v;
+    std::memcpy(&v, &f, sizeof(v));
+    p[0] = (unsigned char)(v >> 24);
+    p[1] = (unsigned char)(v >> 16);
+    p[2] = (unsigned char)(v >> 8);
+    p[3] = (unsigned char)(v);
+  }
+}
+
+dm::packed_image::packed_image(const memimage<float>& im, pack_format fmt)
+  : m_xw(im.xw()), m_yw(im.yw()), m_format(fmt), m_bscale(1), m_bzero(0),
+    m_data(im.nelem())
+{
+  if( fmt == pack_scaled ) {
+    float minval, maxval;
+    if( finite_range(im, &minval, &maxval) )
+      range_scaling(minval, maxval, &m_bscale, &m_bzero);
+  }
+  pack(im);
+}
+
+dm::packed_image::packed_image(const memimage<float>& im,
+			       float bscale, float bzero)
+  : m_xw(im.xw()), m_yw(im.yw()), m_format(pack_scaled),
+    m_bscale(bscale), m_bzero(bzero), m_data(im.nelem())
+{
+  if( !(bscale > 0) || ! std::isfinite(bscale) || ! std::isfinite(bzero) )
+    throw_invalid("Invalid scaling in dm::packed_image");
+  pack(im);
+}
+
+void dm::packed_image::pack(const memimage<float>& im)
+{
+  const float* in = im.data();
+  uint16_t* out = m_data.data();
+  const size_t n = m_data.size();
+  if( m_format == pack_half )
+    float_to_half(out, in, n);
+  else
+    float_to_scaled(reinterpret_cast<short*>(out), in, n, m_bscale, m_bzero);
+}
+
+void dm::packed_image::get_row(unsigned y, float* out) const
+{
+  // rows are short, so are converted in this thread
+  const uint16_t* in = raw_row(y);
+  if( m_format == pack_half )
+    half_to_float(out, in, m_xw, 1);
+  else
+    scaled_to_float(out, reinterpret_cast<const short*>(in), m_xw,
+		    m_bscale, m_bzero, 1);
+}
+
+void dm::packed_image::unpack(memimage<float>* out) const
+{
+  if( out->xw() != m_xw || out->yw() != m_yw )
+    throw memimage<float>::size_mismatch_exception();
+
+  const uint16_t* in = m_data.data();
+  const size_t n = m_data.size();
+  if( m_format == pack_half )
+    half_to_float(out->data(), in, n);
+  else
+    scaled_to_float(out->data(), reinterpret_cast<const short*>(in), n,
+		    m_bscale, m_bzero);
+}
+
+bool dm::packed_image::finite_range(const memimage<float>& im,
+				    float* minval, float* maxval)
+{
+  const size_t n = im.nelem();
+  const size_t nchunks = (n + chunk_size - 1) / chunk_size;
+  std::vector<float> mins(nchunks, std::numeric_limits<float>::max());
+  std::vector<float> maxs(nchunks, -std::numeric_limits<float>::max());
+
+  const float* d = im.data();
+  parallel_for(n, chunk_size, [&](size_t i0, size_t i1)
+    {
+      float lo = std::numeric_limits<float>::max();
+      float hi = -std::numeric_limits<float>::max();
+      for(size_t i=i0; i<i1; ++i)
+	if( std::isfinite(d[i]) ) {
+	  lo = std::min(lo, d[i]);
+	  hi = std::max(hi, d[i]);
+	}
+      mins[i0/chunk_size] = lo;
+      maxs[i0/chunk_size] = hi;
+    });
+
+  if( nchunks == 0 )
+    return false;
+  *minval = *std::min_element(mins.begin(), mins.end());
+  *maxval = *std::max_element(maxs.begin(), maxs.end());
+  return *minval <= *maxval;
+}
+
+void dm::packed_image::range_scaling(float minval, float maxval,
+				     float* bscale, float* bzero)
+{
+  // integers -32767..32767 (-32768 is blank)
+  *bzero = float(0.5*(double(minval) + maxval));
+  const double range = double(maxval) - minval;
+  *bscale = range > 0 ? float(range / 65534.) : 1.f;
+}
+
+void dm::packed_image::write(const std::string& filename,
+			     const std::vector<const packed_image*>& planes,
+			     open_mode mode)
+{
+  if( mode != create && mode != create_over )
+    throw_invalid("Invalid mode in dm::packed_image::write");
+  if( planes.empty() )
+    throw_invalid("No images in dm::packed_image::write");
+
+  const packed_image& first = *planes.front();
+  for(size_t i=1; i<planes.size(); ++i) {
+    const packed_image& p = *planes[i];
+    if( p.xw() != first.xw() || p.yw() != first.yw() ||
+	p.format() != first.format() )
+      throw_invalid("Images differ in dm::packed_image::write");
+    if( p.format() == pack_scaled &&
+	(p.bscale() != first.bscale() || p.bzero() != first.bzero()) )
+      throw_invalid("Scaling differs in dm::packed_image::write");
+  }
+
+  const bool scaled = first.format() == pack_scaled;
+  std::vector<std::string> cards;
+  cards.push_back(fits_card_bool("SIMPLE", true, "file conforms to FITS"));
+  cards.push_back(fits_card_int("BITPIX", scaled ? 16 : -32));
+  cards.push_back(fits_card_int("NAXIS", planes.size() > 1 ? 3 : 2));
+  cards.push_back(fits_card_int("NAXIS1", first.xw()));
+  cards.push_back(fits_card_int("NAXIS2", first.yw()));
+  if( planes.size() > 1 )
+    cards.push_back(fits_card_int("NAXIS3", (long long)(planes.size())));
+  if( scaled ) {
+    cards.push_back(fits_card_real("BSCALE", first.bscale()));
+    cards.push_back(fits_card_real("BZERO", first.bzero()));
+    cards.push_back(fits_card_int("BLANK", scaled_blank));
+  }
+  const std::string header = fits_header_block(cards);
+
+  const int flags = O_WRONLY | O_CREAT | (mode == create ? O_EXCL : O_TRUNC);
+  const int fd = ::open(filename.c_str(), flags, 0666);
+  if( fd < 0 ) {
+    except_unable_to_create e;
+    e.set_descr("Cannot create file " + filename);
+    throw e;
+  }
+
+  bool ok = write_all(fd, header.data(), header.size());
+
+  // each plane is converted to big endian in parallel, then written
+  const unsigned bytepix = scaled ? 2 : 4;
+  const size_t npix = size_t(first.xw())*first.yw();
+  std::vector<unsigned char> buf(npix*bytepix);
+  for(size_t p=0; p<planes.size() && ok; ++p) {
+    const packed_image& plane = *planes[p];
+    parallel_rows(plane.yw(), [&](unsigned y0, unsigned y1)
+      {
+	std::vector<float> row(scaled ? 0 : plane.xw());
+	for(unsigned y=y0; y<y1; ++y) {
+	  unsigned char* out = &buf[size_t(y)*plane.xw()*bytepix];
+	  if( scaled ) {
+	    const uint16_t* in = plane.raw_row(y);
+	    for(unsigned x=0; x<plane.xw(); ++x)
+	      put_be16(out + 2*x, in[x]);
+	  } else {
+	    plane.get_row(y, row.data());
+	    for(unsigned x=0; x<plane.xw(); ++x)
+	      put_be32(out + 4*x, row[x]);
+	  }
+	}
+      });
+    ok = write_all(fd, buf.data(), buf.size());
+  }
+
+  // pad to block
+  const long long datasize = (long long)(npix)*bytepix*planes.size();
+  const std::string pad((fits_block - datasize % fits_block) % fits_block,
+			'\0');
+  ok = ok && write_all(fd, pad.data(), pad.size());
+  ok = (::close(fd) == 0) && ok;
+
+  if( ! ok ) {
+    except_unable_to_create e;
+    e.set_descr("Error writing file " + filename);
+    throw e;
+  }
+}
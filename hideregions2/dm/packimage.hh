@@ -0,0 +1,87 @@
+#ifndef DM_PACKIMAGE_HH
+#define DM_PACKIMAGE_HH
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include "general.hh"
+#include "memimage.hh"
+
+namespace dm
+{
+  // how packed_image stores its values
+  enum pack_format
+    {
+      pack_half,    // IEEE half precision (about 3 significant digits)
+      pack_scaled   // 16 bit integers scaled by bscale and bzero
+    };
+
+  // floating point image held in 16 bits per pixel, for images which
+  // are only needed to a few significant digits (e.g. GGM images at
+  // several scales which are combined interactively). This is half
+  // the memory of memimage<float>. Values are converted to float a
+  // row at a time when read.
+  //
+  // Half precision keeps the relative accuracy of small values, but
+  // values above 65504 become infinite. Scaled integers have a fixed
+  // step of bscale (1/65534 of the range of the image, by default).
+  // NaN is kept by both.
+  class packed_image
+  {
+  public:
+    // pack image. Scaled values cover the range of the finite values.
+    packed_image(const memimage<float>& im, pack_format fmt);
+    // pack image as integers with the given scaling
+    packed_image(const memimage<float>& im, float bscale, float bzero);
+
+    unsigned xw() const { return m_xw; }
+    unsigned yw() const { return m_yw; }
+    pack_format format() const { return m_format; }
+    float bscale() const { return m_bscale; }
+    float bzero() const { return m_bzero; }
+
+    // bytes used by the pixels
+    size_t nbytes() const { return m_data.size()*sizeof(uint16_t); }
+
+    // convert row y to xw values in out
+    void get_row(unsigned y, float* out) const;
+    // convert whole image (out must be the same size)
+    void unpack(memimage<float>* out) const;
+
+    // packed values of a row (half values, or shorts if scaled)
+    const uint16_t* raw_row(unsigned y) const
+    { return &m_data[size_t(y)*m_xw]; }
+
+  public:
+    // static functions
+
+    // get the range of the finite values in im, returning false if
+    // there are none
+    static bool finite_range(const memimage<float>& im,
+			     float* minval, float* maxval);
+    // scaling of integers covering minval to maxval
+    static void range_scaling(float minval, float maxval,
+			      float* bscale, float* bzero);
+
+    // write images of the same size and format to a FITS file, as a
+    // cube if there is more than one. Scaled images must have the
+    // same scaling, and are written with BITPIX=16 and the BSCALE,
+    // BZERO and BLANK keywords. FITS has no half precision type, so
+    // half images are written as 32 bit floats.
+    static void write(const std::string& filename,
+		      const std::vector<const packed_image*>& planes,
+		      open_mode mode = create_over);
+
+  private:
+    void pack(const memimage<float>& im);
+
+  private:
+    unsigned m_xw, m_yw;
+    pack_format m_format;
+    float m_bscale, m_bzero;
+    std::vector<uint16_t> m_data;
+  };
+}
+
+#endif
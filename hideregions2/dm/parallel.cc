@@ -0,0 +1,184 @@
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdlib>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "parallel.hh"
+
+namespace
+{
+  std::atomic<unsigned> nthreads_setting(0);
+
+  unsigned default_threads()
+  {
+    static const unsigned n = []() {
+      const char* env = std::getenv("DM_THREADS");
+      if( env != 0 && std::atoi(env) > 0 )
+	return unsigned(std::atoi(env));
+      return std::max(1u, std::thread::hardware_concurrency());
+    }();
+    return n;
+  }
+
+  // a call to run_tasks
+  struct job
+  {
+    job(size_t n, unsigned maxw,
+	const std::function<void(size_t, unsigned)>& f)
+      : func(f), ntasks(n), maxworkers(maxw), next(0), joined(1),
+	active(1)
+    {}
+
+    const std::function<void(size_t, unsigned)>& func;
+    const size_t ntasks;
+    const unsigned maxworkers;
+    std::atomic<size_t> next;
+    // threads which have joined and are still working (pool lock)
+    unsigned joined, active;
+
+    std::mutex errmutex;
+    std::exception_ptr error;
+
+    bool joinable() const { return joined < maxworkers && next < ntasks; }
+
+    // take tasks until there are none left
+    void work(unsigned worker)
+    {
+      try {
+	for(;;) {
+	  const size_t i = next++;
+	  if( i >= ntasks )
+	    break;
+	  func(i, worker);
+	}
+      } catch( ... ) {
+	std::lock_guard<std::mutex> lock(errmutex);
+	if( ! error )
+	  error = std::current_exception();
+	next = ntasks;
+      }
+    }
+  };
+
+  // threads waiting for jobs. Jobs are queued, and idle threads join
+  // the first job which still has tasks left and room for a worker.
+  class pool
+  {
+  public:
+    pool() : m_stop(false) {}
+
+    ~pool()
+    {
+      {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_stop = true;
+      }
+      m_work.notify_all();
+      for(size_t i=0; i<m_threads.size(); ++i)
+	m_threads[i].join();
+    }
+
+    void run(job& j)
+    {
+      {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	// the pool only grows, but each job limits its own workers
+	while( m_threads.size() < j.maxworkers-1 )
+	  m_threads.push_back(std::thread(&pool::loop, this));
+	m_jobs.push_back(&j);
+      }
+      m_work.notify_all();
+
+      j.work(0);
+
+      std::unique_lock<std::mutex> lock(m_mutex);
+      remove(&j);
+      --j.active;
+      m_done.wait(lock, [&j]() { return j.active == 0; });
+    }
+
+  private:
+    void remove(job* j)
+    {
+      std::deque<job*>::iterator i =
+	std::find(m_jobs.begin(), m_jobs.end(), j);
+      if( i != m_jobs.end() )
+	m_jobs.erase(i);
+    }
+
+    void loop()
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      for(;;) {
+	job* j = 0;
+	while( ! m_jobs.empty() ) {
+	  if( m_jobs.front()->joinable() ) {
+	    j = m_jobs.front();
+	    break;
+	  }
+	  m_jobs.pop_front();
+	}
+
+	if( j == 0 ) {
+	  if( m_stop )
+	    return;
+	  m_work.wait(lock);
+	  continue;
+	}
+
+	const unsigned worker = j->joined++;
+	++j->active;
+	lock.unlock();
+	j->work(worker);
+	lock.lock();
+	if( --j->active == 0 )
+	  m_done.notify_all();
+      }
+    }
+
+  private:
+    std::mutex m_mutex;
+    std::condition_variable m_work, m_done;
+    std::deque<job*> m_jobs;
+    std::vector<std::thread> m_threads;
+    bool m_stop;
+  };
+
+  pool& get_pool()
+  {
+    static pool p;
+    return p;
+  }
+}
+
+unsigned dm::get_threads()
+{
+  const unsigned n = nthreads_setting;
+  return n == 0 ? default_threads() : n;
+}
+
+void dm::set_threads(unsigned nthreads)
+{
+  nthreads_setting = nthreads;
+}
+
+void dm::run_tasks(size_t ntasks, unsigned nworkers,
+		   const std::function<void(size_t, unsigned)>& func)
+{
+  if( ntasks == 0 )
+    return;
+
+  job j(ntasks, std::max(nworkers, 1u), func);
+  if( j.maxworkers == 1 || ntasks == 1 )
+    j.work(0);
+  else
+    get_pool().run(j);
+
+  if( j.error )
+    std::rethrow_exception(j.error);
+}
@@ -0,0 +1,97 @@
+#ifndef DM_PARALLEL_HH
+#define DM_PARALLEL_HH
+
+#include <algorithm>
+#include <cstddef>
+#include <functional>
+
+namespace dm
+{
+  // Parallel loops run on a single pool of threads shared by the whole
+  // process. The thread calling a loop also does some of the work, and
+  // loops started from inside other loops, or by several threads at
+  // once, share the same threads, so the number of cores is not
+  // exceeded when several stages run together.
+  //
+  // This is not a work-stealing pool: each loop is one job in a single
+  // queue, and its threads take tasks in turn from an atomic counter.
+  // The tasks of a loop are chunks of about the same size, so taking
+  // the next one as a thread becomes free balances the load as well as
+  // stealing would, without a deque per thread.
+
+  // number of threads used by parallel loops by default: the value
+  // given to set_threads, else the DM_THREADS environment variable,
+  // else the number of cores
+  unsigned get_threads();
+  // set the number of threads (0 restores the default)
+  void set_threads(unsigned nthreads);
+
+  // number of workers to use for items (threads=0 is get_threads())
+  inline unsigned no_workers(unsigned threads, size_t items)
+  {
+    if( threads == 0 )
+      threads = get_threads();
+    return unsigned(std::max(size_t(1), std::min(size_t(threads), items)));
+  }
+
+  // call func(task, worker) for tasks [0, ntasks) using at most
+  // nworkers threads (including the calling thread). worker is an index
+  // in [0, nworkers) which is unique among the threads running at
+  // once. The first exception thrown by func is rethrown here.
+  void run_tasks(size_t ntasks, unsigned nworkers,
+		 const std::function<void(size_t, unsigned)>& func);
+
+  // call func(item, worker) for each item, where worker is the index
+  // of the thread calling it. Items are taken in turn as threads
+  // become free, so items can take different amounts of time.
+  template<class Func> void parallel_items(unsigned threads, size_t items,
+					   Func func)
+  {
+    run_tasks(items, no_workers(threads, items), func);
+  }
+
+  // call func(i0, i1) for [0, n) split into chunks of the given size.
+  // The chunks depend only on n and chunk, not on the number of
+  // threads, so combining per-chunk results in chunk order gives the
+  // same answer however many threads are used.
+  template<class Func> void parallel_for(size_t n, size_t chunk, Func func,
+					 unsigned threads = 0)
+  {
+    chunk = std::max(chunk, size_t(1));
+    const size_t nchunks = (n + chunk - 1) / chunk;
+    parallel_items(threads, nchunks, [&](size_t c, unsigned) {
+	func(c*chunk, std::min(n, (c+1)*chunk));
+      });
+  }
+
+  // call func(y0, y1) for bands of rows [0, ny). The bands depend only
+  // on ny.
+  template<class Func> void parallel_rows(unsigned ny, Func func,
+					  unsigned threads = 0)
+  {
+    const unsigned maxbands = 256;
+    const unsigned band = std::max(1u, (ny + maxbands - 1) / maxbands);
+    parallel_for(ny, band, [&](size_t y0, size_t y1) {
+	func(unsigned(y0), unsigned(y1));
+      }, threads);
+  }
+
+  // call func(x0, y0, x1, y1) for tiles (upper bounds exclusive)
+  // covering an image of xw*yw pixels
+  template<class Func> void parallel_tiles(unsigned xw, unsigned yw,
+					   unsigned tile_xw, unsigned tile_yw,
+					   Func func, unsigned threads = 0)
+  {
+    tile_xw = std::max(tile_xw, 1u);
+    tile_yw = std::max(tile_yw, 1u);
+    const size_t ntx = (xw + tile_xw - 1) / tile_xw;
+    const size_t nty = (yw + tile_yw - 1) / tile_yw;
+    parallel_items(threads, ntx*nty, [&](size_t t, unsigned) {
+	const unsigned x0 = unsigned(t % ntx) * tile_xw;
+	const unsigned y0 = unsigned(t / ntx) * tile_yw;
+	func(x0, y0, std::min(xw, x0+tile_xw), std::min(yw, y0+tile_yw));
+      });
+  }
+}
+
+#endif
@@ -0,0 +1,138 @@
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "exception.hh"
+#include "parallel.hh"
+#include "pyramid.hh"
+
+namespace
+{
+  // number of blocks of size bin covering n pixels
+  inline unsigned no_blocks(unsigned n, unsigned bin)
+  {
+    return (n+bin-1) / bin;
+  }
+}
+
+dm::memimage<float> dm::block_average(const memimage<float>& in,
+				      unsigned bin)
+{
+  if( bin == 0 ) {
+    except_invalid_param e;
+    e.set_descr("Invalid binning in dm::block_average");
+    throw e;
+  }
+
+  const unsigned xw = no_blocks(in.xw(), bin), yw = no_blocks(in.yw(), bin);
+  memimage<float> out(xw, yw);
+
+  parallel_rows(yw, [&](unsigned y0, unsigned y1)
+    {
+      std::vector<float> sum(xw);
+      std::vector<unsigned> num(xw);
+      for(unsigned y=y0; y<y1; ++y) {
+	std::fill(sum.begin(), sum.end(), 0.f);
+	std::fill(num.begin(), num.end(), 0u);
+	for(unsigned iy=y*bin; iy<std::min(in.yw(), (y+1)*bin); ++iy) {
+	  const float* row = in.row(iy);
+	  for(unsigned x=0; x<in.xw(); ++x)
+	    if( std::isfinite(row[x]) ) {
+	      sum[x/bin] += row[x];
+	      num[x/bin]++;
+	    }
+	}
+	float* o = out.row(y);
+	for(unsigned x=0; x<xw; ++x)
+	  o[x] = num[x] > 0 ? sum[x]/num[x] :
+	    std::numeric_limits<float>::quiet_NaN();
+      }
+    });
+
+  return out;
+}
+
+const unsigned dm::image_pyramid::max_levels;
+
+dm::image_pyramid::image_pyramid(const memimage<float>& im,
+				 unsigned nlevels)
+  : m_xw(im.xw()), m_yw(im.yw())
+{
+  if( nlevels > max_levels ) {
+    except_invalid_param e;
+    e.set_descr("Too many levels in dm::image_pyramid");
+    throw e;
+  }
+
+  m_levels.reserve(nlevels);
+  for(unsigned l=1; l<=nlevels; ++l)
+    m_levels.emplace_back(no_blocks(m_xw, factor(l)),
+			  no_blocks(m_yw, factor(l)));
+  if( nlevels == 0 || m_xw == 0 || m_yw == 0 )
+    return;
+
+  // Threads make bands of rows of the input covering one row of the
+  // coarsest level. Each input row is added to the sums of the level
+  // 1 row it is in. When a row of a level is complete it is written,
+  // and its sums added to those of the level above.
+  const float nan = std::numeric_limits<float>::quiet_NaN();
+  const unsigned band = factor(nlevels);
+  parallel_rows(m_levels.back().yw(), [&](unsigned b0, unsigned b1)
+    {
+      std::vector< std::vector<double> > sum(nlevels);
+      std::vector< std::vector<unsigned> > num(nlevels);
+      for(unsigned l=0; l<nlevels; ++l) {
+	sum[l].assign(m_levels[l].xw(), 0.);
+	num[l].assign(m_levels[l].xw(), 0u);
+      }
+
+      const unsigned yend = unsigned(std::min(size_t(m_yw),
+					      size_t(b1)*band));
+      for(unsigned y=b0*band; y<yend; ++y) {
+	const float* row = im.row(y);
+	double* s = sum[0].data();
+	unsigned* n = num[0].data();
+	unsigned x = 0;
+	for(; x+1<m_xw; x+=2) {
+	  const float a = row[x], b = row[x+1];
+	  const bool fa = std::isfinite(a), fb = std::isfinite(b);
+	  s[x>>1] += (fa ? a : 0.f) + (fb ? b : 0.f);
+	  n[x>>1] += unsigned(fa) + unsigned(fb);
+	}
+	if( x < m_xw && std::isfinite(row[x]) ) {
+	  s[x>>1] += row[x];
+	  n[x>>1]++;
+	}
+
+	// finish the rows completed by this input row (if a level is
+	// not complete, neither are those above it)
+	for(unsigned l=0; l<nlevels; ++l) {
+	  if( ((y+1) & (factor(l+1)-1)) != 0 && y+1 != m_yw )
+	    break;
+
+	  memimage<float>& out = m_levels[l];
+	  float* o = out.row(y >> (l+1));
+	  std::vector<double>& ls = sum[l];
+	  std::vector<unsigned>& ln = num[l];
+	  for(unsigned i=0; i<out.xw(); ++i)
+	    o[i] = ln[i] > 0 ? float(ls[i] / ln[i]) : nan;
+
+	  if( l+1 < nlevels )
+	    for(unsigned i=0; i<out.xw(); ++i) {
+	      sum[l+1][i>>1] += ls[i];
+	      num[l+1][i>>1] += ln[i];
+	    }
+	  std::fill(ls.begin(), ls.end(), 0.);
+	  std::fill(ln.begin(), ln.end(), 0u);
+	}
+      }
+    });
+}
+
+unsigned dm::image_pyramid::level_for_size(unsigned xw, unsigned yw) const
+{
+  for(unsigned l=no_levels(); l>0; --l)
+    if( level(l).xw() >= xw && level(l).yw() >= yw )
+      return l;
+  return 0;
+}
@@ -0,0 +1,51 @@
+#ifndef DM_PYRAMID_HH
+#define DM_PYRAMID_HH
+
+#include <vector>
+
+#include "memimage.hh"
+
+namespace dm
+{
+  // average image in blocks of bin*bin pixels, ignoring NaNs. Blocks
+  // at the right and top edges may be partial. Blocks without finite
+  // values are NaN.
+  memimage<float> block_average(const memimage<float>& in, unsigned bin);
+
+  // Block averaged copies of an image at 2x, 4x, 8x... smaller sizes
+  // (a mipmap), for previews which should cost the same whatever the
+  // size of the input. Level l is the average of finite values in
+  // blocks of 2^l * 2^l pixels, as block_average. All the levels are
+  // made in one pass over the input, summing each level from the sums
+  // of the level below, and together they take 1/3 of the memory of
+  // the input.
+  class image_pyramid
+  {
+  public:
+    // make levels 1..nlevels of im (nlevels up to max_levels). The
+    // input is not kept.
+    image_pyramid(const memimage<float>& im, unsigned nlevels);
+
+    static const unsigned max_levels = 16;
+
+    // size of the original image
+    unsigned xw() const { return m_xw; }
+    unsigned yw() const { return m_yw; }
+
+    unsigned no_levels() const { return unsigned(m_levels.size()); }
+    // block size of level l
+    static unsigned factor(unsigned l) { return 1u << l; }
+    // image at level l (1..no_levels())
+    const memimage<float>& level(unsigned l) const
+    { return m_levels.at(l-1); }
+
+    // coarsest level which is at least xw by yw (0 is the original)
+    unsigned level_for_size(unsigned xw, unsigned yw) const;
+
+  private:
+    unsigned m_xw, m_yw;
+    std::vector< memimage<float> > m_levels;
+  };
+}
+
+#endif
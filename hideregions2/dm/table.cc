@@ -0,0 +1,58 @@
+#include <cassert>
+#include "exception.hh"
+#include "general.hh"
+#include "table.hh"
+
+long dm::table::get_no_rows()
+{
+  assert( m_block != 0 );
+
+  return dmTableGetNoRows(m_block);
+}
+
+bool dm::table::has_column(const std::string& name)
+{
+  assert( m_block != 0 );
+
+  if( m_columns.find(name) != m_columns.end() )
+    return true;
+
+  strlike buffer(name);
+  dmDescriptor* col = dmTableOpenColumn(m_block, buffer());
+  if( col == 0 )
+    return false;
+  m_columns[name] = col;
+  return true;
+}
+
+void dm::table::read_column(const std::string& name, long firstrow,
+			    long nrows, double* vals)
+{
+  dmDescriptor* col = _get_column(name);
+
+  // DM rows start at 1
+  const long nread = dmGetScalars_d(col, vals, firstrow+1, nrows);
+  if( nread != nrows ) {
+    except_invalid_param e;
+    e.set_descr("Unable to read rows from column " + name);
+    throw e;
+  }
+}
+
+bool dm::table::get_column_range(const std::string& name, double* min,
+				 double* max)
+{
+  dmDescriptor* col = _get_column(name);
+
+  return dmDescriptorGetRange_d(col, min, max) == dmSUCCESS && *max > *min;
+}
+
+dmDescriptor* dm::table::_get_column(const std::string& name)
+{
+  if( ! has_column(name) ) {
+    except_invalid_param e;
+    e.set_descr("No column " + name + " in table");
+    throw e;
+  }
+  return m_columns[name];
+}
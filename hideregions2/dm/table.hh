@@ -0,0 +1,50 @@
+#ifndef DM_TABLE_HH
+#define DM_TABLE_HH
+
+#include <map>
+#include <string>
+#include <ascdm.h>
+
+#include "block.hh"
+
+namespace dm
+{
+  class table : public block
+  {
+  public:
+    // get number of rows in table
+    long get_no_rows();
+
+    // does the table have the named column?
+    bool has_column(const std::string& name);
+
+    // read nrows values of a scalar column, starting at firstrow
+    // (starting at 0). Reading rows in batches is much faster than
+    // reading one at a time.
+    void read_column(const std::string& name, long firstrow, long nrows,
+		     double* vals);
+
+    // get range of values allowed in column (TLMIN/TLMAX), returning
+    // false if not known
+    bool get_column_range(const std::string& name, double* min,
+			  double* max);
+
+  protected:
+    table(dmBlock *init) : block(init) {}  // protected constructor
+
+    friend class dataset;
+
+  private:
+    table(const table& other);  // disallow copy usage
+    table& operator=(const table& other); // disallow =
+
+    dmDescriptor* _get_column(const std::string& name);
+
+  private:
+    // columns opened so far
+    std::map<std::string, dmDescriptor*> m_columns;
+  };
+
+}
+
+#endif
@@ -0,0 +1,300 @@
+#include <cstring>
+#include <zlib.h>
+#include "tilecodec.hh"
+
+namespace
+{
+  // writes bits, most significant first
+  class bit_writer
+  {
+  public:
+    bit_writer(dm::codec::bytes* out) : m_out(out), m_buf(0), m_nbits(0) {}
+
+    void put(unsigned value, unsigned nbits)
+    {
+      while( nbits > 0 ) {
+	const unsigned take = std::min(nbits, 8-m_nbits);
+	const unsigned bits = (value >> (nbits-take)) & ((1u << take)-1);
+	m_buf = (m_buf << take) | bits;
+	m_nbits += take;
+	nbits -= take;
+	if( m_nbits == 8 ) {
+	  m_out->push_back((unsigned char)(m_buf));
+	  m_buf = 0;
+	  m_nbits = 0;
+	}
+      }
+    }
+
+    // write nzero zero bits followed by a one bit
+    void put_unary(unsigned nzero)
+    {
+      for( ; nzero >= 16; nzero -= 16 )
+	put(0, 16);
+      put(1, nzero+1);
+    }
+
+    void flush()
+    {
+      if( m_nbits > 0 )
+	put(0, 8-m_nbits);
+    }
+
+  private:
+    dm::codec::bytes* m_out;
+    unsigned m_buf, m_nbits;
+  };
+
+  // reads bits, most significant first
+  class bit_reader
+  {
+  public:
+    bit_reader(const unsigned char* in, size_t len)
+      : m_in(in), m_len(len), m_pos(0), m_bit(0), m_overrun(false) {}
+
+    unsigned get(unsigned nbits)
+    {
+      unsigned v = 0;
+      for(unsigned i=0; i<nbits; ++i)
+	v = (v << 1) | get_bit();
+      return v;
+    }
+
+    // count zero bits until a one bit
+    unsigned get_unary()
+    {
+      unsigned n = 0;
+      // skip whole zero bytes quickly
+      while( m_bit == 0 && m_pos < m_len && m_in[m_pos] == 0 ) {
+	n += 8;
+	++m_pos;
+      }
+      while( get_bit() == 0 && ! m_overrun )
+	++n;
+      return n;
+    }
+
+    bool overrun() const { return m_overrun; }
+
+  private:
+    unsigned get_bit()
+    {
+      if( m_pos >= m_len ) {
+	m_overrun = true;
+	return 1;
+      }
+      const unsigned b = (m_in[m_pos] >> (7-m_bit)) & 1;
+      if( ++m_bit == 8 ) {
+	m_bit = 0;
+	++m_pos;
+      }
+      return b;
+    }
+
+    const unsigned char* m_in;
+    size_t m_len, m_pos;
+    unsigned m_bit;
+    bool m_overrun;
+  };
+
+  // parameters of rice coding for bytes per pixel
+  void rice_params(unsigned bytepix, unsigned* fsbits, unsigned* fsmax,
+		   unsigned* bbits)
+  {
+    switch( bytepix ) {
+    case 1: *fsbits = 3; *fsmax = 6; *bbits = 8; break;
+    case 2: *fsbits = 4; *fsmax = 14; *bbits = 16; break;
+    default: *fsbits = 5; *fsmax = 25; *bbits = 32; break;
+    }
+  }
+
+  // wrap value to bbits and sign extend
+  inline int wrap(unsigned v, unsigned bbits)
+  {
+    if( bbits == 32 )
+      return int(v);
+    v &= (1u << bbits)-1;
+    return (v & (1u << (bbits-1))) ? int(v) - int(1u << bbits) : int(v);
+  }
+}
+
+void dm::codec::rice_encode(const int* in, unsigned n, unsigned bytepix,
+			    unsigned blocksize, bytes* out)
+{
+  unsigned fsbits, fsmax, bbits;
+  rice_params(bytepix, &fsbits, &fsmax, &bbits);
+
+  out->clear();
+  bit_writer bw(out);
+  if( n == 0 )
+    return;
+
+  // first value is written directly
+  bw.put(unsigned(in[0]) & (bbits == 32 ? ~0u : (1u << bbits)-1), bbits);
+
+  std::vector<unsigned> diff(blocksize);
+  int lastpix = in[0];
+  for(unsigned i=0; i<n; i+=blocksize) {
+    const unsigned thisblock = std::min(blocksize, n-i);
+
+    // map differences to unsigned values
+    double pixelsum = 0;
+    for(unsigned j=0; j<thisblock; ++j) {
+      const int nextpix = in[i+j];
+      const int pdiff = wrap(unsigned(nextpix) - unsigned(lastpix), bbits);
+      diff[j] = pdiff < 0 ? ~(unsigned(pdiff) << 1) : (unsigned(pdiff) << 1);
+      if( bbits < 32 )
+	diff[j] &= (1u << bbits)-1;
+      pixelsum += diff[j];
+      lastpix = nextpix;
+    }
+
+    // choose number of split bits
+    double dpsum = (pixelsum - (thisblock/2) - 1) / thisblock;
+    if( dpsum < 0 )
+      dpsum = 0;
+    unsigned psum = unsigned(dpsum) >> 1;
+    unsigned fs = 0;
+    for( ; psum > 0; ++fs )
+      psum >>= 1;
+
+    if( fs >= fsmax ) {
+      // high entropy, so write differences directly
+      bw.put(fsmax+1, fsbits);
+      for(unsigned j=0; j<thisblock; ++j)
+	bw.put(diff[j], bbits);
+    } else if( fs == 0 && pixelsum == 0 ) {
+      // all differences zero
+      bw.put(0, fsbits);
+    } else {
+      bw.put(fs+1, fsbits);
+      const unsigned fsmask = (1u << fs)-1;
+      for(unsigned j=0; j<thisblock; ++j) {
+	bw.put_unary(diff[j] >> fs);
+	if( fs > 0 )
+	  bw.put(diff[j] & fsmask, fs);
+      }
+    }
+  }
+  bw.flush();
+}
+
+bool dm::codec::rice_decode(const unsigned char* in, size_t len,
+			    unsigned bytepix, unsigned blocksize,
+			    int* out, unsigned n)
+{
+  unsigned fsbits, fsmax, bbits;
+  rice_params(bytepix, &fsbits, &fsmax, &bbits);
+  if( n == 0 )
+    return true;
+
+  bit_reader br(in, len);
+  int lastpix = wrap(br.get(bbits), bbits);
+
+  for(unsigned i=0; i<n; i+=blocksize) {
+    const unsigned imax = std::min(n, i+blocksize);
+    const int fs = int(br.get(fsbits)) - 1;
+
+    if( fs < 0 ) {
+      for(unsigned j=i; j<imax; ++j)
+	out[j] = lastpix;
+    } else {
+      for(unsigned j=i; j<imax; ++j) {
+	unsigned diff;
+	if( fs == int(fsmax) )
+	  diff = br.get(bbits);
+	else {
+	  diff = br.get_unary() << fs;
+	  if( fs > 0 )
+	    diff |= br.get(fs);
+	}
+	const unsigned d = (diff & 1) == 0 ? (diff >> 1) : ~(diff >> 1);
+	lastpix = wrap(d + unsigned(lastpix), bbits);
+	out[j] = lastpix;
+      }
+    }
+    if( br.overrun() )
+      return false;
+  }
+  return true;
+}
+
+void dm::codec::gzip_encode(const unsigned char* in, size_t len, bytes* out)
+{
+  z_stream strm;
+  std::memset(&strm, 0, sizeof(strm));
+  // 16+15 window bits gives a gzip header
+  deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 16+15, 8,
+	       Z_DEFAULT_STRATEGY);
+
+  out->resize(deflateBound(&strm, len) + 32);
+  strm.next_in = const_cast<unsigned char*>(in);
+  strm.avail_in = len;
+  strm.next_out = &(*out)[0];
+  strm.avail_out = out->size();
+  deflate(&strm, Z_FINISH);
+  out->resize(strm.total_out);
+  deflateEnd(&strm);
+}
+
+bool dm::codec::gzip_decode(const unsigned char* in, size_t len,
+			    unsigned char* out, size_t outlen)
+{
+  z_stream strm;
+  std::memset(&strm, 0, sizeof(strm));
+  // automatically detect gzip or zlib headers
+  if( inflateInit2(&strm, 32+15) != Z_OK )
+    return false;
+
+  strm.next_in = const_cast<unsigned char*>(in);
+  strm.avail_in = len;
+  strm.next_out = out;
+  strm.avail_out = outlen;
+  const int ret = inflate(&strm, Z_FINISH);
+  const bool ok = (ret == Z_STREAM_END || ret == Z_OK || ret == Z_BUF_ERROR)
+    && strm.total_out == outlen;
+  inflateEnd(&strm);
+  return ok;
+}
+
+void dm::codec::shuffle(unsigned char* data, size_t nitems, unsigned bytepix)
+{
+  std::vector<unsigned char> tmp(data, data + nitems*bytepix);
+  for(size_t i=0; i<nitems; ++i)
+    for(unsigned b=0; b<bytepix; ++b)
+      data[b*nitems + i] = tmp[i*bytepix + b];
+}
+
+void dm::codec::unshuffle(unsigned char* data, size_t nitems,
+			  unsigned bytepix)
+{
+  std::vector<unsigned char> tmp(data, data + nitems*bytepix);
+  for(size_t i=0; i<nitems; ++i)
+    for(unsigned b=0; b<bytepix; ++b)
+      data[i*bytepix + b] = tmp[b*nitems + i];
+}
+
+namespace
+{
+  struct dither_table
+  {
+    dither_table()
+    {
+      // Park-Miller generator, as in the FITS convention
+      const double a = 16807, m = 2147483647;
+      double seed = 1;
+      for(unsigned i=0; i<dm::codec::dither_nrandom; ++i) {
+	const double temp = a*seed;
+	seed = temp - m*double((long long)(temp/m));
+	vals[i] = float(seed/m);
+      }
+    }
+    float vals[dm::codec::dither_nrandom];
+  };
+}
+
+const float* dm::codec::dither_randoms()
+{
+  static const dither_table table;
+  return table.vals;
+}
@@ -0,0 +1,46 @@
+#ifndef DM_TILECODEC_HH
+#define DM_TILECODEC_HH
+
+#include <vector>
+#include <string>
+
+// codecs used by FITS tile compression (see compimage.hh)
+
+namespace dm
+{
+  namespace codec
+  {
+    typedef std::vector<unsigned char> bytes;
+
+    // Rice compression (RICE_1) of integers, with the block size
+    // (usually 32) and bytes per pixel (1, 2 or 4) of the FITS
+    // convention
+    void rice_encode(const int* in, unsigned n, unsigned bytepix,
+		     unsigned blocksize, bytes* out);
+    // returns false if the input is corrupt
+    bool rice_decode(const unsigned char* in, size_t len, unsigned bytepix,
+		     unsigned blocksize, int* out, unsigned n);
+
+    // gzip compression (GZIP_1) of bytes
+    void gzip_encode(const unsigned char* in, size_t len, bytes* out);
+    // returns false if the input is corrupt or doesn't give outlen bytes
+    bool gzip_decode(const unsigned char* in, size_t len,
+		     unsigned char* out, size_t outlen);
+
+    // shuffle bytes of items of size bytepix so that the most
+    // significant bytes come first (GZIP_2)
+    void shuffle(unsigned char* data, size_t nitems, unsigned bytepix);
+    void unshuffle(unsigned char* data, size_t nitems, unsigned bytepix);
+
+    // subtractive dithering random sequence of the FITS tiled image
+    // convention (10000 values)
+    const float* dither_randoms();
+    const unsigned dither_nrandom = 10000;
+
+    // quantised integer values for null and zero
+    const int null_value = -2147483647;
+    const int zero_value = -2147483646;
+  }
+}
+
+#endif
@@ -0,0 +1,301 @@
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
+#include <cmath>
+
+#include <boost/foreach.hpp>
+#include <boost/tokenizer.hpp>
+#include <boost/lexical_cast.hpp>
+
+#include "fill.hh"
+#include "stats.hh"
+
+void fillRegion(Region* reg, Region* enlarge, const Transform& trans,
+                const dm::memimage<float>* inimage,
+                dm::memimage<float>* outimage,
+                const PixelBox* box,
+                std::mt19937_64* rng,
+                std::vector<FilledPixel>* filled,
+                const std::vector<Region*>* exclude,
+                FillStats* stats)
+{
+  PixelBox all = { 0, 0, inimage->xw()-1, inimage->yw()-1 };
+  if(box == 0)
+    box = &all;
+
+  STAT(uint64_t nannulus = 0, nexcluded = 0, nfilled = 0);
+
+  std::vector<float> vals;
+
+  unsigned minx=inimage->xw(), maxx=0;
+  unsigned miny=inimage->yw(), maxy=0;
+
+  for(unsigned y = box->y0; y <= box->y1; ++y)
+    for(unsigned x = box->x0; x <= box->x1; ++x)
+      {
+        double px = trans.x2phys(x);
+        double py = trans.y2phys(y);
+
+        if(enlarge->inside(px, py) && !reg->inside(px, py))
+          {
+            minx=std::min(minx, x);
+            miny=std::min(miny, y);
+            maxx=std::max(maxx, x);
+            maxy=std::max(maxy, y);
+            STAT(++nannulus);
+
+            bool excluded = false;
+            if(exclude != 0)
+              for(size_t i=0; i<exclude->size() && !excluded; ++i)
+                excluded = (*exclude)[i]->inside(px, py);
+            if(excluded)
+              {
+                STAT(++nexcluded);
+                continue;
+              }
+
+            vals.push_back((*inimage)(x, y));
+          }
+      }
+
+  if(vals.empty() && exclude != 0 && !exclude->empty())
+    {
+      // fall back to using the excluded pixels. The stats are then
+      // those of the second pass, apart from the pixels excluded here
+      STAT(if(stats != 0)
+             {
+               stats->excluded += nexcluded;
+               stats->fallback = true;
+             });
+      fillRegion(reg, enlarge, trans, inimage, outimage, box, rng,
+                 filled, 0, stats);
+      return;
+    }
+
+  STAT(if(stats != 0)
+         {
+           stats->tested += uint64_t(box->x1-box->x0+1)*(box->y1-box->y0+1);
+           stats->annulus += nannulus;
+           stats->excluded += nexcluded;
+           stats->samples = vals.size();
+         });
+
+  if(vals.empty())
+    return;
+
+  for(unsigned y = miny; y <= maxy; ++y)
+    for(unsigned x = minx; x <= maxx; ++x)
+      {
+        double px = trans.x2phys(x);
+        double py = trans.y2phys(y);
+
+        if(reg->inside(px, py))
+          {
+            const float v = rng != 0
+              ? vals[(*rng)() % vals.size()]
+              : vals[unsigned(rand()*(1./RAND_MAX)*vals.size())];
+            STAT(++nfilled);
+            if(outimage != 0)
+              (*outimage)(x, y) = v;
+            if(filled != 0)
+              {
+                const FilledPixel p = { x, y, v };
+                filled->push_back(p);
+              }
+          }
+      }
+
+  STAT(if(stats != 0)
+         {
+           stats->tested += uint64_t(maxx-minx+1)*(maxy-miny+1);
+           stats->filled += nfilled;
+         });
+}
+
+RegionIndex::RegionIndex(const std::vector<PixelBox>& boxes,
+                         const std::vector<bool>& valid)
+  : m_boxes(boxes), m_cellsize(1), m_nx(0), m_ny(0)
+{
+  // cells are a few times the median size of the regions, so that
+  // most regions are in one or two cells
+  std::vector<unsigned> sizes;
+  unsigned maxx = 0, maxy = 0;
+  for(size_t i=0; i<boxes.size(); ++i)
+    if(valid[i])
+      {
+        sizes.push_back(std::max(boxes[i].x1-boxes[i].x0,
+                                 boxes[i].y1-boxes[i].y0) + 1);
+        maxx = std::max(maxx, boxes[i].x1);
+        maxy = std::max(maxy, boxes[i].y1);
+      }
+  if(sizes.empty())
+    return;
+
+  std::nth_element(sizes.begin(), sizes.begin()+sizes.size()/2,
+                   sizes.end());
+  m_cellsize = std::max(4*sizes[sizes.size()/2], 16u);
+  m_nx = maxx/m_cellsize + 1;
+  m_ny = maxy/m_cellsize + 1;
+
+  // count the regions in each cell, then fill them in
+  m_start.assign(size_t(m_nx)*m_ny + 1, 0);
+  for(int pass=0; pass<2; ++pass)
+    {
+      std::vector<unsigned> next(m_start);
+      for(size_t i=0; i<boxes.size(); ++i)
+        {
+          if(!valid[i])
+            continue;
+          for(unsigned cy=boxes[i].y0/m_cellsize;
+              cy<=boxes[i].y1/m_cellsize; ++cy)
+            for(unsigned cx=boxes[i].x0/m_cellsize;
+                cx<=boxes[i].x1/m_cellsize; ++cx)
+              {
+                const size_t cell = size_t(cy)*m_nx + cx;
+                if(pass == 0)
+                  ++m_start[cell+1];
+                else
+                  m_items[next[cell]++] = unsigned(i);
+              }
+        }
+      if(pass == 0)
+        {
+          for(size_t c=1; c<m_start.size(); ++c)
+            m_start[c] += m_start[c-1];
+          m_items.resize(m_start.back());
+        }
+    }
+}
+
+void RegionIndex::find(const PixelBox& box,
+                       std::vector<unsigned>* indices) const
+{
+  indices->clear();
+  if(m_nx == 0)
+    return;
+
+  const unsigned cx1 = std::min(box.x1/m_cellsize, m_nx-1);
+  const unsigned cy1 = std::min(box.y1/m_cellsize, m_ny-1);
+  for(unsigned cy=box.y0/m_cellsize; cy<=cy1; ++cy)
+    for(unsigned cx=box.x0/m_cellsize; cx<=cx1; ++cx)
+      {
+        const size_t cell = size_t(cy)*m_nx + cx;
+        for(unsigned j=m_start[cell]; j<m_start[cell+1]; ++j)
+          {
+            const PixelBox& b = m_boxes[m_items[j]];
+            if(b.x0 <= box.x1 && b.x1 >= box.x0 &&
+               b.y0 <= box.y1 && b.y1 >= box.y0)
+              indices->push_back(m_items[j]);
+          }
+      }
+
+  // regions covering several cells are found more than once
+  std::sort(indices->begin(), indices->end());
+  indices->erase(std::unique(indices->begin(), indices->end()),
+                 indices->end());
+}
+
+std::string enlargeRegion(const std::string& str)
+{
+  boost::char_separator<char> sep("(,)");
+  boost::tokenizer< boost::char_separator<char> > tokens(str, sep);
+  //BOOST_FOREACH (const std::string& t, tokens) {
+  //  std::cout << t << "." << std::endl;
+  // }
+
+  boost::tokenizer< boost::char_separator<char> >::iterator it = tokens.begin();
+
+  std::string name(*it++);
+  std::string out(name + "(");
+  if(name == "ellipse")
+    {
+      out += *it++;
+      out += ",";
+      out += *it++;
+      out += ",";
+
+      double rad1(boost::lexical_cast<double>(*it++));
+      out += boost::lexical_cast<std::string>(rad1+EXPANDSIZE);
+      out += ",";
+      double rad2(boost::lexical_cast<double>(*it++));
+      out += boost::lexical_cast<std::string>(rad2+EXPANDSIZE);
+      out += ",";
+
+      out += *it++;
+    }
+  else if(name == "circle")
+    {
+      out += *it++;
+      out += ",";
+      out += *it++;
+      out += ",";
+
+      double rad(boost::lexical_cast<double>(*it++));
+      out += boost::lexical_cast<std::string>(rad+EXPANDSIZE);
+    }
+  else
+    {
+      throw std::string("Cannot interpret region");
+    }
+
+  out += ")";
+  return out;
+}
+
+namespace
+{
+  // clip a range of pixel coordinates to 0..size-1, adding a margin
+  bool clipRange(double a, double b, unsigned size,
+                 unsigned* lo, unsigned* hi)
+  {
+    const double l = std::floor(std::min(a, b)) - 1;
+    const double h = std::ceil(std::max(a, b)) + 1;
+    if(!(h >= 0 && l <= size-1.))
+      return false;
+    *lo = unsigned(std::max(l, 0.));
+    *hi = unsigned(std::min(h, size-1.));
+    return true;
+  }
+}
+
+bool regionBox(const std::string& str, const Transform& trans,
+               unsigned xw, unsigned yw, PixelBox* box)
+{
+  boost::char_separator<char> sep("(,)");
+  boost::tokenizer< boost::char_separator<char> > tokens(str, sep);
+  std::vector<std::string> parts(tokens.begin(), tokens.end());
+
+  double rad;
+  if(parts.size() == 6 && parts[0] == "ellipse")
+    rad = std::max(boost::lexical_cast<double>(parts[3]),
+                   boost::lexical_cast<double>(parts[4]));
+  else if(parts.size() == 4 && parts[0] == "circle")
+    rad = boost::lexical_cast<double>(parts[3]);
+  else
+    throw std::string("Cannot interpret region");
+
+  const double cx(boost::lexical_cast<double>(parts[1]));
+  const double cy(boost::lexical_cast<double>(parts[2]));
+
+  return
+    clipRange(trans.phys2x(cx-rad), trans.phys2x(cx+rad), xw,
+              &box->x0, &box->x1) &&
+    clipRange(trans.phys2y(cy-rad), trans.phys2y(cy+rad), yw,
+              &box->y0, &box->y1);
+}
+
+bool regionMask(const std::string& str, const Transform& trans,
+                dm::mask_image* mask)
+{
+  PixelBox box;
+  if(!regionBox(str, trans, mask->xw(), mask->yw(), &box))
+    return false;
+
+  Region reg(str);
+  mask->set_where(box.x0, box.y0, box.x1, box.y1,
+                  [&](unsigned x, unsigned y)
+                  {
+                    return reg.inside(trans.x2phys(x), trans.y2phys(y));
+                  });
+  return true;
+}
@@ -0,0 +1,155 @@
+#ifndef HIDEREGIONS2_FILL_HH
+#define HIDEREGIONS2_FILL_HH
+
+// Filling of regions with random values from the surrounding pixels
+
+#include <string>
+#include <vector>
+#include <random>
+#include <dm/dm.hh>
+#include <dm/maskimage.hh>
+
+#define EXPANDSIZE 1
+
+// standard CAIO region files header
+extern "C"
+{
+# include <cxcregion.h>
+}
+
+class Region
+{
+public:
+  Region(const std::string& str)
+  {
+    reg = regParse(const_cast<char*>(str.c_str()));
+    if(reg == 0)
+      throw std::string("Invalid region: ") + str;
+  }
+
+  ~Region()
+  {
+    regFree(reg);
+  }
+
+  bool inside(double x, double y)
+  {
+    return regInsideRegion(reg, x, y);
+  }
+
+private:
+  regRegion* reg;
+};
+
+struct Transform
+{
+  Transform(dm::image* im)
+  {
+    dmDescriptor* imdesc = im->get_descriptor();
+    dmDescriptor* phys = dmArrayGetAxisGroup(imdesc, 1);
+    dmCoordGetTransform_d(phys, pcrpix, pcrval, pcdlt, 2);
+  }
+
+  Transform(const double crpix[2], const double crval[2],
+            const double cdlt[2])
+  {
+    for(unsigned i=0; i<2; ++i)
+      {
+        pcrpix[i] = crpix[i]; pcrval[i] = crval[i]; pcdlt[i] = cdlt[i];
+      }
+  }
+
+  double x2phys(unsigned x) const
+  {
+    return (x + 1 - pcrpix[0])*pcdlt[0] + pcrval[0];
+  }
+
+  double y2phys(unsigned y) const
+  {
+    return (y + 1 - pcrpix[1])*pcdlt[1] + pcrval[1];
+  }
+
+  // inverses of the above (not rounded to a pixel)
+  double phys2x(double px) const
+  {
+    return (px - pcrval[0])/pcdlt[0] + pcrpix[0] - 1;
+  }
+
+  double phys2y(double py) const
+  {
+    return (py - pcrval[1])/pcdlt[1] + pcrpix[1] - 1;
+  }
+
+  double pcrpix[2], pcrval[2], pcdlt[2];
+};
+
+// range of pixels (inclusive) covered by a region
+struct PixelBox
+{
+  unsigned x0, y0, x1, y1;
+};
+
+struct FillStats;
+
+// a pixel set by fillRegion
+struct FilledPixel
+{
+  unsigned x, y;
+  float val;
+};
+
+// uniform grid over the bounding boxes of regions, to find the
+// regions near a position without checking all of them
+class RegionIndex
+{
+public:
+  // valid[i] is false for regions which are not in the image
+  RegionIndex(const std::vector<PixelBox>& boxes,
+              const std::vector<bool>& valid);
+
+  // get the indices (sorted) of regions whose boxes overlap box
+  void find(const PixelBox& box, std::vector<unsigned>* indices) const;
+
+private:
+  std::vector<PixelBox> m_boxes;
+  unsigned m_cellsize, m_nx, m_ny;
+  // regions in each cell are m_items[m_start[cell]..m_start[cell+1]]
+  std::vector<unsigned> m_start, m_items;
+};
+
+// fill region reg in outimage with random choices from the pixels of
+// inimage which are in the enlarged region, but not in reg
+//
+// if box is given, only the pixels in it are examined (this should
+// contain the enlarged region, see regionBox). If rng is given it is
+// used for the random choices instead of rand(). If filled is given,
+// the pixels set are appended to it (outimage may then be 0, for
+// applying the fill later). Pixels inside any of the exclude
+// regions (e.g. neighbouring sources) are not used, unless there
+// would be no pixels left. If stats is given, the pixels examined
+// are counted in it (see stats.hh).
+void fillRegion(Region* reg, Region* enlarge, const Transform& trans,
+                const dm::memimage<float>* inimage,
+                dm::memimage<float>* outimage,
+                const PixelBox* box = 0,
+                std::mt19937_64* rng = 0,
+                std::vector<FilledPixel>* filled = 0,
+                const std::vector<Region*>* exclude = 0,
+                FillStats* stats = 0);
+
+// make a region string with the radii enlarged by EXPANDSIZE
+std::string enlargeRegion(const std::string& str);
+
+// get the pixels (with a margin) in an xw*yw image which could be
+// inside a circle or ellipse region. Returns false if the region is
+// outside the image.
+bool regionBox(const std::string& str, const Transform& trans,
+               unsigned xw, unsigned yw, PixelBox* box);
+
+// set the pixels of mask whose centres are inside the region (e.g. to
+// make a mask of sources). Returns false if the region is outside
+// the image.
+bool regionMask(const std::string& str, const Transform& trans,
+                dm::mask_image* mask);
+
+#endif
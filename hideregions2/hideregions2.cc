@@ -8,160 +8,28 @@
 #include <cstdlib>
 #include <vector>
 #include <algorithm>
+#include <memory>
 
-#include <boost/foreach.hpp>
-#include <boost/tokenizer.hpp>
-#include <boost/lexical_cast.hpp>
 #include <dm/dm.hh>
+#include <dm/parallel.hh>
 
-#define EXPANDSIZE 1
-
-// standard CAIO region files header
-extern "C"
-{
-# include <cxcregion.h>
-}
-
-class Region
-{
-public:
-  Region(const std::string& str)
-  {
-    reg = regParse(const_cast<char*>(str.c_str()));
-    if(reg == 0)
-      throw std::string("Invalid region: ") + str;
-  }
-
-  ~Region()
-  {
-    regFree(reg);
-  }
-
-  bool inside(double x, double y)
-  {
-    return regInsideRegion(reg, x, y);
-  }
-
-private:
-  regRegion* reg;
-};
-
-struct Transform
-{
-  Transform(dm::image* im)
-  {
-    dmDescriptor* imdesc = im->get_descriptor();
-    dmDescriptor* phys = dmArrayGetAxisGroup(imdesc, 1);
-    dmCoordGetTransform_d(phys, pcrpix, pcrval, pcdlt, 2);
-  }
-
-  double x2phys(unsigned x) const
-  {
-    return (x + 1 - pcrpix[0])*pcdlt[0] + pcrval[0];
-  }
-
-  double y2phys(unsigned y) const
-  {
-    return (y + 1 - pcrpix[1])*pcdlt[1] + pcrval[1];
-  }
-
-  double pcrpix[2], pcrval[2], pcdlt[2];
-};
-
-void fillRegion(Region* reg, Region* enlarge, const Transform& trans,
-                const dm::memimage<float>* inimage,
-                dm::memimage<float>* outimage)
-{
-  std::vector<float> vals;
-
-  unsigned minx=outimage->xw(), maxx=0;
-  unsigned miny=outimage->yw(), maxy=0;
-
-  for(unsigned y = 0; y < inimage->yw(); ++y)
-    for(unsigned x = 0; x < inimage->xw(); ++x)
-      {
-        double px = trans.x2phys(x);
-        double py = trans.y2phys(y);
-
-        if(enlarge->inside(px, py) && !reg->inside(px, py))
-          {
-            minx=std::min(minx, x);
-            miny=std::min(miny, y);
-            maxx=std::max(maxx, x);
-            maxy=std::max(maxy, y);
-
-            vals.push_back((*inimage)(x, y));
-          }
-      }
-
-  if(vals.empty())
-    return;
-
-  for(unsigned y = miny; y <= maxy; ++y)
-    for(unsigned x = minx; x <= maxx; ++x)
-      {
-        double px = trans.x2phys(x);
-        double py = trans.y2phys(y);
-
-        if(reg->inside(px, py))
-          {
-            (*outimage)(x, y) =
-              vals[unsigned(rand()*(1./RAND_MAX)*vals.size())];
-          }
-      }
-}
-
-std::string enlargeRegion(const std::string& str)
-{
-  boost::char_separator<char> sep("(,)");
-  boost::tokenizer< boost::char_separator<char> > tokens(str, sep);
-  //BOOST_FOREACH (const std::string& t, tokens) {
-  //  std::cout << t << "." << std::endl;
-  // }
-
-  boost::tokenizer< boost::char_separator<char> >::iterator it = tokens.begin();
-
-  std::string name(*it++);
-  std::string out(name + "(");
-  if(name == "ellipse")
-    {
-      out += *it++;
-      out += ",";
-      out += *it++;
-      out += ",";
-
-      double rad1(boost::lexical_cast<double>(*it++));
-      out += boost::lexical_cast<std::string>(rad1+EXPANDSIZE);
-      out += ",";
-      double rad2(boost::lexical_cast<double>(*it++));
-      out += boost::lexical_cast<std::string>(rad2+EXPANDSIZE);
-      out += ",";
-
-      out += *it++;
-    }
-  else if(name == "circle")
-    {
-      out += *it++;
-      out += ",";
-      out += *it++;
-      out += ",";
-
-      double rad(boost::lexical_cast<double>(*it++));
-      out += boost::lexical_cast<std::string>(rad+EXPANDSIZE);
-    }
-  else
-    {
-      throw std::string("Cannot interpret region");
-    }
-
-  out += ")";
-  return out;
-}
+#include "fill.hh"
+#include "cache.hh"
+#include "stats.hh"
 
 void run(const std::string& infile,
          const std::string& regfile,
-         const std::string& outfile)
+         const std::string& outfile,
+         const std::string& cachefile,
+         unsigned long seed,
+         bool exclude,
+         const std::string& statsfile,
+         const std::string& regstatsfile)
 {
+  STAT(RunStats stats;
+       stats.setThreads(dm::get_threads());
+       stats.phase("read_image"));
+
   // load in image
   dm::dataset ds(infile);
   dm::image* im = ds.get_image();
@@ -172,10 +40,9 @@ void run(const std::string& infile,
   dm::memimage<float>* inimage;
   im->create_memimage(&inimage);
 
-  dm::memimage<float> outimage(inimage->xw(), inimage->yw());
-  for(unsigned y=0; y<outimage.yw(); ++y)
-    for(unsigned x=0; x<outimage.xw(); ++x)
-      outimage(x, y) = (*inimage)(x, y);
+  dm::memimage<float> outimage(*inimage);
+  STAT(stats.addRead(infile);
+       stats.phase("read_regions"));
 
   std::ifstream inreg(regfile.c_str());
   if(!inreg)
@@ -183,40 +50,232 @@ void run(const std::string& infile,
       throw std::string("Cannot open region file ") + regfile;
     }
 
+  std::vector<std::string> lines;
+  std::vector<unsigned> linenos;
   std::string line;
-  while(std::getline(inreg, line))
+  for(unsigned lineno = 1; std::getline(inreg, line); ++lineno)
     {
       if(line.length() >= 1 && line[0] == '#')
         continue;
+      lines.push_back(line);
+      linenos.push_back(lineno);
+    }
+  const size_t nlines = lines.size();
+  STAT(stats.addRead(regfile);
+       if(!statsfile.empty() || !regstatsfile.empty())
+         stats.setRegions(lines, linenos);
+       stats.phase("prepare"));
+
+  // pixels covered by each region and its enlarged region
+  std::vector<std::string> enlarged(nlines);
+  std::vector<PixelBox> boxes(nlines), enlboxes(nlines);
+  std::vector<bool> inimg(nlines), enlinimg(nlines);
+  for(size_t i=0; i<nlines; ++i)
+    {
+      enlarged[i] = enlargeRegion(lines[i]);
+      inimg[i] = regionBox(lines[i], trans, inimage->xw(), inimage->yw(),
+                           &boxes[i]);
+      enlinimg[i] = regionBox(enlarged[i], trans, inimage->xw(),
+                              inimage->yw(), &enlboxes[i]);
+    }
 
-      std::cout << "Region: " << line << '\n';
-      Region reg(line);
+  // for finding the neighbours of each region, which are excluded
+  // from the pixels it is filled from
+  const RegionIndex index(boxes, inimg);
+  std::vector< std::unique_ptr<Region> > regions(nlines);
 
-      Region enlarge( enlargeRegion(line) );
+  // unchanged regions can be copied from the cache of the previous run
+  const bool incremental = !cachefile.empty();
+  FillCache cache;
+  if(incremental)
+    {
+      STAT(stats.phase("cache_load");
+           stats.addRead(cachefile));
+      cache.load(cachefile);
+    }
 
-      fillRegion(&reg, &enlarge, trans, inimage, &outimage);
+  unsigned nregions = 0, ncached = 0;
+
+  // regions are filled in parallel in batches, then applied in order,
+  // as later regions overwrite earlier ones. Each region has its own
+  // random numbers, so the output does not depend on the threads.
+  const size_t batch = 1024;
+  for(size_t b0 = 0; b0 < nlines; b0 += batch)
+    {
+      const size_t nb = std::min(batch, nlines-b0);
+      std::vector< std::vector<unsigned> > near(nb);
+      std::vector<uint64_t> keys(nb);
+      std::vector<bool> tofill(nb);
+
+      STAT(stats.phase("neighbours"));
+      // find neighbours and look in cache
+      dm::parallel_items(0, nb, [&](size_t k, unsigned)
+        {
+          const size_t i = b0 + k;
+          if(!enlinimg[i])
+            return;
+          if(exclude)
+            {
+              index.find(enlboxes[i], &near[k]);
+              near[k].erase(std::remove(near[k].begin(), near[k].end(),
+                                        unsigned(i)), near[k].end());
+            }
+          if(incremental)
+            {
+              std::vector<std::string> nearlines;
+              for(size_t j=0; j<near[k].size(); ++j)
+                nearlines.push_back(lines[near[k][j]]);
+              keys[k] = FillCache::key(lines[i], enlarged[i], nearlines,
+                                       seed, trans, *inimage, &enlboxes[i]);
+            }
+        });
+
+      // the region library is not thread safe, so parse in this thread
+      STAT(stats.phase("parse"));
+      std::vector< std::unique_ptr<Region> > enlarge(nb);
+      std::vector< std::vector<Region*> > neighbours(nb);
+      for(size_t k=0; k<nb; ++k)
+        {
+          const size_t i = b0 + k;
+          tofill[k] = enlinimg[i] && !(incremental && cache.has(keys[k]));
+          if(!tofill[k])
+            continue;
+
+          for(size_t j=0; j<near[k].size(); ++j)
+            {
+              if(!regions[near[k][j]])
+                regions[near[k][j]].reset(new Region(lines[near[k][j]]));
+              neighbours[k].push_back(regions[near[k][j]].get());
+            }
+          if(!regions[i])
+            regions[i].reset(new Region(lines[i]));
+          enlarge[k].reset(new Region(enlarged[i]));
+        }
+
+      // fill regions
+      STAT(stats.phase("fill"));
+      std::vector< std::vector<FilledPixel> > filled(nb);
+      dm::parallel_items(0, nb, [&](size_t k, unsigned)
+        {
+          const size_t i = b0 + k;
+          if(!tofill[k])
+            return;
+          FillStats* fs = 0;
+          STAT(const double t0 = RunStats::wallTime();
+               if(stats.haveRegions())
+                 fs = &stats.region(i).fill);
+          std::mt19937_64 rng(FillCache::regionSeed(lines[i], seed));
+          fillRegion(regions[i].get(), enlarge[k].get(), trans, inimage, 0,
+                     &enlboxes[i], &rng, &filled[k], &neighbours[k], fs);
+          STAT(if(fs != 0)
+                 stats.region(i).seconds = RunStats::wallTime() - t0);
+        });
+
+      // apply in order
+      STAT(stats.phase("apply"));
+      for(size_t k=0; k<nb; ++k)
+        {
+          const size_t i = b0 + k;
+          if(!enlinimg[i])
+            continue;
+          ++nregions;
+
+          if(!tofill[k])
+            {
+              cache.apply(keys[k], &outimage);
+              ++ncached;
+              STAT(if(stats.haveRegions())
+                     stats.region(i).status = RunStats::RegionStats::cached);
+              continue;
+            }
+
+          std::cout << "Region: " << lines[i] << '\n';
+          STAT(if(stats.haveRegions())
+                 stats.region(i).status = RunStats::RegionStats::filled);
+          const std::vector<FilledPixel>& f = filled[k];
+          for(size_t p=0; p<f.size(); ++p)
+            outimage(f[p].x, f[p].y) = f[p].val;
+          if(incremental)
+            cache.add(keys[k], f);
+        }
+    }
+
+  if(incremental)
+    {
+      std::cout << nregions << " regions, " << ncached
+                << " copied from cache\n";
+      STAT(stats.phase("cache_save"));
+      cache.save(cachefile);
+      STAT(stats.addWritten(cachefile));
     }
 
-  dm::dataset ds_im_out(outfile, dm::create_over);
-  dm::image *im_im_out = ds_im_out.create_image("IMAGE", dmFLOAT,
-                                                outimage.xw(),
-						outimage.yw());
-  im_im_out->write_from_memimage(outimage);
+  STAT(stats.phase("write_image"));
+  {
+    dm::dataset ds_im_out(outfile, dm::create_over);
+    dm::image *im_im_out = ds_im_out.create_image("IMAGE", dmFLOAT,
+                                                  outimage.xw(),
+                                                  outimage.yw());
+    im_im_out->write_from_memimage(outimage);
+  }
+  STAT(stats.addWritten(outfile);
+       stats.phase("");
+       if(!statsfile.empty())
+         stats.writeJSON(statsfile);
+       if(!regstatsfile.empty())
+         stats.writeCSV(regstatsfile));
 }
 
 int main(int argc, char* argv[])
 {
-  if( argc != 4 )
+  std::string cachefile;
+  unsigned long seed = 0;
+  bool exclude = true;
+  std::string statsfile, regstatsfile;
+  std::vector<std::string> args;
+
+  for(int i=1; i<argc; ++i)
+    {
+      const std::string a(argv[i]);
+      if(a.compare(0, 8, "--cache=") == 0)
+        cachefile = a.substr(8);
+      else if(a.compare(0, 7, "--seed=") == 0)
+        seed = std::strtoul(a.substr(7).c_str(), 0, 10);
+      else if(a == "--keep-neighbours")
+        exclude = false;
+      else if(a.compare(0, 10, "--threads=") == 0)
+        dm::set_threads(std::atoi(a.substr(10).c_str()));
+      else if(a.compare(0, 8, "--stats=") == 0)
+        statsfile = a.substr(8);
+      else if(a.compare(0, 15, "--region-stats=") == 0)
+        regstatsfile = a.substr(15);
+      else
+        args.push_back(a);
+    }
+
+  if( args.size() != 3 )
     {
       std::cerr << "Usage: "
 		<< argv[0]
+		<< " [--cache=fill.cache] [--seed=N] [--keep-neighbours]"
+		<< " [--threads=N] [--stats=stats.json]"
+		<< " [--region-stats=regions.csv]"
 		<< " infile.fits region.reg outfile.fits\n";
       return 1;
     }
 
+#ifndef HIDEREGIONS2_STATS
+  if(!statsfile.empty() || !regstatsfile.empty())
+    {
+      std::cerr << "This hideregions2 was built without statistics"
+                << " support (see the Makefile)\n";
+      return 1;
+    }
+#endif
+
   try
     {
-      run(argv[1], argv[2], argv[3]);
+      run(args[0], args[1], args[2], cachefile, seed, exclude,
+          statsfile, regstatsfile);
     }
   catch(std::string s)
     {
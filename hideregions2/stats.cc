@@ -0,0 +1,253 @@
+#include "stats.hh"
+
+#ifdef HIDEREGIONS2_STATS
+
+#include <fstream>
+#include <algorithm>
+#include <chrono>
+#include <ctime>
+
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+namespace
+{
+  uint64_t fileSize(const std::string& filename)
+  {
+    struct stat st;
+    if(stat(filename.c_str(), &st) != 0)
+      return 0;
+    return uint64_t(st.st_size);
+  }
+
+  // quoted JSON string
+  std::string quote(const std::string& s)
+  {
+    std::string out("\"");
+    for(size_t i=0; i<s.size(); ++i)
+      {
+        if(s[i] == '"' || s[i] == '\\')
+          out += '\\';
+        if(static_cast<unsigned char>(s[i]) >= 0x20)
+          out += s[i];
+      }
+    return out + '"';
+  }
+
+  // quoted CSV field
+  std::string csvQuote(const std::string& s)
+  {
+    std::string out("\"");
+    for(size_t i=0; i<s.size(); ++i)
+      {
+        if(s[i] == '"')
+          out += '"';
+        out += s[i];
+      }
+    return out + '"';
+  }
+
+  const char* statusName(RunStats::RegionStats::Status s)
+  {
+    switch(s)
+      {
+      case RunStats::RegionStats::filled: return "filled";
+      case RunStats::RegionStats::cached: return "cached";
+      default: return "outside";
+      }
+  }
+}
+
+RunStats::RunStats()
+  : m_start_wall(wallTime()), m_start_cpu(cpuTime()), m_current(-1),
+    m_phase_wall(0), m_phase_cpu(0), m_read(0), m_written(0),
+    m_threads(0)
+{
+}
+
+double RunStats::wallTime()
+{
+  return std::chrono::duration<double>
+    (std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+double RunStats::cpuTime()
+{
+  // total for all threads
+  timespec ts;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+void RunStats::phase(const std::string& name)
+{
+  const double wall = wallTime(), cpu = cpuTime();
+  if(m_current >= 0)
+    {
+      m_phases[m_current].wall += wall - m_phase_wall;
+      m_phases[m_current].cpu += cpu - m_phase_cpu;
+    }
+
+  m_current = -1;
+  if(name.empty())
+    return;
+
+  for(size_t i=0; i<m_phases.size() && m_current<0; ++i)
+    if(m_phases[i].name == name)
+      m_current = int(i);
+  if(m_current < 0)
+    {
+      const Phase p = { name, 0, 0 };
+      m_phases.push_back(p);
+      m_current = int(m_phases.size()) - 1;
+    }
+  m_phase_wall = wall;
+  m_phase_cpu = cpu;
+}
+
+void RunStats::setRegions(const std::vector<std::string>& lines,
+                          const std::vector<unsigned>& linenos)
+{
+  m_regions.resize(lines.size());
+  for(size_t i=0; i<lines.size(); ++i)
+    {
+      m_regions[i].lineno = linenos[i];
+      m_regions[i].region = lines[i];
+    }
+}
+
+void RunStats::addRead(const std::string& filename)
+{
+  m_read += fileSize(filename);
+}
+
+void RunStats::addWritten(const std::string& filename)
+{
+  m_written += fileSize(filename);
+}
+
+void RunStats::writeJSON(const std::string& filename)
+{
+  phase("");
+  const double wall = wallTime() - m_start_wall;
+  const double cpu = cpuTime() - m_start_cpu;
+
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  // ru_maxrss is in kB on Linux
+  const uint64_t peak = uint64_t(usage.ru_maxrss) * 1024;
+
+  std::ofstream out(filename.c_str());
+  if(!out)
+    throw std::string("Cannot write statistics file ") + filename;
+
+  FillStats total;
+  unsigned nfilled = 0, ncached = 0, nfallback = 0;
+  std::vector<uint64_t> samples;
+  std::vector<size_t> order;
+  for(size_t i=0; i<m_regions.size(); ++i)
+    {
+      const RegionStats& r = m_regions[i];
+      if(r.status == RegionStats::cached)
+        ++ncached;
+      if(r.status != RegionStats::filled)
+        continue;
+      ++nfilled;
+      total.tested += r.fill.tested;
+      total.annulus += r.fill.annulus;
+      total.excluded += r.fill.excluded;
+      total.samples += r.fill.samples;
+      total.filled += r.fill.filled;
+      if(r.fill.fallback)
+        ++nfallback;
+      samples.push_back(r.fill.samples);
+      order.push_back(i);
+    }
+
+  out.precision(6);
+  out << "{\n"
+      << "  \"threads\": " << m_threads << ",\n"
+      << "  \"wall_seconds\": " << wall << ",\n"
+      << "  \"cpu_seconds\": " << cpu << ",\n"
+      << "  \"peak_memory_bytes\": " << peak << ",\n"
+      << "  \"bytes_read\": " << m_read << ",\n"
+      << "  \"bytes_written\": " << m_written << ",\n";
+
+  out << "  \"phases\": [\n";
+  for(size_t i=0; i<m_phases.size(); ++i)
+    out << "    {\"name\": " << quote(m_phases[i].name)
+        << ", \"wall_seconds\": " << m_phases[i].wall
+        << ", \"cpu_seconds\": " << m_phases[i].cpu << '}'
+        << (i+1 < m_phases.size() ? ",\n" : "\n");
+  out << "  ],\n";
+
+  out << "  \"regions\": {\"total\": " << m_regions.size()
+      << ", \"filled\": " << nfilled
+      << ", \"cached\": " << ncached
+      << ", \"outside\": " << m_regions.size() - nfilled - ncached
+      << ", \"fallback\": " << nfallback << "},\n";
+
+  out << "  \"pixels\": {\"tested\": " << total.tested
+      << ", \"annulus\": " << total.annulus
+      << ", \"excluded\": " << total.excluded
+      << ", \"samples\": " << total.samples
+      << ", \"filled\": " << total.filled << "},\n";
+
+  // distribution of the number of pixels each fill chose from
+  out << "  \"annulus_samples\": {";
+  if(!samples.empty())
+    {
+      std::sort(samples.begin(), samples.end());
+      const size_t n = samples.size();
+      out << "\"min\": " << samples[0]
+          << ", \"p10\": " << samples[n/10]
+          << ", \"median\": " << samples[n/2]
+          << ", \"p90\": " << samples[n*9/10]
+          << ", \"max\": " << samples[n-1]
+          << ", \"mean\": " << double(total.samples)/n;
+    }
+  out << "},\n";
+
+  // the slowest regions, to find outliers
+  const size_t nslow = std::min(order.size(), size_t(10));
+  std::partial_sort(order.begin(), order.begin()+nslow, order.end(),
+                    [this](size_t a, size_t b)
+                    {
+                      return m_regions[a].seconds > m_regions[b].seconds;
+                    });
+  out << "  \"slowest_regions\": [\n";
+  for(size_t i=0; i<nslow; ++i)
+    {
+      const RegionStats& r = m_regions[order[i]];
+      out << "    {\"line\": " << r.lineno
+          << ", \"region\": " << quote(r.region)
+          << ", \"seconds\": " << r.seconds
+          << ", \"tested\": " << r.fill.tested
+          << ", \"samples\": " << r.fill.samples
+          << ", \"filled\": " << r.fill.filled << '}'
+          << (i+1 < nslow ? ",\n" : "\n");
+    }
+  out << "  ]\n}\n";
+}
+
+void RunStats::writeCSV(const std::string& filename) const
+{
+  std::ofstream out(filename.c_str());
+  if(!out)
+    throw std::string("Cannot write region statistics file ") + filename;
+
+  out.precision(6);
+  out << "line,region,status,seconds,tested,annulus,excluded,samples,"
+      << "filled,fallback\n";
+  for(size_t i=0; i<m_regions.size(); ++i)
+    {
+      const RegionStats& r = m_regions[i];
+      out << r.lineno << ',' << csvQuote(r.region) << ','
+          << statusName(r.status) << ',' << r.seconds << ','
+          << r.fill.tested << ',' << r.fill.annulus << ','
+          << r.fill.excluded << ',' << r.fill.samples << ','
+          << r.fill.filled << ',' << (r.fill.fallback ? 1 : 0) << '\n';
+    }
+}
+
+#endif
@@ -0,0 +1,103 @@
+#ifndef HIDEREGIONS2_STATS_HH
+#define HIDEREGIONS2_STATS_HH
+
+// Timings and counters for a hideregions2 run, written with --stats
+// (JSON summary) and --region-stats (CSV line per region).
+//
+// Only built if HIDEREGIONS2_STATS is defined (see the Makefile).
+// Otherwise STAT(...) removes the code counting and timing things.
+
+#ifdef HIDEREGIONS2_STATS
+# define STAT(...) __VA_ARGS__
+#else
+# define STAT(...)
+#endif
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+// counters of fillRegion for one region. If all the pixels around it
+// were excluded, these are of the fallback pass which used them,
+// except that excluded still counts the pixels excluded at first.
+struct FillStats
+{
+  FillStats()
+    : tested(0), annulus(0), excluded(0), samples(0), filled(0),
+      fallback(false)
+  {}
+
+  uint64_t tested;    // pixels checked against the regions
+  uint64_t annulus;   // pixels in the enlarged region but not the region
+  uint64_t excluded;  // annulus pixels inside neighbouring regions
+  uint64_t samples;   // pixels the fill values were chosen from
+  uint64_t filled;    // pixels set
+  bool fallback;      // neighbours were not excluded, as none were left
+};
+
+#ifdef HIDEREGIONS2_STATS
+
+class RunStats
+{
+public:
+  // stats for a region
+  struct RegionStats
+  {
+    RegionStats() : lineno(0), status(outside), seconds(0) {}
+
+    enum Status { outside, filled, cached };
+
+    unsigned lineno;
+    std::string region;
+    Status status;
+    double seconds;     // wall time of fill
+    FillStats fill;
+  };
+
+public:
+  RunStats();
+
+  // wall clock and CPU time used by the process
+  static double wallTime();
+  static double cpuTime();
+
+  // end the current phase and start another (times for phases with
+  // the same name are added). An empty name stops timing.
+  void phase(const std::string& name);
+
+  // keep stats for each region (lines are the regions, linenos their
+  // lines in the region file)
+  void setRegions(const std::vector<std::string>& lines,
+                  const std::vector<unsigned>& linenos);
+  bool haveRegions() const { return !m_regions.empty(); }
+  RegionStats& region(size_t i) { return m_regions[i]; }
+
+  // record the size of a file read or written (if it exists)
+  void addRead(const std::string& filename);
+  void addWritten(const std::string& filename);
+
+  void setThreads(unsigned n) { m_threads = n; }
+
+  void writeJSON(const std::string& filename);
+  void writeCSV(const std::string& filename) const;
+
+private:
+  struct Phase
+  {
+    std::string name;
+    double wall, cpu;
+  };
+
+  double m_start_wall, m_start_cpu;
+  int m_current;
+  double m_phase_wall, m_phase_cpu;
+  std::vector<Phase> m_phases;
+
+  std::vector<RegionStats> m_regions;
+  uint64_t m_read, m_written;
+  unsigned m_threads;
+};
+
+#endif
+
+#endif